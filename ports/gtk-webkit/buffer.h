@@ -4,10 +4,14 @@ Use of this file is governed by the license that can be found in LICENSE.
 */
 #pragma once
 
+#include <unistd.h>
+#include <glib/gstdio.h>
 #include <webkit2/webkit2.h>
 #include <JavaScriptCore/JavaScript.h>
 
+#include "context.h"
 #include "javascript.h"
+#include "policy.h"
 
 typedef struct {
 	int mod;
@@ -33,12 +37,42 @@ static Modifier modifier_names[] = {
 typedef struct {
 	WebKitWebView *web_view;
 	int callback_count;
-	char *identifier;
-	// WebKit does not seem to expose any accessor to the proxy settings, so we
-	// need to store them ourselves.
-	WebKitNetworkProxyMode _proxy_mode;
-	const char *_proxy_uri;
-	const char *const *_ignore_hosts;
+	gint identifier;
+	// The profile of the web context, shared with other buffers.
+	ContextProfile *profile;
+	// Name of the keymap of the buffer mode, see keymap.h.
+	char *keymap;
+	// A hibernated buffer has no web view, only what is needed to restore it,
+	// see buffer_hibernate.  Deferred buffers start hibernated with only a URI,
+	// see buffer_init_deferred.
+	gboolean hibernated;
+	// Set while the scroll position and the snapshot are being captured.
+	// Cancel it to abort the hibernation.
+	GCancellable *hibernation;
+	char *uri;
+	WebKitWebViewSessionState *session_state;
+	gdouble scroll_x;
+	gdouble scroll_y;
+	// Set when the scroll position must be restored once the page is loaded.
+	gboolean restore_scroll;
+	// Set while the scroll position is kept up to date by the page events, see
+	// message.h.
+	gboolean scroll_known;
+	// PNG file of the visible part of the page when it was hibernated, or NULL.
+	char *snapshot_path;
+	// Set while a window displays the buffer, which puts its loads ahead of the
+	// others, see buffer_schedule_load.
+	gboolean displayed;
+	// Set while the buffer waits in state.load_queue, with the URI to load or
+	// NULL to restore it only.
+	gboolean queued;
+	char *queued_uri;
+	// Set from the start of a navigation until it finishes, which counts in
+	// state.active_loads.
+	gboolean loading;
+	// Tasks waiting for the page of a buffer being restored, see
+	// buffer_when_loaded.
+	GQueue pending_tasks;
 } Buffer;
 
 typedef struct {
@@ -46,10 +80,46 @@ typedef struct {
 	int callback_id;
 } BufferInfo;
 
+typedef void (*BufferTaskFunction)(Buffer *buffer, gpointer data);
+
+typedef struct {
+	BufferTaskFunction run;
+	gpointer data;
+	GDestroyNotify free_data;
+} BufferTask;
+
+static void buffer_task_free(gpointer task_data) {
+	BufferTask *task = task_data;
+	if (task->free_data != NULL) {
+		task->free_data(task->data);
+	}
+	g_free(task);
+}
+
+// Run the tasks that waited for the page of BUFFER.
+static void buffer_run_pending_tasks(Buffer *buffer) {
+	BufferTask *task;
+	while ((task = g_queue_pop_head(&buffer->pending_tasks)) != NULL) {
+		task->run(buffer, task->data);
+		buffer_task_free(task);
+	}
+}
+
+static void buffer_load_started(Buffer *buffer) {
+	if (!buffer->loading) {
+		buffer->loading = TRUE;
+		state.active_loads++;
+	}
+}
+
+// Forward declaration because the end of a load may start the queued ones.
+static void buffer_load_ended(Buffer *buffer);
+
 
 static void buffer_web_view_load_changed(WebKitWebView *web_view,
 	WebKitLoadEvent load_event,
 	gpointer data) {
+	Buffer *buffer = data;
 	const char *uri = webkit_web_view_get_uri(web_view);
 	const char *method_name = "buffer.did.commit.navigation";
 
@@ -58,6 +128,9 @@ static void buffer_web_view_load_changed(WebKitWebView *web_view,
 		/* New load, we have now a provisional URI */
 		/* Here we could start a spinner or update the
 		 * location bar with the provisional URI */
+		// Navigations that the core did not schedule, e.g. link clicks, count
+		// too.
+		buffer_load_started(buffer);
 		break;
 	case WEBKIT_LOAD_REDIRECTED:
 		// TODO: Let the core know that we have been redirected?
@@ -68,6 +141,8 @@ static void buffer_web_view_load_changed(WebKitWebView *web_view,
 		 * load is requested or a navigation within the
 		 * same page is performed */
 		uri = webkit_web_view_get_uri(web_view); // TODO: Only need to set URI at the beginning?
+		// Until the new page posts its position.
+		buffer->scroll_known = FALSE;
 
 		// TODO: Notify Lisp core on invalid TLS certificate, leave to the Lisp core
 		// the possibility to load the non-HTTPS URL.
@@ -82,6 +157,19 @@ static void buffer_web_view_load_changed(WebKitWebView *web_view,
 	case WEBKIT_LOAD_FINISHED:
 		/* Load finished, we can now stop the spinner */
 		method_name = "buffer.did.finish.navigation";
+		if (buffer->restore_scroll) {
+			buffer->restore_scroll = FALSE;
+			// Not %f, whose decimal separator depends on the locale.
+			char x[G_ASCII_DTOSTR_BUF_SIZE];
+			char y[G_ASCII_DTOSTR_BUF_SIZE];
+			g_ascii_dtostr(x, sizeof x, buffer->scroll_x);
+			g_ascii_dtostr(y, sizeof y, buffer->scroll_y);
+			char *script = g_strdup_printf("window.scrollTo(%s, %s)", x, y);
+			webkit_web_view_run_javascript(web_view, script, NULL, NULL, NULL);
+			g_free(script);
+		}
+		buffer_run_pending_tasks(buffer);
+		buffer_load_ended(buffer);
 	}
 
 	if (uri == NULL) {
@@ -90,55 +178,62 @@ static void buffer_web_view_load_changed(WebKitWebView *web_view,
 
 	g_debug("Load changed: %s", uri);
 
-	Buffer *buffer = data;
-	GError *error = NULL;
-	GVariant *arg = g_variant_new("(ss)", buffer->identifier, uri);
+	GVariant *arg = g_variant_new("(is)", buffer->identifier, uri);
 	g_message("XML-RPC message: %s %s", method_name, g_variant_print(arg, TRUE));
 
-	SoupMessage *msg = soup_xmlrpc_message_new(state.core_socket,
-			method_name, arg, &error);
-
-	if (error) {
-		g_warning("Malformed XML-RPC message: %s", error->message);
-		g_error_free(error);
-		return;
-	}
-	soup_session_queue_message(xmlrpc_env, msg, NULL, NULL);
-	// 'msg' and 'uri' are freed automatically.
+	client_call(method_name, arg, NULL, NULL);
+	// 'uri' is freed automatically.
 }
 
 typedef struct  {
 	WebKitPolicyDecision *decision;
 	const gchar *uri;
+	gint buffer_id;
 } DecisionInfo;
 
-void buffer_navigated_callback(SoupSession *_session, SoupMessage *msg, gpointer data) {
-	GError *error = NULL;
-	g_debug("Buffer navigation XML-RPC response: %s", msg->response_body->data);
+static gboolean buffer_check_ignored_load(gpointer buffer_id) {
+	Buffer *buffer = handle_table_lookup(state.buffers, GPOINTER_TO_INT(buffer_id));
+	if (buffer != NULL && buffer->loading && buffer->web_view != NULL
+	    && !webkit_web_view_is_loading(buffer->web_view)) {
+		g_debug("Buffer %i does not load after all", buffer->identifier);
+		buffer_load_ended(buffer);
+	}
+	return G_SOURCE_REMOVE;
+}
 
+// WebKit emits no "load-changed" signal for an ignored navigation, so the load
+// that buffer_load_now counted would never end: release it once WebKit is done
+// with DECISION, unless the web view loads something else anyway, e.g. when
+// DECISION was about a frame of the page.
+static void buffer_ignore_decision(gint buffer_id, WebKitPolicyDecision *decision) {
+	webkit_policy_decision_ignore(decision);
+	g_idle_add(buffer_check_ignored_load, GINT_TO_POINTER(buffer_id));
+}
+
+void buffer_navigated_callback(GVariant *loadv, gpointer data) {
+	DecisionInfo *decision_info = data;
 	// TODO: Use boolean instead of integer when Atlas' s-xml-rpc package is in
 	// Quicklisp.
-	GVariant *loadv = soup_xmlrpc_parse_response(msg->response_body->data,
-			msg->response_body->length, "i", &error);
-
-	if (error) {
-		g_warning("%s: '%s'", error->message,
-			strndup(msg->response_body->data, msg->response_body->length));
-		g_error_free(error);
+	if (loadv == NULL || !g_variant_is_of_type(loadv, G_VARIANT_TYPE_INT32)) {
+		g_warning("Malformed buffer navigation response for '%s'", decision_info->uri);
+		buffer_ignore_decision(decision_info->buffer_id, decision_info->decision);
+		g_free(decision_info);
 		return;
 	}
 
 	gint32 load = g_variant_get_int32(loadv);
 
-	DecisionInfo *decision_info = data;
 	WebKitPolicyDecision *decision = decision_info->decision;
-	if (load != 0) {
-		// TODO: Should we download or use when it's a RESPONSE?
+	if (load == 2) {
+		// The download is then reported by download.h.
+		g_debug("Download resource '%s'", decision_info->uri);
+		webkit_policy_decision_download(decision);
+	} else if (load != 0) {
 		g_debug("Load resource '%s'", decision_info->uri);
 		webkit_policy_decision_use(decision);
 	} else {
 		g_debug("Ignore resource '%s'", decision_info->uri);
-		webkit_policy_decision_ignore(decision);
+		buffer_ignore_decision(decision_info->buffer_id, decision);
 	}
 
 	g_free(decision_info);
@@ -206,6 +301,20 @@ gboolean buffer_web_view_decide_policy(WebKitWebView *_web_view,
 		}
 	}
 
+	Buffer *buffer = bufferp;
+	const char *kind = is_new_window ? "new-window" : action ? "navigation" : "response";
+	PolicyAction policy_action = policy_decide(kind, uri, event_type, is_known_type);
+	stats_policy_decision(policy_action != POLICY_ASK);
+	if (policy_action == POLICY_ALLOW) {
+		g_debug("Load resource '%s' by rule", uri);
+		webkit_policy_decision_use(decision);
+		return TRUE;
+	} else if (policy_action == POLICY_DENY) {
+		g_debug("Ignore resource '%s' by rule", uri);
+		buffer_ignore_decision(buffer->identifier, decision);
+		return TRUE;
+	}
+
 	// No need for webkit_navigation_action_is_user_gesture if mouse_button and
 	// modifiers tell us the same information.
 	GVariantBuilder builder;
@@ -226,8 +335,7 @@ gboolean buffer_web_view_decide_policy(WebKitWebView *_web_view,
 	const char *method_name = "request.resource";
 
 	// TODO: Test if it's a redirect?
-	Buffer *buffer = bufferp;
-	GVariant *arg = g_variant_new("(sssbbsas)", buffer->identifier, uri,
+	GVariant *arg = g_variant_new("(issbbsas)", buffer->identifier, uri,
 			event_type,
 			is_new_window,
 			is_known_type,
@@ -236,70 +344,45 @@ gboolean buffer_web_view_decide_policy(WebKitWebView *_web_view,
 	g_message("XML-RPC message: %s (buffer id, URI, event_type, is_new_window, is_known_type, button, modifiers) = %s",
 		method_name, g_variant_print(arg, TRUE));
 
-	GError *error = NULL;
-	SoupMessage *msg = soup_xmlrpc_message_new(state.core_socket,
-			method_name, arg, &error);
-
-	if (error) {
-		g_warning("Malformed XML-RPC message: %s", error->message);
-		g_error_free(error);
-		// TODO: Return TRUE or FALSE?
-		return FALSE;
-	}
-
 	if (action) {
 		g_free(mouse_button);
 	}
 	DecisionInfo *decision_info = g_new(DecisionInfo, 1);
 	decision_info->decision = decision;
 	decision_info->uri = uri;
-	soup_session_queue_message(xmlrpc_env, msg, (SoupSessionCallback)buffer_navigated_callback, decision_info);
+	decision_info->buffer_id = buffer->identifier;
+	client_call(method_name, arg, buffer_navigated_callback, decision_info);
 
 	// Keep a reference on the decision so that in won't be freed before the callback.
 	g_object_ref(decision);
 	return TRUE;
 }
 
-void buffer_set_cookie_file(Buffer *buffer, const char *path) {
-	if (path == NULL) {
-		return;
-	}
-	WebKitCookieManager *cookie_manager =
-		webkit_web_context_get_cookie_manager(webkit_web_view_get_context(buffer->web_view));
-	webkit_cookie_manager_set_persistent_storage(cookie_manager,
-		path,
-	        // TODO: Make format configurable?
-		WEBKIT_COOKIE_PERSISTENT_STORAGE_TEXT);
-}
-
-// TODO: Remove this once all downloads have been transfered to the Lisp core.
-void buffer_web_view_download_started(WebKitWebContext *_context,
-	WebKitDownload *download, Buffer *_buffer) {
-	const char *uri = webkit_uri_request_get_uri(webkit_download_get_request(download));
-	g_warning("Download starting: %s", uri);
-	/*
-	Signal handlers accessible from here:
-	        - decide-destination
-	        - failed
-	        - finished
-	        - received-data
-	*/
-}
-
 gboolean buffer_web_view_web_process_crashed(WebKitWebView *_web_view, Buffer *buffer) {
-	g_warning("Buffer %s web process crashed", buffer->identifier);
+	g_warning("Buffer %i web process crashed", buffer->identifier);
+	buffer_load_ended(buffer);
 	return FALSE;
 }
 
+// Forward declarations because the content filters, the scripts, the page
+// messages and find in page need to know about buffers, see filter.h, script.h,
+// message.h and find.h.
+void filter_attach(WebKitWebView *web_view);
+void script_attach(WebKitWebView *web_view);
+void message_add_script(WebKitUserContentManager *manager);
+void message_attach(Buffer *buffer);
+void message_detach(Buffer *buffer);
+void find_attach(Buffer *buffer);
+void find_detach(Buffer *buffer);
+
 // Forward declaration because input events need to know about windows.
 gboolean window_button_event(GtkWidget *_widget, GdkEventButton *event, gpointer window_data);
 gboolean window_scroll_event(GtkWidget *_widget, GdkEventScroll *event, gpointer buffer_data);
 
-Buffer *buffer_init(const char *cookie_file) {
-	Buffer *buffer = calloc(1, sizeof (Buffer));
-	WebKitWebContext *context = webkit_web_context_new();
-	buffer->web_view = WEBKIT_WEB_VIEW(webkit_web_view_new_with_context(context));
-	buffer_set_cookie_file(buffer, cookie_file);
+static void buffer_make_view(Buffer *buffer) {
+	// We hold a reference to the view, otherwise changing buffer in a window
+	// would unref+destroy the view.
+	buffer->web_view = context_profile_take_view(buffer->profile);
 
 	g_signal_connect(buffer->web_view, "load-changed",
 		G_CALLBACK(buffer_web_view_load_changed), buffer);
@@ -308,35 +391,329 @@ Buffer *buffer_init(const char *cookie_file) {
 	g_signal_connect(buffer->web_view, "web-process-crashed",
 		G_CALLBACK(buffer_web_view_web_process_crashed), buffer);
 
-	g_signal_connect(context, "download-started", G_CALLBACK(buffer_web_view_download_started), buffer);
-
 	// Mouse events are captured by the web view first, so we must intercept them here.
 	g_signal_connect(buffer->web_view, "button-press-event", G_CALLBACK(window_button_event), buffer);
 	g_signal_connect(buffer->web_view, "button-release-event", G_CALLBACK(window_button_event), buffer);
 	g_signal_connect(buffer->web_view, "scroll-event", G_CALLBACK(window_scroll_event), buffer);
 
-	// We need to hold a reference to the view, otherwise changing buffer in the a
-	// window will unref+destroy the view.
-	g_object_ref(buffer->web_view);
+	filter_attach(buffer->web_view);
+	script_attach(buffer->web_view);
+	message_attach(buffer);
+	find_attach(buffer);
 	g_debug("Init buffer %p with view %p", buffer, buffer->web_view);
+}
+
+// PROFILE is owned by the buffer, see context_profile_acquire.
+Buffer *buffer_init(ContextProfile *profile) {
+	Buffer *buffer = calloc(1, sizeof (Buffer));
+	buffer->profile = profile;
+	buffer_make_view(buffer);
 	buffer->callback_count = 0;
 	// So far we leave the core to set the default URL, otherwise the load-changed
 	// signal would be emitted while the buffer identifier is still empty.
 	return buffer;
 }
 
+// Return a buffer without web view, which loads URI only once it is displayed
+// or used, like a hibernated buffer.  Until then, the core receives no
+// navigation events for it.
+Buffer *buffer_init_deferred(ContextProfile *profile, const char *uri) {
+	Buffer *buffer = calloc(1, sizeof (Buffer));
+	buffer->profile = profile;
+	buffer->uri = g_strdup(uri);
+	buffer->hibernated = TRUE;
+	return buffer;
+}
+
+// Free what buffer_hibernate saved, once it is restored or no longer needed.
+static void buffer_clear_hibernation(Buffer *buffer) {
+	if (buffer->hibernation != NULL) {
+		// The pending callbacks get a cancellation error and leave the buffer alone.
+		g_cancellable_cancel(buffer->hibernation);
+		g_clear_object(&buffer->hibernation);
+	}
+	g_clear_pointer(&buffer->uri, g_free);
+	g_clear_pointer(&buffer->session_state, webkit_web_view_session_state_unref);
+	if (buffer->snapshot_path != NULL) {
+		g_unlink(buffer->snapshot_path);
+		g_clear_pointer(&buffer->snapshot_path, g_free);
+	}
+}
+
 void buffer_delete(Buffer *buffer) {
-	// Remove the extra ref added in buffer_init()?
+	// Remove the reference taken in buffer_make_view()?
 	/* g_object_unref(buffer->web_view); */
 	// TODO: What happens to the Window's web view when current buffer is deleted?
 
-	gtk_widget_destroy(GTK_WIDGET(buffer->web_view));
-	g_free(buffer->identifier);
+	buffer_clear_hibernation(buffer);
+	if (buffer->queued) {
+		g_queue_remove(&state.load_queue, buffer);
+	}
+	g_free(buffer->queued_uri);
+	g_queue_clear_full(&buffer->pending_tasks, buffer_task_free);
+	if (buffer->web_view != NULL) {
+		message_detach(buffer);
+		find_detach(buffer);
+		gtk_widget_destroy(GTK_WIDGET(buffer->web_view));
+	}
+	// Last, since it may start the loads of other buffers.
+	buffer_load_ended(buffer);
+	context_profile_release(buffer->profile);
+	g_free(buffer->keymap);
 	g_free(buffer);
 }
 
+// Hibernation: the web view of a buffer which is not displayed is destroyed,
+// which frees its share of the web process, and restored from its session state
+// when the buffer is needed again.  The session state holds the back/forward
+// list, the scroll position is restored once the page has loaded again.
+
+static void buffer_hibernation_finish(Buffer *buffer) {
+	g_clear_object(&buffer->hibernation);
+	buffer->uri = g_strdup(webkit_web_view_get_uri(buffer->web_view));
+	buffer->session_state = webkit_web_view_get_session_state(buffer->web_view);
+	message_detach(buffer);
+	find_detach(buffer);
+	gtk_widget_destroy(GTK_WIDGET(buffer->web_view));
+	g_object_unref(buffer->web_view);
+	buffer->web_view = NULL;
+	buffer->hibernated = TRUE;
+	buffer_load_ended(buffer);
+	g_message("Buffer %i hibernated at %s", buffer->identifier, buffer->uri);
+
+	const char *method_name = "buffer.did.hibernate";
+	GVariant *arg = g_variant_new("(iss)", buffer->identifier,
+			buffer->uri != NULL ? buffer->uri : "",
+			buffer->snapshot_path != NULL ? buffer->snapshot_path : "");
+	g_message("XML-RPC message: %s %s", method_name, g_variant_print(arg, TRUE));
+	client_call(method_name, arg, NULL, NULL);
+}
+
+static void buffer_snapshot_callback(GObject *object, GAsyncResult *result,
+	gpointer data) {
+	GError *error = NULL;
+	cairo_surface_t *snapshot = webkit_web_view_get_snapshot_finish(WEBKIT_WEB_VIEW(object),
+			result, &error);
+	if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		// The buffer may be gone.
+		g_error_free(error);
+		return;
+	}
+	Buffer *buffer = data;
+	if (snapshot == NULL) {
+		g_debug("No snapshot of buffer %i: %s", buffer->identifier, error->message);
+		g_error_free(error);
+	} else {
+		char *directory = g_build_filename(g_get_user_cache_dir(), "next", "snapshots", NULL);
+		char *name = g_strdup_printf("%i-%i.png", getpid(), buffer->identifier);
+		g_mkdir_with_parents(directory, 0700);
+		buffer->snapshot_path = g_build_filename(directory, name, NULL);
+		if (cairo_surface_write_to_png(snapshot, buffer->snapshot_path) != CAIRO_STATUS_SUCCESS) {
+			g_warning("Cannot write snapshot %s", buffer->snapshot_path);
+			g_clear_pointer(&buffer->snapshot_path, g_free);
+		}
+		cairo_surface_destroy(snapshot);
+		g_free(name);
+		g_free(directory);
+	}
+	buffer_hibernation_finish(buffer);
+}
+
+static void buffer_hibernation_snapshot(Buffer *buffer) {
+	webkit_web_view_get_snapshot(buffer->web_view, WEBKIT_SNAPSHOT_REGION_VISIBLE,
+		WEBKIT_SNAPSHOT_OPTIONS_NONE, buffer->hibernation,
+		buffer_snapshot_callback, buffer);
+}
+
+static void buffer_scroll_position_callback(GObject *object, GAsyncResult *result,
+	gpointer data) {
+	GError *error = NULL;
+	WebKitJavascriptResult *js_result = webkit_web_view_run_javascript_finish(
+		WEBKIT_WEB_VIEW(object), result, &error);
+	if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		g_error_free(error);
+		return;
+	}
+	Buffer *buffer = data;
+	if (js_result == NULL) {
+		g_debug("No scroll position for buffer %i: %s", buffer->identifier, error->message);
+		g_error_free(error);
+	} else {
+		JSCValue *position = webkit_javascript_result_get_js_value(js_result);
+		JSCValue *x = jsc_value_object_get_property_at_index(position, 0);
+		JSCValue *y = jsc_value_object_get_property_at_index(position, 1);
+		buffer->scroll_x = jsc_value_to_double(x);
+		buffer->scroll_y = jsc_value_to_double(y);
+		g_object_unref(x);
+		g_object_unref(y);
+		webkit_javascript_result_unref(js_result);
+	}
+	buffer_hibernation_snapshot(buffer);
+}
+
+// Start hibernating BUFFER.  The caller must make sure that no window displays
+// it.  Return FALSE if the buffer is already hibernated or hibernating.
+gboolean buffer_hibernate(Buffer *buffer) {
+	if (buffer->hibernated || buffer->hibernation != NULL) {
+		return FALSE;
+	}
+	buffer->hibernation = g_cancellable_new();
+	if (buffer->scroll_known) {
+		buffer_hibernation_snapshot(buffer);
+		return TRUE;
+	}
+	webkit_web_view_run_javascript(buffer->web_view, "[window.scrollX, window.scrollY]",
+		buffer->hibernation, buffer_scroll_position_callback, buffer);
+	return TRUE;
+}
+
+// Like buffer_wake, but when NAVIGATE is FALSE, only the back/forward list is
+// restored: the caller loads another page right away.
+static gboolean buffer_restore(Buffer *buffer, gboolean navigate) {
+	if (!buffer->hibernated) {
+		if (buffer->hibernation == NULL) {
+			return FALSE;
+		}
+		buffer_clear_hibernation(buffer);
+		return TRUE;
+	}
+	buffer_make_view(buffer);
+	buffer->hibernated = FALSE;
+	g_message("Buffer %i wakes up at %s", buffer->identifier, buffer->uri);
+
+	WebKitBackForwardListItem *item = NULL;
+	if (buffer->session_state != NULL) {
+		webkit_web_view_restore_session_state(buffer->web_view, buffer->session_state);
+		item = webkit_back_forward_list_get_current_item(
+			webkit_web_view_get_back_forward_list(buffer->web_view));
+	}
+	if (navigate) {
+		if (item != NULL) {
+			webkit_web_view_go_to_back_forward_list_item(buffer->web_view, item);
+		} else if (buffer->uri != NULL) {
+			webkit_web_view_load_uri(buffer->web_view, buffer->uri);
+		}
+	}
+	// Don't scroll deferred buffers to the top, the URI may have a fragment.
+	buffer->restore_scroll = navigate && (buffer->scroll_x != 0 || buffer->scroll_y != 0);
+	buffer->scroll_known = FALSE;
+	buffer_clear_hibernation(buffer);
+	return TRUE;
+}
+
+// Restore the web view of BUFFER, or abort its hibernation if it is still in
+// progress.  Return FALSE if BUFFER was neither hibernated nor hibernating.
+gboolean buffer_wake(Buffer *buffer) {
+	return buffer_restore(buffer, TRUE);
+}
+
+// Loads are scheduled so that at most state.max_loads navigations run at once,
+// e.g. when many buffers are opened together.  Displayed buffers skip the queue
+// and load right away.
+
+static void buffer_load_now(Buffer *buffer) {
+	char *uri = buffer->queued_uri;
+	buffer->queued_uri = NULL;
+	buffer->queued = FALSE;
+	// Restoring a buffer loads its page, unless another one is loaded: then
+	// only its back/forward list is restored, for a single navigation.
+	gboolean started = buffer->hibernated
+		&& (buffer->session_state != NULL || buffer->uri != NULL);
+	buffer_restore(buffer, uri == NULL);
+	if (uri != NULL) {
+		buffer->restore_scroll = FALSE;
+		webkit_web_view_load_uri(buffer->web_view, uri);
+		g_free(uri);
+		started = TRUE;
+	}
+	// Count the load now, "load-changed" is emitted later.
+	if (started) {
+		buffer_load_started(buffer);
+	} else {
+		// There is no page to wait for.
+		buffer_run_pending_tasks(buffer);
+	}
+}
+
+// Start the queued loads while there is room for them.
+static void buffer_schedule_run() {
+	while (state.max_loads <= 0 || state.active_loads < (guint)state.max_loads) {
+		Buffer *buffer = g_queue_pop_head(&state.load_queue);
+		if (buffer == NULL) {
+			return;
+		}
+		buffer_load_now(buffer);
+	}
+}
+
+static void buffer_load_ended(Buffer *buffer) {
+	if (!buffer->loading) {
+		return;
+	}
+	buffer->loading = FALSE;
+	state.active_loads--;
+	buffer_schedule_run();
+}
+
+// Load URI in BUFFER, or restore BUFFER if it is hibernated when URI is NULL,
+// now or once other loads are done.
+void buffer_schedule_load(Buffer *buffer, const char *uri) {
+	if (uri != NULL) {
+		g_free(buffer->queued_uri);
+		buffer->queued_uri = g_strdup(uri);
+	}
+	if (buffer->displayed
+	    || state.max_loads <= 0
+	    || state.active_loads < (guint)state.max_loads) {
+		if (buffer->queued) {
+			g_queue_remove(&state.load_queue, buffer);
+		}
+		buffer_load_now(buffer);
+		return;
+	}
+	if (!buffer->queued) {
+		buffer->queued = TRUE;
+		g_queue_push_tail(&state.load_queue, buffer);
+		g_debug("Buffer %i waits for %u loads", buffer->identifier, state.active_loads);
+	}
+}
+
+// Return the position of BUFFER in the load queue, 0 for the next one to load,
+// or -1 if it is not waiting.
+gint buffer_load_queue_position(Buffer *buffer) {
+	if (!buffer->queued) {
+		return -1;
+	}
+	return g_queue_index(&state.load_queue, buffer);
+}
+
 void buffer_load(Buffer *buffer, const char *uri) {
-	webkit_web_view_load_uri(buffer->web_view, uri);
+	buffer_schedule_load(buffer, uri);
+}
+
+// Run RUN with DATA in BUFFER, now or, if BUFFER is hibernated, once its page is
+// restored: scripts and DOM queries need the page, not the empty view of a
+// buffer that just woke up.  The restoration is scheduled like any other load.
+// FREE_DATA, if not NULL, frees DATA afterwards.
+void buffer_when_loaded(Buffer *buffer, BufferTaskFunction run, gpointer data,
+	GDestroyNotify free_data) {
+	if (buffer->hibernated || !g_queue_is_empty(&buffer->pending_tasks)) {
+		BufferTask *task = g_new(BufferTask, 1);
+		task->run = run;
+		task->data = data;
+		task->free_data = free_data;
+		g_queue_push_tail(&buffer->pending_tasks, task);
+		if (buffer->hibernated) {
+			buffer_schedule_load(buffer, NULL);
+		}
+		return;
+	}
+	// Abort a hibernation in progress, the page is still there.
+	buffer_wake(buffer);
+	run(buffer, data);
+	if (free_data != NULL) {
+		free_data(data);
+	}
 }
 
 static void buffer_javascript_callback(GObject *object, GAsyncResult *result,
@@ -347,6 +724,26 @@ static void buffer_javascript_callback(GObject *object, GAsyncResult *result,
 	g_free(buffer_info);
 }
 
+typedef struct {
+	char *javascript;
+	BufferInfo *buffer_info;
+} BufferEvaluation;
+
+static void buffer_evaluation_run(Buffer *buffer, gpointer data) {
+	BufferEvaluation *evaluation = data;
+	webkit_web_view_run_javascript(buffer->web_view, evaluation->javascript,
+		NULL, buffer_javascript_callback, evaluation->buffer_info);
+	// Now owned by the callback.
+	evaluation->buffer_info = NULL;
+}
+
+static void buffer_evaluation_free(gpointer data) {
+	BufferEvaluation *evaluation = data;
+	g_free(evaluation->javascript);
+	g_free(evaluation->buffer_info);
+	g_free(evaluation);
+}
+
 // Caller must free the result.
 char *buffer_evaluate(Buffer *buffer, const char *javascript) {
 	// If another buffer_evaluate is run before the callback is called, there will
@@ -359,34 +756,104 @@ char *buffer_evaluate(Buffer *buffer, const char *javascript) {
 
 	buffer->callback_count++;
 
-	webkit_web_view_run_javascript(buffer->web_view, javascript,
-		NULL, buffer_javascript_callback, buffer_info);
+	BufferEvaluation *evaluation = g_new(BufferEvaluation, 1);
+	evaluation->javascript = g_strdup(javascript);
+	evaluation->buffer_info = buffer_info;
+	buffer_when_loaded(buffer, buffer_evaluation_run, evaluation, buffer_evaluation_free);
 	g_debug("buffer_evaluate callback count: %i", buffer_info->callback_id);
 	return g_strdup_printf("%i", buffer_info->callback_id);
 }
 
-void buffer_set_proxy(Buffer *buffer, WebKitNetworkProxyMode mode,
-	const gchar *proxy_uri, const gchar *const *ignore_hosts) {
-	WebKitWebContext *context = webkit_web_view_get_context(buffer->web_view);
+// Resolve the hosts of the HTTP(S) URIS ahead of a likely navigation, in the web
+// context of BUFFER.  Return the number of hosts.
+//
+// Nothing is added to the page of BUFFER: it could observe the origins that
+// the user considers, e.g. as the completions of a URL prompt are selected.
+guint buffer_prefetch(Buffer *buffer, char **uris) {
+	GHashTable *hosts = g_hash_table_new_full(g_str_hash, g_str_equal, &g_free, NULL);
+	for (char **uri = uris; *uri != NULL; uri++) {
+		SoupURI *parsed_uri = soup_uri_new(*uri);
+		if (parsed_uri == NULL) {
+			continue;
+		}
+		const char *host = soup_uri_get_host(parsed_uri);
+		if (SOUP_URI_VALID_FOR_HTTP(parsed_uri) && !g_hash_table_contains(hosts, host)) {
+			g_hash_table_add(hosts, g_strdup(host));
+			webkit_web_context_prefetch_dns(buffer->profile->context, host);
+		}
+		soup_uri_free(parsed_uri);
+	}
+	guint count = g_hash_table_size(hosts);
+	g_hash_table_unref(hosts);
+	return count;
+}
+
+typedef struct {
+	char *method;
+	GVariant *args;
+	int callback_id;
+} BufferQuery;
+
+static void buffer_query_run(Buffer *buffer, gpointer data) {
+	BufferQuery *query = data;
+	gboolean called = dom_call(buffer->web_view, query->method, query->args,
+			buffer->identifier, query->callback_id);
+	// Consumed by dom_call.
+	query->args = NULL;
+	if (!called) {
+		// The identifier was returned already: the Lisp core learns from the
+		// result that it must run its script instead.
+		dom_send_result(buffer->identifier, query->callback_id,
+			g_variant_new_string(DOM_QUERY_FAILED));
+	}
+}
+
+static void buffer_query_free(gpointer data) {
+	BufferQuery *query = data;
+	g_free(query->method);
+	if (query->args != NULL) {
+		g_variant_unref(query->args);
+	}
+	g_free(query);
+}
 
-	WebKitNetworkProxySettings *settings = NULL;
-	if (mode == WEBKIT_NETWORK_PROXY_MODE_CUSTOM) {
-		settings = webkit_network_proxy_settings_new(proxy_uri, ignore_hosts);
+// Run the native DOM query METHOD, see dom.h, in the page of BUFFER with the
+// arguments ARGS, a tuple or NULL, which is consumed.  Return the callback
+// identifier of the result like buffer_evaluate, or NULL if the query cannot
+// run natively.  Caller must free the result.
+char *buffer_query_dom(Buffer *buffer, const char *method, GVariant *args) {
+	if (!buffer->hibernated && g_queue_is_empty(&buffer->pending_tasks)) {
+		// Abort a hibernation in progress, the page is still there.
+		buffer_wake(buffer);
+		if (!dom_call(buffer->web_view, method, args, buffer->identifier,
+				buffer->callback_count)) {
+			return NULL;
+		}
+		return g_strdup_printf("%i", buffer->callback_count++);
 	}
-	webkit_web_context_set_network_proxy_settings(context, mode, settings);
-	buffer->_proxy_mode = mode;
-	buffer->_proxy_uri = strdup(proxy_uri);
-	buffer->_ignore_hosts = ignore_hosts;
+	BufferQuery *query = g_new(BufferQuery, 1);
+	query->method = g_strdup(method);
+	query->args = args != NULL ? g_variant_ref_sink(args) : NULL;
+	query->callback_id = buffer->callback_count++;
+	buffer_when_loaded(buffer, buffer_query_run, query, buffer_query_free);
+	return g_strdup_printf("%i", query->callback_id);
+}
+
+// The proxy is a setting of the web context, so it applies to all the buffers
+// of the profile.
+void buffer_set_proxy(Buffer *buffer, WebKitNetworkProxyMode mode,
+	const gchar *proxy_uri, const gchar *const *ignore_hosts) {
+	context_profile_set_proxy(buffer->profile, mode, proxy_uri, ignore_hosts);
 	g_debug("Proxy set");
 }
 
 void buffer_get_proxy(Buffer *buffer, WebKitNetworkProxyMode *mode,
 	const gchar **proxy_uri, const gchar *const **ignore_hosts) {
-	*mode = buffer->_proxy_mode;
+	*mode = buffer->profile->proxy_mode;
 	*proxy_uri = "";
 	*ignore_hosts = NULL;
 	if (*mode == WEBKIT_NETWORK_PROXY_MODE_CUSTOM) {
-		*proxy_uri = buffer->_proxy_uri;
-		*ignore_hosts = buffer->_ignore_hosts;
+		*proxy_uri = buffer->profile->proxy_uri;
+		*ignore_hosts = (const gchar *const *)buffer->profile->ignore_hosts;
 	}
 }
@@ -4,10 +4,401 @@ Use of this file is governed by the license that can be found in LICENSE.
 */
 #pragma once
 
+#include <string.h>
+#include <gio/gio.h>
+#include <gio/gunixsocketaddress.h>
 #include <libsoup/soup.h>
 
+#include "protocol.h"
+#include "server-state.h"
+#include "stats.h"
+
+#define CLIENT_TIMEOUT 5
+
+// The result is NULL if the call failed.  The result is owned by the client
+// and must not be freed.
+typedef void (*ClientCallback) (GVariant *result, gpointer data);
+
+typedef struct {
+	char *method_name;
+	ClientCallback callback;
+	gpointer data;
+	GSocketConnection *connection;
+	GString *http_request;
+	GOutputStream *http_response;
+	// When the request was made, as per g_get_monotonic_time.
+	gint64 start;
+	// Source failing a binary call that gets no response, see client_binary_send.
+	guint timeout_source;
+} ClientRequest;
+
 static SoupSession *xmlrpc_env;
+// Only used when the Lisp core listens to a Unix domain socket.
+static GSocketClient *unix_socket_client;
+static GSocketAddress *unix_socket_address;
+static char *unix_socket_request_path;
+// Requests sent over the binary connection and waiting for a response, indexed
+// by call identifier.
+static GHashTable *binary_pending_requests;
+static guint32 binary_call_count;
 
 void start_client() {
-	xmlrpc_env = soup_session_new_with_options("timeout", 5, NULL);
+	xmlrpc_env = soup_session_new_with_options("timeout", CLIENT_TIMEOUT, NULL);
+	binary_pending_requests = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	if (state.core_socket_path != NULL) {
+		// libsoup's session cannot connect to Unix domain sockets, so we speak
+		// HTTP ourselves over a GIO socket connection.
+		unix_socket_client = g_socket_client_new();
+		g_socket_client_set_timeout(unix_socket_client, CLIENT_TIMEOUT);
+		unix_socket_address = g_unix_socket_address_new(state.core_socket_path);
+		SoupURI *uri = soup_uri_new(state.core_socket);
+		unix_socket_request_path = g_strdup(uri != NULL ? uri->path : "/RPC2");
+		if (uri != NULL) {
+			soup_uri_free(uri);
+		}
+		g_debug("Sending to the Lisp core over Unix domain socket %s", state.core_socket_path);
+	}
+}
+
+// Return NULL on error.  Result must be freed.
+GVariant *client_parse_response(const char *body, gsize length) {
+	GError *error = NULL;
+	GVariant *result = soup_xmlrpc_parse_response(body, length, NULL, &error);
+	if (error) {
+		g_warning("%s: '%s'", error->message, body);
+		g_error_free(error);
+		return NULL;
+	}
+	return result;
+}
+
+ClientRequest *client_request_new(const char *method_name, ClientCallback callback,
+	gpointer data) {
+	ClientRequest *request = g_new0(ClientRequest, 1);
+	request->method_name = g_strdup(method_name);
+	request->callback = callback;
+	request->data = data;
+	request->start = g_get_monotonic_time();
+	stats_count_call(method_name);
+	stats_queue_push();
+	return request;
+}
+
+void client_request_free(ClientRequest *request) {
+	stats_queue_pop();
+	if (request->timeout_source != 0) {
+		g_source_remove(request->timeout_source);
+	}
+	if (request->connection != NULL) {
+		g_io_stream_close(G_IO_STREAM(request->connection), NULL, NULL);
+		g_object_unref(request->connection);
+	}
+	if (request->http_request != NULL) {
+		g_string_free(request->http_request, TRUE);
+	}
+	if (request->http_response != NULL) {
+		g_object_unref(request->http_response);
+	}
+	g_free(request->method_name);
+	g_free(request);
+}
+
+void client_request_finish(ClientRequest *request, GVariant *result) {
+	stats_record(request->method_name, STATS_ROUND_TRIP, request->start);
+	if (request->callback != NULL) {
+		request->callback(result, request->data);
+	}
+	if (result != NULL) {
+		g_variant_unref(result);
+	}
+	client_request_free(request);
+}
+
+// Return the XML-RPC body of the NUL-terminated HTTP RESPONSE, or NULL if the
+// status is not successful.  The body is not copied.
+const char *client_http_response_body(char *response, gsize *body_length) {
+	const char *body = strstr(response, "\r\n\r\n");
+	if (body == NULL) {
+		g_warning("Truncated HTTP response");
+		return NULL;
+	}
+	guint status = 0;
+	char *status_line = g_strndup(response, strcspn(response, "\r\n"));
+	gboolean parsed = soup_headers_parse_status_line(status_line, NULL, &status, NULL);
+	g_free(status_line);
+	if (!parsed || !SOUP_STATUS_IS_SUCCESSFUL(status)) {
+		g_warning("Unexpected HTTP response status %u", status);
+		return NULL;
+	}
+	body += 4;
+	*body_length = strlen(body);
+	return body;
+}
+
+// Return NULL on error.  Result must be freed.
+GString *client_http_request(const char *method_name, GVariant *params) {
+	GError *error = NULL;
+	// 'params' is floating and soup_xmlrpc_build_request will consume it.
+	char *body = soup_xmlrpc_build_request(method_name, params, &error);
+	if (error) {
+		g_warning("Malformed XML-RPC message: %s", error->message);
+		g_error_free(error);
+		return NULL;
+	}
+	GString *request = g_string_new(NULL);
+	// We close the connection after each call, which lets the response be read
+	// until end-of-stream.
+	g_string_printf(request,
+		"POST %s HTTP/1.1\r\n"
+		"Host: localhost\r\n"
+		"Content-Type: text/xml\r\n"
+		"Content-Length: %zu\r\n"
+		"Connection: close\r\n"
+		"\r\n"
+		"%s",
+		unix_socket_request_path, strlen(body), body);
+	g_free(body);
+	return request;
+}
+
+static void client_unix_response_read(GObject *object, GAsyncResult *result, gpointer data) {
+	ClientRequest *request = data;
+	GError *error = NULL;
+	g_output_stream_splice_finish(G_OUTPUT_STREAM(object), result, &error);
+	if (error) {
+		g_warning("Failed to read response to %s: %s", request->method_name, error->message);
+		g_error_free(error);
+		client_request_finish(request, NULL);
+		return;
+	}
+
+	GMemoryOutputStream *stream = G_MEMORY_OUTPUT_STREAM(request->http_response);
+	stats_bytes_in(g_memory_output_stream_get_data_size(stream));
+	char *response = g_strndup(g_memory_output_stream_get_data(stream),
+			g_memory_output_stream_get_data_size(stream));
+	gsize body_length = 0;
+	const char *body = client_http_response_body(response, &body_length);
+	GVariant *value = NULL;
+	if (body != NULL) {
+		value = client_parse_response(body, body_length);
+	}
+	g_free(response);
+	client_request_finish(request, value);
+}
+
+static void client_unix_request_written(GObject *object, GAsyncResult *result, gpointer data) {
+	ClientRequest *request = data;
+	GError *error = NULL;
+	g_output_stream_write_all_finish(G_OUTPUT_STREAM(object), result, NULL, &error);
+	if (error) {
+		g_warning("Failed to send %s: %s", request->method_name, error->message);
+		g_error_free(error);
+		client_request_finish(request, NULL);
+		return;
+	}
+	stats_bytes_out(request->http_request->len);
+
+	request->http_response = g_memory_output_stream_new_resizable();
+	g_output_stream_splice_async(request->http_response,
+		g_io_stream_get_input_stream(G_IO_STREAM(request->connection)),
+		G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET, G_PRIORITY_DEFAULT, NULL,
+		client_unix_response_read, request);
+}
+
+static void client_unix_connected(GObject *object, GAsyncResult *result, gpointer data) {
+	ClientRequest *request = data;
+	GError *error = NULL;
+	request->connection = g_socket_client_connect_finish(G_SOCKET_CLIENT(object), result, &error);
+	if (error) {
+		g_warning("Failed to connect to %s: %s", state.core_socket_path, error->message);
+		g_error_free(error);
+		client_request_finish(request, NULL);
+		return;
+	}
+
+	g_output_stream_write_all_async(
+		g_io_stream_get_output_stream(G_IO_STREAM(request->connection)),
+		request->http_request->str, request->http_request->len,
+		G_PRIORITY_DEFAULT, NULL, client_unix_request_written, request);
+}
+
+static void client_soup_response(SoupSession *_session, SoupMessage *msg, gpointer data) {
+	ClientRequest *request = data;
+	g_debug("XML-RPC response to %s: %s", request->method_name, msg->response_body->data);
+	stats_bytes_out(msg->request_body->length);
+	stats_bytes_in(msg->response_body->length);
+	GVariant *value = NULL;
+	if (SOUP_STATUS_IS_SUCCESSFUL(msg->status_code)) {
+		value = client_parse_response(msg->response_body->data, msg->response_body->length);
+	} else {
+		g_warning("XML-RPC call %s failed: %s", request->method_name, msg->reason_phrase);
+	}
+	// 'msg' is freed automatically.
+	client_request_finish(request, value);
+}
+
+// Called by the server when the Lisp core answers a call sent over the binary
+// connection.  RESULT is NULL on fault.  RESULT is consumed.
+void client_binary_response(guint32 id, GVariant *result) {
+	ClientRequest *request = g_hash_table_lookup(binary_pending_requests, GUINT_TO_POINTER(id));
+	if (request == NULL) {
+		g_warning("Response to unknown binary call %u", id);
+		if (result != NULL) {
+			g_variant_unref(result);
+		}
+		return;
+	}
+	g_hash_table_remove(binary_pending_requests, GUINT_TO_POINTER(id));
+	client_request_finish(request, result);
+}
+
+// Fail all pending calls, e.g. when the binary connection is lost.
+void client_binary_disconnected() {
+	GList *requests = g_hash_table_get_values(binary_pending_requests);
+	g_hash_table_remove_all(binary_pending_requests);
+	for (GList *l = requests; l != NULL; l = l->next) {
+		client_request_finish(l->data, NULL);
+	}
+	g_list_free(requests);
+}
+
+// Fail the binary call ID after CLIENT_TIMEOUT seconds without a response, like
+// the XML-RPC calls, so that its callback frees what it holds.
+static gboolean client_binary_timeout(gpointer id) {
+	ClientRequest *request = g_hash_table_lookup(binary_pending_requests, id);
+	if (request != NULL) {
+		g_warning("No response to binary call %s after %i seconds",
+			request->method_name, CLIENT_TIMEOUT);
+		request->timeout_source = 0;
+		g_hash_table_remove(binary_pending_requests, id);
+		client_request_finish(request, NULL);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+// REQUEST is NULL when no response is expected.  'params' is floating and will
+// be consumed.  Return FALSE if the frame could not be sent.
+gboolean client_binary_send(const char *method_name, GVariant *params,
+	ClientRequest *request) {
+	guint32 id = ++binary_call_count;
+	if (request != NULL) {
+		g_hash_table_insert(binary_pending_requests, GUINT_TO_POINTER(id), request);
+		request->timeout_source = g_timeout_add_seconds(CLIENT_TIMEOUT,
+				client_binary_timeout, GUINT_TO_POINTER(id));
+	}
+	if (!protocol_write_frame(state.binary_connection,
+		protocol_call_frame(id, method_name, params))) {
+		if (request != NULL) {
+			g_hash_table_remove(binary_pending_requests, GUINT_TO_POINTER(id));
+			client_request_finish(request, NULL);
+		}
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// Send METHOD_NAME asynchronously to the Lisp core.  'params' is floating and
+// will be consumed.  CALLBACK, if non-NULL, is called with the result once the
+// response is received, or with NULL if the call failed.
+void client_call(const char *method_name, GVariant *params,
+	ClientCallback callback, gpointer data) {
+	if (state.binary_connection != NULL) {
+		ClientRequest *request = NULL;
+		if (callback != NULL) {
+			request = client_request_new(method_name, callback, data);
+		} else {
+			stats_count_call(method_name);
+		}
+		client_binary_send(method_name, params, request);
+		return;
+	}
+
+	ClientRequest *request = client_request_new(method_name, callback, data);
+
+	if (state.core_socket_path != NULL) {
+		request->http_request = client_http_request(method_name, params);
+		if (request->http_request == NULL) {
+			client_request_finish(request, NULL);
+			return;
+		}
+		g_socket_client_connect_async(unix_socket_client,
+			G_SOCKET_CONNECTABLE(unix_socket_address), NULL,
+			client_unix_connected, request);
+		return;
+	}
+
+	GError *error = NULL;
+	// 'params' is floating and soup_xmlrpc_message_new will consume it.
+	SoupMessage *msg = soup_xmlrpc_message_new(state.core_socket,
+			method_name, params, &error);
+	if (error) {
+		g_warning("Malformed XML-RPC message: %s", error->message);
+		g_error_free(error);
+		client_request_finish(request, NULL);
+		return;
+	}
+	soup_session_queue_message(xmlrpc_env, msg, client_soup_response, request);
+}
+
+// Like client_call but block until the response is received.
+// Return FALSE if the call failed.
+// Over the binary connection, only block until the call is sent.
+gboolean client_call_sync(const char *method_name, GVariant *params) {
+	stats_count_call(method_name);
+	if (state.binary_connection != NULL) {
+		return client_binary_send(method_name, params, NULL);
+	}
+
+	GError *error = NULL;
+	gint64 start = g_get_monotonic_time();
+	if (state.core_socket_path != NULL) {
+		GString *http_request = client_http_request(method_name, params);
+		if (http_request == NULL) {
+			return FALSE;
+		}
+		GSocketConnection *connection = g_socket_client_connect(unix_socket_client,
+				G_SOCKET_CONNECTABLE(unix_socket_address), NULL, &error);
+		gboolean success = connection != NULL
+			&& g_output_stream_write_all(
+			g_io_stream_get_output_stream(G_IO_STREAM(connection)),
+			http_request->str, http_request->len, NULL, NULL, &error);
+		GOutputStream *response = g_memory_output_stream_new_resizable();
+		success = success
+			&& g_output_stream_splice(response,
+			g_io_stream_get_input_stream(G_IO_STREAM(connection)),
+			G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET, NULL, &error) >= 0;
+		if (success) {
+			stats_bytes_out(http_request->len);
+			stats_bytes_in(g_memory_output_stream_get_data_size(
+					G_MEMORY_OUTPUT_STREAM(response)));
+		}
+		if (error) {
+			g_warning("Failed to send %s: %s", method_name, error->message);
+			g_error_free(error);
+		}
+		if (connection != NULL) {
+			g_io_stream_close(G_IO_STREAM(connection), NULL, NULL);
+			g_object_unref(connection);
+		}
+		g_object_unref(response);
+		g_string_free(http_request, TRUE);
+		stats_record(method_name, STATS_ROUND_TRIP, start);
+		return success;
+	}
+
+	// 'params' is floating and soup_xmlrpc_message_new will consume it.
+	SoupMessage *msg = soup_xmlrpc_message_new(state.core_socket,
+			method_name, params, &error);
+	if (error) {
+		g_warning("Malformed XML-RPC message: %s", error->message);
+		g_error_free(error);
+		return FALSE;
+	}
+	guint status = soup_session_send_message(xmlrpc_env, msg);
+	stats_record(method_name, STATS_ROUND_TRIP, start);
+	stats_bytes_out(msg->request_body->length);
+	stats_bytes_in(msg->response_body->length);
+	g_object_unref(msg);
+	return SOUP_STATUS_IS_SUCCESSFUL(status);
 }
@@ -0,0 +1,265 @@
+/*
+Copyright © 2019 Atlas Engineer LLC.
+Use of this file is governed by the license that can be found in LICENSE.
+*/
+#pragma once
+
+#include <string.h>
+#include <webkit2/webkit2.h>
+
+#include "dom.h"
+#include "download.h"
+#include "server-state.h"
+#include "stats.h"
+
+// A WebKitWebContext comes with its own network process, cookie manager, cache
+// and web process pool, so we share one context between all the buffers of a
+// profile, i.e. with the same cookie file, proxy settings, ephemeral flag and
+// storage settings.
+
+typedef struct {
+	WebKitWebContext *context;
+	// Key of the profile in state.contexts, or NULL if the profile is not in the
+	// pool, e.g. when isolated contexts are requested.
+	char *key;
+	char *cookie_path;
+	gboolean ephemeral;
+	// WebKit does not seem to expose any accessor to the proxy settings, so we
+	// need to store them ourselves.
+	WebKitNetworkProxyMode proxy_mode;
+	char *proxy_uri;
+	char **ignore_hosts;
+	// Storage settings: WEBKIT_CACHE_MODEL_DOCUMENT_VIEWER disables the memory
+	// cache, and the directories of the website data and of the disk cache are
+	// the WebKit defaults when NULL.
+	WebKitCacheModel cache_model;
+	char *data_directory;
+	char *cache_directory;
+	guint buffer_count;
+	// Web views created in advance, see context_profile_take_view.
+	GQueue spare_views;
+	guint refill_source;
+} ContextProfile;
+
+// Number of live web contexts, pooled or not.
+static guint context_count;
+
+// Result must be freed.
+char *context_profile_key(const ContextProfile *settings) {
+	gboolean custom_proxy = settings->proxy_mode == WEBKIT_NETWORK_PROXY_MODE_CUSTOM;
+	char *hosts = settings->ignore_hosts != NULL
+		? g_strjoinv(",", settings->ignore_hosts)
+		: g_strdup("");
+	char *key = g_strdup_printf("%s\n%i\n%i\n%s\n%s\n%i\n%s\n%s",
+			settings->cookie_path != NULL ? settings->cookie_path : "",
+			settings->ephemeral,
+			settings->proxy_mode,
+			custom_proxy && settings->proxy_uri != NULL ? settings->proxy_uri : "",
+			custom_proxy ? hosts : "",
+			settings->cache_model,
+			settings->data_directory != NULL ? settings->data_directory : "",
+			settings->cache_directory != NULL ? settings->cache_directory : "");
+	g_free(hosts);
+	return key;
+}
+
+static void context_profile_apply_proxy(ContextProfile *profile) {
+	WebKitNetworkProxySettings *settings = NULL;
+	if (profile->proxy_mode == WEBKIT_NETWORK_PROXY_MODE_CUSTOM) {
+		settings = webkit_network_proxy_settings_new(profile->proxy_uri,
+				(const char *const *)profile->ignore_hosts);
+	}
+	webkit_web_context_set_network_proxy_settings(profile->context,
+		profile->proxy_mode, settings);
+	if (settings != NULL) {
+		webkit_network_proxy_settings_free(settings);
+	}
+}
+
+static WebKitWebContext *context_new(const ContextProfile *settings) {
+	if (settings->ephemeral) {
+		return webkit_web_context_new_ephemeral();
+	}
+	if (settings->data_directory == NULL && settings->cache_directory == NULL) {
+		return webkit_web_context_new();
+	}
+	// The disk cache and the other website data go to the given directories,
+	// e.g. on faster storage.
+	WebKitWebsiteDataManager *manager = webkit_website_data_manager_new(
+		"base-data-directory", settings->data_directory,
+		"base-cache-directory", settings->cache_directory,
+		NULL);
+	WebKitWebContext *context = webkit_web_context_new_with_website_data_manager(manager);
+	g_object_unref(manager);
+	return context;
+}
+
+// Return a new profile with a copy of SETTINGS, whose other fields are ignored.
+static ContextProfile *context_profile_new(const ContextProfile *settings) {
+	ContextProfile *profile = g_new0(ContextProfile, 1);
+	context_count++;
+	profile->context = context_new(settings);
+	profile->ephemeral = settings->ephemeral;
+	profile->cookie_path = g_strdup(settings->cookie_path);
+	profile->proxy_mode = settings->proxy_mode;
+	profile->proxy_uri = g_strdup(settings->proxy_uri != NULL ? settings->proxy_uri : "");
+	profile->ignore_hosts = g_strdupv(settings->ignore_hosts);
+	profile->cache_model = settings->cache_model;
+	profile->data_directory = g_strdup(settings->data_directory);
+	profile->cache_directory = g_strdup(settings->cache_directory);
+
+	if (settings->cookie_path != NULL && !settings->ephemeral) {
+		webkit_cookie_manager_set_persistent_storage(
+			webkit_web_context_get_cookie_manager(profile->context),
+			settings->cookie_path,
+			// TODO: Make format configurable?
+			WEBKIT_COOKIE_PERSISTENT_STORAGE_TEXT);
+	}
+	if (settings->proxy_mode != WEBKIT_NETWORK_PROXY_MODE_DEFAULT) {
+		context_profile_apply_proxy(profile);
+	}
+	webkit_web_context_set_cache_model(profile->context, settings->cache_model);
+	dom_context_setup(profile->context);
+	g_signal_connect(profile->context, "download-started",
+		G_CALLBACK(download_started), NULL);
+	return profile;
+}
+
+// Destroy the spare web views of PROFILE and stop refilling them.
+static void context_profile_drain(ContextProfile *profile) {
+	if (profile->refill_source != 0) {
+		g_source_remove(profile->refill_source);
+		profile->refill_source = 0;
+	}
+	WebKitWebView *view;
+	while ((view = g_queue_pop_head(&profile->spare_views)) != NULL) {
+		gtk_widget_destroy(GTK_WIDGET(view));
+		g_object_unref(view);
+	}
+}
+
+static void context_profile_free(ContextProfile *profile) {
+	context_profile_drain(profile);
+	g_object_unref(profile->context);
+	context_count--;
+	g_free(profile->key);
+	g_free(profile->cookie_path);
+	g_free(profile->proxy_uri);
+	g_strfreev(profile->ignore_hosts);
+	g_free(profile->data_directory);
+	g_free(profile->cache_directory);
+	g_free(profile);
+}
+
+// Return the profile for SETTINGS, creating its context if no buffer uses it
+// yet.  Only the settings fields of SETTINGS are used, which the profile
+// copies.  Release it with context_profile_release.
+ContextProfile *context_profile_acquire(const ContextProfile *settings) {
+	ContextProfile *profile = NULL;
+	char *key = context_profile_key(settings);
+	if (!state.isolated_contexts) {
+		profile = g_hash_table_lookup(state.contexts, key);
+	}
+	if (profile == NULL) {
+		profile = context_profile_new(settings);
+		if (!state.isolated_contexts) {
+			profile->key = g_strdup(key);
+			g_hash_table_insert(state.contexts, profile->key, profile);
+		}
+		g_debug("New web context for profile '%s'", key);
+	}
+	g_free(key);
+	profile->buffer_count++;
+	return profile;
+}
+
+void context_profile_release(ContextProfile *profile) {
+	profile->buffer_count--;
+	if (profile->buffer_count > 0) {
+		return;
+	}
+	if (profile->key != NULL) {
+		g_hash_table_remove(state.contexts, profile->key);
+	}
+	context_profile_free(profile);
+}
+
+// Change the proxy of PROFILE, which applies to all the buffers of the profile.
+void context_profile_set_proxy(ContextProfile *profile, WebKitNetworkProxyMode mode,
+	const char *proxy_uri, const char *const *ignore_hosts) {
+	g_free(profile->proxy_uri);
+	g_strfreev(profile->ignore_hosts);
+	profile->proxy_mode = mode;
+	profile->proxy_uri = g_strdup(proxy_uri != NULL ? proxy_uri : "");
+	profile->ignore_hosts = g_strdupv((char **)ignore_hosts);
+	context_profile_apply_proxy(profile);
+
+	if (profile->key == NULL) {
+		return;
+	}
+	// The profile now matches another key.  If a profile with those settings
+	// already exists, it keeps the slot and this one leaves the pool.
+	g_hash_table_remove(state.contexts, profile->key);
+	g_free(profile->key);
+	profile->key = context_profile_key(profile);
+	if (g_hash_table_contains(state.contexts, profile->key)) {
+		g_clear_pointer(&profile->key, g_free);
+		return;
+	}
+	g_hash_table_insert(state.contexts, profile->key, profile);
+}
+
+// Creating a web view takes a while on the main thread, so we keep a few spare
+// ones per pooled profile, created when the main loop is idle, and hand them out
+// to new buffers.  Ephemeral profiles get none: they are typically used for a
+// single buffer.  The pool of a profile is only refilled after a view is taken
+// from it, so that the views freed by context_drain_spare_views, e.g. under
+// memory pressure, do not come back until buffers are made again.
+
+static gboolean context_profile_refill(gpointer data) {
+	ContextProfile *profile = data;
+	if ((gint)g_queue_get_length(&profile->spare_views) >= state.view_pool_size) {
+		profile->refill_source = 0;
+		return G_SOURCE_REMOVE;
+	}
+	WebKitWebView *view = WEBKIT_WEB_VIEW(webkit_web_view_new_with_context(profile->context));
+	g_queue_push_tail(&profile->spare_views, g_object_ref_sink(view));
+	// One view per iteration so that events are not held back for long.
+	return G_SOURCE_CONTINUE;
+}
+
+// Return a web view of PROFILE, a spare one if there is any.  The caller owns
+// the returned reference.
+WebKitWebView *context_profile_take_view(ContextProfile *profile) {
+	WebKitWebView *view = g_queue_pop_head(&profile->spare_views);
+	stats_view_pool(view != NULL);
+	if (view == NULL) {
+		view = WEBKIT_WEB_VIEW(webkit_web_view_new_with_context(profile->context));
+		g_object_ref_sink(view);
+	}
+	// Profiles outside the pool, e.g. with isolated contexts, are unlikely to
+	// get other buffers.
+	if (profile->key != NULL && !profile->ephemeral && state.view_pool_size > 0
+	    && profile->refill_source == 0) {
+		profile->refill_source = g_idle_add_full(G_PRIORITY_LOW,
+				context_profile_refill, profile, NULL);
+	}
+	return view;
+}
+
+// Free the spare web views of all the profiles, when memory matters more than
+// the time to make buffers.  Return the number of destroyed views.
+guint context_drain_spare_views() {
+	guint count = 0;
+	GHashTableIter iter;
+	gpointer profile = NULL;
+	g_hash_table_iter_init(&iter, state.contexts);
+	while (g_hash_table_iter_next(&iter, NULL, &profile)) {
+		count += g_queue_get_length(&((ContextProfile *)profile)->spare_views);
+		context_profile_drain(profile);
+	}
+	if (count > 0) {
+		g_debug("Destroyed %u spare web views", count);
+	}
+	return count;
+}
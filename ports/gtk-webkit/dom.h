@@ -0,0 +1,216 @@
+/*
+Copyright © 2019 Atlas Engineer LLC.
+Use of this file is governed by the license that can be found in LICENSE.
+*/
+#pragma once
+
+#include <unistd.h>
+#include <gio/gio.h>
+#include <webkit2/webkit2.h>
+
+#include "client.h"
+#include "server-state.h"
+#include "web-extension.h"
+
+// Native DOM queries: link hints and headings are found by the web extension of
+// the port in the web process, see web-extension.c, instead of JavaScript whose
+// result is serialized to JSON.  Each web process connects to a D-Bus
+// peer-to-peer server of the port and announces its pages.  Results are sent to
+// the Lisp core with buffer.dom.call.back as XML-RPC values, e.g. lists.
+
+// Result of a query that failed, e.g. because the web process went away.
+#define DOM_QUERY_FAILED "next:dom-query-failed"
+
+// Only let processes of the same user in.
+static gboolean dom_authorize_peer(GDBusAuthObserver *_observer, GIOStream *_stream,
+	GCredentials *credentials, gpointer _data) {
+	return credentials != NULL && g_credentials_get_unix_user(credentials, NULL) == getuid();
+}
+
+static void dom_page_signal(GDBusConnection *connection, const char *_sender,
+	const char *_object_path, const char *_interface_name, const char *signal_name,
+	GVariant *parameters, gpointer _data) {
+	guint64 page_id = 0;
+	g_variant_get(parameters, "(t)", &page_id);
+	if (g_strcmp0(signal_name, "PageCreated") == 0) {
+		gint64 *key = g_new(gint64, 1);
+		*key = (gint64)page_id;
+		g_hash_table_replace(state.dom_pages, key, g_object_ref(connection));
+	} else if (g_strcmp0(signal_name, "PageDestroyed") == 0
+	           && g_hash_table_lookup(state.dom_pages, &page_id) == connection) {
+		// The page may have moved to another web process meanwhile, e.g. after a
+		// crash, whose PageCreated must not be undone.
+		g_hash_table_remove(state.dom_pages, &page_id);
+	}
+}
+
+static gboolean dom_page_has_connection(gpointer _page_id, gpointer connection,
+	gpointer closed_connection) {
+	return connection == closed_connection;
+}
+
+static void dom_connection_closed(GDBusConnection *connection,
+	gboolean _remote_peer_vanished, GError *_error, gpointer _data) {
+	g_debug("Web extension disconnected");
+	g_hash_table_foreach_remove(state.dom_pages, dom_page_has_connection, connection);
+	g_object_unref(connection);
+}
+
+static gboolean dom_new_connection(GDBusServer *_server, GDBusConnection *connection,
+	gpointer _data) {
+	g_debug("Web extension connected");
+	g_object_ref(connection);
+	g_signal_connect(connection, "closed", G_CALLBACK(dom_connection_closed), NULL);
+	g_dbus_connection_signal_subscribe(connection, NULL, WEB_EXTENSION_INTERFACE, NULL,
+		WEB_EXTENSION_OBJECT_PATH, NULL, G_DBUS_SIGNAL_FLAGS_NONE,
+		dom_page_signal, NULL, NULL);
+	return TRUE;
+}
+
+// Start the server that the web extensions connect to.  Without it, the
+// queries fall back to JavaScript.
+void dom_start() {
+	state.dom_pages = g_hash_table_new_full(g_int64_hash, g_int64_equal, &g_free,
+			&g_object_unref);
+	char *address = g_strdup_printf("unix:tmpdir=%s", g_get_tmp_dir());
+	char *guid = g_dbus_generate_guid();
+	GDBusAuthObserver *observer = g_dbus_auth_observer_new();
+	g_signal_connect(observer, "authorize-authenticated-peer",
+		G_CALLBACK(dom_authorize_peer), NULL);
+	GError *error = NULL;
+	state.dom_server = g_dbus_server_new_sync(address, G_DBUS_SERVER_FLAGS_NONE, guid,
+			observer, NULL, &error);
+	g_object_unref(observer);
+	g_free(guid);
+	g_free(address);
+	if (state.dom_server == NULL) {
+		g_warning("Cannot start the web extension server: %s", error->message);
+		g_error_free(error);
+		return;
+	}
+	g_signal_connect(state.dom_server, "new-connection", G_CALLBACK(dom_new_connection), NULL);
+	g_dbus_server_start(state.dom_server);
+	g_debug("Web extension server listening on %s",
+		g_dbus_server_get_client_address(state.dom_server));
+}
+
+void dom_stop() {
+	if (state.dom_server != NULL) {
+		g_dbus_server_stop(state.dom_server);
+	}
+}
+
+// Make the web processes of CONTEXT load the web extension.
+void dom_context_setup(WebKitWebContext *context) {
+	if (state.dom_server == NULL) {
+		return;
+	}
+	webkit_web_context_set_web_extensions_directory(context,
+		state.web_extensions_directory);
+	webkit_web_context_set_web_extensions_initialization_user_data(context,
+		g_variant_new_string(g_dbus_server_get_client_address(state.dom_server)));
+}
+
+// Return the process identifiers of the web extensions connected to the
+// port, one per web process, to be freed with g_array_unref.
+GArray *dom_web_process_pids() {
+	GArray *pids = g_array_new(FALSE, FALSE, sizeof (pid_t));
+	if (state.dom_pages == NULL) {
+		return pids;
+	}
+	// A web process hosts many pages over one connection.
+	GHashTable *connections = g_hash_table_new(g_direct_hash, g_direct_equal);
+	GHashTableIter iter;
+	gpointer connection = NULL;
+	g_hash_table_iter_init(&iter, state.dom_pages);
+	while (g_hash_table_iter_next(&iter, NULL, &connection)) {
+		if (!g_hash_table_add(connections, connection)) {
+			continue;
+		}
+		GCredentials *credentials = g_dbus_connection_get_peer_credentials(connection);
+		pid_t pid = credentials != NULL ? g_credentials_get_unix_pid(credentials, NULL) : -1;
+		if (pid > 0) {
+			g_array_append_val(pids, pid);
+		}
+	}
+	g_hash_table_unref(connections);
+	return pids;
+}
+
+typedef struct {
+	gint buffer_id;
+	int callback_id;
+} DomCall;
+
+// Send VALUE, which is consumed, to the Lisp core as the result of the query
+// CALLBACK_ID in buffer BUFFER_ID.
+void dom_send_result(gint buffer_id, int callback_id, GVariant *value) {
+	g_variant_take_ref(value);
+	char *callback_string = g_strdup_printf("%i", callback_id);
+	const char *method_name = "buffer.dom.call.back";
+	GVariant *params = g_variant_new("(i@*s)", buffer_id, value, callback_string);
+	g_message("XML-RPC message: %s (buffer id, result, callback id) = (%i, ..., %s)",
+		method_name, buffer_id, callback_string);
+	client_call(method_name, params, NULL, NULL);
+	g_variant_unref(value);
+	g_free(callback_string);
+}
+
+static void dom_call_finish(GObject *connection, GAsyncResult *result, gpointer data) {
+	DomCall *call = data;
+	GError *error = NULL;
+	GVariant *reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(connection), result,
+			&error);
+	GVariant *value = NULL;
+	if (reply == NULL) {
+		g_warning("DOM query in buffer %i failed: %s", call->buffer_id, error->message);
+		g_error_free(error);
+		// The Lisp core runs its script instead.
+		value = g_variant_new_string(DOM_QUERY_FAILED);
+	} else {
+		value = g_variant_get_child_value(reply, 0);
+		g_variant_unref(reply);
+	}
+	dom_send_result(call->buffer_id, call->callback_id, value);
+	g_free(call);
+}
+
+// Call METHOD of the web extension hosting the page of WEB_VIEW, with the page
+// identifier followed by ARGS, a tuple or NULL, which is consumed.  The result
+// is sent to the Lisp core as the one of CALLBACK_ID in buffer BUFFER_ID.
+// Return FALSE if no web extension hosts the page, e.g. while it starts.
+gboolean dom_call(WebKitWebView *web_view, const char *method, GVariant *args,
+	gint buffer_id, int callback_id) {
+	if (args != NULL) {
+		g_variant_ref_sink(args);
+	}
+	guint64 page_id = webkit_web_view_get_page_id(web_view);
+	GDBusConnection *connection = state.dom_pages != NULL
+		? g_hash_table_lookup(state.dom_pages, &page_id)
+		: NULL;
+	if (connection == NULL) {
+		if (args != NULL) {
+			g_variant_unref(args);
+		}
+		return FALSE;
+	}
+
+	GVariantBuilder builder;
+	g_variant_builder_init(&builder, G_VARIANT_TYPE_TUPLE);
+	g_variant_builder_add(&builder, "t", page_id);
+	if (args != NULL) {
+		for (gsize i = 0; i < g_variant_n_children(args); i++) {
+			GVariant *arg = g_variant_get_child_value(args, i);
+			g_variant_builder_add_value(&builder, arg);
+			g_variant_unref(arg);
+		}
+		g_variant_unref(args);
+	}
+	DomCall *call = g_new(DomCall, 1);
+	call->buffer_id = buffer_id;
+	call->callback_id = callback_id;
+	g_dbus_connection_call(connection, NULL, WEB_EXTENSION_OBJECT_PATH,
+		WEB_EXTENSION_INTERFACE, method, g_variant_builder_end(&builder), NULL,
+		G_DBUS_CALL_FLAGS_NONE, -1, NULL, dom_call_finish, call);
+	return TRUE;
+}
@@ -0,0 +1,341 @@
+/*
+Copyright © 2019 Atlas Engineer LLC.
+Use of this file is governed by the license that can be found in LICENSE.
+*/
+#pragma once
+
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <webkit2/webkit2.h>
+
+#include "client.h"
+#include "server-state.h"
+
+// Downloads are started by pages, when the Lisp core answers "request.resource"
+// with 2, or by the core with download.start.  WebKit streams them to the
+// download directory.  The port reports them to the core with:
+//
+// - download.did.start (id, URI, path) once the destination is known;
+// - download.did.progress (id, received bytes, total bytes, ...) for all the
+//   downloads that progressed, at most every DOWNLOAD_PROGRESS_INTERVAL;
+// - download.did.finish (id, status, path or error) where status is
+//   "finished", "failed" or "cancelled".
+//
+// WebKit cannot resume a download, so a failed one is started again from
+// scratch, to the same file if it is still free, up to DOWNLOAD_MAX_ATTEMPTS
+// times.  No file is ever overwritten.
+
+#ifndef DOWNLOAD_PROGRESS_INTERVAL
+#define DOWNLOAD_PROGRESS_INTERVAL 500
+#endif
+#ifndef DOWNLOAD_MAX_ATTEMPTS
+#define DOWNLOAD_MAX_ATTEMPTS 3
+#endif
+
+typedef struct {
+	gint identifier;
+	// The current attempt, NULL while waiting to retry.
+	WebKitDownload *download;
+	WebKitWebContext *context;
+	char *uri;
+	// Destination file, NULL until WebKit has suggested a file name.
+	char *path;
+	guint attempts;
+	guint retry_source;
+	// Set when the download failed for good or was cancelled.
+	char *error;
+	gboolean cancelled;
+	// Set when new data arrived since the last progress report.
+	gboolean progressed;
+	guint64 received;
+	guint64 total;
+} Download;
+
+static void download_free(Download *download) {
+	if (download->retry_source != 0) {
+		g_source_remove(download->retry_source);
+	}
+	if (download->download != NULL) {
+		g_signal_handlers_disconnect_by_data(download->download, download);
+		g_object_unref(download->download);
+	}
+	g_object_unref(download->context);
+	g_free(download->uri);
+	g_free(download->path);
+	g_free(download->error);
+	g_free(download);
+}
+
+static Download *download_lookup(gint identifier) {
+	if (state.downloads == NULL) {
+		return NULL;
+	}
+	return g_hash_table_lookup(state.downloads, GINT_TO_POINTER(identifier));
+}
+
+// Return the download directory, by default the XDG one.
+static const char *download_directory() {
+	if (state.download_directory != NULL) {
+		return state.download_directory;
+	}
+	const char *directory = g_get_user_special_dir(G_USER_DIRECTORY_DOWNLOAD);
+	return directory != NULL ? directory : g_get_home_dir();
+}
+
+// Return whether PATH exists or is the destination of a download other than
+// EXCEPT: WebKit creates the file only once data arrives, so two downloads of
+// the same name that start together would otherwise get the same path.
+static gboolean download_path_in_use(const char *path, Download *except) {
+	if (g_file_test(path, G_FILE_TEST_EXISTS)) {
+		return TRUE;
+	}
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, state.downloads);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		Download *download = value;
+		if (download != except && g_strcmp0(download->path, path) == 0) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+// Return a path in DIRECTORY for FILENAME that is not in use by DOWNLOAD, adding
+// a number before the extension if needed.  Must be freed.
+static char *download_unique_path(const char *directory, const char *filename,
+	Download *download) {
+	char *path = g_build_filename(directory, filename, NULL);
+	const char *extension = strrchr(filename, '.');
+	if (extension == NULL || extension == filename) {
+		extension = filename + strlen(filename);
+	}
+	for (guint i = 1; download_path_in_use(path, download); i++) {
+		g_free(path);
+		char *numbered = g_strdup_printf("%.*s (%u)%s",
+				(int)(extension - filename), filename, i, extension);
+		path = g_build_filename(directory, numbered, NULL);
+		g_free(numbered);
+	}
+	return path;
+}
+
+// Send the progress of the downloads that progressed since the last call, and
+// return the number of downloads in progress.
+static guint download_flush_progress() {
+	GVariantBuilder builder;
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("ad"));
+	guint count = 0;
+	guint active = 0;
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, state.downloads);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		Download *download = value;
+		if (download->download != NULL || download->retry_source != 0) {
+			active++;
+		}
+		if (!download->progressed) {
+			continue;
+		}
+		download->progressed = FALSE;
+		// Doubles since XML-RPC has no 64-bit integers.
+		g_variant_builder_add(&builder, "d", (gdouble)download->identifier);
+		g_variant_builder_add(&builder, "d", (gdouble)download->received);
+		g_variant_builder_add(&builder, "d", (gdouble)download->total);
+		count++;
+	}
+	if (count == 0) {
+		g_variant_builder_clear(&builder);
+	} else {
+		const char *method_name = "download.did.progress";
+		GVariant *arg = g_variant_new("(ad)", &builder);
+		g_debug("XML-RPC message: %s, %u downloads", method_name, count);
+		client_call(method_name, arg, NULL, NULL);
+	}
+	return active;
+}
+
+static gboolean download_report_progress(gpointer _data) {
+	if (download_flush_progress() == 0) {
+		state.download_progress_source = 0;
+		return G_SOURCE_REMOVE;
+	}
+	return G_SOURCE_CONTINUE;
+}
+
+static void download_schedule_progress() {
+	if (state.download_progress_source == 0) {
+		state.download_progress_source = g_timeout_add(DOWNLOAD_PROGRESS_INTERVAL,
+				download_report_progress, NULL);
+	}
+}
+
+static gboolean download_decide_destination(WebKitDownload *web_download,
+	gchar *suggested_filename, Download *download) {
+	// Retries keep the path unless a file appeared there meanwhile, e.g. what
+	// the failed attempt left: a new name is taken rather than overwriting it.
+	gboolean moved = download->path == NULL
+		|| download_path_in_use(download->path, download);
+	if (moved) {
+		char *filename = g_path_get_basename(suggested_filename != NULL
+				&& suggested_filename[0] != '\0' ? suggested_filename : "download");
+		g_mkdir_with_parents(download_directory(), 0700);
+		g_free(download->path);
+		download->path = download_unique_path(download_directory(), filename, download);
+		g_free(filename);
+	}
+	char *destination = g_filename_to_uri(download->path, NULL, NULL);
+	webkit_download_set_destination(web_download, destination);
+	g_free(destination);
+
+	// The core updates the path of a known download.
+	if (moved) {
+		const char *method_name = "download.did.start";
+		GVariant *arg = g_variant_new("(iss)", download->identifier, download->uri,
+				download->path);
+		g_message("XML-RPC message: %s (download id, URI, path) = %s",
+			method_name, g_variant_print(arg, TRUE));
+		client_call(method_name, arg, NULL, NULL);
+	}
+	return TRUE;
+}
+
+static void download_received_data(WebKitDownload *web_download,
+	guint64 _data_length, Download *download) {
+	download->received = webkit_download_get_received_data_length(web_download);
+	WebKitURIResponse *response = webkit_download_get_response(web_download);
+	download->total = response != NULL ? webkit_uri_response_get_content_length(response) : 0;
+	download->progressed = TRUE;
+	download_schedule_progress();
+}
+
+static void download_failed(WebKitDownload *_web_download, GError *error,
+	Download *download) {
+	g_free(download->error);
+	download->error = g_strdup(error->message);
+	download->cancelled = g_error_matches(error, WEBKIT_DOWNLOAD_ERROR,
+			WEBKIT_DOWNLOAD_ERROR_CANCELLED_BY_USER);
+}
+
+static void download_watch(Download *download, WebKitDownload *web_download);
+
+static gboolean download_retry(gpointer data) {
+	Download *download = data;
+	download->retry_source = 0;
+	g_message("Retrying download %i of %s", download->identifier, download->uri);
+	WebKitDownload *web_download = webkit_web_context_download_uri(download->context,
+			download->uri);
+	download_watch(download, web_download);
+	g_object_unref(web_download);
+	return G_SOURCE_REMOVE;
+}
+
+// WebKit emits "finished" after "failed" too.
+static void download_finished(WebKitDownload *_web_download, Download *download) {
+	g_signal_handlers_disconnect_by_data(download->download, download);
+	g_clear_object(&download->download);
+
+	if (download->error != NULL && !download->cancelled
+	    && download->attempts < DOWNLOAD_MAX_ATTEMPTS) {
+		g_warning("Download %i failed: %s", download->identifier, download->error);
+		g_clear_pointer(&download->error, g_free);
+		// Back off 1, 2, 4... seconds.
+		download->retry_source = g_timeout_add_seconds(1 << (download->attempts - 1),
+				download_retry, download);
+		return;
+	}
+
+	// The last progress report would come after the end otherwise.
+	download_flush_progress();
+	const char *method_name = "download.did.finish";
+	const char *status = download->cancelled ? "cancelled"
+		: download->error != NULL ? "failed"
+		: "finished";
+	GVariant *arg = g_variant_new("(iss)", download->identifier, status,
+			download->error != NULL ? download->error
+			: download->path != NULL ? download->path : "");
+	g_message("XML-RPC message: %s (download id, status, path or error) = %s",
+		method_name, g_variant_print(arg, TRUE));
+	client_call(method_name, arg, NULL, NULL);
+	g_hash_table_remove(state.downloads, GINT_TO_POINTER(download->identifier));
+}
+
+// Follow WEB_DOWNLOAD, a new attempt of DOWNLOAD.
+static void download_watch(Download *download, WebKitDownload *web_download) {
+	download->download = g_object_ref(web_download);
+	download->attempts++;
+	g_object_set_data(G_OBJECT(web_download), "next-download", download);
+	g_signal_connect(web_download, "decide-destination",
+		G_CALLBACK(download_decide_destination), download);
+	g_signal_connect(web_download, "received-data",
+		G_CALLBACK(download_received_data), download);
+	g_signal_connect(web_download, "failed",
+		G_CALLBACK(download_failed), download);
+	g_signal_connect(web_download, "finished",
+		G_CALLBACK(download_finished), download);
+}
+
+static Download *download_new(WebKitWebContext *context, const char *uri) {
+	if (state.downloads == NULL) {
+		state.downloads = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+				(GDestroyNotify)&download_free);
+	}
+	Download *download = g_new0(Download, 1);
+	download->identifier = ++state.download_count;
+	download->context = g_object_ref(context);
+	download->uri = g_strdup(uri);
+	g_hash_table_insert(state.downloads, GINT_TO_POINTER(download->identifier), download);
+	return download;
+}
+
+// Handler of the "download-started" signal of web contexts, for the downloads
+// started by pages.
+void download_started(WebKitWebContext *context, WebKitDownload *web_download,
+	gpointer _data) {
+	if (g_object_get_data(G_OBJECT(web_download), "next-download") != NULL) {
+		// Started by download_start or download_retry.
+		return;
+	}
+	const char *uri = webkit_uri_request_get_uri(webkit_download_get_request(web_download));
+	Download *download = download_new(context, uri);
+	g_message("Download %i started by a page: %s", download->identifier, uri);
+	download_watch(download, web_download);
+}
+
+// Download URI in CONTEXT and return the download identifier.
+gint download_start(WebKitWebContext *context, const char *uri) {
+	Download *download = download_new(context, uri);
+	WebKitDownload *web_download = webkit_web_context_download_uri(context, uri);
+	download_watch(download, web_download);
+	g_object_unref(web_download);
+	return download->identifier;
+}
+
+// Return FALSE if there is no such download.
+gboolean download_cancel(gint identifier) {
+	Download *download = download_lookup(identifier);
+	if (download == NULL) {
+		return FALSE;
+	}
+	if (download->download != NULL) {
+		// download_finished takes it from there.
+		webkit_download_cancel(download->download);
+		return TRUE;
+	}
+	// Waiting to retry.
+	const char *method_name = "download.did.finish";
+	GVariant *arg = g_variant_new("(iss)", download->identifier, "cancelled",
+			"Cancelled by user");
+	g_message("XML-RPC message: %s (download id, status, path or error) = %s",
+		method_name, g_variant_print(arg, TRUE));
+	client_call(method_name, arg, NULL, NULL);
+	g_hash_table_remove(state.downloads, GINT_TO_POINTER(identifier));
+	return TRUE;
+}
+
+// Return the number of downloads in progress or waiting to retry.
+guint download_count() {
+	return state.downloads != NULL ? g_hash_table_size(state.downloads) : 0;
+}
@@ -0,0 +1,201 @@
+/*
+Copyright © 2019 Atlas Engineer LLC.
+Use of this file is governed by the license that can be found in LICENSE.
+*/
+#pragma once
+
+#include <string.h>
+#include <glib.h>
+#include <webkit2/webkit2.h>
+
+#include "buffer.h"
+#include "server-state.h"
+
+// Content blocking: the Lisp core loads filter sets, JSON rule lists in the
+// WebKit content blocker format, which WebKit compiles to bytecode.  The
+// compiled filters are kept on disk by a WebKitUserContentFilterStore along
+// with a checksum of their source, so that they are only compiled again when
+// the source changes.  Every loaded filter applies to every buffer.
+
+typedef struct {
+	char *identifier;
+	char *path;
+	char *checksum;
+} FilterRequest;
+
+static void filter_request_free(FilterRequest *request) {
+	g_free(request->identifier);
+	g_free(request->path);
+	g_free(request->checksum);
+	g_free(request);
+}
+
+static WebKitUserContentFilterStore *filter_store() {
+	if (state.filter_store == NULL) {
+		char *path = g_build_filename(g_get_user_cache_dir(), "next", "content-filters", NULL);
+		state.filter_store = webkit_user_content_filter_store_new(path);
+		g_free(path);
+	}
+	return state.filter_store;
+}
+
+// Result must be freed.
+static char *filter_checksum_path(const char *identifier) {
+	char *name = g_strdup_printf("%s.sha256", identifier);
+	char *path = g_build_filename(webkit_user_content_filter_store_get_path(filter_store()),
+			name, NULL);
+	g_free(name);
+	return path;
+}
+
+// Add the installed filters to the user content manager of WEB_VIEW.
+void filter_attach(WebKitWebView *web_view) {
+	if (state.filters == NULL) {
+		return;
+	}
+	WebKitUserContentManager *manager = webkit_web_view_get_user_content_manager(web_view);
+	GHashTableIter iter;
+	gpointer filter;
+	g_hash_table_iter_init(&iter, state.filters);
+	while (g_hash_table_iter_next(&iter, NULL, &filter)) {
+		webkit_user_content_manager_add_filter(manager, filter);
+	}
+}
+
+// Make FILTER active in all the buffers, in place of the filter with the same
+// identifier if any.
+static void filter_install(WebKitUserContentFilter *filter) {
+	const char *identifier = webkit_user_content_filter_get_identifier(filter);
+	for (guint i = 1; i < state.buffers->len; i++) {
+		Buffer *buffer = g_ptr_array_index(state.buffers, i);
+		if (buffer == NULL || buffer->web_view == NULL) {
+			continue;
+		}
+		WebKitUserContentManager *manager =
+			webkit_web_view_get_user_content_manager(buffer->web_view);
+		// A filter replaces the one with the same identifier.
+		webkit_user_content_manager_add_filter(manager, filter);
+	}
+	g_hash_table_replace(state.filters, g_strdup(identifier),
+		webkit_user_content_filter_ref(filter));
+	g_message("Content filter '%s' installed", identifier);
+}
+
+static void filter_saved(GObject *store, GAsyncResult *result, gpointer data) {
+	FilterRequest *request = data;
+	GError *error = NULL;
+	WebKitUserContentFilter *filter = webkit_user_content_filter_store_save_finish(
+		WEBKIT_USER_CONTENT_FILTER_STORE(store), result, &error);
+	if (filter == NULL) {
+		g_warning("Cannot compile content filter '%s' from %s: %s",
+			request->identifier, request->path, error->message);
+		g_error_free(error);
+		filter_request_free(request);
+		return;
+	}
+	char *checksum_path = filter_checksum_path(request->identifier);
+	if (!g_file_set_contents(checksum_path, request->checksum, -1, &error)) {
+		g_warning("Cannot save content filter checksum: %s", error->message);
+		g_error_free(error);
+	}
+	g_free(checksum_path);
+	filter_install(filter);
+	webkit_user_content_filter_unref(filter);
+	filter_request_free(request);
+}
+
+// Compile the source of REQUEST, which must be freed, whose CONTENTS are
+// consumed.
+static void filter_compile(FilterRequest *request, GBytes *contents) {
+	g_message("Compiling content filter '%s' from %s", request->identifier, request->path);
+	webkit_user_content_filter_store_save(filter_store(), request->identifier, contents,
+		NULL, filter_saved, request);
+	g_bytes_unref(contents);
+}
+
+typedef struct {
+	FilterRequest *request;
+	GBytes *contents;
+} FilterLoad;
+
+static void filter_loaded(GObject *store, GAsyncResult *result, gpointer data) {
+	FilterLoad *load = data;
+	GError *error = NULL;
+	WebKitUserContentFilter *filter = webkit_user_content_filter_store_load_finish(
+		WEBKIT_USER_CONTENT_FILTER_STORE(store), result, &error);
+	if (filter == NULL) {
+		g_debug("No compiled content filter '%s': %s", load->request->identifier,
+			error->message);
+		g_error_free(error);
+		filter_compile(load->request, load->contents);
+	} else {
+		filter_install(filter);
+		webkit_user_content_filter_unref(filter);
+		filter_request_free(load->request);
+		g_bytes_unref(load->contents);
+	}
+	g_free(load);
+}
+
+// Load the filter set IDENTIFIER from the JSON file at PATH.  Unless FORCE is
+// set, the compiled filter is reused when PATH has not changed since it was
+// compiled.  Return FALSE if PATH cannot be read.
+gboolean filter_load(const char *identifier, const char *path, gboolean force) {
+	if (state.filters == NULL) {
+		state.filters = g_hash_table_new_full(g_str_hash, g_str_equal, &g_free,
+				(GDestroyNotify)&webkit_user_content_filter_unref);
+	}
+	char *contents = NULL;
+	gsize length = 0;
+	GError *error = NULL;
+	if (!g_file_get_contents(path, &contents, &length, &error)) {
+		g_warning("Cannot read content filter '%s': %s", identifier, error->message);
+		g_error_free(error);
+		return FALSE;
+	}
+	GBytes *bytes = g_bytes_new_take(contents, length);
+
+	FilterRequest *request = g_new0(FilterRequest, 1);
+	request->identifier = g_strdup(identifier);
+	request->path = g_strdup(path);
+	request->checksum = g_compute_checksum_for_bytes(G_CHECKSUM_SHA256, bytes);
+
+	char *checksum_path = filter_checksum_path(identifier);
+	char *saved_checksum = NULL;
+	gboolean unchanged = g_file_get_contents(checksum_path, &saved_checksum, NULL, NULL)
+		&& g_strcmp0(saved_checksum, request->checksum) == 0;
+	g_free(saved_checksum);
+	g_free(checksum_path);
+
+	if (force || !unchanged) {
+		filter_compile(request, bytes);
+		return TRUE;
+	}
+	FilterLoad *load = g_new(FilterLoad, 1);
+	load->request = request;
+	load->contents = bytes;
+	webkit_user_content_filter_store_load(filter_store(), identifier, NULL,
+		filter_loaded, load);
+	return TRUE;
+}
+
+static gint filter_compare_strings(gconstpointer a, gconstpointer b) {
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+// Return the identifiers of the installed filters, sorted.  Free the array,
+// not its elements.
+const char **filter_identifiers() {
+	GPtrArray *identifiers = g_ptr_array_new();
+	if (state.filters != NULL) {
+		GHashTableIter iter;
+		gpointer identifier;
+		g_hash_table_iter_init(&iter, state.filters);
+		while (g_hash_table_iter_next(&iter, &identifier, NULL)) {
+			g_ptr_array_add(identifiers, identifier);
+		}
+	}
+	g_ptr_array_sort(identifiers, filter_compare_strings);
+	g_ptr_array_add(identifiers, NULL);
+	return (const char **)g_ptr_array_free(identifiers, FALSE);
+}
@@ -0,0 +1,91 @@
+/*
+Copyright © 2019 Atlas Engineer LLC.
+Use of this file is governed by the license that can be found in LICENSE.
+*/
+#pragma once
+
+#include <glib.h>
+#include <webkit2/webkit2.h>
+
+#include "buffer.h"
+#include "client.h"
+
+// Find in page with the WebKitFindController of the web view, which highlights
+// all the matches and scrolls to the current one without touching the DOM.
+// Every search, next and previous reports the number of matches to the Lisp
+// core with buffer.did.find (buffer id, text, match count).
+
+static void find_report(Buffer *buffer, WebKitFindController *controller, guint match_count) {
+	const char *text = webkit_find_controller_get_search_text(controller);
+	const char *method_name = "buffer.did.find";
+	GVariant *arg = g_variant_new("(isi)", buffer->identifier, text != NULL ? text : "",
+			(gint32)MIN(match_count, G_MAXINT32));
+	g_message("XML-RPC message: %s (buffer id, text, match count) = %s",
+		method_name, g_variant_print(arg, TRUE));
+	client_call(method_name, arg, NULL, NULL);
+}
+
+static void find_found_text(WebKitFindController *controller, guint match_count,
+	Buffer *buffer) {
+	find_report(buffer, controller, match_count);
+}
+
+static void find_failed_to_find_text(WebKitFindController *controller, Buffer *buffer) {
+	find_report(buffer, controller, 0);
+}
+
+// Report the searches in BUFFER.
+void find_attach(Buffer *buffer) {
+	WebKitFindController *controller = webkit_web_view_get_find_controller(buffer->web_view);
+	g_signal_connect(controller, "found-text", G_CALLBACK(find_found_text), buffer);
+	g_signal_connect(controller, "failed-to-find-text",
+		G_CALLBACK(find_failed_to_find_text), buffer);
+}
+
+// Stop reporting the searches in BUFFER, before its web view is destroyed.
+void find_detach(Buffer *buffer) {
+	g_signal_handlers_disconnect_by_data(
+		webkit_web_view_get_find_controller(buffer->web_view), buffer);
+}
+
+// Highlight the matches of TEXT in BUFFER and go to the first one.  Return
+// FALSE if the buffer has no page to search, e.g. while it is hibernated.
+gboolean find_search(Buffer *buffer, const char *text, gboolean case_sensitive) {
+	if (buffer->web_view == NULL) {
+		return FALSE;
+	}
+	guint32 options = WEBKIT_FIND_OPTIONS_WRAP_AROUND;
+	if (!case_sensitive) {
+		options |= WEBKIT_FIND_OPTIONS_CASE_INSENSITIVE;
+	}
+	webkit_find_controller_search(webkit_web_view_get_find_controller(buffer->web_view),
+		text, options, G_MAXUINT);
+	return TRUE;
+}
+
+// Go to the next match of the current search, or the previous one with
+// BACKWARDS.
+gboolean find_step(Buffer *buffer, gboolean backwards) {
+	if (buffer->web_view == NULL) {
+		return FALSE;
+	}
+	WebKitFindController *controller = webkit_web_view_get_find_controller(buffer->web_view);
+	if (webkit_find_controller_get_search_text(controller) == NULL) {
+		return FALSE;
+	}
+	if (backwards) {
+		webkit_find_controller_search_previous(controller);
+	} else {
+		webkit_find_controller_search_next(controller);
+	}
+	return TRUE;
+}
+
+// Remove the highlights of the current search.
+gboolean find_finish(Buffer *buffer) {
+	if (buffer->web_view == NULL) {
+		return FALSE;
+	}
+	webkit_find_controller_search_finish(webkit_web_view_get_find_controller(buffer->web_view));
+	return TRUE;
+}
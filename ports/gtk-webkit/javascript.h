@@ -4,18 +4,88 @@ Use of this file is governed by the license that can be found in LICENSE.
 */
 #pragma once
 
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 #include <webkit2/webkit2.h>
 #include <JavaScriptCore/JavaScript.h>
 #include "client.h"
 #include "server-state.h"
 
-// Return value must be freed.
-gchar *javascript_result(GObject *object, GAsyncResult *result,
-	gpointer _data) {
-	WebKitJavascriptResult *js_result;
+// Results larger than this are not embedded in the RPC but written to a memory
+// file that the Lisp core reads directly, which spares the XML escaping and
+// parsing of megabytes of page text or JSON.
+#define JAVASCRIPT_TRANSFER_THRESHOLD (64 * 1024)
+
+typedef struct {
+	int fd;
+	// The path the Lisp core opens to read the result.
+	char *path;
+	// Whether 'path' is a temporary file to remove once the result is read.
+	gboolean temporary;
+} JavascriptTransfer;
+
+// Write the LENGTH bytes of DATA to a new memory file, or a temporary file
+// where memfd_create is not available.  Return NULL on error.
+JavascriptTransfer *javascript_transfer_new(const char *data, gsize length) {
+	JavascriptTransfer *transfer = g_new0(JavascriptTransfer, 1);
+	transfer->fd = -1;
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+	transfer->fd = memfd_create("next-javascript-result", MFD_CLOEXEC);
+	if (transfer->fd != -1) {
+		transfer->path = g_strdup_printf("/proc/%d/fd/%d", getpid(), transfer->fd);
+	}
+#endif
+	if (transfer->fd == -1) {
+		GError *error = NULL;
+		transfer->fd = g_file_open_tmp("next-javascript-XXXXXX", &transfer->path, &error);
+		if (transfer->fd == -1) {
+			g_warning("Failed to create a file for the javascript result: %s", error->message);
+			g_error_free(error);
+			g_free(transfer);
+			return NULL;
+		}
+		transfer->temporary = TRUE;
+	}
+
+	gsize written = 0;
+	while (written < length) {
+		gssize count = write(transfer->fd, data + written, length - written);
+		if (count < 0) {
+			g_warning("Failed to write the javascript result to %s", transfer->path);
+			if (transfer->temporary) {
+				g_unlink(transfer->path);
+			}
+			close(transfer->fd);
+			g_free(transfer->path);
+			g_free(transfer);
+			return NULL;
+		}
+		written += count;
+	}
+	return transfer;
+}
+
+// A ClientCallback: the Lisp core has read the result by the time it responds.
+// The call also fails, and the file is freed, if the core does not respond in
+// time or the connection is lost.
+void javascript_transfer_free(GVariant *_result, gpointer transfer_data) {
+	JavascriptTransfer *transfer = transfer_data;
+	if (transfer->temporary) {
+		g_unlink(transfer->path);
+	}
+	close(transfer->fd);
+	g_free(transfer->path);
+	g_free(transfer);
+}
+
+// Return the string value of JS_RESULT, or NULL and log ERROR if the script
+// failed.  Return value must be freed.
+static gchar *javascript_result_string(WebKitJavascriptResult *js_result, GError *error) {
 	JSCValue *value;
-	GError *error = NULL;
-	js_result = webkit_web_view_run_javascript_finish(WEBKIT_WEB_VIEW(object), result, &error);
 	if (!js_result) {
 		g_warning("Error running javascript: %s", error->message);
 		g_error_free(error);
@@ -30,6 +100,8 @@ gchar *javascript_result(GObject *object, GAsyncResult *result,
 	exception = jsc_context_get_exception(jsc_value_get_context(value));
 	if (exception) {
 		g_warning("Error running javascript: %s", jsc_exception_get_message(exception));
+		g_free(str_value);
+		webkit_javascript_result_unref(js_result);
 		return NULL;
 	}
 
@@ -38,23 +110,89 @@ gchar *javascript_result(GObject *object, GAsyncResult *result,
 	return str_value;
 }
 
-void javascript_transform_result(GObject *object, GAsyncResult *result,
-	const char *identifier, int callback_id) {
-	gchar *transformed_result = javascript_result(object, result, NULL);
-	g_debug("Javascript result: %s", transformed_result);
-	if (transformed_result == NULL) {
-		return;
-	}
+// Return value must be freed.
+gchar *javascript_result(GObject *object, GAsyncResult *result,
+	gpointer _data) {
+	GError *error = NULL;
+	WebKitJavascriptResult *js_result = webkit_web_view_run_javascript_finish(
+		WEBKIT_WEB_VIEW(object), result, &error);
+	return javascript_result_string(js_result, error);
+}
 
+// Like javascript_result, for webkit_web_view_run_javascript_in_world.
+gchar *javascript_world_result(GObject *object, GAsyncResult *result,
+	gpointer _data) {
 	GError *error = NULL;
-	const char *method_name = "buffer.javascript.call.back";
+	WebKitJavascriptResult *js_result = webkit_web_view_run_javascript_in_world_finish(
+		WEBKIT_WEB_VIEW(object), result, &error);
+	return javascript_result_string(js_result, error);
+}
+
+// Return STRING as a JavaScript string literal.  Must be freed.
+char *javascript_string_literal(const char *string) {
+	GString *literal = g_string_new("\"");
+	for (const char *c = string; *c != '\0'; c++) {
+		switch (*c) {
+		case '"':
+			g_string_append(literal, "\\\"");
+			break;
+		case '\\':
+			g_string_append(literal, "\\\\");
+			break;
+		case '\n':
+			g_string_append(literal, "\\n");
+			break;
+		default:
+			if ((guchar)*c < 0x20) {
+				g_string_append_printf(literal, "\\u%04x", (guchar)*c);
+			} else if (g_str_has_prefix(c, "\xe2\x80\xa8") || g_str_has_prefix(c, "\xe2\x80\xa9")) {
+				// Line terminators, not allowed in literals by older engines.
+				g_string_append_printf(literal, "\\u%04x", c[2] == '\xa8' ? 0x2028 : 0x2029);
+				c += 2;
+			} else {
+				g_string_append_c(literal, *c);
+			}
+		}
+	}
+	g_string_append_c(literal, '"');
+	return g_string_free(literal, FALSE);
+}
+
+// Send TRANSFORMED_RESULT, which is consumed, to the Lisp core as the result of
+// the script of CALLBACK_ID in buffer IDENTIFIER.
+void javascript_send_result(gchar *transformed_result, gint identifier, int callback_id) {
 	char *callback_string = g_strdup_printf("%i", callback_id);
+	gsize length = strlen(transformed_result);
+	if (length > JAVASCRIPT_TRANSFER_THRESHOLD) {
+		JavascriptTransfer *transfer = javascript_transfer_new(transformed_result, length);
+		if (transfer != NULL) {
+			const char *method_name = "buffer.javascript.call.back.file";
+			GVariant *params = g_variant_new(
+				"(isis)",
+				identifier,
+				transfer->path,
+				(gint32)length,
+				callback_string);
+			g_message("XML-RPC message: %s (buffer id, path, length, callback id) = (%i, %s, %zu, %s)",
+				method_name,
+				identifier,
+				transfer->path,
+				length,
+				callback_string);
+			g_free(callback_string);
+			g_free(transformed_result);
+			client_call(method_name, params, javascript_transfer_free, transfer);
+			return;
+		}
+	}
+
+	const char *method_name = "buffer.javascript.call.back";
 	GVariant *params = g_variant_new(
-		"(sss)",
+		"(iss)",
 		identifier,
 		transformed_result,
 		callback_string);
-	g_message("XML-RPC message: %s (buffer id, javascript, callback id) = (%s, ..., %s)",
+	g_message("XML-RPC message: %s (buffer id, javascript, callback id) = (%i, ..., %s)",
 		method_name,
 		identifier,
 		callback_string);
@@ -63,15 +201,16 @@ void javascript_transform_result(GObject *object, GAsyncResult *result,
 	g_free(callback_string);
 	g_free(transformed_result);
 
-	// 'params' is floating and soup_xmlrpc_message_new will consume it.
-	SoupMessage *msg = soup_xmlrpc_message_new(state.core_socket,
-			method_name, params, &error);
+	// 'params' is floating and client_call will consume it.
+	client_call(method_name, params, NULL, NULL);
+}
 
-	if (error) {
-		g_warning("Malformed XML-RPC message: %s", error->message);
-		g_error_free(error);
+void javascript_transform_result(GObject *object, GAsyncResult *result,
+	gint identifier, int callback_id) {
+	gchar *transformed_result = javascript_result(object, result, NULL);
+	g_debug("Javascript result: %s", transformed_result);
+	if (transformed_result == NULL) {
 		return;
 	}
-
-	soup_session_queue_message(xmlrpc_env, msg, NULL, NULL);
+	javascript_send_result(transformed_result, identifier, callback_id);
 }
@@ -0,0 +1,93 @@
+/*
+Copyright © 2018-2019 Atlas Engineer LLC.
+Use of this file is governed by the license that can be found in LICENSE.
+*/
+#pragma once
+
+#include <string.h>
+#include <glib.h>
+
+#include "server-state.h"
+
+// The Lisp core pushes its keymaps here so that key presses which are bound in
+// none of the active keymaps can be forwarded to GTK right away, without a
+// round trip to the core.
+//
+// A keymap is a table of key sequences.  A key sequence is a string of chords
+// separated by spaces, where a chord is its modifiers sorted by strcmp followed
+// by the key string, all separated by hyphens, e.g. "C-x C-s" or "C-M-f".
+
+typedef enum {
+	KEYMAP_UNBOUND,
+	KEYMAP_COMMAND,
+	KEYMAP_PREFIX,
+} KeymapBinding;
+
+// Name of the keymap that is active in every buffer.
+#define KEYMAP_GLOBAL "global"
+
+// Return TRUE if both the global keymap and the keymap LOCAL have been pushed
+// by the core, i.e. if the cache knows about all the keymaps that are active.
+gboolean keymap_cache_covers(const char *local) {
+	return state.keymaps != NULL
+	       && local != NULL
+	       && g_hash_table_contains(state.keymaps, KEYMAP_GLOBAL)
+	       && g_hash_table_contains(state.keymaps, local);
+}
+
+static gint keymap_compare_strings(gconstpointer a, gconstpointer b) {
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+// Return the canonical string of the chord made of KEY and MODIFIERS, a
+// NULL-terminated array.  Must be freed.
+char *keymap_chord_string(const char *key, const char **modifiers) {
+	GPtrArray *sorted = g_ptr_array_new();
+	for (int i = 0; modifiers[i] != NULL; i++) {
+		g_ptr_array_add(sorted, (gpointer)modifiers[i]);
+	}
+	g_ptr_array_sort(sorted, keymap_compare_strings);
+
+	GString *chord = g_string_new(NULL);
+	for (guint i = 0; i < sorted->len; i++) {
+		g_string_append_printf(chord, "%s-", (char *)g_ptr_array_index(sorted, i));
+	}
+	g_string_append(chord, key);
+	g_ptr_array_free(sorted, TRUE);
+	return g_string_free(chord, FALSE);
+}
+
+// Replace the keymap NAME.  BOUND and PREFIXES are NULL-terminated arrays of
+// key sequences, bound to commands and prefixes of longer sequences
+// respectively.
+void keymap_set(const char *name, char **bound, char **prefixes) {
+	GHashTable *keymap = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	for (int i = 0; bound[i] != NULL; i++) {
+		g_hash_table_insert(keymap, g_strdup(bound[i]), GINT_TO_POINTER(KEYMAP_COMMAND));
+	}
+	for (int i = 0; prefixes[i] != NULL; i++) {
+		g_hash_table_insert(keymap, g_strdup(prefixes[i]), GINT_TO_POINTER(KEYMAP_PREFIX));
+	}
+	g_debug("Keymap %s: %u sequences", name, g_hash_table_size(keymap));
+	g_hash_table_replace(state.keymaps, g_strdup(name), keymap);
+}
+
+// Return the binding of SEQUENCE in the global keymap, or else in the keymap
+// LOCAL, the same precedence as the Lisp core.
+KeymapBinding keymap_lookup(const char *local, const char *sequence) {
+	const char *names[] = {KEYMAP_GLOBAL, local};
+	for (int i = 0; i < (sizeof names)/(sizeof names[0]); i++) {
+		if (names[i] == NULL) {
+			continue;
+		}
+		GHashTable *keymap = g_hash_table_lookup(state.keymaps, names[i]);
+		if (keymap == NULL) {
+			continue;
+		}
+		gpointer binding = g_hash_table_lookup(keymap, sequence);
+		if (binding != NULL) {
+			return GPOINTER_TO_INT(binding);
+		}
+	}
+	return KEYMAP_UNBOUND;
+}
@@ -0,0 +1,246 @@
+/*
+Copyright © 2019 Atlas Engineer LLC.
+Use of this file is governed by the license that can be found in LICENSE.
+*/
+#pragma once
+
+#include <string.h>
+#include <glib.h>
+#include <webkit2/webkit2.h>
+#include <JavaScriptCore/JavaScript.h>
+
+#include "buffer.h"
+#include "client.h"
+#include "script.h"
+#include "server-state.h"
+
+// Pages push events to the port with
+//
+//   window.webkit.messageHandlers.next.postMessage({type: "...", ...})
+//
+// instead of the Lisp core polling them with JavaScript round trips.  The port
+// forwards them with buffer.did.post.messages (buffer ids, JSON messages), at
+// most once per MESSAGE_FLUSH_INTERVAL: a message replaces the pending one of
+// the same buffer and type, so that e.g. only the last scroll position is sent.
+//
+// The handler only exists in SCRIPT_WORLD, where the page cannot post to it.
+// Messages of other types than the built-in events that the Lisp core
+// subscribes to with message.subscribe are dropped.  Those events are posted by
+// a user script:
+//
+// - dom-ready {url, title, x, y} once the document is parsed;
+// - scroll {x, y} at most once per animation frame;
+// - selection {text} at most once per animation frame.
+
+#ifndef MESSAGE_FLUSH_INTERVAL
+#define MESSAGE_FLUSH_INTERVAL 16
+#endif
+
+#define MESSAGE_HANDLER "next"
+
+typedef struct {
+	const char *type;
+	const char *listener;
+} MessageEvent;
+
+static const MessageEvent message_events[] = {
+	{.type = "dom-ready", .listener =
+	 "document.addEventListener('DOMContentLoaded', function () {"
+	 "post({type: 'dom-ready', url: window.location.href, title: document.title,"
+	 " x: window.scrollX, y: window.scrollY});"
+	 "});"},
+	{.type = "scroll", .listener =
+	 "window.addEventListener('scroll', throttle(function () {"
+	 "return {type: 'scroll', x: window.scrollX, y: window.scrollY};"
+	 "}), {passive: true});"},
+	{.type = "selection", .listener =
+	 "document.addEventListener('selectionchange', throttle(function () {"
+	 "return {type: 'selection', text: String(window.getSelection())};"
+	 "}));"},
+};
+
+typedef struct {
+	gint buffer_id;
+	char *type;
+	char *json;
+} Message;
+
+static void message_free(Message *message) {
+	g_free(message->type);
+	g_free(message->json);
+	g_free(message);
+}
+
+// Add the user script of the subscribed events to MANAGER.
+void message_add_script(WebKitUserContentManager *manager) {
+	if (state.message_script != NULL) {
+		webkit_user_content_manager_add_script(manager, state.message_script);
+	}
+}
+
+// Post the built-in events TYPES, and no others, from now on.  Return the
+// number of known types.
+guint message_subscribe(char **types) {
+	GString *source = g_string_new("(function () {"
+			"var post = function (message) {"
+			"window.webkit.messageHandlers." MESSAGE_HANDLER ".postMessage(message);"
+			"};"
+			"var throttle = function (make) {"
+			"var pending = false;"
+			"return function () {"
+			"if (pending) { return; }"
+			"pending = true;"
+			"window.requestAnimationFrame(function () { pending = false; post(make()); });"
+			"};"
+			"};");
+	guint count = 0;
+	g_clear_pointer(&state.message_types, g_hash_table_unref);
+	state.message_types = g_hash_table_new(g_str_hash, g_str_equal);
+	for (char **type = types; *type != NULL; type++) {
+		gboolean known = FALSE;
+		for (int i = 0; i < (sizeof message_events)/(sizeof message_events[0]); i++) {
+			if (strcmp(*type, message_events[i].type) == 0) {
+				g_string_append(source, message_events[i].listener);
+				g_hash_table_add(state.message_types, (gpointer)message_events[i].type);
+				known = TRUE;
+				count++;
+				break;
+			}
+		}
+		if (!known) {
+			g_warning("Unknown page event '%s'", *type);
+		}
+	}
+	g_string_append(source, "})();");
+
+	g_clear_pointer(&state.message_script, webkit_user_script_unref);
+	if (count > 0) {
+		state.message_script = webkit_user_script_new_for_world(source->str,
+				WEBKIT_USER_CONTENT_INJECT_TOP_FRAME,
+				WEBKIT_USER_SCRIPT_INJECT_AT_DOCUMENT_START,
+				SCRIPT_WORLD, NULL, NULL);
+	}
+	g_string_free(source, TRUE);
+	// Pages already loaded keep their listeners until they are loaded again.
+	script_reattach_all();
+	g_debug("Subscribed to %u page events", count);
+	return count;
+}
+
+static gboolean message_flush(gpointer _data) {
+	state.message_flush_source = 0;
+	GVariantBuilder buffer_ids;
+	GVariantBuilder messages;
+	g_variant_builder_init(&buffer_ids, G_VARIANT_TYPE("ai"));
+	g_variant_builder_init(&messages, G_VARIANT_TYPE("as"));
+	for (guint i = 0; i < state.messages->len; i++) {
+		Message *message = g_ptr_array_index(state.messages, i);
+		g_variant_builder_add(&buffer_ids, "i", message->buffer_id);
+		g_variant_builder_add(&messages, "s", message->json);
+	}
+	guint count = state.messages->len;
+	g_ptr_array_set_size(state.messages, 0);
+
+	const char *method_name = "buffer.did.post.messages";
+	GVariant *arg = g_variant_new("(aias)", &buffer_ids, &messages);
+	g_debug("XML-RPC message: %s, %u messages", method_name, count);
+	client_call(method_name, arg, NULL, NULL);
+	return G_SOURCE_REMOVE;
+}
+
+// Queue the message JSON of TYPE from the buffer BUFFER_ID, which takes TYPE and
+// JSON.
+static void message_queue(gint buffer_id, char *type, char *json) {
+	if (state.messages == NULL) {
+		state.messages = g_ptr_array_new_with_free_func((GDestroyNotify)&message_free);
+	}
+	for (guint i = 0; i < state.messages->len; i++) {
+		Message *message = g_ptr_array_index(state.messages, i);
+		if (message->buffer_id == buffer_id && strcmp(message->type, type) == 0) {
+			g_free(message->json);
+			message->json = json;
+			g_free(type);
+			return;
+		}
+	}
+	Message *message = g_new(Message, 1);
+	message->buffer_id = buffer_id;
+	message->type = type;
+	message->json = json;
+	g_ptr_array_add(state.messages, message);
+	if (state.message_flush_source == 0) {
+		state.message_flush_source = g_timeout_add(MESSAGE_FLUSH_INTERVAL,
+				message_flush, NULL);
+	}
+}
+
+// Keep the scroll position of BUFFER, so that hibernating it needs no
+// JavaScript, see buffer_hibernate.
+static void message_track_scroll(Buffer *buffer, JSCValue *value) {
+	// The position to restore, see buffer_wake, wins over the one of the page
+	// being loaded.
+	if (buffer->restore_scroll) {
+		return;
+	}
+	JSCValue *x = jsc_value_object_get_property(value, "x");
+	JSCValue *y = jsc_value_object_get_property(value, "y");
+	if (jsc_value_is_number(x) && jsc_value_is_number(y)) {
+		buffer->scroll_x = jsc_value_to_double(x);
+		buffer->scroll_y = jsc_value_to_double(y);
+		buffer->scroll_known = TRUE;
+	}
+	g_object_unref(x);
+	g_object_unref(y);
+}
+
+static void message_received(WebKitUserContentManager *_manager,
+	WebKitJavascriptResult *js_result, Buffer *buffer) {
+	JSCValue *value = webkit_javascript_result_get_js_value(js_result);
+	if (!jsc_value_is_object(value)) {
+		g_debug("Ignoring message of buffer %i, not an object", buffer->identifier);
+		return;
+	}
+	JSCValue *type_value = jsc_value_object_get_property(value, "type");
+	if (!jsc_value_is_string(type_value)) {
+		g_debug("Ignoring message of buffer %i without type", buffer->identifier);
+		g_object_unref(type_value);
+		return;
+	}
+	char *type = jsc_value_to_string(type_value);
+	g_object_unref(type_value);
+	if (state.message_types == NULL
+		|| !g_hash_table_contains(state.message_types, type)) {
+		g_debug("Ignoring message '%s' of buffer %i, not subscribed", type,
+			buffer->identifier);
+		g_free(type);
+		return;
+	}
+	if (strcmp(type, "dom-ready") == 0 || strcmp(type, "scroll") == 0) {
+		message_track_scroll(buffer, value);
+	}
+	char *json = jsc_value_to_json(value, 0);
+	if (json == NULL) {
+		g_debug("Ignoring message '%s' of buffer %i, not serializable", type,
+			buffer->identifier);
+		g_free(type);
+		return;
+	}
+	message_queue(buffer->identifier, type, json);
+}
+
+// Let the user scripts in the page of BUFFER post messages.
+void message_attach(Buffer *buffer) {
+	WebKitUserContentManager *manager = webkit_web_view_get_user_content_manager(buffer->web_view);
+	webkit_user_content_manager_register_script_message_handler_in_world(manager,
+		MESSAGE_HANDLER, SCRIPT_WORLD);
+	g_signal_connect(manager, "script-message-received::" MESSAGE_HANDLER,
+		G_CALLBACK(message_received), buffer);
+}
+
+// Stop listening to the page of BUFFER, before its web view is destroyed.
+void message_detach(Buffer *buffer) {
+	WebKitUserContentManager *manager = webkit_web_view_get_user_content_manager(buffer->web_view);
+	g_signal_handlers_disconnect_by_data(manager, buffer);
+	webkit_user_content_manager_unregister_script_message_handler_in_world(manager,
+		MESSAGE_HANDLER, SCRIPT_WORLD);
+}
@@ -12,7 +12,7 @@ Use of this file is governed by the license that can be found in LICENSE.
 typedef struct {
 	WebKitWebView *web_view;
 	int callback_count;
-	char *parent_window_identifier;
+	gint parent_window_identifier;
 } Minibuffer;
 
 typedef struct {
@@ -22,7 +22,7 @@ typedef struct {
 
 gboolean minibuffer_web_view_web_process_crashed(WebKitWebView *_web_view,
 	Minibuffer *minibuffer) {
-	g_warning("Window %s minibuffer web process crashed",
+	g_warning("Window %i minibuffer web process crashed",
 		minibuffer->parent_window_identifier);
 	return FALSE;
 }
@@ -40,7 +40,6 @@ Minibuffer *minibuffer_init() {
 
 void minibuffer_delete(Minibuffer *minibuffer) {
 	gtk_widget_destroy(GTK_WIDGET(minibuffer->web_view));
-	g_free(minibuffer->parent_window_identifier);
 	g_free(minibuffer);
 }
 
@@ -11,9 +11,17 @@ int main(int argc, char *argv[]) {
 	// TODO: Use GtkApplication?
 	GError *error = NULL;
 	char *default_port = g_strdup_printf("%i", NEXT_PLATFORM_PORT);
+	char *default_view_pool_size = g_strdup_printf("%i", NEXT_VIEW_POOL_SIZE);
+	char *default_max_loads = g_strdup_printf("%i", NEXT_MAX_LOADS);
 	GOptionEntry options[] = {
 		{"port", 'p', 0, G_OPTION_ARG_INT, &state.port, "Port the XML-RPC server listens to", default_port},
 		{"core-socket", 's', 0, G_OPTION_ARG_STRING, &state.core_socket, "Socket of the Lisp core", NEXT_CORE_SOCKET},
+		{"socket-path", 0, 0, G_OPTION_ARG_FILENAME, &state.socket_path, "Unix domain socket the XML-RPC server listens to instead of the port", "PATH"},
+		{"core-socket-path", 0, 0, G_OPTION_ARG_FILENAME, &state.core_socket_path, "Unix domain socket of the Lisp core", "PATH"},
+		{"isolated-contexts", 0, 0, G_OPTION_ARG_NONE, &state.isolated_contexts, "Give each buffer its own web context instead of sharing it between buffers of the same profile", NULL},
+		{"view-pool-size", 0, 0, G_OPTION_ARG_INT, &state.view_pool_size, "Number of web views created in advance for each web context", default_view_pool_size},
+		{"max-loads", 0, 0, G_OPTION_ARG_INT, &state.max_loads, "Number of pages loading at once beyond which buffers that are not displayed wait, 0 for no limit", default_max_loads},
+		{"web-extensions-directory", 0, 0, G_OPTION_ARG_FILENAME, &state.web_extensions_directory, "Directory of the web extension of the port, which runs DOM queries natively", NEXT_WEB_EXTENSIONS_DIRECTORY},
 		{NULL}
 	};
 
@@ -22,17 +30,23 @@ int main(int argc, char *argv[]) {
 		g_error("%s", error->message);
 		g_error_free(error);
 		g_free(default_port);
+		g_free(default_view_pool_size);
+		g_free(default_max_loads);
 		return EXIT_FAILURE;
 	}
 	g_free(default_port);
+	g_free(default_view_pool_size);
+	g_free(default_max_loads);
 
 	// TODO: Start the xmlrpc server first?  If GUI is started, then we can
 	// report xmlrpc startup issue graphically.
 	start_server();
 	start_client();
+	dom_start();
 
 	gtk_main();
 
 	stop_server();
+	dom_stop();
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,132 @@
+/*
+Copyright © 2019 Atlas Engineer LLC.
+Use of this file is governed by the license that can be found in LICENSE.
+*/
+#pragma once
+
+#include <string.h>
+#include <glib.h>
+#include <libsoup/soup.h>
+
+#include "server-state.h"
+
+// The Lisp core installs rules here so that policy decisions it would answer
+// the same way every time are taken without a round trip to the core.
+//
+// A rule matches a decision by its kind ("navigation", "new-window" or
+// "response"), the scheme of the URI, a glob pattern on its host, the
+// navigation type (as in "request.resource") and whether the MIME type is
+// supported.  Empty fields match anything.  The first matching rule wins, and
+// without any, the core is asked.
+
+typedef enum {
+	POLICY_ASK,
+	POLICY_ALLOW,
+	POLICY_DENY,
+} PolicyAction;
+
+// Number of strings per rule in policy_set_rules.
+#define POLICY_RULE_FIELDS 6
+
+typedef struct {
+	char *kind;
+	char *scheme;
+	GPatternSpec *host;
+	char *navigation_type;
+	// -1 for any, otherwise a boolean.
+	int known_type;
+	PolicyAction action;
+} PolicyRule;
+
+static void policy_rule_free(gpointer data) {
+	PolicyRule *rule = data;
+	g_free(rule->kind);
+	g_free(rule->scheme);
+	if (rule->host != NULL) {
+		g_pattern_spec_free(rule->host);
+	}
+	g_free(rule->navigation_type);
+	g_free(rule);
+}
+
+static char *policy_field(const char *field) {
+	return field[0] != '\0' ? g_strdup(field) : NULL;
+}
+
+// Replace the rules.  FIELDS is a NULL-terminated array of POLICY_RULE_FIELDS
+// strings per rule: kind, scheme, host pattern, navigation type, known type
+// ("true", "false" or "") and action ("allow", "deny" or "ask").
+void policy_set_rules(char **fields) {
+	GPtrArray *rules = g_ptr_array_new_with_free_func(&policy_rule_free);
+	guint length = g_strv_length(fields);
+	if (length % POLICY_RULE_FIELDS != 0) {
+		g_warning("Malformed policy rules: %u fields", length);
+		length -= length % POLICY_RULE_FIELDS;
+	}
+	for (guint i = 0; i < length; i += POLICY_RULE_FIELDS) {
+		char **field = fields + i;
+		PolicyRule *rule = g_new0(PolicyRule, 1);
+		rule->kind = policy_field(field[0]);
+		rule->scheme = policy_field(field[1]);
+		if (field[2][0] != '\0') {
+			rule->host = g_pattern_spec_new(field[2]);
+		}
+		rule->navigation_type = policy_field(field[3]);
+		rule->known_type = field[4][0] == '\0' ? -1 : g_strcmp0(field[4], "true") == 0;
+		if (g_strcmp0(field[5], "allow") == 0) {
+			rule->action = POLICY_ALLOW;
+		} else if (g_strcmp0(field[5], "deny") == 0) {
+			rule->action = POLICY_DENY;
+		} else {
+			rule->action = POLICY_ASK;
+		}
+		g_ptr_array_add(rules, rule);
+	}
+	if (state.policy_rules != NULL) {
+		g_ptr_array_unref(state.policy_rules);
+	}
+	state.policy_rules = rules;
+	g_debug("Policy: %u rules", rules->len);
+}
+
+static gboolean policy_rule_matches(PolicyRule *rule, const char *kind, SoupURI *uri,
+	const char *navigation_type, gboolean known_type) {
+	if (rule->kind != NULL && g_strcmp0(rule->kind, kind) != 0) {
+		return FALSE;
+	}
+	if (rule->scheme != NULL
+	    && (uri == NULL || g_strcmp0(rule->scheme, soup_uri_get_scheme(uri)) != 0)) {
+		return FALSE;
+	}
+	if (rule->host != NULL
+	    && (uri == NULL || soup_uri_get_host(uri) == NULL
+	        || !g_pattern_match_string(rule->host, soup_uri_get_host(uri)))) {
+		return FALSE;
+	}
+	if (rule->navigation_type != NULL
+	    && g_strcmp0(rule->navigation_type, navigation_type) != 0) {
+		return FALSE;
+	}
+	return rule->known_type == -1 || rule->known_type == known_type;
+}
+
+// Return the action of the first rule matching the decision, or POLICY_ASK.
+PolicyAction policy_decide(const char *kind, const char *uri,
+	const char *navigation_type, gboolean known_type) {
+	if (state.policy_rules == NULL || state.policy_rules->len == 0) {
+		return POLICY_ASK;
+	}
+	SoupURI *parsed_uri = soup_uri_new(uri);
+	PolicyAction action = POLICY_ASK;
+	for (guint i = 0; i < state.policy_rules->len; i++) {
+		PolicyRule *rule = g_ptr_array_index(state.policy_rules, i);
+		if (policy_rule_matches(rule, kind, parsed_uri, navigation_type, known_type)) {
+			action = rule->action;
+			break;
+		}
+	}
+	if (parsed_uri != NULL) {
+		soup_uri_free(parsed_uri);
+	}
+	return action;
+}
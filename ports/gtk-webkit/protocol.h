@@ -0,0 +1,416 @@
+/*
+Copyright © 2019 Atlas Engineer LLC.
+Use of this file is governed by the license that can be found in LICENSE.
+*/
+#pragma once
+
+#include <string.h>
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "stats.h"
+
+// Binary alternative to XML-RPC.  It carries the same methods but saves the XML
+// parsing and encoding on both ends.
+//
+// A frame is a big-endian uint32 payload length followed by the payload.
+// The payload is a kind byte, a big-endian uint32 call identifier, then:
+// - 'c' (call): the method name as a string value, or the method identifier as
+//   an int value (see "server.method.table"), the parameters as an array value.
+// - 'r' (result): the result value.
+// - 'f' (fault): the fault code as an int value, the message as a string value.
+//
+// A value is a tag byte followed by:
+// - 'b': one byte, 0 or 1.
+// - 'i': big-endian int32.
+// - 'x': big-endian int64.
+// - 'd': big-endian IEEE 754 double.
+// - 's': big-endian uint32 byte length, then UTF-8 bytes.
+// - 'a': big-endian uint32 element count, then the element values.
+//
+// Decoded arrays are "av" variants, like XML-RPC arrays in libsoup.
+//
+// Payloads above PROTOCOL_MAX_FRAME_LENGTH bytes and arrays nested deeper than
+// PROTOCOL_MAX_DEPTH are rejected, since the peer chooses both.
+
+#ifndef PROTOCOL_MAX_FRAME_LENGTH
+#define PROTOCOL_MAX_FRAME_LENGTH (64 * 1024 * 1024)
+#endif
+
+#ifndef PROTOCOL_MAX_DEPTH
+#define PROTOCOL_MAX_DEPTH 32
+#endif
+
+#define PROTOCOL_CALL 'c'
+#define PROTOCOL_RESULT 'r'
+#define PROTOCOL_FAULT 'f'
+
+typedef struct {
+	char kind;
+	guint32 id;
+	// Calls give either the method name or its identifier, otherwise -1.
+	char *method_name;
+	gint32 method_id;
+	// Parameters tuple for calls, result for results, message string for faults.
+	GVariant *value;
+	gint32 fault_code;
+} ProtocolFrame;
+
+void protocol_write_uint32(GByteArray *buffer, guint32 value) {
+	guint32 be = GUINT32_TO_BE(value);
+	g_byte_array_append(buffer, (const guint8 *)&be, sizeof be);
+}
+
+void protocol_write_uint64(GByteArray *buffer, guint64 value) {
+	guint64 be = GUINT64_TO_BE(value);
+	g_byte_array_append(buffer, (const guint8 *)&be, sizeof be);
+}
+
+void protocol_write_tag(GByteArray *buffer, char tag) {
+	g_byte_array_append(buffer, (const guint8 *)&tag, 1);
+}
+
+void protocol_write_int(GByteArray *buffer, gint64 value) {
+	if (value >= G_MININT32 && value <= G_MAXINT32) {
+		protocol_write_tag(buffer, 'i');
+		protocol_write_uint32(buffer, (guint32)(gint32)value);
+	} else {
+		protocol_write_tag(buffer, 'x');
+		protocol_write_uint64(buffer, (guint64)value);
+	}
+}
+
+void protocol_write_string(GByteArray *buffer, const char *string) {
+	guint32 length = strlen(string);
+	protocol_write_tag(buffer, 's');
+	protocol_write_uint32(buffer, length);
+	g_byte_array_append(buffer, (const guint8 *)string, length);
+}
+
+void protocol_write_value(GByteArray *buffer, GVariant *value) {
+	switch (g_variant_classify(value)) {
+	case G_VARIANT_CLASS_BOOLEAN: {
+		guint8 b = g_variant_get_boolean(value) ? 1 : 0;
+		protocol_write_tag(buffer, 'b');
+		g_byte_array_append(buffer, &b, 1);
+		break;
+	}
+	case G_VARIANT_CLASS_BYTE:
+		protocol_write_int(buffer, g_variant_get_byte(value));
+		break;
+	case G_VARIANT_CLASS_INT16:
+		protocol_write_int(buffer, g_variant_get_int16(value));
+		break;
+	case G_VARIANT_CLASS_UINT16:
+		protocol_write_int(buffer, g_variant_get_uint16(value));
+		break;
+	case G_VARIANT_CLASS_INT32:
+		protocol_write_int(buffer, g_variant_get_int32(value));
+		break;
+	case G_VARIANT_CLASS_UINT32:
+		protocol_write_int(buffer, g_variant_get_uint32(value));
+		break;
+	case G_VARIANT_CLASS_INT64:
+		protocol_write_int(buffer, g_variant_get_int64(value));
+		break;
+	case G_VARIANT_CLASS_UINT64:
+		protocol_write_int(buffer, (gint64)g_variant_get_uint64(value));
+		break;
+	case G_VARIANT_CLASS_HANDLE:
+		protocol_write_int(buffer, g_variant_get_handle(value));
+		break;
+	case G_VARIANT_CLASS_DOUBLE: {
+		union {
+			gdouble d;
+			guint64 u;
+		} bits = {.d = g_variant_get_double(value)};
+		protocol_write_tag(buffer, 'd');
+		protocol_write_uint64(buffer, bits.u);
+		break;
+	}
+	case G_VARIANT_CLASS_STRING:
+	case G_VARIANT_CLASS_OBJECT_PATH:
+	case G_VARIANT_CLASS_SIGNATURE:
+		protocol_write_string(buffer, g_variant_get_string(value, NULL));
+		break;
+	case G_VARIANT_CLASS_VARIANT: {
+		GVariant *child = g_variant_get_variant(value);
+		protocol_write_value(buffer, child);
+		g_variant_unref(child);
+		break;
+	}
+	case G_VARIANT_CLASS_MAYBE: {
+		GVariant *child = g_variant_get_maybe(value);
+		if (child == NULL) {
+			guint8 b = 0;
+			protocol_write_tag(buffer, 'b');
+			g_byte_array_append(buffer, &b, 1);
+		} else {
+			protocol_write_value(buffer, child);
+			g_variant_unref(child);
+		}
+		break;
+	}
+	case G_VARIANT_CLASS_ARRAY:
+	case G_VARIANT_CLASS_TUPLE:
+	case G_VARIANT_CLASS_DICT_ENTRY: {
+		gsize count = g_variant_n_children(value);
+		protocol_write_tag(buffer, 'a');
+		protocol_write_uint32(buffer, count);
+		for (gsize i = 0; i < count; i++) {
+			GVariant *child = g_variant_get_child_value(value, i);
+			protocol_write_value(buffer, child);
+			g_variant_unref(child);
+		}
+		break;
+	}
+	}
+}
+
+// Return a new frame with the length prefix left to be filled by
+// protocol_frame_end.
+GByteArray *protocol_frame_begin(char kind, guint32 id) {
+	GByteArray *frame = g_byte_array_new();
+	protocol_write_uint32(frame, 0);
+	protocol_write_tag(frame, kind);
+	protocol_write_uint32(frame, id);
+	return frame;
+}
+
+GBytes *protocol_frame_end(GByteArray *frame) {
+	guint32 length = GUINT32_TO_BE(frame->len - sizeof length);
+	memcpy(frame->data, &length, sizeof length);
+	return g_byte_array_free_to_bytes(frame);
+}
+
+// 'params' may be floating, in which case it is consumed.
+GBytes *protocol_call_frame(guint32 id, const char *method_name, GVariant *params) {
+	GByteArray *frame = protocol_frame_begin(PROTOCOL_CALL, id);
+	protocol_write_string(frame, method_name);
+	g_variant_ref_sink(params);
+	protocol_write_value(frame, params);
+	g_variant_unref(params);
+	return protocol_frame_end(frame);
+}
+
+// 'result' may be floating, in which case it is consumed.
+GBytes *protocol_result_frame(guint32 id, GVariant *result) {
+	GByteArray *frame = protocol_frame_begin(PROTOCOL_RESULT, id);
+	g_variant_ref_sink(result);
+	protocol_write_value(frame, result);
+	g_variant_unref(result);
+	return protocol_frame_end(frame);
+}
+
+GBytes *protocol_fault_frame(guint32 id, gint32 code, const char *message) {
+	GByteArray *frame = protocol_frame_begin(PROTOCOL_FAULT, id);
+	protocol_write_int(frame, code);
+	protocol_write_string(frame, message);
+	return protocol_frame_end(frame);
+}
+
+gboolean protocol_read_uint32(const guint8 **data, const guint8 *end, guint32 *value) {
+	if (end - *data < (gssize)sizeof *value) {
+		return FALSE;
+	}
+	memcpy(value, *data, sizeof *value);
+	*value = GUINT32_FROM_BE(*value);
+	*data += sizeof *value;
+	return TRUE;
+}
+
+gboolean protocol_read_uint64(const guint8 **data, const guint8 *end, guint64 *value) {
+	if (end - *data < (gssize)sizeof *value) {
+		return FALSE;
+	}
+	memcpy(value, *data, sizeof *value);
+	*value = GUINT64_FROM_BE(*value);
+	*data += sizeof *value;
+	return TRUE;
+}
+
+// Return a new floating variant, or NULL if the data is malformed.  DEPTH is
+// the number of arrays that enclose the value.
+static GVariant *protocol_read_nested_value(const guint8 **data, const guint8 *end,
+	guint depth) {
+	if (*data >= end) {
+		return NULL;
+	}
+	char tag = **data;
+	(*data)++;
+	switch (tag) {
+	case 'b': {
+		if (*data >= end) {
+			return NULL;
+		}
+		gboolean b = **data != 0;
+		(*data)++;
+		return g_variant_new_boolean(b);
+	}
+	case 'i': {
+		guint32 value;
+		if (!protocol_read_uint32(data, end, &value)) {
+			return NULL;
+		}
+		return g_variant_new_int32((gint32)value);
+	}
+	case 'x': {
+		guint64 value;
+		if (!protocol_read_uint64(data, end, &value)) {
+			return NULL;
+		}
+		return g_variant_new_int64((gint64)value);
+	}
+	case 'd': {
+		union {
+			gdouble d;
+			guint64 u;
+		} bits;
+		if (!protocol_read_uint64(data, end, &bits.u)) {
+			return NULL;
+		}
+		return g_variant_new_double(bits.d);
+	}
+	case 's': {
+		guint32 length;
+		if (!protocol_read_uint32(data, end, &length) || (gsize)(end - *data) < length) {
+			return NULL;
+		}
+		if (!g_utf8_validate((const char *)*data, length, NULL)) {
+			return NULL;
+		}
+		char *string = g_strndup((const char *)*data, length);
+		*data += length;
+		return g_variant_new_take_string(string);
+	}
+	case 'a': {
+		guint32 count;
+		if (depth >= PROTOCOL_MAX_DEPTH || !protocol_read_uint32(data, end, &count)) {
+			return NULL;
+		}
+		GVariantBuilder builder;
+		g_variant_builder_init(&builder, G_VARIANT_TYPE("av"));
+		for (guint32 i = 0; i < count; i++) {
+			GVariant *child = protocol_read_nested_value(data, end, depth + 1);
+			if (child == NULL) {
+				g_variant_builder_clear(&builder);
+				return NULL;
+			}
+			g_variant_builder_add(&builder, "v", child);
+		}
+		return g_variant_builder_end(&builder);
+	}
+	}
+	return NULL;
+}
+
+// Return a new floating variant, or NULL if the data is malformed.
+GVariant *protocol_read_value(const guint8 **data, const guint8 *end) {
+	return protocol_read_nested_value(data, end, 0);
+}
+
+// The "av" parameter array is turned into a tuple, like server_unwrap_params
+// does for XML-RPC.
+GVariant *protocol_array_to_tuple(GVariant *array) {
+	GVariantBuilder builder;
+	g_variant_builder_init(&builder, G_VARIANT_TYPE_TUPLE);
+	GVariantIter iter;
+	g_variant_iter_init(&iter, array);
+	GVariant *child;
+	while (g_variant_iter_loop(&iter, "v", &child)) {
+		g_variant_builder_add_value(&builder, child);
+	}
+	return g_variant_builder_end(&builder);
+}
+
+void protocol_frame_clear(ProtocolFrame *frame) {
+	g_free(frame->method_name);
+	if (frame->value != NULL) {
+		g_variant_unref(frame->value);
+	}
+}
+
+// Parse the PAYLOAD of a frame, i.e. without the length prefix.
+// On success, FRAME must be cleared with protocol_frame_clear.
+gboolean protocol_parse_frame(const guint8 *payload, gsize length, ProtocolFrame *frame) {
+	const guint8 *data = payload;
+	const guint8 *end = payload + length;
+	memset(frame, 0, sizeof *frame);
+	frame->method_id = -1;
+	if (length < 1) {
+		return FALSE;
+	}
+	frame->kind = *data;
+	data++;
+	if (!protocol_read_uint32(&data, end, &frame->id)) {
+		return FALSE;
+	}
+
+	switch (frame->kind) {
+	case PROTOCOL_CALL: {
+		GVariant *method_name = protocol_read_value(&data, end);
+		GVariant *params = protocol_read_value(&data, end);
+		if (method_name == NULL || params == NULL
+			|| !(g_variant_is_of_type(method_name, G_VARIANT_TYPE_STRING)
+			     || g_variant_is_of_type(method_name, G_VARIANT_TYPE_INT32))
+			|| !g_variant_is_of_type(params, G_VARIANT_TYPE("av"))) {
+			g_clear_pointer(&method_name, g_variant_unref);
+			g_clear_pointer(&params, g_variant_unref);
+			return FALSE;
+		}
+		g_variant_ref_sink(method_name);
+		g_variant_ref_sink(params);
+		if (g_variant_is_of_type(method_name, G_VARIANT_TYPE_INT32)) {
+			frame->method_id = g_variant_get_int32(method_name);
+		} else {
+			frame->method_name = g_variant_dup_string(method_name, NULL);
+		}
+		frame->value = g_variant_ref_sink(protocol_array_to_tuple(params));
+		g_variant_unref(method_name);
+		g_variant_unref(params);
+		return TRUE;
+	}
+	case PROTOCOL_RESULT: {
+		frame->value = protocol_read_value(&data, end);
+		if (frame->value == NULL) {
+			return FALSE;
+		}
+		g_variant_ref_sink(frame->value);
+		return TRUE;
+	}
+	case PROTOCOL_FAULT: {
+		GVariant *code = protocol_read_value(&data, end);
+		frame->value = protocol_read_value(&data, end);
+		if (code == NULL || frame->value == NULL
+			|| !g_variant_is_of_type(code, G_VARIANT_TYPE_INT32)) {
+			g_clear_pointer(&code, g_variant_unref);
+			g_clear_pointer(&frame->value, g_variant_unref);
+			return FALSE;
+		}
+		g_variant_ref_sink(code);
+		g_variant_ref_sink(frame->value);
+		frame->fault_code = g_variant_get_int32(code);
+		g_variant_unref(code);
+		return TRUE;
+	}
+	}
+	return FALSE;
+}
+
+// Frames are small and the peer always reads, so we write synchronously.  This
+// also keeps frames from interleaving.
+gboolean protocol_write_frame(GSocketConnection *connection, GBytes *frame) {
+	GError *error = NULL;
+	gsize length = 0;
+	gconstpointer data = g_bytes_get_data(frame, &length);
+	g_output_stream_write_all(g_io_stream_get_output_stream(G_IO_STREAM(connection)),
+		data, length, NULL, NULL, &error);
+	g_bytes_unref(frame);
+	if (error) {
+		g_warning("Failed to write binary frame: %s", error->message);
+		g_error_free(error);
+		return FALSE;
+	}
+	stats_bytes_out(length);
+	return TRUE;
+}
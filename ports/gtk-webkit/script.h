@@ -0,0 +1,198 @@
+/*
+Copyright © 2019 Atlas Engineer LLC.
+Use of this file is governed by the license that can be found in LICENSE.
+*/
+#pragma once
+
+#include <string.h>
+#include <glib.h>
+#include <webkit2/webkit2.h>
+
+#include "buffer.h"
+#include "javascript.h"
+#include "server-state.h"
+
+// Scripts that the Lisp core runs often are registered once with their name
+// and the source of a JavaScript function.  The port installs them as user
+// scripts in every page, so that running one only takes its name and arguments
+// instead of the whole source, which WebKit would parse every time.
+//
+// The scripts and their results live in a script world of their own, which
+// shares the DOM with the page but not its JavaScript globals: the page cannot
+// replace them or forge their results.
+#define SCRIPT_WORLD "next"
+
+// Result of an invocation in a page that lacks the script, e.g. a page loaded
+// before the script was registered.
+#define SCRIPT_MISSING "next:script-missing"
+
+typedef struct {
+	// JavaScript statement that defines the function.
+	char *definition;
+	WebKitUserScript *user_script;
+} Script;
+
+static void script_free(Script *script) {
+	g_free(script->definition);
+	webkit_user_script_unref(script->user_script);
+	g_free(script);
+}
+
+// Add the page event script and the registered scripts to the user content
+// manager of WEB_VIEW.
+void script_attach(WebKitWebView *web_view) {
+	WebKitUserContentManager *manager = webkit_web_view_get_user_content_manager(web_view);
+	message_add_script(manager);
+	if (state.scripts == NULL) {
+		return;
+	}
+	GHashTableIter iter;
+	gpointer script;
+	g_hash_table_iter_init(&iter, state.scripts);
+	while (g_hash_table_iter_next(&iter, NULL, &script)) {
+		webkit_user_content_manager_add_script(manager, ((Script *)script)->user_script);
+	}
+}
+
+// Install the user scripts of every buffer again.  Scripts cannot be removed
+// one by one before WebKitGTK 2.32.
+void script_reattach_all() {
+	for (guint i = 1; i < state.buffers->len; i++) {
+		Buffer *buffer = g_ptr_array_index(state.buffers, i);
+		if (buffer == NULL || buffer->web_view == NULL) {
+			continue;
+		}
+		webkit_user_content_manager_remove_all_scripts(
+			webkit_web_view_get_user_content_manager(buffer->web_view));
+		script_attach(buffer->web_view);
+	}
+}
+
+// Register the function of JavaScript source SOURCE as NAME, in place of the
+// previous script of that name if any.
+void script_register(const char *name, const char *source) {
+	if (state.scripts == NULL) {
+		state.scripts = g_hash_table_new_full(g_str_hash, g_str_equal, &g_free,
+				(GDestroyNotify)&script_free);
+	}
+	char *name_literal = javascript_string_literal(name);
+	Script *script = g_new0(Script, 1);
+	script->definition = g_strdup_printf(
+		"(window.nextScripts = window.nextScripts || {})[%s] = %s;",
+		name_literal, source);
+	script->user_script = webkit_user_script_new_for_world(script->definition,
+			WEBKIT_USER_CONTENT_INJECT_TOP_FRAME,
+			WEBKIT_USER_SCRIPT_INJECT_AT_DOCUMENT_START,
+			SCRIPT_WORLD, NULL, NULL);
+	g_free(name_literal);
+	g_hash_table_replace(state.scripts, g_strdup(name), script);
+
+	script_reattach_all();
+	// Pages already loaded get the new script right away.
+	for (guint i = 1; i < state.buffers->len; i++) {
+		Buffer *buffer = g_ptr_array_index(state.buffers, i);
+		if (buffer == NULL || buffer->web_view == NULL) {
+			continue;
+		}
+		webkit_web_view_run_javascript_in_world(buffer->web_view, script->definition,
+			SCRIPT_WORLD, NULL, NULL, NULL);
+	}
+	g_debug("Script '%s' registered", name);
+}
+
+typedef struct {
+	Buffer *buffer;
+	int callback_id;
+	// Definition and invocation, in case the page lacks the script.
+	char *fallback;
+} ScriptInvocation;
+
+static void script_fallback_callback(GObject *object, GAsyncResult *result,
+	gpointer data) {
+	BufferInfo *buffer_info = data;
+	gchar *transformed_result = javascript_world_result(object, result, NULL);
+	if (transformed_result != NULL) {
+		javascript_send_result(transformed_result, buffer_info->buffer->identifier,
+			buffer_info->callback_id);
+	}
+	g_free(buffer_info);
+}
+
+static void script_invocation_callback(GObject *object, GAsyncResult *result,
+	gpointer data) {
+	ScriptInvocation *invocation = data;
+	gchar *transformed_result = javascript_world_result(object, result, NULL);
+	if (g_strcmp0(transformed_result, SCRIPT_MISSING) == 0) {
+		g_debug("Script missing in buffer %i, sending it", invocation->buffer->identifier);
+		g_free(transformed_result);
+		BufferInfo *buffer_info = g_new(BufferInfo, 1);
+		buffer_info->buffer = invocation->buffer;
+		buffer_info->callback_id = invocation->callback_id;
+		webkit_web_view_run_javascript_in_world(WEBKIT_WEB_VIEW(object),
+			invocation->fallback, SCRIPT_WORLD, NULL, script_fallback_callback, buffer_info);
+	} else if (transformed_result != NULL) {
+		javascript_send_result(transformed_result, invocation->buffer->identifier,
+			invocation->callback_id);
+	}
+	g_free(invocation->fallback);
+	g_free(invocation);
+}
+
+typedef struct {
+	char *source;
+	ScriptInvocation *invocation;
+} ScriptRun;
+
+static void script_run(Buffer *buffer, gpointer data) {
+	ScriptRun *run = data;
+	webkit_web_view_run_javascript_in_world(buffer->web_view, run->source,
+		SCRIPT_WORLD, NULL, script_invocation_callback, run->invocation);
+	// Now owned by the callback.
+	run->invocation = NULL;
+}
+
+static void script_run_free(gpointer data) {
+	ScriptRun *run = data;
+	if (run->invocation != NULL) {
+		g_free(run->invocation->fallback);
+		g_free(run->invocation);
+	}
+	g_free(run->source);
+	g_free(run);
+}
+
+// Run the script NAME in BUFFER with the string arguments ARGS, and return the
+// callback identifier of the result like buffer_evaluate, or NULL if there is
+// no such script.  Caller must free the result.
+char *script_invoke(Buffer *buffer, const char *name, char **args) {
+	Script *script = state.scripts != NULL ? g_hash_table_lookup(state.scripts, name) : NULL;
+	if (script == NULL) {
+		return NULL;
+	}
+	GString *call = g_string_new(NULL);
+	char *name_literal = javascript_string_literal(name);
+	g_string_append_printf(call, "window.nextScripts[%s](", name_literal);
+	for (char **arg = args; *arg != NULL; arg++) {
+		char *literal = javascript_string_literal(*arg);
+		g_string_append_printf(call, "%s%s", arg == args ? "" : ", ", literal);
+		g_free(literal);
+	}
+	g_string_append(call, ")");
+	ScriptRun *run = g_new(ScriptRun, 1);
+	run->source = g_strdup_printf(
+		"(window.nextScripts && window.nextScripts[%s]) ? %s : \"" SCRIPT_MISSING "\"",
+		name_literal, call->str);
+
+	ScriptInvocation *invocation = g_new(ScriptInvocation, 1);
+	invocation->buffer = buffer;
+	invocation->callback_id = buffer->callback_count;
+	int callback_id = invocation->callback_id;
+	invocation->fallback = g_strdup_printf("%s %s", script->definition, call->str);
+	buffer->callback_count++;
+	run->invocation = invocation;
+
+	buffer_when_loaded(buffer, script_run, run, script_run_free);
+	g_free(name_literal);
+	g_string_free(call, TRUE);
+	return g_strdup_printf("%i", callback_id);
+}
@@ -16,12 +16,136 @@ Use of this file is governed by the license that can be found in LICENSE.
 typedef struct {
 	gint port;
 	gchar *core_socket;
-	GHashTable *windows;
-	GHashTable *buffers;
-	GHashTable *server_callbacks;
+	// When set, the Unix domain sockets are used instead of the TCP port and
+	// the host of core_socket.
+	gchar *socket_path;
+	gchar *core_socket_path;
+	// Set once the Lisp core has connected with the binary protocol.
+	GSocketConnection *binary_connection;
+	// Handle tables, see handle_table_lookup.
+	GPtrArray *windows;
+	GPtrArray *buffers;
+	// Method identifiers indexed by method name, see server_methods.
+	GHashTable *server_method_ids;
+	// Keymaps pushed by the Lisp core, see keymap.h.
+	GHashTable *keymaps;
+	// Web context profiles indexed by key, see context.h.
+	GHashTable *contexts;
+	// When set, each buffer gets its own web context, as before contexts were
+	// shared.  Useful to compare memory usage.
+	gboolean isolated_contexts;
+	// Number of spare web views kept per web context, see
+	// context_profile_take_view.
+	gint view_pool_size;
+	// Buffers waiting to load and number of navigations in progress, see
+	// buffer_schedule_load.
+	GQueue load_queue;
+	guint active_loads;
+	// At most that many navigations at once, unlimited if 0.
+	gint max_loads;
+	// Policy rules installed by the Lisp core, see policy.h.
+	GPtrArray *policy_rules;
+	// Content filters by identifier, see filter.h.
+	WebKitUserContentFilterStore *filter_store;
+	GHashTable *filters;
+	// Downloads by identifier, see download.h.
+	GHashTable *downloads;
+	gint download_count;
+	guint download_progress_source;
+	// NULL for the XDG download directory.
+	char *download_directory;
+	// Scripts registered by the Lisp core by name, see script.h.
+	GHashTable *scripts;
+	// User script and types of the page events the Lisp core subscribed to, and
+	// messages of the pages waiting to be sent, see message.h.
+	WebKitUserScript *message_script;
+	GHashTable *message_types;
+	GPtrArray *messages;
+	guint message_flush_source;
+	// Server of the web extensions and their connections by page identifier,
+	// see dom.h.
+	GDBusServer *dom_server;
+	GHashTable *dom_pages;
+	char *web_extensions_directory;
+	// Buffers of the loaded session waiting to be created, see session.h.
+	GHashTable *session_entries;
 } ServerState;
 
+#ifndef NEXT_VIEW_POOL_SIZE
+#define NEXT_VIEW_POOL_SIZE 2
+#endif
+#ifndef NEXT_MAX_LOADS
+#define NEXT_MAX_LOADS 4
+#endif
+#ifndef NEXT_WEB_EXTENSIONS_DIRECTORY
+#define NEXT_WEB_EXTENSIONS_DIRECTORY "/usr/local/lib/next/web-extensions"
+#endif
+
 static ServerState state = {
 	.port = NEXT_PLATFORM_PORT,
 	.core_socket = NEXT_CORE_SOCKET,
+	.view_pool_size = NEXT_VIEW_POOL_SIZE,
+	.load_queue = G_QUEUE_INIT,
+	.max_loads = NEXT_MAX_LOADS,
+	.web_extensions_directory = NEXT_WEB_EXTENSIONS_DIRECTORY,
 };
+
+// Windows and buffers are identified by handles, small positive integers
+// allocated by the Lisp core, and stored in dense tables indexed by handle.
+// Free slots are NULL.  Handle 0 is never allocated and stands for none.
+// Handles above HANDLE_MAX are rejected, so that a peer cannot make a table
+// grow to any size.
+
+#define HANDLE_MAX (1 << 20)
+
+gpointer handle_table_lookup(GPtrArray *table, gint handle) {
+	if (handle <= 0 || (guint)handle >= table->len) {
+		return NULL;
+	}
+	return g_ptr_array_index(table, handle);
+}
+
+// Return whether HANDLE is valid and free in TABLE.
+gboolean handle_table_available(GPtrArray *table, gint handle) {
+	if (handle <= 0 || handle > HANDLE_MAX) {
+		g_warning("Invalid handle %i", handle);
+		return FALSE;
+	}
+	if (handle_table_lookup(table, handle) != NULL) {
+		g_warning("Handle %i is already in use", handle);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// Store OBJECT under HANDLE in TABLE.  Return FALSE, and leave TABLE unchanged,
+// if HANDLE is invalid or already in use.
+gboolean handle_table_insert(GPtrArray *table, gint handle, gpointer object) {
+	if (!handle_table_available(table, handle)) {
+		return FALSE;
+	}
+	if ((guint)handle >= table->len) {
+		g_ptr_array_set_size(table, handle + 1);
+	}
+	table->pdata[handle] = object;
+	return TRUE;
+}
+
+// Remove the object of HANDLE from TABLE and return it, or NULL if there is none.
+gpointer handle_table_steal(GPtrArray *table, gint handle) {
+	gpointer object = handle_table_lookup(table, handle);
+	if (object != NULL) {
+		table->pdata[handle] = NULL;
+	}
+	return object;
+}
+
+guint handle_table_count(GPtrArray *table) {
+	guint count = 0;
+	for (guint i = 1; i < table->len; i++) {
+		if (table->pdata[i] != NULL) {
+			count++;
+		}
+	}
+	return count;
+}
@@ -6,11 +6,83 @@ Use of this file is governed by the license that can be found in LICENSE.
 
 #include <stdarg.h>
 #include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gunixsocketaddress.h>
 #include <libsoup/soup.h>
 
+#include "stats.h"
 #include "window.h"
-
-typedef GVariant * (*ServerCallback) (SoupXMLRPCParams *);
+#include "filter.h"
+#include "script.h"
+#include "message.h"
+#include "find.h"
+#include "session.h"
+
+// Callbacks are given the unwrapped parameters, see server_unwrap_params.  The
+// result may be floating.
+typedef GVariant * (*ServerCallback) (GVariant *);
+
+// Identifiers of the methods served to the Lisp core, i.e. indices in
+// server_methods.  Over the binary protocol, the core may call a method by its
+// identifier instead of its name, see "server.method.table".
+typedef enum {
+	SERVER_LIST_METHODS,
+	SERVER_METHOD_TABLE,
+	SERVER_BINARY_LISTEN,
+	SERVER_MULTICALL,
+	SERVER_STATS,
+	SERVER_MEMORY,
+	SERVER_WINDOW_MAKE,
+	SERVER_WINDOW_SET_TITLE,
+	SERVER_WINDOW_DELETE,
+	SERVER_WINDOW_ACTIVE,
+	SERVER_WINDOW_EXISTS,
+	SERVER_WINDOW_SET_ACTIVE_BUFFER,
+	SERVER_WINDOW_SET_MINIBUFFER_HEIGHT,
+	SERVER_BUFFER_MAKE,
+	SERVER_BUFFER_DELETE,
+	SERVER_BUFFER_LOAD,
+	SERVER_BUFFER_EVALUATE_JAVASCRIPT,
+	SERVER_MINIBUFFER_EVALUATE_JAVASCRIPT,
+	SERVER_GENERATE_INPUT_EVENT,
+	SERVER_SET_PROXY,
+	SERVER_GET_PROXY,
+	SERVER_KEYMAP_SET,
+	SERVER_BUFFER_SET_KEYMAP,
+	SERVER_WINDOW_SET_MINIBUFFER_ACTIVE,
+	SERVER_BUFFER_HIBERNATE,
+	SERVER_BUFFER_WAKE,
+	SERVER_BUFFER_LOAD_QUEUE_POSITION,
+	SERVER_POLICY_SET_RULES,
+	SERVER_FILTER_LOAD,
+	SERVER_FILTER_REFRESH,
+	SERVER_FILTER_LIST,
+	SERVER_BUFFER_PREFETCH,
+	SERVER_DOWNLOAD_START,
+	SERVER_DOWNLOAD_CANCEL,
+	SERVER_DOWNLOAD_SET_DIRECTORY,
+	SERVER_SCRIPT_REGISTER,
+	SERVER_BUFFER_INVOKE_SCRIPT,
+	SERVER_MESSAGE_SUBSCRIBE,
+	SERVER_BUFFER_LINK_HINTS,
+	SERVER_BUFFER_HEADINGS,
+	SERVER_BUFFER_SCROLL_TO_HEADING,
+	SERVER_BUFFER_FIND_SEARCH,
+	SERVER_BUFFER_FIND_NEXT,
+	SERVER_BUFFER_FIND_PREVIOUS,
+	SERVER_BUFFER_FIND_FINISH,
+	SERVER_SESSION_SAVE,
+	SERVER_SESSION_LOAD,
+	SERVER_METHOD_COUNT,
+} ServerMethodId;
+
+typedef struct {
+	const char *name;
+	ServerCallback callback;
+} ServerMethod;
+
+// Defined after the callbacks.
+static const ServerMethod server_methods[SERVER_METHOD_COUNT];
 
 // The params variant type string is "av", and the embedded "v"'s type string
 // can be anything.
@@ -26,6 +98,7 @@ GVariant *server_unwrap_params(SoupXMLRPCParams *params) {
 	}
 	if (!g_variant_check_format_string(variant, "av", FALSE)) {
 		g_warning("Malformed parameter value: %s", g_variant_get_type_string(variant));
+		g_variant_unref(variant);
 		return NULL;
 	}
 
@@ -37,38 +110,36 @@ GVariant *server_unwrap_params(SoupXMLRPCParams *params) {
 	while (g_variant_iter_loop(&iter, "v", &child)) {
 		g_variant_builder_add_value(&builder, child);
 	}
+	g_variant_unref(variant);
 
 	return g_variant_builder_end(&builder);
 }
 
-static GVariant *server_window_make(SoupXMLRPCParams *params) {
-	GVariant *unwrapped_params = server_unwrap_params(params);
-	if (!unwrapped_params) {
-		return g_variant_new_boolean(FALSE);
-	}
-	const char *a_key = NULL;
-	g_variant_get(unwrapped_params, "(&s)", &a_key);
-	g_message("Method parameter(s): %s", a_key);
+static GVariant *server_window_make(GVariant *unwrapped_params) {
+	gint a_key = 0;
+	g_variant_get(unwrapped_params, "(i)", &a_key);
+	g_message("Method parameter(s): %i", a_key);
 
+	// Checked first: a window cannot be taken down without notifying the Lisp
+	// core.
+	if (!handle_table_available(state.windows, a_key)) {
+		return NULL;
+	}
 	Window *window = window_init();
-	g_hash_table_insert(state.windows, strdup(a_key), window);
-	window->identifier = strdup(a_key);
-	window->minibuffer->parent_window_identifier = strdup(window->identifier);
-	g_message("Method result(s): window id %s", window->identifier);
-	return g_variant_new_string(window->identifier);
+	handle_table_insert(state.windows, a_key, window);
+	window->identifier = a_key;
+	window->minibuffer->parent_window_identifier = window->identifier;
+	g_message("Method result(s): window id %i", window->identifier);
+	return g_variant_new_int32(window->identifier);
 }
 
-static GVariant *server_window_set_title(SoupXMLRPCParams *params) {
-	GVariant *unwrapped_params = server_unwrap_params(params);
-	if (!unwrapped_params) {
-		return g_variant_new_boolean(FALSE);
-	}
-	const char *a_key = NULL;
+static GVariant *server_window_set_title(GVariant *unwrapped_params) {
+	gint a_key = 0;
 	const char *title = NULL;
-	g_variant_get(unwrapped_params, "(&s&s)", &a_key, &title);
-	g_message("Method parameter(s): %s, %s", a_key, title);
+	g_variant_get(unwrapped_params, "(i&s)", &a_key, &title);
+	g_message("Method parameter(s): %i, %s", a_key, title);
 
-	Window *window = g_hash_table_lookup(state.windows, a_key);
+	Window *window = handle_table_lookup(state.windows, a_key);
 	if (!window) {
 		return g_variant_new_boolean(FALSE);
 	}
@@ -76,92 +147,90 @@ static GVariant *server_window_set_title(SoupXMLRPCParams *params) {
 	return g_variant_new_boolean(TRUE);
 }
 
-static GVariant *server_window_delete(SoupXMLRPCParams *params) {
-	GVariant *unwrapped_params = server_unwrap_params(params);
-	if (!unwrapped_params) {
-		return g_variant_new_boolean(FALSE);
-	}
-	const char *a_key = NULL;
-	g_variant_get(unwrapped_params, "(&s)", &a_key);
-	g_message("Method parameter(s): %s", a_key);
+static GVariant *server_window_delete(GVariant *unwrapped_params) {
+	gint a_key = 0;
+	g_variant_get(unwrapped_params, "(i)", &a_key);
+	g_message("Method parameter(s): %i", a_key);
 
-	g_hash_table_remove(state.windows, a_key);
+	Window *window = handle_table_steal(state.windows, a_key);
+	if (window != NULL) {
+		window_delete(window);
+	}
 	return g_variant_new_boolean(TRUE);
 }
 
-static GVariant *server_window_active(SoupXMLRPCParams *_params) {
+static GVariant *server_window_active(GVariant *_unwrapped_params) {
 	// TODO: If we run a GTK application, then we could call
 	// gtk_application_get_active_window() and get the identifier from there.
 	// We could also lookup the active window in gtk_window_list_toplevels().
-	GHashTableIter iter;
-	gpointer key, value;
-
-	char *id = "<no active window>";
-	g_hash_table_iter_init(&iter, state.windows);
-	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		Window *window = (Window *)value;
-		if (gtk_window_is_active(GTK_WINDOW(window->base))) {
+	// 0 when no window is active.
+	gint id = 0;
+	for (guint i = 1; i < state.windows->len; i++) {
+		Window *window = g_ptr_array_index(state.windows, i);
+		if (window != NULL && gtk_window_is_active(GTK_WINDOW(window->base))) {
 			id = window->identifier;
 			break;
 		}
 	}
 
-	g_message("Method parameter(s): %s", id);
-	return g_variant_new_string(id);
+	g_message("Method parameter(s): %i", id);
+	return g_variant_new_int32(id);
 }
 
-static GVariant *server_window_exists(SoupXMLRPCParams *params) {
-	GVariant *unwrapped_params = server_unwrap_params(params);
-	if (!unwrapped_params) {
-		return g_variant_new_boolean(FALSE);
-	}
-	const char *a_key = NULL;
-	g_variant_get(unwrapped_params, "(&s)", &a_key);
-	g_message("Method parameter(s): %s", a_key);
+static GVariant *server_window_exists(GVariant *unwrapped_params) {
+	gint a_key = 0;
+	g_variant_get(unwrapped_params, "(i)", &a_key);
+	g_message("Method parameter(s): %i", a_key);
 
-	Window *window = g_hash_table_lookup(state.windows, a_key);
+	Window *window = handle_table_lookup(state.windows, a_key);
 	if (!window) {
 		return g_variant_new_boolean(FALSE);
 	}
 	return g_variant_new_boolean(TRUE);
 }
 
-static GVariant *server_window_set_active_buffer(SoupXMLRPCParams *params) {
-	GVariant *unwrapped_params = server_unwrap_params(params);
-	if (!unwrapped_params) {
-		return g_variant_new_boolean(FALSE);
-	}
-	const char *window_id = NULL;
-	const char *buffer_id = NULL;
-	g_variant_get(unwrapped_params, "(&s&s)", &window_id, &buffer_id);
-	g_message("Method parameter(s): window id %s, buffer id %s", window_id, buffer_id);
+static GVariant *server_window_set_active_buffer(GVariant *unwrapped_params) {
+	gint window_id = 0;
+	gint buffer_id = 0;
+	g_variant_get(unwrapped_params, "(ii)", &window_id, &buffer_id);
+	g_message("Method parameter(s): window id %i, buffer id %i", window_id, buffer_id);
 
-	Window *window = g_hash_table_lookup(state.windows, window_id);
-	Buffer *buffer = g_hash_table_lookup(state.buffers, buffer_id);
+	Window *window = handle_table_lookup(state.windows, window_id);
+	Buffer *buffer = handle_table_lookup(state.buffers, buffer_id);
 	if (window == NULL) {
-		g_warning("Non-existent window %s", window_id);
+		g_warning("Non-existent window %i", window_id);
 		return g_variant_new_boolean(FALSE);
 	}
 	if (buffer == NULL) {
-		g_warning("Non-existent buffer %s", buffer_id);
+		g_warning("Non-existent buffer %i", buffer_id);
 		return g_variant_new_boolean(FALSE);
 	}
 	window_set_active_buffer(window, buffer);
 	return g_variant_new_boolean(TRUE);
 }
 
-static GVariant *server_buffer_make(SoupXMLRPCParams *params) {
-	GVariant *unwrapped_params = server_unwrap_params(params);
-	if (!unwrapped_params) {
-		return g_variant_new_string("");
+// Return the cache model named NAME, by default the one for web browsers.
+static WebKitCacheModel server_cache_model(const char *name) {
+	if (g_strcmp0(name, "document-viewer") == 0) {
+		return WEBKIT_CACHE_MODEL_DOCUMENT_VIEWER;
+	}
+	if (g_strcmp0(name, "document-browser") == 0) {
+		return WEBKIT_CACHE_MODEL_DOCUMENT_BROWSER;
 	}
-	const char *a_key = NULL;
+	if (name != NULL && g_strcmp0(name, "web-browser") != 0) {
+		g_warning("Unknown cache model '%s'", name);
+	}
+	return WEBKIT_CACHE_MODEL_WEB_BROWSER;
+}
+
+static GVariant *server_buffer_make(GVariant *unwrapped_params) {
+	gint a_key = 0;
 	GHashTable *options = g_hash_table_new(g_str_hash, g_str_equal);
 	// Options are passed as a list of string.  We could have used a dictionary,
 	// but the Cocoa XML-RPC library does not support it.
 	{
 		GVariantIter *iter;
-		g_variant_get(unwrapped_params, "(&sav)", &a_key, &iter);
+		g_variant_get(unwrapped_params, "(iav)", &a_key, &iter);
 
 		GVariant *str_variant;
 		gchar *key = NULL;
@@ -176,41 +245,75 @@ static GVariant *server_buffer_make(SoupXMLRPCParams *params) {
 		}
 		g_variant_iter_free(iter);
 	}
-	g_message("Method parameter(s): buffer ID %s, cookie file %s", a_key,
-		g_hash_table_lookup(options, "COOKIES-PATH"));
-	Buffer *buffer = buffer_init(g_hash_table_lookup(options, "COOKIES-PATH"));
-	g_hash_table_insert(state.buffers, strdup(a_key), buffer);
-	buffer->identifier = strdup(a_key);
-	g_message("Method result(s): buffer id %s", buffer->identifier);
-	return g_variant_new_string(buffer->identifier);
+	// Buffers with the same cookie file, proxy, ephemeral flag and storage
+	// settings share their web context, see context.h.
+	ContextProfile settings = {
+		.cookie_path = g_hash_table_lookup(options, "COOKIES-PATH"),
+		.ephemeral = g_strcmp0(g_hash_table_lookup(options, "EPHEMERAL"), "true") == 0,
+		.proxy_mode = WEBKIT_NETWORK_PROXY_MODE_DEFAULT,
+		.proxy_uri = g_hash_table_lookup(options, "PROXY-URI"),
+		.cache_model = server_cache_model(g_hash_table_lookup(options, "CACHE-MODEL")),
+		.data_directory = g_hash_table_lookup(options, "DATA-DIRECTORY"),
+		.cache_directory = g_hash_table_lookup(options, "CACHE-DIRECTORY"),
+	};
+	if (settings.proxy_uri != NULL && settings.proxy_uri[0] != '\0') {
+		settings.proxy_mode = WEBKIT_NETWORK_PROXY_MODE_CUSTOM;
+		const char *hosts = g_hash_table_lookup(options, "PROXY-IGNORE-HOSTS");
+		if (hosts != NULL && hosts[0] != '\0') {
+			settings.ignore_hosts = g_strsplit(hosts, ",", -1);
+		}
+	}
+	// Buffers opened in the background need no web view until they are
+	// displayed.
+	const char *deferred_uri = g_hash_table_lookup(options, "DEFERRED-URI");
+	// Buffers of a restored session, see session.h, are deferred as well.
+	const char *session_id = g_hash_table_lookup(options, "SESSION-ID");
+	g_message("Method parameter(s): buffer ID %i, cookie file %s, ephemeral %i, proxy %s, "
+		"cache model %i, data directory %s, cache directory %s, deferred URI %s, "
+		"session ID %s",
+		a_key, settings.cookie_path, settings.ephemeral, settings.proxy_uri,
+		settings.cache_model, settings.data_directory, settings.cache_directory,
+		deferred_uri, session_id);
+	ContextProfile *profile = context_profile_acquire(&settings);
+	Buffer *buffer = session_id != NULL
+		? session_take(profile, (gint)g_ascii_strtoll(session_id, NULL, 10))
+		: NULL;
+	if (buffer == NULL) {
+		buffer = deferred_uri != NULL
+			? buffer_init_deferred(profile, deferred_uri)
+			: buffer_init(profile);
+	}
+	g_strfreev(settings.ignore_hosts);
+	if (!handle_table_insert(state.buffers, a_key, buffer)) {
+		buffer_delete(buffer);
+		return NULL;
+	}
+	buffer->identifier = a_key;
+	g_message("Method result(s): buffer id %i", buffer->identifier);
+	return g_variant_new_int32(buffer->identifier);
 }
 
-static GVariant *server_buffer_delete(SoupXMLRPCParams *params) {
-	GVariant *unwrapped_params = server_unwrap_params(params);
-	if (!unwrapped_params) {
-		return g_variant_new_boolean(FALSE);
-	}
-	const char *a_key = NULL;
-	g_variant_get(unwrapped_params, "(&s)", &a_key);
-	g_message("Method parameter(s): %s", a_key);
+static GVariant *server_buffer_delete(GVariant *unwrapped_params) {
+	gint a_key = 0;
+	g_variant_get(unwrapped_params, "(i)", &a_key);
+	g_message("Method parameter(s): %i", a_key);
 
-	g_hash_table_remove(state.buffers, a_key);
+	Buffer *buffer = handle_table_steal(state.buffers, a_key);
+	if (buffer != NULL) {
+		buffer_delete(buffer);
+	}
 	return g_variant_new_boolean(TRUE);
 }
 
-static GVariant *server_buffer_load(SoupXMLRPCParams *params) {
-	GVariant *unwrapped_params = server_unwrap_params(params);
-	if (!unwrapped_params) {
-		return g_variant_new_boolean(FALSE);
-	}
-	const char *buffer_id = NULL;
+static GVariant *server_buffer_load(GVariant *unwrapped_params) {
+	gint buffer_id = 0;
 	const char *uri = NULL;
-	g_variant_get(unwrapped_params, "(&s&s)", &buffer_id, &uri);
-	g_message("Method parameter(s): buffer id %s, URI %s", buffer_id, uri);
+	g_variant_get(unwrapped_params, "(i&s)", &buffer_id, &uri);
+	g_message("Method parameter(s): buffer id %i, URI %s", buffer_id, uri);
 
-	Buffer *buffer = g_hash_table_lookup(state.buffers, buffer_id);
+	Buffer *buffer = handle_table_lookup(state.buffers, buffer_id);
 	if (!buffer) {
-		g_warning("Non-existent buffer %s", buffer_id);
+		g_warning("Non-existent buffer %i", buffer_id);
 		return g_variant_new_boolean(FALSE);
 	}
 
@@ -218,20 +321,16 @@ static GVariant *server_buffer_load(SoupXMLRPCParams *params) {
 	return g_variant_new_boolean(TRUE);
 }
 
-static GVariant *server_buffer_evaluate(SoupXMLRPCParams *params) {
-	GVariant *unwrapped_params = server_unwrap_params(params);
-	if (!unwrapped_params) {
-		return g_variant_new_boolean(FALSE);
-	}
-	const char *buffer_id = NULL;
+static GVariant *server_buffer_evaluate(GVariant *unwrapped_params) {
+	gint buffer_id = 0;
 	const char *javascript = NULL;
-	g_variant_get(unwrapped_params, "(&s&s)", &buffer_id, &javascript);
-	g_message("Method parameter(s): buffer id %s", buffer_id);
+	g_variant_get(unwrapped_params, "(i&s)", &buffer_id, &javascript);
+	g_message("Method parameter(s): buffer id %i", buffer_id);
 	g_debug("Javascript: \"%s\"", javascript);
 
-	Buffer *buffer = g_hash_table_lookup(state.buffers, buffer_id);
+	Buffer *buffer = handle_table_lookup(state.buffers, buffer_id);
 	if (!buffer) {
-		g_warning("Non-existent buffer %s", buffer_id);
+		g_warning("Non-existent buffer %i", buffer_id);
 		return g_variant_new_string("");
 	}
 	char *callback_id = buffer_evaluate(buffer, javascript);
@@ -241,21 +340,17 @@ static GVariant *server_buffer_evaluate(SoupXMLRPCParams *params) {
 	return callback_variant;
 }
 
-static GVariant *server_window_set_minibuffer_height(SoupXMLRPCParams *params) {
-	GVariant *unwrapped_params = server_unwrap_params(params);
-	if (!unwrapped_params) {
-		return g_variant_new_boolean(FALSE);
-	}
-	const char *window_id = NULL;
+static GVariant *server_window_set_minibuffer_height(GVariant *unwrapped_params) {
+	gint window_id = 0;
 	int minibuffer_height = 0;
-	g_variant_get(unwrapped_params, "(&si)", &window_id,
+	g_variant_get(unwrapped_params, "(ii)", &window_id,
 		&minibuffer_height);
-	g_message("Method parameter(s): window id %s, minibuffer height %i", window_id,
+	g_message("Method parameter(s): window id %i, minibuffer height %i", window_id,
 		minibuffer_height);
 
-	Window *window = g_hash_table_lookup(state.windows, window_id);
+	Window *window = handle_table_lookup(state.windows, window_id);
 	if (!window) {
-		g_warning("Non-existent window %s", window_id);
+		g_warning("Non-existent window %i", window_id);
 		return g_variant_new_int64(0);
 	}
 	gint64 preferred_height = window_set_minibuffer_height(window, minibuffer_height);
@@ -263,18 +358,18 @@ static GVariant *server_window_set_minibuffer_height(SoupXMLRPCParams *params) {
 	return g_variant_new_int64(preferred_height);
 }
 
-static GVariant *server_minibuffer_evaluate(SoupXMLRPCParams *params) {
-	GVariant *unwrapped_params = server_unwrap_params(params);
-	if (!unwrapped_params) {
-		return g_variant_new_boolean(FALSE);
-	}
-	const char *window_id = NULL;
+static GVariant *server_minibuffer_evaluate(GVariant *unwrapped_params) {
+	gint window_id = 0;
 	const char *javascript = NULL;
-	g_variant_get(unwrapped_params, "(&s&s)", &window_id, &javascript);
-	g_message("Method parameter(s): window id %s", window_id);
+	g_variant_get(unwrapped_params, "(i&s)", &window_id, &javascript);
+	g_message("Method parameter(s): window id %i", window_id);
 	g_debug("Javascript: \"%s\"", javascript);
 
-	Window *window = g_hash_table_lookup(state.windows, window_id);
+	Window *window = handle_table_lookup(state.windows, window_id);
+	if (!window) {
+		g_warning("Non-existent window %i", window_id);
+		return g_variant_new_string("");
+	}
 	Minibuffer *minibuffer = window->minibuffer;
 	char *callback_id = minibuffer_evaluate(minibuffer, javascript);
 	g_message("Method result(s): callback id %s", callback_id);
@@ -283,27 +378,32 @@ static GVariant *server_minibuffer_evaluate(SoupXMLRPCParams *params) {
 	return callback_variant;
 }
 
-static GVariant *server_generate_input_event(SoupXMLRPCParams *params) {
-	GVariant *unwrapped_params = server_unwrap_params(params);
-	if (!unwrapped_params) {
-		return g_variant_new_boolean(FALSE);
-	}
-	const char *window_id = NULL;
+static GVariant *server_generate_input_event(GVariant *unwrapped_params) {
+	gint window_id = 0;
 	guint hardware_keycode = 0; // We are given an integer "i", not a uint16.
 	guint modifiers = 0; // modifiers
 	guint keyval = 0;
 	gdouble x = -1;
 	gdouble y = -1;
 	gboolean released = false;
+	// Coalesced scroll events come with their accumulated delta.
+	gboolean has_delta = false;
+	gdouble delta_x = 0;
+	gdouble delta_y = 0;
 
 	{
-		if (!g_variant_check_format_string(unwrapped_params, "(siavidd)", FALSE)) {
+		GVariantIter *iter;
+		if (g_variant_check_format_string(unwrapped_params, "(iiavidddd)", FALSE)) {
+			has_delta = true;
+			g_variant_get(unwrapped_params, "(iiavidddd)", &window_id, &hardware_keycode,
+				&iter, &keyval, &x, &y, &delta_x, &delta_y);
+		} else if (g_variant_check_format_string(unwrapped_params, "(iiavidd)", FALSE)) {
+			g_variant_get(unwrapped_params, "(iiavidd)", &window_id, &hardware_keycode,
+				&iter, &keyval, &x, &y);
+		} else {
 			g_warning("Malformed input event: %s", g_variant_get_type_string(unwrapped_params));
 			return g_variant_new_boolean(FALSE);
 		}
-		GVariantIter *iter;
-		g_variant_get(unwrapped_params, "(siavidd)", &window_id, &hardware_keycode,
-			&iter, &keyval, &x, &y);
 
 		GVariant *str_variant;
 		while (g_variant_iter_loop(iter, "v", &str_variant)) {
@@ -321,19 +421,19 @@ static GVariant *server_generate_input_event(SoupXMLRPCParams *params) {
 		g_variant_iter_free(iter);
 	}
 
-	g_message("Method parameter(s): window id '%s', hardware_keycode %i, keyval %i, modifiers %i",
+	g_message("Method parameter(s): window id %i, hardware_keycode %i, keyval %i, modifiers %i",
 		window_id, hardware_keycode, keyval, modifiers);
 
-	Window *window = g_hash_table_lookup(state.windows, window_id);
+	Window *window = handle_table_lookup(state.windows, window_id);
 	if (!window) {
-		g_warning("Non-existent window %s", window_id);
+		g_warning("Non-existent window %i", window_id);
 		return g_variant_new_boolean(FALSE);
 	}
 
 	GdkEvent event;
 	if (x != -1) {
 		// TODO: Rename hardware_keycode to something that fits mouse buttons.
-		if (hardware_keycode != 0) {
+		if (has_delta || hardware_keycode != 0) {
 			GdkEventScroll event_scroll = {
 				.state = modifiers,
 				.direction = hardware_keycode,
@@ -342,7 +442,10 @@ static GVariant *server_generate_input_event(SoupXMLRPCParams *params) {
 				.delta_x = -1,
 				.delta_y = -1,
 			};
-			if (keyval == 5 || keyval == 7) {
+			if (has_delta) {
+				event_scroll.delta_x = delta_x;
+				event_scroll.delta_y = delta_y;
+			} else if (keyval == 5 || keyval == 7) {
 				event_scroll.delta_x = 1;
 				event_scroll.delta_y = 1;
 			}
@@ -387,21 +490,23 @@ static GVariant *server_generate_input_event(SoupXMLRPCParams *params) {
 	return g_variant_new_boolean(TRUE);
 }
 
-static GVariant *server_list_methods(SoupXMLRPCParams *_params) {
-	GHashTableIter iter;
-	gpointer key;
-
+// The method names are listed in the order of their identifiers, which
+// "server.method.table" guarantees.
+static GVariant *server_list_methods(GVariant *_unwrapped_params) {
 	GVariantBuilder builder;
 	g_variant_builder_init(&builder, G_VARIANT_TYPE_ARRAY);
 
-	g_hash_table_iter_init(&iter, state.server_callbacks);
-	while (g_hash_table_iter_next(&iter, &key, NULL)) {
-		g_variant_builder_add_parsed(&builder, "%s", key);
+	for (int id = 0; id < SERVER_METHOD_COUNT; id++) {
+		g_variant_builder_add_parsed(&builder, "%s", server_methods[id].name);
 	}
 
 	return g_variant_builder_end(&builder);
 }
 
+static GVariant *server_method_table(GVariant *unwrapped_params) {
+	return server_list_methods(unwrapped_params);
+}
+
 /* ITER cannot be used after this call.  RESULT must be freed. */
 GList *server_unwrap_string_list(GVariantIter *iter) {
 	GVariant *str_variant;
@@ -436,12 +541,21 @@ char **server_string_list_to_array_pointer(GList *list) {
 	return result;
 }
 
-static GVariant *server_set_proxy(SoupXMLRPCParams *params) {
-	GVariant *unwrapped_params = server_unwrap_params(params);
-	if (!unwrapped_params) {
-		return g_variant_new_boolean(FALSE);
+/* ITER cannot be used after this call.  RESULT must be freed with
+g_array_unref. */
+GArray *server_unwrap_handle_list(GVariantIter *iter) {
+	GVariant *handle_variant;
+	GArray *result = g_array_new(FALSE, FALSE, sizeof (gint));
+	while (g_variant_iter_loop(iter, "v", &handle_variant)) {
+		gint handle = g_variant_get_int32(handle_variant);
+		g_array_append_val(result, handle);
 	}
-	GList *buffer_ids = NULL;
+	g_variant_iter_free(iter);
+	return result;
+}
+
+static GVariant *server_set_proxy(GVariant *unwrapped_params) {
+	GArray *buffer_ids = NULL;
 	const char *mode = NULL;
 	const char *proxy_uri = NULL;
 	char **ignore_hosts = NULL;
@@ -451,7 +565,7 @@ static GVariant *server_set_proxy(SoupXMLRPCParams *params) {
 		GVariantIter *iter_buffers;
 		g_variant_get(unwrapped_params, "(av&s&sav)", &iter_buffers, &mode, &proxy_uri, &iter);
 
-		buffer_ids = server_unwrap_string_list(iter_buffers);
+		buffer_ids = server_unwrap_handle_list(iter_buffers);
 		GList *ignore_hosts_list = server_unwrap_string_list(iter);
 		ignore_hosts = server_string_list_to_array_pointer(ignore_hosts_list);
 		g_list_free(ignore_hosts_list);
@@ -459,12 +573,14 @@ static GVariant *server_set_proxy(SoupXMLRPCParams *params) {
 
 	{
 		gchar *pretty_ignore_hosts = g_strjoinv(",", ignore_hosts);
-		char **buffer_ids_buf = server_string_list_to_array_pointer(buffer_ids);
-		gchar *pretty_buffer_ids = g_strjoinv(",", buffer_ids_buf);
+		GString *pretty_buffer_ids = g_string_new(NULL);
+		for (guint i = 0; i < buffer_ids->len; i++) {
+			g_string_append_printf(pretty_buffer_ids, i == 0 ? "%i" : ",%i",
+				g_array_index(buffer_ids, gint, i));
+		}
 		g_message("Method parameter(s): buffer ID(s) %s, set proxy=%s, URI=%s, ignore_hosts=%s",
-			pretty_buffer_ids, mode, proxy_uri, pretty_ignore_hosts);
-		g_free(buffer_ids_buf);
-		g_free(pretty_buffer_ids);
+			pretty_buffer_ids->str, mode, proxy_uri, pretty_ignore_hosts);
+		g_string_free(pretty_buffer_ids, TRUE);
 		g_free(pretty_ignore_hosts);
 	}
 
@@ -475,32 +591,36 @@ static GVariant *server_set_proxy(SoupXMLRPCParams *params) {
 		mode_enum = WEBKIT_NETWORK_PROXY_MODE_NO_PROXY;
 	}
 
-	while (buffer_ids != NULL) {
-		Buffer *buffer = g_hash_table_lookup(state.buffers, buffer_ids->data);
+	for (guint i = 0; i < buffer_ids->len; i++) {
+		gint buffer_id = g_array_index(buffer_ids, gint, i);
+		Buffer *buffer = handle_table_lookup(state.buffers, buffer_id);
+		if (!buffer) {
+			g_warning("Non-existent buffer %i", buffer_id);
+			continue;
+		}
 		buffer_set_proxy(buffer, mode_enum, proxy_uri, (const char *const *)ignore_hosts);
-		buffer_ids = buffer_ids->next;
 	}
 
-	// TODO: Don't free ignore_hosts if we need to store them in the Buffer struct?
-	// More elegant way to do this?
-	/* g_free(ignore_hosts); */
-	g_list_free(buffer_ids);
+	// The profile keeps its own copy.
+	g_strfreev(ignore_hosts);
+	g_array_unref(buffer_ids);
 	return g_variant_new_boolean(TRUE);
 }
 
-static GVariant *server_get_proxy(SoupXMLRPCParams *params) {
-	GVariant *unwrapped_params = server_unwrap_params(params);
-	if (!unwrapped_params) {
+static GVariant *server_get_proxy(GVariant *unwrapped_params) {
+	gint a_key = 0;
+	g_variant_get(unwrapped_params, "(i)", &a_key);
+	g_message("Method parameter(s): %i", a_key);
+
+	Buffer *buffer = handle_table_lookup(state.buffers, a_key);
+	if (!buffer) {
+		g_warning("Non-existent buffer %i", a_key);
 		return g_variant_new_boolean(FALSE);
 	}
-	const char *a_key = NULL;
-	g_variant_get(unwrapped_params, "(&s)", &a_key);
-	g_message("Method parameter(s): %s", a_key);
-
 	WebKitNetworkProxyMode mode;
 	const gchar *proxy_uri = NULL;
 	const gchar *const *ignore_hosts = NULL;
-	buffer_get_proxy(g_hash_table_lookup(state.buffers, a_key),
+	buffer_get_proxy(buffer,
 		&mode, &proxy_uri, &ignore_hosts);
 
 	char *mode_string = "default";
@@ -523,6 +643,750 @@ static GVariant *server_get_proxy(SoupXMLRPCParams *params) {
 	return g_variant_builder_end(&builder);
 }
 
+// Return the strings of VALUE, an array of strings, as a NULL-terminated array
+// to free with g_strfreev.  The Lisp core encodes empty lists as FALSE.
+static char **server_string_array(GVariant *value) {
+	GPtrArray *strings = g_ptr_array_new();
+	if (g_variant_is_container(value)) {
+		GVariantIter iter;
+		g_variant_iter_init(&iter, value);
+		GVariant *child;
+		while ((child = g_variant_iter_next_value(&iter)) != NULL) {
+			if (g_variant_is_of_type(child, G_VARIANT_TYPE_VARIANT)) {
+				GVariant *inner = g_variant_get_variant(child);
+				g_variant_unref(child);
+				child = inner;
+			}
+			if (g_variant_is_of_type(child, G_VARIANT_TYPE_STRING)) {
+				g_ptr_array_add(strings, g_variant_dup_string(child, NULL));
+			}
+			g_variant_unref(child);
+		}
+	}
+	g_ptr_array_add(strings, NULL);
+	return (char **)g_ptr_array_free(strings, FALSE);
+}
+
+static GVariant *server_keymap_set(GVariant *unwrapped_params) {
+	if (g_variant_n_children(unwrapped_params) != 3) {
+		g_warning("Malformed keymap.set parameters");
+		return g_variant_new_boolean(FALSE);
+	}
+	GVariant *name = g_variant_get_child_value(unwrapped_params, 0);
+	GVariant *bound_variant = g_variant_get_child_value(unwrapped_params, 1);
+	GVariant *prefixes_variant = g_variant_get_child_value(unwrapped_params, 2);
+	char **bound = server_string_array(bound_variant);
+	char **prefixes = server_string_array(prefixes_variant);
+	g_message("Method parameter(s): keymap %s, %u bound, %u prefixes",
+		g_variant_get_string(name, NULL),
+		g_strv_length(bound), g_strv_length(prefixes));
+
+	keymap_set(g_variant_get_string(name, NULL), bound, prefixes);
+
+	g_strfreev(bound);
+	g_strfreev(prefixes);
+	g_variant_unref(name);
+	g_variant_unref(bound_variant);
+	g_variant_unref(prefixes_variant);
+	return g_variant_new_boolean(TRUE);
+}
+
+static GVariant *server_policy_set_rules(GVariant *unwrapped_params) {
+	if (g_variant_n_children(unwrapped_params) != 1) {
+		g_warning("Malformed policy.set.rules parameters");
+		return g_variant_new_boolean(FALSE);
+	}
+	GVariant *fields_variant = g_variant_get_child_value(unwrapped_params, 0);
+	char **fields = server_string_array(fields_variant);
+	g_message("Method parameter(s): %u rule fields", g_strv_length(fields));
+
+	policy_set_rules(fields);
+
+	g_strfreev(fields);
+	g_variant_unref(fields_variant);
+	return g_variant_new_boolean(TRUE);
+}
+
+// Load the filter set IDENTIFIER from the JSON file PATH, compiling it only if
+// the file changed since last time.
+static GVariant *server_filter_load(GVariant *unwrapped_params) {
+	const char *identifier = NULL;
+	const char *path = NULL;
+	g_variant_get(unwrapped_params, "(&s&s)", &identifier, &path);
+	g_message("Method parameter(s): filter %s, path %s", identifier, path);
+	return g_variant_new_boolean(filter_load(identifier, path, FALSE));
+}
+
+// Like filter.load, but always compile the filter set.
+static GVariant *server_filter_refresh(GVariant *unwrapped_params) {
+	const char *identifier = NULL;
+	const char *path = NULL;
+	g_variant_get(unwrapped_params, "(&s&s)", &identifier, &path);
+	g_message("Method parameter(s): filter %s, path %s", identifier, path);
+	return g_variant_new_boolean(filter_load(identifier, path, TRUE));
+}
+
+static GVariant *server_filter_list(GVariant *_unwrapped_params) {
+	const char **identifiers = filter_identifiers();
+	GVariant *result = g_variant_new_strv(identifiers, -1);
+	g_free(identifiers);
+	return result;
+}
+
+static GVariant *server_buffer_set_keymap(GVariant *unwrapped_params) {
+	gint buffer_id = 0;
+	const char *keymap = NULL;
+	g_variant_get(unwrapped_params, "(i&s)", &buffer_id, &keymap);
+	g_message("Method parameter(s): buffer id %i, keymap %s", buffer_id, keymap);
+
+	Buffer *buffer = handle_table_lookup(state.buffers, buffer_id);
+	if (!buffer) {
+		g_warning("Non-existent buffer %i", buffer_id);
+		return g_variant_new_boolean(FALSE);
+	}
+	g_free(buffer->keymap);
+	buffer->keymap = g_strdup(keymap);
+	return g_variant_new_boolean(TRUE);
+}
+
+static GVariant *server_window_set_minibuffer_active(GVariant *unwrapped_params) {
+	gint window_id = 0;
+	gboolean active = FALSE;
+	g_variant_get(unwrapped_params, "(ib)", &window_id, &active);
+	g_message("Method parameter(s): window id %i, minibuffer active %i", window_id, active);
+
+	Window *window = handle_table_lookup(state.windows, window_id);
+	if (!window) {
+		g_warning("Non-existent window %i", window_id);
+		return g_variant_new_boolean(FALSE);
+	}
+	window->minibuffer_active = active;
+	g_string_truncate(window->key_sequence, 0);
+	return g_variant_new_boolean(TRUE);
+}
+
+// Return whether the hibernation has started.  The port calls
+// buffer.did.hibernate once it is done.
+static GVariant *server_buffer_hibernate(GVariant *unwrapped_params) {
+	gint buffer_id = 0;
+	g_variant_get(unwrapped_params, "(i)", &buffer_id);
+	g_message("Method parameter(s): buffer id %i", buffer_id);
+
+	Buffer *buffer = handle_table_lookup(state.buffers, buffer_id);
+	if (!buffer) {
+		g_warning("Non-existent buffer %i", buffer_id);
+		return g_variant_new_boolean(FALSE);
+	}
+	if (window_of_buffer(buffer) != NULL) {
+		g_debug("Buffer %i is displayed, not hibernating it", buffer_id);
+		return g_variant_new_boolean(FALSE);
+	}
+	// The core hibernates buffers to save memory, which the spare views would
+	// waste.
+	context_drain_spare_views();
+	return g_variant_new_boolean(buffer_hibernate(buffer));
+}
+
+static GVariant *server_buffer_wake(GVariant *unwrapped_params) {
+	gint buffer_id = 0;
+	g_variant_get(unwrapped_params, "(i)", &buffer_id);
+	g_message("Method parameter(s): buffer id %i", buffer_id);
+
+	Buffer *buffer = handle_table_lookup(state.buffers, buffer_id);
+	if (!buffer) {
+		g_warning("Non-existent buffer %i", buffer_id);
+		return g_variant_new_boolean(FALSE);
+	}
+	gboolean hibernated = buffer->hibernated || buffer->hibernation != NULL;
+	buffer_schedule_load(buffer, NULL);
+	return g_variant_new_boolean(hibernated);
+}
+
+// Return the position of the buffer in the load queue, 0 for the next one to
+// load, or -1 if it is not waiting.
+static GVariant *server_buffer_load_queue_position(GVariant *unwrapped_params) {
+	gint buffer_id = 0;
+	g_variant_get(unwrapped_params, "(i)", &buffer_id);
+	g_message("Method parameter(s): buffer id %i", buffer_id);
+
+	Buffer *buffer = handle_table_lookup(state.buffers, buffer_id);
+	if (!buffer) {
+		g_warning("Non-existent buffer %i", buffer_id);
+		return g_variant_new_int32(-1);
+	}
+	return g_variant_new_int32(buffer_load_queue_position(buffer));
+}
+
+// Prefetch the DNS of a list of URIs in the context of a buffer.  Return the
+// number of hosts.
+static GVariant *server_buffer_prefetch(GVariant *unwrapped_params) {
+	if (g_variant_n_children(unwrapped_params) != 2) {
+		g_warning("Malformed buffer.prefetch parameters");
+		return g_variant_new_int32(0);
+	}
+	GVariant *buffer_id_variant = g_variant_get_child_value(unwrapped_params, 0);
+	GVariant *uris_variant = g_variant_get_child_value(unwrapped_params, 1);
+	gint buffer_id = g_variant_get_int32(buffer_id_variant);
+	char **uris = server_string_array(uris_variant);
+	g_message("Method parameter(s): buffer id %i, %u URIs",
+		buffer_id, g_strv_length(uris));
+
+	guint count = 0;
+	Buffer *buffer = handle_table_lookup(state.buffers, buffer_id);
+	if (!buffer) {
+		g_warning("Non-existent buffer %i", buffer_id);
+	} else {
+		count = buffer_prefetch(buffer, uris);
+	}
+
+	g_strfreev(uris);
+	g_variant_unref(buffer_id_variant);
+	g_variant_unref(uris_variant);
+	return g_variant_new_int32(count);
+}
+
+// Download a URI in the web context of a buffer and return the download
+// identifier, or -1 if there is no such buffer.
+static GVariant *server_download_start(GVariant *unwrapped_params) {
+	gint buffer_id = 0;
+	const char *uri = NULL;
+	g_variant_get(unwrapped_params, "(i&s)", &buffer_id, &uri);
+	g_message("Method parameter(s): buffer id %i, URI %s", buffer_id, uri);
+
+	Buffer *buffer = handle_table_lookup(state.buffers, buffer_id);
+	if (!buffer) {
+		g_warning("Non-existent buffer %i", buffer_id);
+		return g_variant_new_int32(-1);
+	}
+	gint download_id = download_start(buffer->profile->context, uri);
+	g_message("Method result(s): download id %i", download_id);
+	return g_variant_new_int32(download_id);
+}
+
+static GVariant *server_download_cancel(GVariant *unwrapped_params) {
+	gint download_id = 0;
+	g_variant_get(unwrapped_params, "(i)", &download_id);
+	g_message("Method parameter(s): download id %i", download_id);
+
+	if (!download_cancel(download_id)) {
+		g_warning("Non-existent download %i", download_id);
+		return g_variant_new_boolean(FALSE);
+	}
+	return g_variant_new_boolean(TRUE);
+}
+
+// Set the directory of the downloads started from now on, or the XDG one if
+// empty.
+static GVariant *server_download_set_directory(GVariant *unwrapped_params) {
+	const char *directory = NULL;
+	g_variant_get(unwrapped_params, "(&s)", &directory);
+	g_message("Method parameter(s): directory %s", directory);
+
+	g_free(state.download_directory);
+	state.download_directory = directory[0] != '\0' ? g_strdup(directory) : NULL;
+	return g_variant_new_boolean(TRUE);
+}
+
+// Register a script given its name and the JavaScript source of a function.
+static GVariant *server_script_register(GVariant *unwrapped_params) {
+	const char *name = NULL;
+	const char *source = NULL;
+	g_variant_get(unwrapped_params, "(&s&s)", &name, &source);
+	g_message("Method parameter(s): script %s", name);
+	g_debug("Javascript: \"%s\"", source);
+
+	script_register(name, source);
+	return g_variant_new_boolean(TRUE);
+}
+
+// Run a registered script with a list of string arguments and return the
+// callback identifier of the result, like buffer.evaluate.javascript, or the
+// empty string if there is no such buffer or script.
+static GVariant *server_buffer_invoke_script(GVariant *unwrapped_params) {
+	if (g_variant_n_children(unwrapped_params) != 3) {
+		g_warning("Malformed buffer.invoke.script parameters");
+		return g_variant_new_string("");
+	}
+	GVariant *buffer_id_variant = g_variant_get_child_value(unwrapped_params, 0);
+	GVariant *name_variant = g_variant_get_child_value(unwrapped_params, 1);
+	GVariant *args_variant = g_variant_get_child_value(unwrapped_params, 2);
+	gint buffer_id = g_variant_get_int32(buffer_id_variant);
+	const char *name = g_variant_get_string(name_variant, NULL);
+	char **args = server_string_array(args_variant);
+	g_message("Method parameter(s): buffer id %i, script %s, %u arguments",
+		buffer_id, name, g_strv_length(args));
+
+	char *callback_id = NULL;
+	Buffer *buffer = handle_table_lookup(state.buffers, buffer_id);
+	if (!buffer) {
+		g_warning("Non-existent buffer %i", buffer_id);
+	} else {
+		callback_id = script_invoke(buffer, name, args);
+		if (callback_id == NULL) {
+			g_warning("Non-existent script %s", name);
+		}
+	}
+	g_message("Method result(s): callback id %s", callback_id);
+	GVariant *callback_variant = g_variant_new_string(callback_id != NULL ? callback_id : "");
+	g_free(callback_id);
+	g_strfreev(args);
+	g_variant_unref(buffer_id_variant);
+	g_variant_unref(name_variant);
+	g_variant_unref(args_variant);
+	return callback_variant;
+}
+
+// Choose the built-in page events that are pushed to the Lisp core with
+// buffer.did.post.messages, and return the number of known ones.
+static GVariant *server_message_subscribe(GVariant *unwrapped_params) {
+	if (g_variant_n_children(unwrapped_params) != 1) {
+		g_warning("Malformed message.subscribe parameters");
+		return g_variant_new_int32(0);
+	}
+	GVariant *types_variant = g_variant_get_child_value(unwrapped_params, 0);
+	char **types = server_string_array(types_variant);
+	g_message("Method parameter(s): %u page events", g_strv_length(types));
+
+	guint count = message_subscribe(types);
+
+	g_strfreev(types);
+	g_variant_unref(types_variant);
+	return g_variant_new_int32(count);
+}
+
+// Run the native DOM query METHOD with ARGS, which is consumed, in the page of
+// BUFFER_ID.  Return the callback identifier of the result, which comes with
+// buffer.dom.call.back, or the empty string if there is no such buffer or the
+// query cannot run natively, in which case the Lisp core runs a script instead.
+static GVariant *server_buffer_query_dom(gint buffer_id, const char *method, GVariant *args) {
+	char *callback_id = NULL;
+	Buffer *buffer = handle_table_lookup(state.buffers, buffer_id);
+	if (!buffer) {
+		g_warning("Non-existent buffer %i", buffer_id);
+		if (args != NULL) {
+			g_variant_unref(g_variant_ref_sink(args));
+		}
+	} else {
+		callback_id = buffer_query_dom(buffer, method, args);
+	}
+	g_message("Method result(s): callback id %s", callback_id);
+	GVariant *callback_variant = g_variant_new_string(callback_id != NULL ? callback_id : "");
+	g_free(callback_id);
+	return callback_variant;
+}
+
+// Add hints to the links in the viewport.  The result is the list of (hint,
+// URI, x, y, width, height) of the links.
+static GVariant *server_buffer_link_hints(GVariant *unwrapped_params) {
+	gint buffer_id = 0;
+	g_variant_get(unwrapped_params, "(i)", &buffer_id);
+	g_message("Method parameter(s): buffer id %i", buffer_id);
+	return server_buffer_query_dom(buffer_id, "AddLinkHints", NULL);
+}
+
+// The result is the list of (level, text) of the headings.
+static GVariant *server_buffer_headings(GVariant *unwrapped_params) {
+	gint buffer_id = 0;
+	g_variant_get(unwrapped_params, "(i)", &buffer_id);
+	g_message("Method parameter(s): buffer id %i", buffer_id);
+	return server_buffer_query_dom(buffer_id, "Headings", NULL);
+}
+
+// Scroll to the heading of an index in the result of buffer.headings.  The
+// result is whether it exists.
+static GVariant *server_buffer_scroll_to_heading(GVariant *unwrapped_params) {
+	gint buffer_id = 0;
+	gint index = 0;
+	g_variant_get(unwrapped_params, "(ii)", &buffer_id, &index);
+	g_message("Method parameter(s): buffer id %i, heading %i", buffer_id, index);
+	return server_buffer_query_dom(buffer_id, "ScrollToHeading",
+		g_variant_new("(u)", (guint32)MAX(index, 0)));
+}
+
+// Highlight the matches of a text in a buffer, case-sensitively or not, and go
+// to the first one.  The number of matches comes with buffer.did.find.
+static GVariant *server_buffer_find_search(GVariant *unwrapped_params) {
+	gint buffer_id = 0;
+	const char *text = NULL;
+	gboolean case_sensitive = FALSE;
+	g_variant_get(unwrapped_params, "(i&sb)", &buffer_id, &text, &case_sensitive);
+	g_message("Method parameter(s): buffer id %i, text %s, case-sensitive %i",
+		buffer_id, text, case_sensitive);
+
+	Buffer *buffer = handle_table_lookup(state.buffers, buffer_id);
+	if (!buffer) {
+		g_warning("Non-existent buffer %i", buffer_id);
+		return g_variant_new_boolean(FALSE);
+	}
+	return g_variant_new_boolean(find_search(buffer, text, case_sensitive));
+}
+
+static GVariant *server_buffer_find_step(GVariant *unwrapped_params, gboolean backwards) {
+	gint buffer_id = 0;
+	g_variant_get(unwrapped_params, "(i)", &buffer_id);
+	g_message("Method parameter(s): buffer id %i", buffer_id);
+
+	Buffer *buffer = handle_table_lookup(state.buffers, buffer_id);
+	if (!buffer) {
+		g_warning("Non-existent buffer %i", buffer_id);
+		return g_variant_new_boolean(FALSE);
+	}
+	return g_variant_new_boolean(find_step(buffer, backwards));
+}
+
+static GVariant *server_buffer_find_next(GVariant *unwrapped_params) {
+	return server_buffer_find_step(unwrapped_params, FALSE);
+}
+
+static GVariant *server_buffer_find_previous(GVariant *unwrapped_params) {
+	return server_buffer_find_step(unwrapped_params, TRUE);
+}
+
+// Remove the highlights of the search in a buffer.
+static GVariant *server_buffer_find_finish(GVariant *unwrapped_params) {
+	gint buffer_id = 0;
+	g_variant_get(unwrapped_params, "(i)", &buffer_id);
+	g_message("Method parameter(s): buffer id %i", buffer_id);
+
+	Buffer *buffer = handle_table_lookup(state.buffers, buffer_id);
+	if (!buffer) {
+		g_warning("Non-existent buffer %i", buffer_id);
+		return g_variant_new_boolean(FALSE);
+	}
+	return g_variant_new_boolean(find_finish(buffer));
+}
+
+// Save the state of every buffer to a file.  Return the number of buffers, or
+// -1 on error.
+static GVariant *server_session_save(GVariant *unwrapped_params) {
+	const char *path = NULL;
+	g_variant_get(unwrapped_params, "(&s)", &path);
+	g_message("Method parameter(s): path %s", path);
+	return g_variant_new_int32(session_save(path));
+}
+
+// Load a session saved with session.save, whose buffers are then created with
+// the SESSION-ID option of buffer.make.  Return the number of buffers, or -1 on
+// error.
+static GVariant *server_session_load(GVariant *unwrapped_params) {
+	const char *path = NULL;
+	g_variant_get(unwrapped_params, "(&s)", &path);
+	g_message("Method parameter(s): path %s", path);
+	return g_variant_new_int32(session_load(path));
+}
+
+// Return the identifier of METHOD_NAME, or -1 if the method is unknown.
+gint server_method_id(const char *method_name) {
+	gpointer id = NULL;
+	if (!g_hash_table_lookup_extended(state.server_method_ids, method_name, NULL, &id)) {
+		return -1;
+	}
+	return GPOINTER_TO_INT(id);
+}
+
+// Return the name under which the statistics of METHOD_NAME, as sent by the
+// Lisp core, are recorded.  Unknown methods share one entry, so that the table
+// of statistics does not grow with every name a peer sends.
+const char *server_stats_method_name(const char *method_name) {
+	gint id = server_method_id(method_name);
+	return id < 0 ? "<unknown>" : server_methods[id].name;
+}
+
+// Run the method of identifier ID.  UNWRAPPED_PARAMS may be floating, in which
+// case it is consumed.  Return NULL if the method is unknown.
+GVariant *server_call_method(gint id, GVariant *unwrapped_params) {
+	g_variant_ref_sink(unwrapped_params);
+	if (id < 0 || id >= SERVER_METHOD_COUNT) {
+		g_warning("Unknown method identifier: %i", id);
+		g_variant_unref(unwrapped_params);
+		return NULL;
+	}
+	const char *method_name = server_methods[id].name;
+	g_message("Method name: %s", method_name);
+
+	stats_count_call(method_name);
+	gint64 start = g_get_monotonic_time();
+	GVariant *result = server_methods[id].callback(unwrapped_params);
+	stats_record(method_name, STATS_EXECUTE, start);
+	g_variant_unref(unwrapped_params);
+	return result;
+}
+
+// Like server_call_method for the method named METHOD_NAME.
+GVariant *server_call(const char *method_name, GVariant *unwrapped_params) {
+	gint id = server_method_id(method_name);
+	if (id < 0) {
+		g_warning("Unknown method: %s", method_name);
+		g_variant_ref_sink(unwrapped_params);
+		g_variant_unref(unwrapped_params);
+		return NULL;
+	}
+	return server_call_method(id, unwrapped_params);
+}
+
+// Return the name of the method called by FRAME, which may be given by
+// identifier.
+const char *server_frame_method_name(ProtocolFrame *frame) {
+	if (frame->method_name != NULL) {
+		return frame->method_name;
+	}
+	if (frame->method_id >= 0 && frame->method_id < SERVER_METHOD_COUNT) {
+		return server_methods[frame->method_id].name;
+	}
+	return "<unknown>";
+}
+
+typedef struct {
+	GSocketConnection *connection;
+	guint8 header[4];
+	guint8 *payload;
+	gsize length;
+} BinaryReader;
+
+static void server_binary_read_frame(BinaryReader *reader);
+
+void server_binary_close(BinaryReader *reader) {
+	g_debug("Binary connection closed");
+	if (state.binary_connection == reader->connection) {
+		state.binary_connection = NULL;
+		client_binary_disconnected();
+	}
+	g_io_stream_close(G_IO_STREAM(reader->connection), NULL, NULL);
+	g_object_unref(reader->connection);
+	g_free(reader->payload);
+	g_free(reader);
+}
+
+void server_binary_dispatch(BinaryReader *reader, ProtocolFrame *frame) {
+	switch (frame->kind) {
+	case PROTOCOL_CALL: {
+		const char *method_name = server_frame_method_name(frame);
+		GVariant *result = frame->method_name != NULL
+			? server_call(frame->method_name, frame->value)
+			: server_call_method(frame->method_id, frame->value);
+		gint64 start = g_get_monotonic_time();
+		GBytes *response;
+		if (result == NULL && server_method_id(method_name) < 0) {
+			char *message = g_strdup_printf("Unknown method: %s", method_name);
+			response = protocol_fault_frame(frame->id,
+					SOUP_XMLRPC_FAULT_SERVER_ERROR_REQUESTED_METHOD_NOT_FOUND, message);
+			g_free(message);
+		} else if (result == NULL) {
+			char *message = g_strdup_printf("Failed to run %s", method_name);
+			response = protocol_fault_frame(frame->id,
+					SOUP_XMLRPC_FAULT_APPLICATION_ERROR, message);
+			g_free(message);
+		} else {
+			response = protocol_result_frame(frame->id, result);
+		}
+		protocol_write_frame(reader->connection, response);
+		stats_record(server_stats_method_name(method_name), STATS_SERIALIZE, start);
+		break;
+	}
+	case PROTOCOL_RESULT:
+		client_binary_response(frame->id, g_variant_ref(frame->value));
+		break;
+	case PROTOCOL_FAULT:
+		g_warning("Lisp core fault %i: %s", frame->fault_code,
+			g_variant_is_of_type(frame->value, G_VARIANT_TYPE_STRING)
+			? g_variant_get_string(frame->value, NULL) : "");
+		client_binary_response(frame->id, NULL);
+		break;
+	}
+}
+
+static void server_binary_payload_read(GObject *object, GAsyncResult *result, gpointer data) {
+	BinaryReader *reader = data;
+	GError *error = NULL;
+	gsize bytes_read = 0;
+	g_input_stream_read_all_finish(G_INPUT_STREAM(object), result, &bytes_read, &error);
+	if (error || bytes_read != reader->length) {
+		if (error) {
+			g_warning("Failed to read binary frame: %s", error->message);
+			g_error_free(error);
+		}
+		server_binary_close(reader);
+		return;
+	}
+
+	stats_bytes_in(sizeof reader->header + reader->length);
+	ProtocolFrame frame;
+	gint64 start = g_get_monotonic_time();
+	if (protocol_parse_frame(reader->payload, reader->length, &frame)) {
+		if (frame.kind == PROTOCOL_CALL) {
+			stats_record(server_stats_method_name(server_frame_method_name(&frame)),
+				STATS_PARSE, start);
+		}
+		server_binary_dispatch(reader, &frame);
+		protocol_frame_clear(&frame);
+	} else {
+		g_warning("Malformed binary frame of %zu bytes", reader->length);
+	}
+	g_clear_pointer(&reader->payload, g_free);
+	server_binary_read_frame(reader);
+}
+
+static void server_binary_header_read(GObject *object, GAsyncResult *result, gpointer data) {
+	BinaryReader *reader = data;
+	GError *error = NULL;
+	gsize bytes_read = 0;
+	g_input_stream_read_all_finish(G_INPUT_STREAM(object), result, &bytes_read, &error);
+	if (error || bytes_read != sizeof reader->header) {
+		if (error) {
+			g_warning("Failed to read binary frame: %s", error->message);
+			g_error_free(error);
+		}
+		server_binary_close(reader);
+		return;
+	}
+
+	guint32 length;
+	memcpy(&length, reader->header, sizeof length);
+	reader->length = GUINT32_FROM_BE(length);
+	if (reader->length > PROTOCOL_MAX_FRAME_LENGTH) {
+		g_warning("Binary frame of %zu bytes is too large, closing the connection",
+			reader->length);
+		server_binary_close(reader);
+		return;
+	}
+	reader->payload = g_malloc(reader->length);
+	g_input_stream_read_all_async(G_INPUT_STREAM(object),
+		reader->payload, reader->length, G_PRIORITY_DEFAULT, NULL,
+		server_binary_payload_read, reader);
+}
+
+static void server_binary_read_frame(BinaryReader *reader) {
+	g_input_stream_read_all_async(
+		g_io_stream_get_input_stream(G_IO_STREAM(reader->connection)),
+		reader->header, sizeof reader->header, G_PRIORITY_DEFAULT, NULL,
+		server_binary_header_read, reader);
+}
+
+// Only the first connection is accepted: the listener is then stopped, so that
+// no other local process can take over the link to the Lisp core.
+static gboolean server_binary_incoming(GSocketService *service,
+	GSocketConnection *connection, GObject *_source, gpointer _data) {
+	g_socket_service_stop(service);
+	if (state.binary_connection != NULL) {
+		g_warning("Rejecting a second binary protocol connection");
+		g_io_stream_close(G_IO_STREAM(connection), NULL, NULL);
+		return TRUE;
+	}
+	g_message("Lisp core connected with the binary protocol");
+	BinaryReader *reader = g_new0(BinaryReader, 1);
+	reader->connection = g_object_ref(connection);
+	state.binary_connection = connection;
+	server_binary_read_frame(reader);
+	return TRUE;
+}
+
+static GSocketService *binary_service;
+static char *binary_address;
+
+// Start listening for the binary protocol and return the address the Lisp core
+// should connect to, either "unix:PATH" or "tcp:HOST:PORT".
+static GVariant *server_binary_listen(GVariant *_unwrapped_params) {
+	if (binary_service != NULL) {
+		return g_variant_new_string(binary_address);
+	}
+
+	GError *error = NULL;
+	GSocketService *service = g_socket_service_new();
+	GSocketAddress *address = NULL;
+	if (state.socket_path != NULL) {
+		char *path = g_strdup_printf("%s.binary", state.socket_path);
+		g_unlink(path);
+		address = g_unix_socket_address_new(path);
+		binary_address = g_strdup_printf("unix:%s", path);
+		g_free(path);
+		g_socket_listener_add_address(G_SOCKET_LISTENER(service), address,
+			G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL, &error);
+	} else {
+		// Only listen on the loopback interface, on a port chosen by the system.
+		GInetAddress *loopback = g_inet_address_new_loopback(G_SOCKET_FAMILY_IPV4);
+		address = g_inet_socket_address_new(loopback, 0);
+		g_object_unref(loopback);
+		GSocketAddress *effective_address = NULL;
+		g_socket_listener_add_address(G_SOCKET_LISTENER(service), address,
+			G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP, NULL, &effective_address, &error);
+		if (effective_address != NULL) {
+			binary_address = g_strdup_printf("tcp:127.0.0.1:%u",
+					g_inet_socket_address_get_port(G_INET_SOCKET_ADDRESS(effective_address)));
+			g_object_unref(effective_address);
+		}
+	}
+	g_object_unref(address);
+	if (error) {
+		g_warning("Unable to listen for the binary protocol: %s", error->message);
+		g_error_free(error);
+		g_object_unref(service);
+		g_clear_pointer(&binary_address, g_free);
+		return g_variant_new_string("");
+	}
+
+	g_signal_connect(service, "incoming", G_CALLBACK(server_binary_incoming), NULL);
+	g_socket_service_start(service);
+	binary_service = service;
+	g_message("Method result(s): binary protocol address %s", binary_address);
+	return g_variant_new_string(binary_address);
+}
+
+// Run a list of calls in order and return the list of their results, which
+// saves one round trip per call.  Each call is an array whose first element is
+// the method name and the rest are its parameters.  Each result is wrapped in a
+// one-element array; the array is empty if the call failed.
+static GVariant *server_multicall(GVariant *unwrapped_params) {
+	if (!g_variant_is_of_type(unwrapped_params, G_VARIANT_TYPE("(av)"))) {
+		g_warning("Malformed system.multicall parameters: %s",
+			g_variant_get_type_string(unwrapped_params));
+		return g_variant_new_array(G_VARIANT_TYPE_VARIANT, NULL, 0);
+	}
+	GVariant *calls = NULL;
+	g_variant_get(unwrapped_params, "(@av)", &calls);
+
+	GVariantBuilder results;
+	g_variant_builder_init(&results, G_VARIANT_TYPE("av"));
+	GVariantIter iter;
+	g_variant_iter_init(&iter, calls);
+	GVariant *call;
+	while (g_variant_iter_loop(&iter, "v", &call)) {
+		GVariant *result = NULL;
+		gsize length = g_variant_is_of_type(call, G_VARIANT_TYPE("av"))
+			? g_variant_n_children(call) : 0;
+		GVariant *method_name = NULL;
+		if (length > 0) {
+			g_variant_get_child(call, 0, "v", &method_name);
+		}
+		if (method_name == NULL || !g_variant_is_of_type(method_name, G_VARIANT_TYPE_STRING)) {
+			g_warning("Malformed call in system.multicall");
+		} else {
+			GVariantBuilder params;
+			g_variant_builder_init(&params, G_VARIANT_TYPE_TUPLE);
+			for (gsize i = 1; i < length; i++) {
+				GVariant *param = NULL;
+				g_variant_get_child(call, i, "v", &param);
+				g_variant_builder_add_value(&params, param);
+				g_variant_unref(param);
+			}
+			result = server_call(g_variant_get_string(method_name, NULL),
+					g_variant_builder_end(&params));
+		}
+		g_clear_pointer(&method_name, g_variant_unref);
+
+		if (result == NULL) {
+			g_variant_builder_add(&results, "v",
+				g_variant_new_array(G_VARIANT_TYPE_VARIANT, NULL, 0));
+		} else {
+			GVariant *wrapped = g_variant_new_variant(result);
+			g_variant_builder_add(&results, "v",
+				g_variant_new_array(G_VARIANT_TYPE_VARIANT, &wrapped, 1));
+		}
+	}
+	g_variant_unref(calls);
+
+	return g_variant_builder_end(&results);
+}
+
 static void server_handler(SoupServer *_server, SoupMessage *msg,
 	const char *_path, GHashTable *_query,
 	SoupClientContext *_context, gpointer _data) {
@@ -548,6 +1412,8 @@ static void server_handler(SoupServer *_server, SoupMessage *msg,
 	}
 	*/
 
+	stats_bytes_in(msg->request_body->length);
+	gint64 start = g_get_monotonic_time();
 	SoupXMLRPCParams *params = NULL;
 	GError *error = NULL;
 	char *method_name = soup_xmlrpc_parse_request(msg->request_body->data,
@@ -560,29 +1426,180 @@ static void server_handler(SoupServer *_server, SoupMessage *msg,
 		return;
 	}
 
-	ServerCallback callback = NULL;
-	gboolean found = g_hash_table_lookup_extended(state.server_callbacks, method_name,
-			NULL, (gpointer *)&callback);
-	if (!found) {
+	GVariant *unwrapped_params = server_unwrap_params(params);
+	soup_xmlrpc_params_free(params);
+	stats_record(server_stats_method_name(method_name), STATS_PARSE, start);
+	if (!unwrapped_params) {
 		soup_xmlrpc_message_set_fault(msg,
-			SOUP_XMLRPC_FAULT_SERVER_ERROR_REQUESTED_METHOD_NOT_FOUND,
-			"Unknown method: %s", method_name);
-		g_warning("Unknown method: %s", method_name);
+			SOUP_XMLRPC_FAULT_SERVER_ERROR_INVALID_METHOD_PARAMETERS,
+			"Malformed parameters: %s", method_name);
+		g_free(method_name);
 		return;
 	}
-	g_message("Method name: %s", method_name);
 
-	GVariant *result = callback(params);
-	soup_xmlrpc_params_free(params);
+	GVariant *result = server_call(method_name, unwrapped_params);
+	if (!result) {
+		if (server_method_id(method_name) < 0) {
+			soup_xmlrpc_message_set_fault(msg,
+				SOUP_XMLRPC_FAULT_SERVER_ERROR_REQUESTED_METHOD_NOT_FOUND,
+				"Unknown method: %s", method_name);
+		} else {
+			soup_xmlrpc_message_set_fault(msg,
+				SOUP_XMLRPC_FAULT_APPLICATION_ERROR,
+				"Failed to run %s", method_name);
+		}
+		g_free(method_name);
+		return;
+	}
 
 	// 'result' is floating and soup_xmlrpc_message_set_response will consume it.
+	start = g_get_monotonic_time();
 	soup_xmlrpc_message_set_response(msg, result, &error);
 	if (error) {
 		g_warning("Failed to set XML-RPC response: %s", error->message);
 		g_error_free(error);
 	}
+	stats_record(method_name, STATS_SERIALIZE, start);
+	stats_bytes_out(msg->response_body->length);
+	g_free(method_name);
+}
+
+static guint server_hibernated_buffer_count() {
+	guint count = 0;
+	for (guint i = 1; i < state.buffers->len; i++) {
+		Buffer *buffer = g_ptr_array_index(state.buffers, i);
+		if (buffer != NULL && buffer->hibernated) {
+			count++;
+		}
+	}
+	return count;
 }
 
+// Return the resident memory of the port and of the web processes in kB.
+static guint64 server_memory_kb() {
+	GArray *pids = dom_web_process_pids();
+	guint64 total = stats_memory(pids);
+	g_array_unref(pids);
+	return total;
+}
+
+// Return the RPC statistics followed by the number of buffers and web
+// contexts, which tells how many buffers share a context.  Must be freed.
+char *server_stats_text() {
+	char *rpc = stats_text();
+	char *text = g_strdup_printf("%s"
+			"# TYPE next_port_buffers gauge\n"
+			"next_port_buffers %u\n"
+			"# TYPE next_port_hibernated_buffers gauge\n"
+			"next_port_hibernated_buffers %u\n"
+			"# TYPE next_port_loads gauge\n"
+			"next_port_loads{state=\"active\"} %u\n"
+			"next_port_loads{state=\"queued\"} %u\n"
+			"# TYPE next_port_web_contexts gauge\n"
+			"next_port_web_contexts %u\n"
+			"# TYPE next_port_downloads gauge\n"
+			"next_port_downloads %u\n"
+			"# TYPE next_port_resident_memory_bytes gauge\n"
+			"next_port_resident_memory_bytes %" G_GUINT64_FORMAT "\n",
+			rpc, handle_table_count(state.buffers), server_hibernated_buffer_count(),
+			state.active_loads, g_queue_get_length(&state.load_queue),
+			context_count, download_count(),
+			server_memory_kb() * 1024);
+	g_free(rpc);
+	return text;
+}
+
+// Serve the RPC statistics as plain text at GET /metrics, for scraping.
+static void server_metrics_handler(SoupServer *_server, SoupMessage *msg,
+	const char *_path, GHashTable *_query,
+	SoupClientContext *_context, gpointer _data) {
+	if (msg->method != SOUP_METHOD_GET) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_IMPLEMENTED);
+		return;
+	}
+	char *text = server_stats_text();
+	soup_message_set_status(msg, SOUP_STATUS_OK);
+	// 'text' is freed by libsoup.
+	soup_message_set_response(msg, "text/plain; version=0.0.4", SOUP_MEMORY_TAKE,
+		text, strlen(text));
+}
+
+// Return the resident memory of the port and the WebKit processes in kB.
+static GVariant *server_memory(GVariant *_unwrapped_params) {
+	return g_variant_new_int64(server_memory_kb());
+}
+
+static GVariant *server_stats(GVariant *_unwrapped_params) {
+	char *text = server_stats_text();
+	GVariant *result = g_variant_new_string(text);
+	g_free(text);
+	return result;
+}
+
+static const ServerMethod server_methods[SERVER_METHOD_COUNT] = {
+	[SERVER_LIST_METHODS] = {"listMethods", &server_list_methods},
+	[SERVER_METHOD_TABLE] = {"server.method.table", &server_method_table},
+	[SERVER_BINARY_LISTEN] = {"server.binary.listen", &server_binary_listen},
+	[SERVER_MULTICALL] = {"system.multicall", &server_multicall},
+	[SERVER_STATS] = {"server.stats", &server_stats},
+	[SERVER_MEMORY] = {"server.memory", &server_memory},
+
+	[SERVER_WINDOW_MAKE] = {"window.make", &server_window_make},
+	[SERVER_WINDOW_SET_TITLE] = {"window.set.title", &server_window_set_title},
+	[SERVER_WINDOW_DELETE] = {"window.delete", &server_window_delete},
+	[SERVER_WINDOW_ACTIVE] = {"window.active", &server_window_active},
+	[SERVER_WINDOW_EXISTS] = {"window.exists", &server_window_exists},
+	[SERVER_WINDOW_SET_ACTIVE_BUFFER] = {"window.set.active.buffer", &server_window_set_active_buffer},
+	[SERVER_WINDOW_SET_MINIBUFFER_HEIGHT] = {"window.set.minibuffer.height", &server_window_set_minibuffer_height},
+	[SERVER_BUFFER_MAKE] = {"buffer.make", &server_buffer_make},
+	[SERVER_BUFFER_DELETE] = {"buffer.delete", &server_buffer_delete},
+	[SERVER_BUFFER_LOAD] = {"buffer.load", &server_buffer_load},
+	[SERVER_BUFFER_EVALUATE_JAVASCRIPT] = {"buffer.evaluate.javascript", &server_buffer_evaluate},
+	[SERVER_MINIBUFFER_EVALUATE_JAVASCRIPT] = {"minibuffer.evaluate.javascript", &server_minibuffer_evaluate},
+	[SERVER_GENERATE_INPUT_EVENT] = {"generate.input.event", &server_generate_input_event},
+	[SERVER_SET_PROXY] = {"set.proxy", &server_set_proxy},
+	[SERVER_GET_PROXY] = {"get.proxy", &server_get_proxy},
+	[SERVER_KEYMAP_SET] = {"keymap.set", &server_keymap_set},
+	[SERVER_BUFFER_SET_KEYMAP] = {"buffer.set.keymap", &server_buffer_set_keymap},
+	[SERVER_WINDOW_SET_MINIBUFFER_ACTIVE] = {"window.set.minibuffer.active", &server_window_set_minibuffer_active},
+	[SERVER_BUFFER_HIBERNATE] = {"buffer.hibernate", &server_buffer_hibernate},
+	[SERVER_BUFFER_WAKE] = {"buffer.wake", &server_buffer_wake},
+	[SERVER_BUFFER_LOAD_QUEUE_POSITION] = {"buffer.load.queue.position", &server_buffer_load_queue_position},
+	[SERVER_POLICY_SET_RULES] = {"policy.set.rules", &server_policy_set_rules},
+	[SERVER_FILTER_LOAD] = {"filter.load", &server_filter_load},
+	[SERVER_FILTER_REFRESH] = {"filter.refresh", &server_filter_refresh},
+	[SERVER_FILTER_LIST] = {"filter.list", &server_filter_list},
+	[SERVER_BUFFER_PREFETCH] = {"buffer.prefetch", &server_buffer_prefetch},
+	[SERVER_DOWNLOAD_START] = {"download.start", &server_download_start},
+	[SERVER_DOWNLOAD_CANCEL] = {"download.cancel", &server_download_cancel},
+	[SERVER_DOWNLOAD_SET_DIRECTORY] = {"download.set.directory", &server_download_set_directory},
+	[SERVER_SCRIPT_REGISTER] = {"script.register", &server_script_register},
+	[SERVER_BUFFER_INVOKE_SCRIPT] = {"buffer.invoke.script", &server_buffer_invoke_script},
+	[SERVER_MESSAGE_SUBSCRIBE] = {"message.subscribe", &server_message_subscribe},
+	[SERVER_BUFFER_LINK_HINTS] = {"buffer.link.hints", &server_buffer_link_hints},
+	[SERVER_BUFFER_HEADINGS] = {"buffer.headings", &server_buffer_headings},
+	[SERVER_BUFFER_SCROLL_TO_HEADING] = {"buffer.scroll.to.heading", &server_buffer_scroll_to_heading},
+	[SERVER_BUFFER_FIND_SEARCH] = {"buffer.find.search", &server_buffer_find_search},
+	[SERVER_BUFFER_FIND_NEXT] = {"buffer.find.next", &server_buffer_find_next},
+	[SERVER_BUFFER_FIND_PREVIOUS] = {"buffer.find.previous", &server_buffer_find_previous},
+	[SERVER_BUFFER_FIND_FINISH] = {"buffer.find.finish", &server_buffer_find_finish},
+	[SERVER_SESSION_SAVE] = {"session.save", &server_session_save},
+	[SERVER_SESSION_LOAD] = {"session.load", &server_session_load},
+};
+
+#if GLIB_CHECK_VERSION(2, 64, 0)
+// Leave it to the core to decide which buffers to hibernate when the system
+// runs low on memory.
+static void server_low_memory_warning(GMemoryMonitor *_monitor,
+	GMemoryMonitorWarningLevel level, gpointer _data) {
+	context_drain_spare_views();
+	const char *method_name = "memory.pressure";
+	GVariant *arg = g_variant_new("(i)", level);
+	g_message("XML-RPC message: %s %s", method_name, g_variant_print(arg, TRUE));
+	client_call(method_name, arg, NULL, NULL);
+}
+#endif
+
 void start_server() {
 	// TODO: libsoup's examples don't unref the server.  Should we?
 	SoupServer *server = soup_server_new(
@@ -590,7 +1607,15 @@ void start_server() {
 		NULL);
 
 	GError *error = NULL;
-	soup_server_listen_all(server, state.port, 0, &error);
+	if (state.socket_path != NULL) {
+		// Remove the leftover of a previous instance, otherwise binding fails.
+		g_unlink(state.socket_path);
+		GSocketAddress *address = g_unix_socket_address_new(state.socket_path);
+		soup_server_listen(server, address, 0, &error);
+		g_object_unref(address);
+	} else {
+		soup_server_listen_all(server, state.port, 0, &error);
+	}
 	if (error) {
 		g_printerr("Unable to create server: %s\n", error->message);
 		g_error_free(error);
@@ -598,36 +1623,55 @@ void start_server() {
 	}
 	g_debug("Starting XMLRPC server");
 	soup_server_add_handler(server, NULL, server_handler, NULL, NULL);
+	soup_server_add_handler(server, "/metrics", server_metrics_handler, NULL, NULL);
 
 	// Initialize global state.
-	state.server_callbacks = g_hash_table_new(g_str_hash, g_str_equal);
-	state.windows = g_hash_table_new_full(g_str_hash, g_str_equal,
-			&g_free, (GDestroyNotify)&window_delete);
-	state.buffers = g_hash_table_new_full(g_str_hash, g_str_equal,
-			&g_free, (GDestroyNotify)&buffer_delete);
-
-	// Register callbacks.
-	g_hash_table_insert(state.server_callbacks, "listMethods", &server_list_methods);
-
-	g_hash_table_insert(state.server_callbacks, "window.make", &server_window_make);
-	g_hash_table_insert(state.server_callbacks, "window.set.title", &server_window_set_title);
-	g_hash_table_insert(state.server_callbacks, "window.delete", &server_window_delete);
-	g_hash_table_insert(state.server_callbacks, "window.active", &server_window_active);
-	g_hash_table_insert(state.server_callbacks, "window.exists", &server_window_exists);
-	g_hash_table_insert(state.server_callbacks, "window.set.active.buffer", &server_window_set_active_buffer);
-	g_hash_table_insert(state.server_callbacks, "window.set.minibuffer.height", &server_window_set_minibuffer_height);
-	g_hash_table_insert(state.server_callbacks, "buffer.make", &server_buffer_make);
-	g_hash_table_insert(state.server_callbacks, "buffer.delete", &server_buffer_delete);
-	g_hash_table_insert(state.server_callbacks, "buffer.load", &server_buffer_load);
-	g_hash_table_insert(state.server_callbacks, "buffer.evaluate.javascript", &server_buffer_evaluate);
-	g_hash_table_insert(state.server_callbacks, "minibuffer.evaluate.javascript", &server_minibuffer_evaluate);
-	g_hash_table_insert(state.server_callbacks, "generate.input.event", &server_generate_input_event);
-	g_hash_table_insert(state.server_callbacks, "set.proxy", &server_set_proxy);
-	g_hash_table_insert(state.server_callbacks, "get.proxy", &server_get_proxy);
+	state.server_method_ids = g_hash_table_new(g_str_hash, g_str_equal);
+	for (int id = 0; id < SERVER_METHOD_COUNT; id++) {
+		g_hash_table_insert(state.server_method_ids, (gpointer)server_methods[id].name,
+			GINT_TO_POINTER(id));
+	}
+	state.keymaps = g_hash_table_new_full(g_str_hash, g_str_equal,
+			&g_free, (GDestroyNotify)&g_hash_table_unref);
+	state.contexts = g_hash_table_new(g_str_hash, g_str_equal);
+	state.windows = g_ptr_array_new();
+	state.buffers = g_ptr_array_new();
+
+#if GLIB_CHECK_VERSION(2, 64, 0)
+	// The monitor lives as long as the port.
+	g_signal_connect(g_memory_monitor_dup_default(), "low-memory-warning",
+		G_CALLBACK(server_low_memory_warning), NULL);
+#endif
 }
 
 void stop_server() {
-	g_hash_table_unref(state.windows);
-	g_hash_table_unref(state.buffers);
-	g_hash_table_unref(state.server_callbacks);
+	if (state.socket_path != NULL) {
+		g_unlink(state.socket_path);
+	}
+	if (binary_service != NULL) {
+		g_socket_service_stop(binary_service);
+		if (g_str_has_prefix(binary_address, "unix:")) {
+			g_unlink(binary_address + strlen("unix:"));
+		}
+	}
+	// Free what the pending calls hold, e.g. the temporary files of large
+	// results.
+	client_binary_disconnected();
+	for (guint i = 1; i < state.windows->len; i++) {
+		Window *window = handle_table_steal(state.windows, i);
+		if (window != NULL) {
+			window_delete(window);
+		}
+	}
+	for (guint i = 1; i < state.buffers->len; i++) {
+		Buffer *buffer = handle_table_steal(state.buffers, i);
+		if (buffer != NULL) {
+			buffer_delete(buffer);
+		}
+	}
+	g_ptr_array_unref(state.windows);
+	g_ptr_array_unref(state.buffers);
+	g_hash_table_unref(state.server_method_ids);
+	g_hash_table_unref(state.contexts);
+	g_hash_table_unref(state.keymaps);
 }
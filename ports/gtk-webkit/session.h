@@ -0,0 +1,179 @@
+/*
+Copyright © 2019 Atlas Engineer LLC.
+Use of this file is governed by the license that can be found in LICENSE.
+*/
+#pragma once
+
+#include <string.h>
+#include <glib.h>
+#include <webkit2/webkit2.h>
+
+#include "buffer.h"
+#include "server-state.h"
+
+// Sessions: session.save writes the state of every buffer to a binary file, a
+// serialized GVariant of SESSION_FORMAT, and session.load reads it back.  Each
+// entry holds the buffer identifier, its URI, scroll position and the session
+// state of its web view, i.e. the back/forward list and form data.  The Lisp
+// core keeps the layout of the windows and buffers and creates the buffers of
+// the restored session deferred, each with the identifier its entry was saved
+// with, see session_take.  Like hibernated buffers, they only restore their web
+// view once displayed or used.
+
+#define SESSION_MAGIC "next-session"
+#define SESSION_VERSION 1
+// Magic, version, and (buffer id, URI, scroll x, scroll y, session state).
+#define SESSION_FORMAT "(sua(isddday))"
+
+typedef struct {
+	char *uri;
+	gdouble scroll_x;
+	gdouble scroll_y;
+	GBytes *session_state;
+} SessionEntry;
+
+static void session_entry_free(SessionEntry *entry) {
+	g_free(entry->uri);
+	g_bytes_unref(entry->session_state);
+	g_free(entry);
+}
+
+static void session_add_buffer(GVariantBuilder *entries, Buffer *buffer) {
+	const char *uri = buffer->uri;
+	WebKitWebViewSessionState *session_state = NULL;
+	if (buffer->hibernated) {
+		if (buffer->session_state != NULL) {
+			session_state = webkit_web_view_session_state_ref(buffer->session_state);
+		}
+	} else {
+		uri = webkit_web_view_get_uri(buffer->web_view);
+		session_state = webkit_web_view_get_session_state(buffer->web_view);
+	}
+	if (uri == NULL) {
+		uri = "";
+	}
+	// The scroll position of a loaded page is only known with the page events,
+	// see message.h.  Hibernated buffers always know theirs.
+	gboolean scroll_known = buffer->hibernated || buffer->scroll_known;
+
+	GBytes *bytes = session_state != NULL
+		? webkit_web_view_session_state_serialize(session_state)
+		: g_bytes_new(NULL, 0);
+	g_variant_builder_add(entries, "(isdd@ay)", buffer->identifier, uri,
+		scroll_known ? buffer->scroll_x : 0,
+		scroll_known ? buffer->scroll_y : 0,
+		g_variant_new_from_bytes(G_VARIANT_TYPE_BYTESTRING, bytes, TRUE));
+	g_bytes_unref(bytes);
+	if (session_state != NULL) {
+		webkit_web_view_session_state_unref(session_state);
+	}
+}
+
+// Write the state of every buffer to PATH.  Return the number of buffers, or
+// -1 on error.
+gint session_save(const char *path) {
+	GVariantBuilder entries;
+	g_variant_builder_init(&entries, G_VARIANT_TYPE("a(isddday)"));
+	gint count = 0;
+	for (guint i = 1; i < state.buffers->len; i++) {
+		Buffer *buffer = g_ptr_array_index(state.buffers, i);
+		if (buffer != NULL) {
+			session_add_buffer(&entries, buffer);
+			count++;
+		}
+	}
+	GVariant *session = g_variant_ref_sink(g_variant_new(SESSION_FORMAT, SESSION_MAGIC,
+				SESSION_VERSION, &entries));
+
+	GError *error = NULL;
+	char *directory = g_path_get_dirname(path);
+	g_mkdir_with_parents(directory, 0700);
+	g_free(directory);
+	// Written to a temporary file first, so that a crash leaves the previous
+	// session whole.
+	if (!g_file_set_contents(path, g_variant_get_data(session), g_variant_get_size(session),
+		&error)) {
+		g_warning("Cannot save the session to %s: %s", path, error->message);
+		g_error_free(error);
+		count = -1;
+	} else {
+		g_message("Saved %i buffers to %s", count, path);
+	}
+	g_variant_unref(session);
+	return count;
+}
+
+// Read the session of PATH, whose buffers are then created with session_take.
+// Return the number of buffers, or -1 on error.
+gint session_load(const char *path) {
+	GError *error = NULL;
+	GMappedFile *file = g_mapped_file_new(path, FALSE, &error);
+	if (file == NULL) {
+		g_warning("Cannot load the session of %s: %s", path, error->message);
+		g_error_free(error);
+		return -1;
+	}
+	GBytes *bytes = g_mapped_file_get_bytes(file);
+	g_mapped_file_unref(file);
+	// The file may be truncated or corrupted: GVariant accessors never read out
+	// of bounds and return default values for malformed data.
+	GVariant *session = g_variant_ref_sink(g_variant_new_from_bytes(
+				G_VARIANT_TYPE(SESSION_FORMAT), bytes, FALSE));
+	g_bytes_unref(bytes);
+
+	const char *magic = NULL;
+	guint32 version = 0;
+	GVariantIter *iter = NULL;
+	g_variant_get(session, "(&sua(isddday))", &magic, &version, &iter);
+	if (strcmp(magic, SESSION_MAGIC) != 0 || version != SESSION_VERSION) {
+		g_warning("Cannot load the session of %s: unknown format", path);
+		g_variant_iter_free(iter);
+		g_variant_unref(session);
+		return -1;
+	}
+
+	if (state.session_entries == NULL) {
+		state.session_entries = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+				NULL, (GDestroyNotify)&session_entry_free);
+	}
+	gint count = 0;
+	gint buffer_id = 0;
+	const char *uri = NULL;
+	gdouble scroll_x = 0;
+	gdouble scroll_y = 0;
+	GVariant *session_state = NULL;
+	while (g_variant_iter_loop(iter, "(i&sdd@ay)", &buffer_id, &uri, &scroll_x, &scroll_y,
+		&session_state)) {
+		SessionEntry *entry = g_new(SessionEntry, 1);
+		entry->uri = g_strdup(uri);
+		entry->scroll_x = scroll_x;
+		entry->scroll_y = scroll_y;
+		entry->session_state = g_variant_get_data_as_bytes(session_state);
+		g_hash_table_replace(state.session_entries, GINT_TO_POINTER(buffer_id), entry);
+		count++;
+	}
+	g_variant_iter_free(iter);
+	g_variant_unref(session);
+	g_message("Loaded %i buffers from %s", count, path);
+	return count;
+}
+
+// Return a deferred buffer restoring the entry of SESSION_ID in the loaded
+// session, or NULL if there is none.  Each entry is restored once.
+Buffer *session_take(ContextProfile *profile, gint session_id) {
+	SessionEntry *entry = state.session_entries != NULL
+		? g_hash_table_lookup(state.session_entries, GINT_TO_POINTER(session_id))
+		: NULL;
+	if (entry == NULL) {
+		return NULL;
+	}
+	g_hash_table_steal(state.session_entries, GINT_TO_POINTER(session_id));
+	Buffer *buffer = buffer_init_deferred(profile, entry->uri);
+	if (g_bytes_get_size(entry->session_state) > 0) {
+		buffer->session_state = webkit_web_view_session_state_new(entry->session_state);
+	}
+	buffer->scroll_x = entry->scroll_x;
+	buffer->scroll_y = entry->scroll_y;
+	session_entry_free(entry);
+	return buffer;
+}
@@ -0,0 +1,254 @@
+/*
+Copyright © 2018-2019 Atlas Engineer LLC.
+Use of this file is governed by the license that can be found in LICENSE.
+*/
+#pragma once
+
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+
+// Instrumentation of the RPC traffic between the port and the Lisp core.  The
+// server exposes it with the 'server.stats' method and as plain text at
+// GET /metrics, in the Prometheus exposition format.
+
+typedef enum {
+	// Incoming calls: decoding the request, running the callback and encoding
+	// the response.
+	STATS_PARSE,
+	STATS_EXECUTE,
+	STATS_SERIALIZE,
+	// Outgoing calls: from sending the request to receiving the response.
+	STATS_ROUND_TRIP,
+	STATS_PHASE_COUNT,
+} StatsPhase;
+
+static const char *stats_phase_names[STATS_PHASE_COUNT] = {
+	"parse", "execute", "serialize", "round_trip",
+};
+
+// Upper bounds of the histogram buckets in microseconds.  An extra bucket
+// holds everything above the last bound.
+static const gint64 stats_bucket_bounds[] = {
+	10, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 100000, 1000000,
+};
+#define STATS_BUCKET_COUNT (G_N_ELEMENTS(stats_bucket_bounds) + 1)
+
+typedef struct {
+	guint64 count;
+	gint64 sum;
+	guint64 buckets[STATS_BUCKET_COUNT];
+} StatsHistogram;
+
+typedef struct {
+	// Incoming calls for a server method, outgoing calls for a core method.
+	guint64 calls;
+	StatsHistogram phases[STATS_PHASE_COUNT];
+} StatsMethod;
+
+static struct {
+	GHashTable *methods;
+	guint64 bytes_in;
+	guint64 bytes_out;
+	// Outgoing calls waiting for a response from the Lisp core.
+	guint queue_depth;
+	guint queue_depth_max;
+	// Web views taken from the spare ones of a web context, or created on demand.
+	guint64 view_pool_hits;
+	guint64 view_pool_misses;
+	// Policy decisions taken by the rules of the port, or by the core.
+	guint64 policy_port;
+	guint64 policy_core;
+} stats_state;
+
+static StatsMethod *stats_method(const char *method_name) {
+	if (stats_state.methods == NULL) {
+		stats_state.methods = g_hash_table_new_full(g_str_hash, g_str_equal,
+				&g_free, &g_free);
+	}
+	StatsMethod *method = g_hash_table_lookup(stats_state.methods, method_name);
+	if (method == NULL) {
+		method = g_new0(StatsMethod, 1);
+		g_hash_table_insert(stats_state.methods, g_strdup(method_name), method);
+	}
+	return method;
+}
+
+void stats_count_call(const char *method_name) {
+	stats_method(method_name)->calls++;
+}
+
+// Record the time elapsed since START, a g_get_monotonic_time value, for
+// PHASE of METHOD_NAME.
+void stats_record(const char *method_name, StatsPhase phase, gint64 start) {
+	gint64 elapsed = g_get_monotonic_time() - start;
+	StatsHistogram *histogram = &stats_method(method_name)->phases[phase];
+	guint bucket = 0;
+	while (bucket < G_N_ELEMENTS(stats_bucket_bounds)
+	       && elapsed > stats_bucket_bounds[bucket]) {
+		bucket++;
+	}
+	histogram->buckets[bucket]++;
+	histogram->count++;
+	histogram->sum += elapsed;
+}
+
+void stats_bytes_in(gsize count) {
+	stats_state.bytes_in += count;
+}
+
+void stats_bytes_out(gsize count) {
+	stats_state.bytes_out += count;
+}
+
+void stats_queue_push() {
+	stats_state.queue_depth++;
+	stats_state.queue_depth_max = MAX(stats_state.queue_depth_max, stats_state.queue_depth);
+}
+
+void stats_queue_pop() {
+	if (stats_state.queue_depth > 0) {
+		stats_state.queue_depth--;
+	}
+}
+
+void stats_view_pool(gboolean hit) {
+	if (hit) {
+		stats_state.view_pool_hits++;
+	} else {
+		stats_state.view_pool_misses++;
+	}
+}
+
+void stats_policy_decision(gboolean by_rule) {
+	if (by_rule) {
+		stats_state.policy_port++;
+	} else {
+		stats_state.policy_core++;
+	}
+}
+
+static gint stats_compare_strings(gconstpointer a, gconstpointer b) {
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+// Numbers are formatted with g_ascii_formatd: GTK sets the locale, whose
+// decimal separator may not be a dot.
+static void stats_append_histogram(GString *text, const char *method_name,
+	const char *phase, StatsHistogram *histogram) {
+	char number[G_ASCII_DTOSTR_BUF_SIZE];
+	guint64 cumulative = 0;
+	for (guint i = 0; i < STATS_BUCKET_COUNT; i++) {
+		cumulative += histogram->buckets[i];
+		if (i < G_N_ELEMENTS(stats_bucket_bounds)) {
+			g_ascii_formatd(number, sizeof number, "%g", stats_bucket_bounds[i] / 1e6);
+			g_string_append_printf(text,
+				"next_port_rpc_seconds_bucket{method=\"%s\",phase=\"%s\",le=\"%s\"} %"
+				G_GUINT64_FORMAT "\n",
+				method_name, phase, number, cumulative);
+		} else {
+			g_string_append_printf(text,
+				"next_port_rpc_seconds_bucket{method=\"%s\",phase=\"%s\",le=\"+Inf\"} %"
+				G_GUINT64_FORMAT "\n",
+				method_name, phase, cumulative);
+		}
+	}
+	g_ascii_formatd(number, sizeof number, "%g", histogram->sum / 1e6);
+	g_string_append_printf(text,
+		"next_port_rpc_seconds_sum{method=\"%s\",phase=\"%s\"} %s\n",
+		method_name, phase, number);
+	g_string_append_printf(text,
+		"next_port_rpc_seconds_count{method=\"%s\",phase=\"%s\"} %" G_GUINT64_FORMAT "\n",
+		method_name, phase, histogram->count);
+}
+
+// Return the statistics in the Prometheus text format.  Must be freed.
+char *stats_text() {
+	GString *text = g_string_new(NULL);
+	GPtrArray *names = g_ptr_array_new();
+	if (stats_state.methods != NULL) {
+		GHashTableIter iter;
+		gpointer name;
+		g_hash_table_iter_init(&iter, stats_state.methods);
+		while (g_hash_table_iter_next(&iter, &name, NULL)) {
+			g_ptr_array_add(names, name);
+		}
+		g_ptr_array_sort(names, stats_compare_strings);
+	}
+
+	g_string_append(text, "# TYPE next_port_rpc_calls_total counter\n");
+	for (guint i = 0; i < names->len; i++) {
+		const char *name = g_ptr_array_index(names, i);
+		g_string_append_printf(text, "next_port_rpc_calls_total{method=\"%s\"} %"
+			G_GUINT64_FORMAT "\n",
+			name, stats_method(name)->calls);
+	}
+
+	g_string_append(text, "# TYPE next_port_rpc_seconds histogram\n");
+	for (guint i = 0; i < names->len; i++) {
+		const char *name = g_ptr_array_index(names, i);
+		StatsMethod *method = stats_method(name);
+		for (int phase = 0; phase < STATS_PHASE_COUNT; phase++) {
+			if (method->phases[phase].count > 0) {
+				stats_append_histogram(text, name, stats_phase_names[phase],
+					&method->phases[phase]);
+			}
+		}
+	}
+	g_ptr_array_free(names, TRUE);
+
+	g_string_append_printf(text,
+		"# TYPE next_port_rpc_bytes_total counter\n"
+		"next_port_rpc_bytes_total{direction=\"in\"} %" G_GUINT64_FORMAT "\n"
+		"next_port_rpc_bytes_total{direction=\"out\"} %" G_GUINT64_FORMAT "\n"
+		"# TYPE next_port_rpc_queue_depth gauge\n"
+		"next_port_rpc_queue_depth %u\n"
+		"# TYPE next_port_rpc_queue_depth_max gauge\n"
+		"next_port_rpc_queue_depth_max %u\n"
+		"# TYPE next_port_view_pool_total counter\n"
+		"next_port_view_pool_total{result=\"hit\"} %" G_GUINT64_FORMAT "\n"
+		"next_port_view_pool_total{result=\"miss\"} %" G_GUINT64_FORMAT "\n"
+		"# TYPE next_port_policy_decisions_total counter\n"
+		"next_port_policy_decisions_total{by=\"port\"} %" G_GUINT64_FORMAT "\n"
+		"next_port_policy_decisions_total{by=\"core\"} %" G_GUINT64_FORMAT "\n",
+		stats_state.bytes_in,
+		stats_state.bytes_out,
+		stats_state.queue_depth,
+		stats_state.queue_depth_max,
+		stats_state.view_pool_hits,
+		stats_state.view_pool_misses,
+		stats_state.policy_port,
+		stats_state.policy_core);
+	return g_string_free(text, FALSE);
+}
+
+// Return the VmRSS of process PID in kB, or 0 if unknown.
+static guint64 stats_process_rss(const char *pid) {
+	char *path = g_build_filename("/proc", pid, "status", NULL);
+	char *contents = NULL;
+	guint64 rss = 0;
+	if (g_file_get_contents(path, &contents, NULL, NULL)) {
+		const char *line = strstr(contents, "VmRSS:");
+		if (line != NULL) {
+			rss = g_ascii_strtoull(line + strlen("VmRSS:"), NULL, 10);
+		}
+		g_free(contents);
+	}
+	g_free(path);
+	return rss;
+}
+
+// Return the resident memory in kB of the port and of the processes PIDS, an
+// array of pid_t, i.e. the web processes of WebKit that the port knows about.
+// Only implemented on Linux.
+guint64 stats_memory(GArray *pids) {
+	char *pid = g_strdup_printf("%i", getpid());
+	guint64 total = stats_process_rss(pid);
+	g_free(pid);
+	for (guint i = 0; i < pids->len; i++) {
+		pid = g_strdup_printf("%i", g_array_index(pids, pid_t, i));
+		total += stats_process_rss(pid);
+		g_free(pid);
+	}
+	return total;
+}
@@ -0,0 +1,349 @@
+/*
+Copyright © 2019 Atlas Engineer LLC.
+Use of this file is governed by the license that can be found in LICENSE.
+*/
+
+#include <gio/gio.h>
+#include <gmodule.h>
+#include <jsc/jsc.h>
+#include <webkit2/webkit-web-extension.h>
+
+#include "web-extension.h"
+
+// The web extension of the port, loaded by every web process.  It answers the
+// DOM queries of the port natively, see web-extension.h, instead of JavaScript
+// that would serialize its result to JSON on its way to the Lisp core.
+
+static WebKitWebExtension *extension;
+static GDBusConnection *connection;
+// Pages created before the connection to the port was established.
+static GArray *pending_pages;
+
+static const char introspection_xml[] =
+	"<node>"
+	" <interface name='" WEB_EXTENSION_INTERFACE "'>"
+	"  <method name='AddLinkHints'>"
+	"   <arg type='t' name='page_id' direction='in'/>"
+	"   <arg type='a(ssdddd)' name='hints' direction='out'/>"
+	"  </method>"
+	"  <method name='Headings'>"
+	"   <arg type='t' name='page_id' direction='in'/>"
+	"   <arg type='a(us)' name='headings' direction='out'/>"
+	"  </method>"
+	"  <method name='ScrollToHeading'>"
+	"   <arg type='t' name='page_id' direction='in'/>"
+	"   <arg type='u' name='index' direction='in'/>"
+	"   <arg type='b' name='found' direction='out'/>"
+	"  </method>"
+	"  <signal name='PageCreated'>"
+	"   <arg type='t' name='page_id'/>"
+	"  </signal>"
+	"  <signal name='PageDestroyed'>"
+	"   <arg type='t' name='page_id'/>"
+	"  </signal>"
+	" </interface>"
+	"</node>";
+
+// The queries run in a script world of their own, so that the scripts of the
+// page cannot tamper with them, through the JavaScriptCore GLib API: the DOM
+// bindings of WebKitGTK are deprecated.
+static WebKitScriptWorld *world;
+
+#define HEADING_SELECTOR "'h1, h2, h3, h4, h5, h6'"
+
+// The links in the viewport, as [URI, x, y, width, height] in the viewport.
+static const char link_hints_source[] =
+	"(function () {"
+	"  var width = window.innerWidth, height = window.innerHeight, links = [];"
+	"  if (!document.body) {"
+	"    return links;"
+	"  }"
+	"  var anchors = document.querySelectorAll('a[href]');"
+	"  for (var i = 0; i < anchors.length; i++) {"
+	"    var rect = anchors[i].getBoundingClientRect();"
+	"    if (rect.top >= 0 && rect.left >= 0 && rect.bottom <= height && rect.right <= width) {"
+	"      links.push([anchors[i].href, rect.left, rect.top, rect.width, rect.height]);"
+	"    }"
+	"  }"
+	"  return links;"
+	"})()";
+
+// Function of a hint and of the position in the viewport of its link, which
+// adds the hint to the page like add-link-hints in link-hint.lisp.
+static const char add_hint_source[] =
+	"(function (hint, left, top) {"
+	"  var x = window.pageXOffset + Math.floor(left) - 20;"
+	"  var y = window.pageYOffset + Math.floor(top);"
+	"  var element = document.createElement('span');"
+	"  element.className = 'next-link-hint';"
+	"  element.setAttribute('style', 'background: rgba(255, 255, 255, 0.75);'"
+	"    + 'border: 1px solid red; font-weight: bold; position: absolute;'"
+	"    + 'text-align: center; left: ' + (x < 0 ? x + 20 : x) + 'px; top: '"
+	"    + (y < 0 ? y + 20 : y) + 'px;');"
+	"  element.textContent = hint;"
+	"  document.body.appendChild(element);"
+	"})";
+
+// The headings, as [level, text].
+static const char headings_source[] =
+	"Array.prototype.map.call(document.querySelectorAll(" HEADING_SELECTOR "),"
+	"  function (heading) {"
+	"    return [Number(heading.tagName.charAt(1)), heading.innerText || ''];"
+	"  })";
+
+// Function of a heading index that scrolls to it and returns whether it exists.
+static const char scroll_to_heading_source[] =
+	"(function (index) {"
+	"  var headings = document.querySelectorAll(" HEADING_SELECTOR ");"
+	"  if (index >= headings.length) {"
+	"    return false;"
+	"  }"
+	"  headings[index].scrollIntoView(true);"
+	"  return true;"
+	"})";
+
+// Return the hint of number N like link-hint.lisp does: in base 26 with the
+// letters, where AA follows Z.  Result must be freed.
+static char *web_extension_hint_label(gint64 n) {
+	GString *label = g_string_new(NULL);
+	while (n >= 0) {
+		g_string_prepend_c(label, 'A' + n % 26);
+		n = n / 26 - 1;
+	}
+	return g_string_free(label, FALSE);
+}
+
+// Return the value of SOURCE in CONTEXT, or NULL and log the exception.
+static JSCValue *web_extension_evaluate(JSCContext *context, const char *source) {
+	JSCValue *value = jsc_context_evaluate(context, source, -1);
+	JSCException *exception = jsc_context_get_exception(context);
+	if (exception != NULL) {
+		g_warning("DOM query failed: %s", jsc_exception_get_message(exception));
+		jsc_context_clear_exception(context);
+		g_clear_object(&value);
+	}
+	return value;
+}
+
+static guint web_extension_array_length(JSCValue *array) {
+	JSCValue *length = jsc_value_object_get_property(array, "length");
+	guint result = (guint)jsc_value_to_int32(length);
+	g_object_unref(length);
+	return result;
+}
+
+static char *web_extension_array_string(JSCValue *array, guint index) {
+	JSCValue *item = jsc_value_object_get_property_at_index(array, index);
+	char *result = jsc_value_to_string(item);
+	g_object_unref(item);
+	return result;
+}
+
+static gdouble web_extension_array_double(JSCValue *array, guint index) {
+	JSCValue *item = jsc_value_object_get_property_at_index(array, index);
+	gdouble result = jsc_value_to_double(item);
+	g_object_unref(item);
+	return result;
+}
+
+// Add hints next to the links in the viewport, like add-link-hints in
+// link-hint.lisp.
+static GVariant *web_extension_add_link_hints(JSCContext *context) {
+	JSCValue *links = web_extension_evaluate(context, link_hints_source);
+	JSCValue *add_hint = links != NULL
+		? web_extension_evaluate(context, add_hint_source)
+		: NULL;
+	if (add_hint == NULL) {
+		g_clear_object(&links);
+		return NULL;
+	}
+	GVariantBuilder builder;
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a(ssdddd)"));
+	guint length = web_extension_array_length(links);
+
+	// Hints have as many letters as needed for all the links.
+	gint64 power = 26;
+	while (length > power) {
+		power *= 26;
+	}
+	gint64 first = power / 26 + 1;
+	for (guint i = 0; i < length; i++) {
+		JSCValue *link = jsc_value_object_get_property_at_index(links, i);
+		char *href = web_extension_array_string(link, 0);
+		gdouble left = web_extension_array_double(link, 1);
+		gdouble top = web_extension_array_double(link, 2);
+		char *hint = web_extension_hint_label(first + i);
+		JSCValue *result = jsc_value_function_call(add_hint,
+			G_TYPE_STRING, hint, G_TYPE_DOUBLE, left, G_TYPE_DOUBLE, top,
+			G_TYPE_NONE);
+		g_object_unref(result);
+		g_variant_builder_add(&builder, "(ssdddd)", hint, href, left, top,
+			web_extension_array_double(link, 3),
+			web_extension_array_double(link, 4));
+		g_free(hint);
+		g_free(href);
+		g_object_unref(link);
+	}
+	// A hint that could not be added leaves the others valid.
+	jsc_context_clear_exception(context);
+	g_object_unref(add_hint);
+	g_object_unref(links);
+	return g_variant_new("(a(ssdddd))", &builder);
+}
+
+static GVariant *web_extension_headings(JSCContext *context) {
+	JSCValue *headings = web_extension_evaluate(context, headings_source);
+	if (headings == NULL) {
+		return NULL;
+	}
+	GVariantBuilder builder;
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a(us)"));
+	guint length = web_extension_array_length(headings);
+	for (guint i = 0; i < length; i++) {
+		JSCValue *heading = jsc_value_object_get_property_at_index(headings, i);
+		char *text = web_extension_array_string(heading, 1);
+		g_variant_builder_add(&builder, "(us)",
+			(guint32)web_extension_array_double(heading, 0), text);
+		g_free(text);
+		g_object_unref(heading);
+	}
+	g_object_unref(headings);
+	return g_variant_new("(a(us))", &builder);
+}
+
+static GVariant *web_extension_scroll_to_heading(JSCContext *context, guint32 index) {
+	JSCValue *scroll = web_extension_evaluate(context, scroll_to_heading_source);
+	if (scroll == NULL) {
+		return NULL;
+	}
+	JSCValue *found = jsc_value_function_call(scroll, G_TYPE_UINT, index, G_TYPE_NONE);
+	GVariant *result = g_variant_new("(b)", jsc_value_to_boolean(found));
+	g_object_unref(found);
+	g_object_unref(scroll);
+	return result;
+}
+
+static void web_extension_method_call(GDBusConnection *_connection, const char *_sender,
+	const char *_object_path, const char *_interface_name, const char *method_name,
+	GVariant *parameters, GDBusMethodInvocation *invocation, gpointer _data) {
+	if (g_strcmp0(method_name, "AddLinkHints") != 0
+	    && g_strcmp0(method_name, "Headings") != 0
+	    && g_strcmp0(method_name, "ScrollToHeading") != 0) {
+		g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
+			G_DBUS_ERROR_UNKNOWN_METHOD, "Unknown method %s", method_name);
+		return;
+	}
+	guint64 page_id = 0;
+	g_variant_get_child(parameters, 0, "t", &page_id);
+	WebKitWebPage *page = webkit_web_extension_get_page(extension, page_id);
+	if (page == NULL) {
+		g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
+			G_DBUS_ERROR_INVALID_ARGS, "No page %" G_GUINT64_FORMAT, page_id);
+		return;
+	}
+	JSCContext *context = webkit_frame_get_js_context_for_script_world(
+		webkit_web_page_get_main_frame(page), world);
+
+	GVariant *result = NULL;
+	if (g_strcmp0(method_name, "AddLinkHints") == 0) {
+		result = web_extension_add_link_hints(context);
+	} else if (g_strcmp0(method_name, "Headings") == 0) {
+		result = web_extension_headings(context);
+	} else {
+		guint32 index = 0;
+		g_variant_get_child(parameters, 1, "u", &index);
+		result = web_extension_scroll_to_heading(context, index);
+	}
+	g_object_unref(context);
+	if (result == NULL) {
+		// The port lets the Lisp core run its script instead.
+		g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
+			G_DBUS_ERROR_FAILED, "%s failed in page %" G_GUINT64_FORMAT,
+			method_name, page_id);
+		return;
+	}
+	g_dbus_method_invocation_return_value(invocation, result);
+}
+
+static void web_extension_emit(const char *signal_name, guint64 page_id) {
+	GError *error = NULL;
+	if (!g_dbus_connection_emit_signal(connection, NULL, WEB_EXTENSION_OBJECT_PATH,
+			WEB_EXTENSION_INTERFACE, signal_name, g_variant_new("(t)", page_id), &error)) {
+		g_warning("Cannot emit %s: %s", signal_name, error->message);
+		g_error_free(error);
+	}
+}
+
+static void web_extension_page_destroyed(gpointer data, GObject *_page) {
+	guint64 *page_id = data;
+	if (connection != NULL) {
+		web_extension_emit("PageDestroyed", *page_id);
+	} else {
+		for (guint i = 0; i < pending_pages->len; i++) {
+			if (g_array_index(pending_pages, guint64, i) == *page_id) {
+				g_array_remove_index(pending_pages, i);
+				break;
+			}
+		}
+	}
+	g_free(page_id);
+}
+
+static void web_extension_page_created(WebKitWebExtension *_extension, WebKitWebPage *page,
+	gpointer _data) {
+	guint64 *page_id = g_new(guint64, 1);
+	*page_id = webkit_web_page_get_id(page);
+	if (connection != NULL) {
+		web_extension_emit("PageCreated", *page_id);
+	} else {
+		g_array_append_val(pending_pages, *page_id);
+	}
+	g_object_weak_ref(G_OBJECT(page), web_extension_page_destroyed, page_id);
+}
+
+static void web_extension_connected(GObject *_source, GAsyncResult *result, gpointer _data) {
+	GError *error = NULL;
+	GDBusConnection *new_connection = g_dbus_connection_new_for_address_finish(result, &error);
+	if (new_connection == NULL) {
+		g_warning("Cannot connect to the port: %s", error->message);
+		g_error_free(error);
+		return;
+	}
+	static const GDBusInterfaceVTable vtable = {
+		.method_call = web_extension_method_call,
+	};
+	GDBusNodeInfo *info = g_dbus_node_info_new_for_xml(introspection_xml, NULL);
+	if (!g_dbus_connection_register_object(new_connection, WEB_EXTENSION_OBJECT_PATH,
+			info->interfaces[0], &vtable, NULL, NULL, &error)) {
+		g_warning("Cannot register the web extension object: %s", error->message);
+		g_error_free(error);
+		g_dbus_node_info_unref(info);
+		g_object_unref(new_connection);
+		return;
+	}
+	g_dbus_node_info_unref(info);
+
+	connection = new_connection;
+	for (guint i = 0; i < pending_pages->len; i++) {
+		web_extension_emit("PageCreated", g_array_index(pending_pages, guint64, i));
+	}
+	g_array_set_size(pending_pages, 0);
+}
+
+// USER_DATA is the D-Bus address of the port, see dom_context_setup.
+G_MODULE_EXPORT void webkit_web_extension_initialize_with_user_data(
+	WebKitWebExtension *web_extension, const GVariant *user_data) {
+	GVariant *address = (GVariant *)user_data;
+	if (address == NULL || !g_variant_is_of_type(address, G_VARIANT_TYPE_STRING)) {
+		g_warning("No address to connect to the port");
+		return;
+	}
+	extension = web_extension;
+	world = webkit_script_world_new();
+	pending_pages = g_array_new(FALSE, FALSE, sizeof (guint64));
+	g_signal_connect(web_extension, "page-created",
+		G_CALLBACK(web_extension_page_created), NULL);
+	g_dbus_connection_new_for_address(g_variant_get_string(address, NULL),
+		G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT, NULL, NULL,
+		web_extension_connected, NULL);
+}
@@ -0,0 +1,19 @@
+/*
+Copyright © 2019 Atlas Engineer LLC.
+Use of this file is governed by the license that can be found in LICENSE.
+*/
+#pragma once
+
+// D-Bus interface between the port and its web extension, web-extension.c,
+// which runs in the web processes.  The extension connects to the peer-to-peer
+// server of the port, see dom.h, and emits PageCreated and PageDestroyed with
+// the page identifiers it hosts, so that the port knows where to call the
+// methods of a web view.  Every method takes the page identifier first:
+//
+// - AddLinkHints (t) -> a(ssdddd): add hints to the links in the viewport and
+//   return their hint, URI and rectangle (x, y, width, height) in the viewport;
+// - Headings (t) -> a(us): the level and text of the h1 to h6 headings;
+// - ScrollToHeading (tu) -> b: scroll to the heading of that index in Headings.
+
+#define WEB_EXTENSION_OBJECT_PATH "/engineer/atlas/next/WebExtension"
+#define WEB_EXTENSION_INTERFACE "engineer.atlas.next.WebExtension"
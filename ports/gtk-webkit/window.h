@@ -11,6 +11,7 @@ Use of this file is governed by the license that can be found in LICENSE.
 
 #include "buffer.h"
 #include "minibuffer.h"
+#include "keymap.h"
 #include "server-state.h"
 #include "client.h"
 
@@ -59,12 +60,36 @@ static guint key_blacklist[] = {
 	GDK_ISO_Last_Group_Lock,
 };
 
+// Scroll events of a frame coalesced into one, see window_scroll_event.
+typedef struct {
+	guint button;
+	guint state;
+	GdkScrollDirection direction;
+	gdouble x;
+	gdouble y;
+	gdouble delta_x;
+	gdouble delta_y;
+	// Number of events merged so far, 0 if none is pending.
+	guint count;
+	guint tick_id;
+} WindowScroll;
+
 typedef struct {
 	GtkWidget *base;
 	Buffer *buffer;
-	char *identifier;
+	gint identifier;
 	Minibuffer *minibuffer;
 	int minibuffer_height;
+	// Set by the core when the minibuffer takes all the input.
+	gboolean minibuffer_active;
+	// The key sequence typed so far when it is a prefix in the keymap cache.
+	GString *key_sequence;
+	// Input events sent to the Lisp core that it has not finished handling.  The
+	// command of one of them may activate the minibuffer, which the core only
+	// tells afterwards with window.set.minibuffer.active, so no key is forwarded
+	// to GTK locally until then.
+	guint pending_events;
+	WindowScroll scroll;
 } Window;
 
 typedef struct {
@@ -72,9 +97,15 @@ typedef struct {
 	Window *window;
 } WindowEvent;
 
-void window_destroy_callback(GtkWidget *_widget, Window *window) {
-	g_debug("Signal callback to destroy window %s", window->identifier);
-	g_hash_table_remove(state.windows, window->identifier);
+// Return the window displaying BUFFER, or NULL.
+Window *window_of_buffer(Buffer *buffer) {
+	for (guint i = 1; i < state.windows->len; i++) {
+		Window *window = g_ptr_array_index(state.windows, i);
+		if (window != NULL && window->buffer == buffer) {
+			return window;
+		}
+	}
+	return NULL;
 }
 
 void window_delete(Window *window) {
@@ -85,42 +116,41 @@ void window_delete(Window *window) {
 	GList *box_children = gtk_container_get_children(GTK_CONTAINER(mainbox));
 	g_debug("Remove buffer view %p from window", box_children->data);
 	gtk_container_remove(GTK_CONTAINER(mainbox), GTK_WIDGET(box_children->data));
+	if (window->buffer != NULL) {
+		// The window is no longer in state.windows.
+		window->buffer->displayed = window_of_buffer(window->buffer) != NULL;
+	}
+
+	if (window->scroll.tick_id != 0) {
+		gtk_widget_remove_tick_callback(window->base, window->scroll.tick_id);
+		window->scroll.tick_id = 0;
+	}
 
 	{
 		// Notify the Lisp core.
-		GError *error = NULL;
 		const char *method_name = "window.will.close";
-		GVariant *window_id = g_variant_new("(s)", window->identifier);
+		GVariant *window_id = g_variant_new("(i)", window->identifier);
 		g_message("XML-RPC message: %s %s", method_name, g_variant_print(window_id, TRUE));
 
-		SoupMessage *msg = soup_xmlrpc_message_new(state.core_socket,
-				method_name, window_id, &error);
-
-		if (error) {
-			g_warning("Malformed XML-RPC message: %s", error->message);
-			g_error_free(error);
-			// If the XML-RPC request fails, we should still close the window on the GTK
-			// side.
-		} else {
-			// Send synchronously so that if this is the last window, we don't quit
-			// GTK before actually sending the message.
-			soup_session_send_message(xmlrpc_env, msg);
-			// 'msg' is freed automatically.
-		}
+		// Send synchronously so that if this is the last window, we don't quit
+		// GTK before actually sending the message.
+		// If the XML-RPC request fails, we should still close the window on the GTK
+		// side.
+		client_call_sync(method_name, window_id);
 	}
 
 	if (window->base != NULL && !gtk_widget_in_destruction(window->base)) {
 		// If window was destroyed externally, then this is already done.
-		g_debug("Destroy window widget %s", window->identifier);
+		g_debug("Destroy window widget %i", window->identifier);
 		gtk_widget_destroy(window->base);
 	}
 
 	minibuffer_delete(window->minibuffer);
 
-	g_free(window->identifier);
+	g_string_free(window->key_sequence, TRUE);
 	g_free(window);
 
-	if (g_hash_table_size(state.windows) >= 1) {
+	if (handle_table_count(state.windows) >= 1) {
 		return;
 	}
 
@@ -131,6 +161,13 @@ void window_delete(Window *window) {
 	gtk_main_quit();
 }
 
+void window_destroy_callback(GtkWidget *_widget, Window *window) {
+	g_debug("Signal callback to destroy window %i", window->identifier);
+	if (handle_table_steal(state.windows, window->identifier) != NULL) {
+		window_delete(window);
+	}
+}
+
 void window_generate_input_event(WindowEvent *window_event) {
 	// We need to generate key press events programmatically from the call back
 	// when the key press was not consumed.  The original event might have been
@@ -215,22 +252,15 @@ void window_generate_input_event(WindowEvent *window_event) {
 	g_free(window_event);
 }
 
-void window_consume_event(SoupSession *_session, SoupMessage *msg, gpointer window_data) {
-	GError *error = NULL;
-	g_debug("Window event XML-RPC response: %s", msg->response_body->data);
-
+void window_consume_event(GVariant *consumed, gpointer window_data) {
+	WindowEvent *window_event = (WindowEvent *)window_data;
 	// TODO: Ideally we should receive a boolean.  See on Lisp side.
-	GVariant *consumed = soup_xmlrpc_parse_response(msg->response_body->data,
-			msg->response_body->length, "i", &error);
-
-	if (error) {
-		g_warning("%s: '%s'", error->message,
-			strndup(msg->response_body->data, msg->response_body->length));
-		g_error_free(error);
+	if (consumed == NULL || !g_variant_is_of_type(consumed, G_VARIANT_TYPE_INT32)) {
+		g_warning("Malformed window event response");
+		g_free(window_event);
 		return;
 	}
 
-	WindowEvent *window_event = (WindowEvent *)window_data;
 	if (!g_variant_get_int32(consumed)) {
 		window_generate_input_event(window_event);
 		return;
@@ -238,25 +268,75 @@ void window_consume_event(SoupSession *_session, SoupMessage *msg, gpointer wind
 
 	Window *window = window_event->window;
 	const char *method_name = "consume.key.sequence";
-	GVariant *id = g_variant_new("(s)",
+	GVariant *id = g_variant_new("(i)",
 			window->identifier);
-	g_message("XML-RPC message: %s, window id %s", method_name, window->identifier);
-	msg = soup_xmlrpc_message_new(state.core_socket,
-			method_name, id, &error);
+	g_message("XML-RPC message: %s, window id %i", method_name, window->identifier);
 	// TODO: There is a possible race condition here: if two keys are pressed very
 	// fast before the first CONSUME-KEY-SEQUENCE is received by the Lisp core,
 	// then when the first CONSUME-KEY-SEQUENCE is received, *key-chord-stack*
 	// will contain the two keys.  The second CONSUME-KEY-SEQUENCE will have an
 	// empty *key-chord-stack*.  In practice, those key presses would have to be
 	// programmatically generated at the system level, so it's mostly a non-issue.
-	soup_session_queue_message(xmlrpc_env, msg, NULL, NULL);
+	client_call(method_name, id, NULL, NULL);
 }
 
-gboolean window_send_event(gpointer window_data,
-	gchar *event_string, guint modifiers,
+// Return TRUE if the chord is bound in none of the keymaps that are active in
+// WINDOW, in which case the event can be forwarded to GTK without asking the
+// Lisp core.  Keep track of the prefix sequences typed so far.
+gboolean window_event_is_unbound(Window *window,
+	const gchar *event_string, guint modifiers, gboolean released) {
+	if (window->minibuffer_active || window->buffer == NULL
+		|| !keymap_cache_covers(window->buffer->keymap)) {
+		g_string_truncate(window->key_sequence, 0);
+		return FALSE;
+	}
+
+	const char *modifier_list[(sizeof modifier_names)/(sizeof modifier_names[0]) + 2];
+	int count = 0;
+	for (int i = 0; i < (sizeof modifier_names)/(sizeof modifier_names[0]); i++) {
+		if (modifiers & modifier_names[i].mod) {
+			modifier_list[count++] = modifier_names[i].name;
+		}
+	}
+	if (released) {
+		modifier_list[count++] = "R";
+	}
+	modifier_list[count] = NULL;
+	char *chord = keymap_chord_string(event_string, modifier_list);
+
+	gboolean in_prefix = window->key_sequence->len > 0;
+	if (in_prefix) {
+		g_string_append_c(window->key_sequence, ' ');
+	}
+	g_string_append(window->key_sequence, chord);
+	KeymapBinding binding = keymap_lookup(window->buffer->keymap, window->key_sequence->str);
+	g_debug("Key sequence '%s' binding: %i", window->key_sequence->str, binding);
+	g_free(chord);
+
+	if (binding != KEYMAP_PREFIX) {
+		g_string_truncate(window->key_sequence, 0);
+	}
+	// An unbound key ending a prefix must still go to the core so that it can
+	// reset its key stack.
+	return binding == KEYMAP_UNBOUND && !in_prefix && window->pending_events == 0;
+}
+
+static void window_event_handled(GVariant *_result, gpointer window_id) {
+	Window *window = handle_table_lookup(state.windows, GPOINTER_TO_INT(window_id));
+	if (window != NULL && window->pending_events > 0) {
+		window->pending_events--;
+	}
+}
+
+// Send the input event to the Lisp core.  SCROLL is non-NULL for coalesced
+// scroll events, in which case the accumulated delta and the number of events
+// are sent too.
+void window_push_event(Window *window,
+	const gchar *event_string, guint modifiers,
 	guint16 hardware_keycode, guint keyval,
 	gdouble x, gdouble y,
-	gboolean released) {
+	gboolean released,
+	const WindowScroll *scroll) {
 	GVariantBuilder builder;
 	g_variant_builder_init(&builder, G_VARIANT_TYPE("as"));
 	for (int i = 0; i < (sizeof modifier_names)/(sizeof modifier_names[0]); i++) {
@@ -268,28 +348,34 @@ gboolean window_send_event(gpointer window_data,
 		g_variant_builder_add(&builder, "s", "R");
 	}
 
-	GError *error = NULL;
 	const char *method_name = "push.input.event";
-	Window *window = window_data;
-	GVariant *key_chord = g_variant_new("(isasddis)",
-			hardware_keycode,
-			event_string,
-			&builder,
-			x, y,
-			keyval,
-			window->identifier);
-	g_message("XML-RPC message: %s %s = %s",
-		method_name,
-		"(keycode, keystring, modifiers, x, y, low level data, window id)",
-		g_variant_print(key_chord, TRUE));
-
-	SoupMessage *msg = soup_xmlrpc_message_new(state.core_socket,
-			method_name, key_chord, &error);
-
-	if (error) {
-		g_warning("Malformed XML-RPC message: %s", error->message);
-		g_error_free(error);
-		return TRUE;
+	GVariant *key_chord = NULL;
+	if (scroll == NULL) {
+		key_chord = g_variant_new("(isasddii)",
+				hardware_keycode,
+				event_string,
+				&builder,
+				x, y,
+				keyval,
+				window->identifier);
+		g_message("XML-RPC message: %s %s = %s",
+			method_name,
+			"(keycode, keystring, modifiers, x, y, low level data, window id)",
+			g_variant_print(key_chord, TRUE));
+	} else {
+		key_chord = g_variant_new("(isasddiiddi)",
+				hardware_keycode,
+				event_string,
+				&builder,
+				x, y,
+				keyval,
+				window->identifier,
+				scroll->delta_x, scroll->delta_y,
+				scroll->count);
+		g_message("XML-RPC message: %s %s = %s",
+			method_name,
+			"(keycode, keystring, modifiers, x, y, low level data, window id, delta x, delta y, count)",
+			g_variant_print(key_chord, TRUE));
 	}
 
 	// If using the callback strategy to forward input events to GTK, uncomment the following.
@@ -299,12 +385,63 @@ gboolean window_send_event(gpointer window_data,
 	window_event->event = *event; // Copy the event to keep access to it in case it's freed later.
 	window_event->event.string = g_strdup(event->string);
 
-	soup_session_queue_message(xmlrpc_env, msg, (SoupSessionCallback)window_consume_event,
-	        window_event);
+	client_call(method_name, key_chord, window_consume_event, window_event);
 	*/
 
 	// Other strategy: Leave input event generation to the Lisp.
-	soup_session_queue_message(xmlrpc_env, msg, NULL, NULL);
+	window->pending_events++;
+	client_call(method_name, key_chord, window_event_handled,
+		GINT_TO_POINTER(window->identifier));
+}
+
+// Send the pending coalesced scroll event of WINDOW, if any.
+void window_flush_scroll(Window *window) {
+	WindowScroll *scroll = &window->scroll;
+	if (scroll->count == 0) {
+		return;
+	}
+	g_debug("Flush %u scroll event(s), delta (%g, %g)",
+		scroll->count, scroll->delta_x, scroll->delta_y);
+	gchar *event_string = g_strdup_printf("button%d", scroll->button);
+	// When several events are merged, they are replayed as a single smooth
+	// scroll of the accumulated delta.
+	GdkScrollDirection direction = scroll->count == 1
+		? scroll->direction : GDK_SCROLL_SMOOTH;
+	window_push_event(window,
+		event_string, scroll->state,
+		direction, scroll->button,
+		scroll->x, scroll->y,
+		false,
+		scroll);
+	g_free(event_string);
+	scroll->count = 0;
+}
+
+static gboolean window_scroll_tick(GtkWidget *_widget, GdkFrameClock *_frame_clock,
+	gpointer window_data) {
+	Window *window = window_data;
+	window->scroll.tick_id = 0;
+	window_flush_scroll(window);
+	return G_SOURCE_REMOVE;
+}
+
+gboolean window_send_event(gpointer window_data,
+	gchar *event_string, guint modifiers,
+	guint16 hardware_keycode, guint keyval,
+	gdouble x, gdouble y,
+	gboolean released) {
+	if (window_event_is_unbound(window_data, event_string, modifiers, released)) {
+		g_debug("Forward unbound '%s' to GTK", event_string);
+		return FALSE;
+	}
+	// Keep the order of the events.
+	window_flush_scroll(window_data);
+	window_push_event(window_data,
+		event_string, modifiers,
+		hardware_keycode, keyval,
+		x, y,
+		released,
+		NULL);
 	return TRUE;
 }
 
@@ -407,17 +544,7 @@ gboolean window_button_event(GtkWidget *_widget, GdkEventButton *event, gpointer
 	}
 
 	Buffer *buffer = buffer_data;
-	Window *window = NULL;
-	GHashTableIter iter;
-	gpointer key, value;
-	g_hash_table_iter_init(&iter, state.windows);
-	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		Window *w = (Window *)value;
-		if (w->buffer == buffer) {
-			window = w;
-			break;
-		}
-	}
+	Window *window = window_of_buffer(buffer);
 
 	gchar *event_string = g_strdup_printf("button%d", event->button);
 	return window_send_event(window,
@@ -445,17 +572,7 @@ gboolean window_scroll_event(GtkWidget *_widget, GdkEventScroll *event, gpointer
 	}
 
 	Buffer *buffer = buffer_data;
-	Window *window = NULL;
-	GHashTableIter iter;
-	gpointer key, value;
-	g_hash_table_iter_init(&iter, state.windows);
-	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		Window *w = (Window *)value;
-		if (w->buffer == buffer) {
-			window = w;
-			break;
-		}
-	}
+	Window *window = window_of_buffer(buffer);
 
 	guint button = 0;
 	switch (event->direction) {
@@ -485,12 +602,64 @@ gboolean window_scroll_event(GtkWidget *_widget, GdkEventScroll *event, gpointer
 	}
 	}
 
+	if (window == NULL) {
+		return FALSE;
+	}
+
 	gchar *event_string = g_strdup_printf("button%d", button);
-	return window_send_event(window,
-		       event_string, event->state,
-		       event->direction, button,
-		       event->x, event->y,
-		       false);
+	gboolean unbound = window_event_is_unbound(window, event_string, event->state, false);
+	g_free(event_string);
+	if (unbound) {
+		g_debug("Forward unbound scroll to GTK");
+		return FALSE;
+	}
+
+	// Trackpads emit many events per frame: merge consecutive events of the same
+	// kind until the next frame so that the core receives at most one per frame.
+	gdouble delta_x = event->delta_x;
+	gdouble delta_y = event->delta_y;
+	switch (event->direction) {
+	case GDK_SCROLL_UP:
+		delta_x = 0;
+		delta_y = -1;
+		break;
+	case GDK_SCROLL_DOWN:
+		delta_x = 0;
+		delta_y = 1;
+		break;
+	case GDK_SCROLL_LEFT:
+		delta_x = -1;
+		delta_y = 0;
+		break;
+	case GDK_SCROLL_RIGHT:
+		delta_x = 1;
+		delta_y = 0;
+		break;
+	case GDK_SCROLL_SMOOTH:
+		break;
+	}
+
+	WindowScroll *scroll = &window->scroll;
+	if (scroll->count > 0 && (scroll->button != button || scroll->state != event->state)) {
+		window_flush_scroll(window);
+	}
+	if (scroll->count == 0) {
+		scroll->button = button;
+		scroll->state = event->state;
+		scroll->direction = event->direction;
+		scroll->delta_x = 0;
+		scroll->delta_y = 0;
+	}
+	scroll->x = event->x;
+	scroll->y = event->y;
+	scroll->delta_x += delta_x;
+	scroll->delta_y += delta_y;
+	scroll->count++;
+	if (scroll->tick_id == 0) {
+		scroll->tick_id = gtk_widget_add_tick_callback(window->base,
+				window_scroll_tick, window, NULL);
+	}
+	return TRUE;
 }
 
 Window *window_init() {
@@ -525,6 +694,7 @@ Window *window_init() {
 	gtk_widget_show_all(window->base);
 
 	window->minibuffer = minibuffer;
+	window->key_sequence = g_string_new(NULL);
 	return window;
 }
 
@@ -539,14 +709,22 @@ void window_set_active_buffer(Window *window, Buffer *buffer) {
 	}
 
 	// When window is first set up, there is only a minibuffer.
-	char *previous_buffer_id = NULL;
-	if (window->buffer != NULL) {
-		previous_buffer_id = window->buffer->identifier;
+	Buffer *previous_buffer = window->buffer;
+	gint previous_buffer_id = 0;
+	if (previous_buffer != NULL) {
+		previous_buffer_id = previous_buffer->identifier;
 	}
-	g_message("Window %s switches from buffer %s to %s",
+	g_message("Window %i switches from buffer %i to %i",
 		window->identifier, previous_buffer_id, buffer->identifier);
 
 	window->buffer = buffer;
+	if (previous_buffer != NULL) {
+		previous_buffer->displayed = window_of_buffer(previous_buffer) != NULL;
+	}
+	// A displayed buffer goes ahead of the load queue, and is restored if it
+	// was hibernated.
+	buffer->displayed = TRUE;
+	buffer_schedule_load(buffer, NULL);
 
 	GList *children = gtk_container_get_children(GTK_CONTAINER(window->base));
 	GtkWidget *mainbox = GTK_WIDGET(children->data);
@@ -566,7 +744,7 @@ void window_set_active_buffer(Window *window, Buffer *buffer) {
 }
 
 gint64 window_set_minibuffer_height(Window *window, gint64 height) {
-	g_message("Window %s resizes its minibuffer to %li", window->identifier, height);
+	g_message("Window %i resizes its minibuffer to %li", window->identifier, height);
 	if (height == 0) {
 		gtk_widget_hide(GTK_WIDGET(window->minibuffer->web_view));
 		return 0;
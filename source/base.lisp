@@ -39,8 +39,161 @@ Set to '-' to read standard input instead."))
                       :separator "
 ")))
 
+(defvar *server-benchmark-call-count* 500
+  "Number of round trips performed by `server-benchmark'.")
+
+(define-command server-benchmark ()
+  "Measure the per-call latency of the link to the platform port.
+Run it once with the TCP transport and once with CORE-SOCKET-PATH and
+PLATFORM-PORT-SOCKET-PATH set to compare them, and likewise with the PROTOCOL
+slot of the interface set to :binary and :xml-rpc, or PERSISTENT-CONNECTION-P
+set to t and nil."
+  (let ((start (get-internal-real-time)))
+    (dotimes (i *server-benchmark-call-count*)
+      (%xml-rpc-send *interface* "window.active"))
+    (let ((milliseconds (/ (* 1000.0 (- (get-internal-real-time) start))
+                           internal-time-units-per-second)))
+      (echo (minibuffer *interface*)
+            (format nil "~a calls over ~a~a: ~,3f ms per call, ~,1f calls/sec."
+                    *server-benchmark-call-count*
+                    (cond
+                      ((binary-connection *interface*) "the binary protocol")
+                      ((platform-port-socket-path *interface*) "Unix domain socket")
+                      (t "TCP"))
+                    (if (and (not (binary-connection *interface*))
+                             (persistent-connection-p *interface*))
+                        " (keep-alive)"
+                        "")
+                    (/ milliseconds *server-benchmark-call-count*)
+                    (/ *server-benchmark-call-count* (max (/ milliseconds 1000) 0.001)))))))
+
+(define-command server-stats ()
+  "Show the RPC statistics of the platform port in a help buffer: call counts,
+latency histograms per method, bytes exchanged and the depth of the queue of
+calls to the Lisp core.  The port serves the same text at GET /metrics."
+  (if (platform-port-supports-p *interface* "server.stats")
+      (let* ((stats (%xml-rpc-send *interface* "server.stats"))
+             (stats-buffer (make-buffer "SERVER-STATS" (help-mode)))
+             (contents (cl-markup:markup
+                        (:h1 "Platform port statistics")
+                        (:pre stats)))
+             (insert-contents (ps:ps (setf (ps:@ document Body |innerHTML|)
+                                           (ps:lisp contents)))))
+        (buffer-evaluate-javascript *interface* stats-buffer insert-contents)
+        (set-active-buffer *interface* stats-buffer))
+      (echo (minibuffer *interface*)
+            "The platform port does not report statistics.")))
+
+(defvar *buffer-memory-benchmark-counts* '(10 50 200)
+  "Numbers of buffers opened by `buffer-memory-benchmark'.")
+
+(define-command buffer-memory-benchmark ()
+  "Measure the resident memory of the platform port, WebKit processes included,
+after opening each number of buffers of `*buffer-memory-benchmark-counts*' on
+about:blank.  The buffers share the default profile.  Run it a second time with
+the port started with --isolated-contexts to compare with a web context per
+buffer."
+  (if (not (platform-port-supports-p *interface* "server.memory"))
+      (echo (minibuffer *interface*)
+            "The platform port does not report its memory usage.")
+      ;; Leave the calls of the platform port to their thread while sleeping.
+      (bt:make-thread
+       (lambda ()
+         (let ((baseline (%xml-rpc-send *interface* "server.memory"))
+               (results '()))
+           (dolist (count *buffer-memory-benchmark-counts*)
+             (let ((buffers (loop repeat count collect (make-buffer))))
+               (dolist (buffer buffers)
+                 (buffer-load *interface* buffer "about:blank"))
+               ;; Let WebKit spawn and settle its processes.
+               (sleep 5)
+               (push (cons count (- (%xml-rpc-send *interface* "server.memory") baseline))
+                     results)
+               (dolist (buffer buffers)
+                 (buffer-delete *interface* buffer))))
+           (echo (minibuffer *interface*)
+                 (format nil "Extra memory: ~{~{~a buffers: ~,1f MiB~}~^, ~}."
+                         (mapcar (lambda (result)
+                                   (list (car result) (/ (cdr result) 1024.0)))
+                                 (nreverse results))))))
+       :name "buffer memory benchmark")))
+
+(defvar *repeat-visit-benchmark-urls* '("https://next.atlas.engineer"
+                                         "https://en.wikipedia.org/wiki/Web_browser")
+  "URLs loaded by `repeat-visit-benchmark'.")
+
+(defvar *repeat-visit-benchmark-count* 5
+  "Number of times `repeat-visit-benchmark' loads each URL.")
+
+(defun benchmark-visit (url)
+  "Load URL in a new buffer with the default profile and return the time in
+milliseconds until the navigation finishes, or nil if it does not finish within
+30 seconds."
+  ;; A deferred buffer only loads URL once woken up, so that its first finished
+  ;; navigation is the one we measure.
+  (let* ((buffer (%buffer-make *interface* "benchmark" nil url))
+         (future (buffer-navigation-future buffer))
+         (start (get-internal-real-time)))
+    (buffer-wake *interface* buffer)
+    (unwind-protect
+         (handler-case (progn
+                         (future-wait future :timeout 30)
+                         (/ (* 1000.0 (- (get-internal-real-time) start))
+                            internal-time-units-per-second))
+           (call-timeout () nil))
+      (buffer-delete *interface* buffer))))
+
+(define-command repeat-visit-benchmark ()
+  "Measure the load time of each URL of `*repeat-visit-benchmark-urls*' on the
+first visit and on the following ones, which hit the memory and disk caches of
+the platform port.  Compare runs with different `cache-model' and
+`cache-directory' settings of the buffers.  Clear the cache beforehand for a
+meaningful first visit."
+  (if (not (platform-port-supports-p *interface* "buffer.wake"))
+      (echo (minibuffer *interface*)
+            "The platform port does not support deferred buffers.")
+      (flet ((milliseconds (time)
+               (if time (format nil "~,1f ms" time) "timeout")))
+        ;; The finished navigations are calls of the platform port, which run
+        ;; one after the other: do not wait for them in one of those calls.
+        (bt:make-thread
+         (lambda ()
+           (echo (minibuffer *interface*)
+                 (format nil "~{~a~^; ~}."
+                         (mapcar (lambda (url)
+                                   (let* ((times (loop repeat *repeat-visit-benchmark-count*
+                                                       collect (benchmark-visit url)))
+                                          (repeats (remove nil (rest times))))
+                                     (format nil "~a: first ~a, then ~a on average"
+                                             url
+                                             (milliseconds (first times))
+                                             (milliseconds
+                                              (when repeats
+                                                (/ (reduce #'+ repeats) (length repeats)))))))
+                                 *repeat-visit-benchmark-urls*))))
+         :name "repeat visit benchmark"))))
+
+(define-command refresh-content-filters ()
+  "Compile the content filters again from their files, see `content-filters'."
+  (load-content-filters *interface* :refresh t)
+  (echo (minibuffer *interface*)
+        (format nil "Refreshing ~a content filter(s)."
+                (length (content-filters *interface*)))))
+
+(define-command show-content-filters ()
+  "Echo the identifiers of the content filters in use."
+  (let ((identifiers (list-content-filters *interface*)))
+    (echo (minibuffer *interface*)
+          (if identifiers
+              (format nil "Content filters: ~{~a~^, ~}." identifiers)
+              "No content filters."))))
+
 (define-command kill ()
-  "Quit Next."
+  "Quit Next.  The session is saved first if `restore-session-p' is non-nil."
+  (when (restore-session-p *interface*)
+    (handler-case (session-save *interface*)
+      (error (c)
+        (log:warn "Cannot save the session: ~a" c))))
   (kill-interface *interface*)
   (kill-program (port *interface*)))
 
@@ -74,22 +227,34 @@ Set to '-' to read standard input instead."))
     (loop while (not port-running)
           repeat max-attemps do
       (handler-case
-          (progn
-            (when (list-methods interface)
-              (setf port-running t)))
+          (let ((methods (list-methods interface)))
+            (when methods
+              (setf port-running t
+                    (platform-port-methods interface) methods)
+              (negotiate-protocol interface methods)
+              (push-navigation-rules interface)
+              (load-content-filters interface)
+              (push-download-directory interface)
+              (push-scripts interface)
+              (push-page-events interface)
+              (start-hibernation-thread interface)))
         (error (c)
           (log:debug "Could not communicate with port: ~a" c)
           (log:info "Polling platform port '~a'...~%" (platform-port-socket interface))
           (sleep (platform-port-poll-interval interface))
           (setf port-running nil))))
     (when port-running
+      (with-batched-calls (interface)
+        ;; URLs on the command line replace the saved session.
+        (unless (and (null *free-args*)
+                     (restore-session-p interface)
+                     (session-restore interface))
           ;; TODO: MAKE-WINDOW should probably take INTERFACE as argument.
-      (let ((buffer (nth-value 1 (make-window))))
-        (set-url-buffer (if *free-args* (car *free-args*) (start-page-url interface)) buffer)
-        ;; We can have many URLs as positional arguments.
-        (loop for url in (cdr *free-args*) do
-          (let ((buffer (make-buffer)))
-            (set-url-buffer url buffer)))))))
+          (let ((buffer (nth-value 1 (make-window))))
+            (set-url-buffer (if *free-args* (car *free-args*) (start-page-url interface)) buffer)
+            ;; We can have many URLs as positional arguments.
+            (loop for url in (cdr *free-args*) do
+              (make-deferred-buffer url))))))))
 
 (defvar *init-file-path* (xdg-config-home "init.lisp")
   "The path where the system will look to load an init file from.")
@@ -10,6 +10,18 @@
   "Create a new buffer."
   (%buffer-make *interface* name mode))
 
+(defun make-deferred-buffer (input-url)
+  "Create a buffer for INPUT-URL and return it.  If the platform port supports
+it, the URL is only loaded once the buffer is displayed or used, so that opening
+many buffers in the background is cheap."
+  (if (platform-port-supports-p *interface* "buffer.wake")
+      (let ((url (parse-url input-url)))
+        (history-typed-add input-url)
+        (%buffer-make *interface* "default" nil url))
+      (let ((buffer (make-buffer)))
+        (set-url-buffer input-url buffer)
+        buffer)))
+
 (defun buffer-completion-fn ()
   (let ((buffers (alexandria:hash-table-values (buffers *interface*))))
     (lambda (input)
@@ -57,12 +69,21 @@ buffer to the start page."
     (setf (name buffer) url)
     (unless disable-history
       (history-typed-add input-url))
-    (if (cl-strings:starts-with url "file://")
+    ;; Platform ports with a load queue schedule the loads of buffer.load, which
+    ;; matters when many buffers load at once.
+    (if (or (cl-strings:starts-with url "file://")
+            (platform-port-supports-p *interface* "buffer.load.queue.position"))
         (buffer-load *interface* buffer url)
         (buffer-evaluate-javascript *interface*
                                     buffer
                                     (buffer-set-url url)))))
 
+(defun prefetch-url (input-url)
+  "Prepare the network for a navigation to INPUT-URL, e.g. the selected
+completion of a URL prompt."
+  (buffer-prefetch *interface* (active-buffer *interface*)
+                   (list (parse-url input-url))))
+
 (defun set-url (input-url &optional disable-history)
   (let ((url (parse-url input-url)))
     (set-url-buffer url (active-buffer *interface*) disable-history)))
@@ -73,6 +94,7 @@ buffer to the start page."
                      (minibuffer *interface*)
                      :input-prompt "Open URL in buffer:"
                      :completion-function 'history-typed-complete
+                     :selection-function 'prefetch-url
                      :empty-complete-immediate t))
     (set-url url)))
 
@@ -88,6 +110,7 @@ buffer"
                      (minibuffer *interface*)
                      :input-prompt "Open URL in new buffer:"
                      :completion-function 'history-typed-complete
+                     :selection-function 'prefetch-url
                      :empty-complete-immediate t))
     (let ((buffer (make-buffer)))
       (set-url-buffer url buffer)
@@ -125,7 +148,8 @@ item in the list, jump to the first item."
 (defmethod switch-mode ((buffer buffer) mode)
   (let ((found-mode (gethash (class-name (class-of mode)) (modes buffer))))
     (when found-mode
-      (setf (mode buffer) found-mode))))
+      (setf (mode buffer) found-mode)
+      (sync-keymaps *interface*))))
 
 (defmethod add-or-switch-to-mode ((buffer buffer) mode)
   (add-mode buffer mode)
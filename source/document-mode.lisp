@@ -103,12 +103,15 @@
       (setf (active-history-node mode) new-node)
       (return-from add-or-traverse-history t))))
 
+(defun default-window-title (title url)
+  (concatenate 'string "Next - " title " - " url))
+
 (define-command set-default-window-title ()
   "Set current window title to 'Next - TITLE - URL."
   (with-result* ((url (buffer-get-url))
                  (title (buffer-get-title)))
     (window-set-title *interface* (window-active *interface*)
-                      (concatenate 'string "Next - " title " - " url))))
+                      (default-window-title title url))))
 
 (define-command copy-url ()
   "Save current URL to clipboard."
@@ -121,15 +124,34 @@
     (trivial-clipboard:text title)))
 
 (defmethod did-commit-navigation ((mode document-mode) url)
-  (set-default-window-title)
+  ;; Otherwise the title comes with the "dom-ready" page event, without asking
+  ;; the page.
+  (unless (page-event-p *interface* "dom-ready")
+    (set-default-window-title))
   (add-or-traverse-history mode url)
   (echo (minibuffer *interface*) (concatenate 'string "Loading: " url ".")))
 
 (defmethod did-finish-navigation ((mode document-mode) url)
+  ;; The zoom is set on the document, which the navigation replaced, e.g. when a
+  ;; restored buffer loads, see `session-restore'.
+  (let ((buffer (buffer mode)))
+    (unless (= (current-zoom-ratio buffer) (zoom-ratio-default buffer))
+      (buffer-evaluate-javascript *interface* buffer
+                                  (%set-page-zoom (current-zoom-ratio buffer)))))
   (echo (minibuffer *interface*) (concatenate 'string "Finished loading: " url "."))
   ;; TODO: Wait some time before dismissing the minibuffer.
   (echo-dismiss (minibuffer *interface*)))
 
+(defmethod did-receive-message ((mode document-mode) type message)
+  (when (and (string= type "dom-ready")
+             (eq (buffer mode) (active-buffer *interface*)))
+    (window-set-title *interface* (window-active *interface*)
+                      (default-window-title (cdr (assoc :title message))
+                                            (cdr (assoc :url message)))))
+  message)
+
 (defmethod setup ((mode document-mode) (buffer buffer))
-  (set-url-buffer (default-new-buffer-url buffer) buffer)
+  ;; Deferred buffers already have their URL, see `make-deferred-buffer'.
+  (unless (hibernated-p buffer)
+    (set-url-buffer (default-new-buffer-url buffer) buffer))
   (call-next-method))
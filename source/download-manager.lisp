@@ -0,0 +1,232 @@
+;;; download-manager.lisp --- download files with the platform port
+
+(in-package :next)
+
+;; The platform port downloads and reports the progress, see
+;; ports/gtk-webkit/download.h.  The core keeps the list of downloads and lets
+;; at most `max-downloads' of them run at once; the others wait until a
+;; download finishes.
+
+(defclass download ()
+  ((id :accessor id :initarg :id :initform nil
+       :documentation "The identifier of the download in the platform port, nil
+until it is started.")
+   (url :accessor url :initarg :url)
+   (download-buffer :accessor download-buffer :initarg :buffer :initform nil
+                    :documentation "The buffer in the web context of which the
+download is started.")
+   (status :accessor status :initarg :status :initform :queued
+           :documentation "One of :queued, :starting (requested from the
+platform port, which has not reported it yet), :active, :finished, :failed or
+:cancelled.")
+   (destination :accessor destination :initform nil
+                :documentation "The path of the downloaded file, once known.")
+   (bytes-received :accessor bytes-received :initform 0)
+   (bytes-total :accessor bytes-total :initform 0
+                :documentation "The size of the file, or 0 if unknown.")
+   (error-message :accessor error-message :initform nil)
+   (start-time :accessor start-time :initarg :start-time :initform nil
+               :documentation "When the download was requested from the
+platform port, to expire it if the port never reports it.")))
+
+(defvar *download-start-timeout* 60
+  "Seconds after which a download that the platform port has not reported yet
+stops counting against `max-downloads' and fails.")
+
+(defmethod object-string ((download download))
+  (url download))
+
+(defmethod download-running-p ((download download))
+  (member (status download) '(:starting :active)))
+
+(defmethod download-progress-string ((download download))
+  (if (plusp (bytes-total download))
+      (format nil "~,1f%" (* 100 (/ (bytes-received download) (bytes-total download))))
+      (format nil "~,1f MiB" (/ (bytes-received download) 1048576.0))))
+
+(defun %running-download-count (interface)
+  (count-if #'download-running-p (downloads interface)))
+
+(defun %expire-starting-downloads (interface)
+  "Fail the downloads that the platform port has not reported for
+`*download-start-timeout*' seconds.  Call it with the downloads lock held."
+  (dolist (download (downloads interface))
+    (when (and (eq (status download) :starting)
+               (start-time download)
+               (> (- (get-universal-time) (start-time download))
+                  *download-start-timeout*))
+      (setf (status download) :failed
+            (error-message download) "The platform port did not start it"))))
+
+(defun %download-slot-free-p (interface)
+  (or (null (max-downloads interface))
+      (< (%running-download-count interface) (max-downloads interface))))
+
+(defmethod push-download-directory ((interface remote-interface))
+  "Tell the platform port where to save the downloads."
+  (when (platform-port-supports-p interface "download.set.directory")
+    (%xml-rpc-notify interface "download.set.directory"
+                     (if (download-directory interface)
+                         (namestring (ensure-directories-exist
+                                      (uiop:ensure-directory-pathname
+                                       (download-directory interface))))
+                         ""))))
+
+(defmethod start-queued-downloads ((interface remote-interface))
+  "Start the oldest queued downloads while fewer than `max-downloads' run."
+  ;; Take the slots under the lock but call the port without it: the reports
+  ;; of the port need the lock, and find the :starting downloads by URL until
+  ;; their identifiers are known.
+  (let ((starting (bt:with-lock-held ((downloads-lock interface))
+                    (%expire-starting-downloads interface)
+                    (loop for download in (reverse (downloads interface))
+                          while (%download-slot-free-p interface)
+                          when (eq (status download) :queued)
+                            do (setf (status download) :starting
+                                     (start-time download) (get-universal-time))
+                            and collect download))))
+    (dolist (download starting)
+      (let ((id (%xml-rpc-send interface "download.start"
+                               (id (download-buffer download))
+                               (url download))))
+        (bt:with-lock-held ((downloads-lock interface))
+          (when (eq (status download) :starting)
+            (if (and (integerp id) (<= 0 id))
+                (setf (id download) id
+                      (status download) :active)
+                (setf (status download) :failed
+                      (error-message download) "The buffer is gone"))))))))
+
+(defmethod enqueue-download ((interface remote-interface) url
+                             &optional (buffer (active-buffer interface)))
+  "Download URL in the web context of BUFFER, now or once another download
+finishes.  Return the `download'."
+  (let ((download (make-instance 'download :url url :buffer buffer)))
+    (bt:with-lock-held ((downloads-lock interface))
+      (push download (downloads interface)))
+    (start-queued-downloads interface)
+    download))
+
+(defmethod download-response ((interface remote-interface) buffer url)
+  "Handle the response of URL in BUFFER, which the platform port cannot display.
+Return 2 to let the port download it now, or 0 to ignore it and download URL
+later.  The latter loses the request, e.g. form data."
+  (bt:with-lock-held ((downloads-lock interface))
+    (%expire-starting-downloads interface)
+    (if (%download-slot-free-p interface)
+        (progn
+          ;; Count it as running until the port reports it.
+          (push (make-instance 'download :url url :buffer buffer :status :starting
+                                         :start-time (get-universal-time))
+                (downloads interface))
+          2)
+        (progn
+          (push (make-instance 'download :url url :buffer buffer)
+                (downloads interface))
+          (echo (minibuffer *interface*)
+                (format nil "Download of ~a queued." url))
+          0))))
+
+(defun find-download (download-id)
+  (find download-id (downloads *interface*) :key #'id))
+
+(defun |download.did.start| (download-id url path)
+  (bt:with-lock-held ((downloads-lock *interface*))
+    (let ((download (or (find-download download-id)
+                        (find-if (lambda (download)
+                                   (and (eq (status download) :starting)
+                                        (string= (url download) url)))
+                                 (downloads *interface*))
+                        ;; Started without asking the core.
+                        (first (push (make-instance 'download :url url)
+                                     (downloads *interface*))))))
+      (setf (id download) download-id
+            (status download) :active
+            (destination download) path)))
+  (echo (minibuffer *interface*) (format nil "Downloading ~a to ~a." url path))
+  t)
+
+(defun |download.did.progress| (progress)
+  "PROGRESS is a flat list of download identifier, received bytes and total
+bytes, as floats, for each download that progressed."
+  (bt:with-lock-held ((downloads-lock *interface*))
+    (loop for (download-id received total) on progress by #'cdddr
+          for download = (find-download (round download-id))
+          when download
+            do (setf (bytes-received download) (round received)
+                     (bytes-total download) (round total))))
+  t)
+
+(defun |download.did.finish| (download-id status path-or-error)
+  (let ((download (bt:with-lock-held ((downloads-lock *interface*))
+                    (let ((download (find-download download-id)))
+                      (when download
+                        (setf (status download) (intern (string-upcase status) :keyword))
+                        (if (eq (status download) :finished)
+                            (setf (destination download) path-or-error)
+                            (setf (error-message download) path-or-error)))
+                      download))))
+    (when download
+      (echo (minibuffer *interface*)
+            (case (status download)
+              (:finished (format nil "Downloaded ~a." (destination download)))
+              (:cancelled (format nil "Download of ~a cancelled." (url download)))
+              (t (format nil "Download of ~a failed: ~a."
+                         (url download) (error-message download)))))))
+  (start-queued-downloads *interface*)
+  t)
+
+(import '|download.did.start| :s-xml-rpc-exports)
+(import '|download.did.progress| :s-xml-rpc-exports)
+(import '|download.did.finish| :s-xml-rpc-exports)
+
+(define-command download-url ()
+  "Download a URL, completing with history."
+  (if (platform-port-supports-p *interface* "download.start")
+      (with-result (url (read-from-minibuffer
+                         (minibuffer *interface*)
+                         :input-prompt "Download URL:"
+                         :completion-function 'history-typed-complete
+                         :empty-complete-immediate t))
+        (enqueue-download *interface* (parse-url url)))
+      (echo (minibuffer *interface*)
+            "The platform port does not support downloads.")))
+
+(define-command cancel-download ()
+  "Cancel a download in progress or remove a queued one."
+  (with-result (download (read-from-minibuffer
+                          (minibuffer *interface*)
+                          :input-prompt "Cancel download:"
+                          :completion-function
+                          (lambda (input)
+                            (fuzzy-match input
+                                         (remove-if-not
+                                          (lambda (download)
+                                            (member (status download)
+                                                    '(:queued :active)))
+                                          (downloads *interface*))
+                                         :accessor-function #'url))))
+    (if (eq (status download) :queued)
+        (bt:with-lock-held ((downloads-lock *interface*))
+          (setf (status download) :cancelled))
+        (%xml-rpc-notify *interface* "download.cancel" (id download)))))
+
+(define-command show-downloads ()
+  "Show the downloads of the session in a help buffer."
+  (let* ((downloads-buffer (make-buffer "DOWNLOADS" (help-mode)))
+         (contents (cl-markup:markup
+                    (:h1 "Downloads")
+                    (:ul (loop for download in (downloads *interface*)
+                               collect (cl-markup:markup
+                                        (:li (format nil "~a (~(~a~)~@[, ~a~]): ~a"
+                                                     (url download)
+                                                     (status download)
+                                                     (when (download-running-p download)
+                                                       (download-progress-string download))
+                                                     (or (destination download)
+                                                         (error-message download)
+                                                         ""))))))))
+         (insert-contents (ps:ps (setf (ps:@ document Body |innerHTML|)
+                                       (ps:lisp contents)))))
+    (buffer-evaluate-javascript *interface* downloads-buffer insert-contents)
+    (set-active-buffer *interface* downloads-buffer)))
@@ -10,6 +10,19 @@
 (defvar *interface* nil
   "The CLOS object responsible for rendering the interface.")
 
+(defvar *call-timeout* 10
+  "Seconds after which a call to the platform port sent asynchronously, or
+over the binary protocol, fails with a `call-timeout' error.  Bind it to change
+the timeout of a given call, nil means no timeout.")
+
+(defvar *scripts* (make-hash-table :test #'equal)
+  "The JavaScript functions by name that the platform port keeps ready in every
+page.  See `register-script'.")
+
+(defvar *call-batch* nil
+  "When non-nil, the calls to the platform port queued by `%xml-rpc-notify'.
+See `with-batched-calls'.")
+
 ;; TODO: Move commands with their hooks to a REMOTE-INTERFACE slot?
 (defvar *available-hooks* (make-hash-table :test #'equalp)
   "A hash of all available hooks.")
@@ -20,17 +20,30 @@
          (when (equal (ps:lisp heading-inner-text) (ps:chain heading inner-text))
            (ps:chain heading (scroll-into-view t))))))
 
+(defun query-headings (callback &optional (buffer (active-buffer *interface*)))
+  "Call CALLBACK with the list of the heading texts of BUFFER.  The platform port
+finds them natively when it can."
+  (buffer-query-dom *interface* buffer "buffer.headings"
+                    :callback (lambda (headings)
+                                ;; Drop the levels.
+                                (funcall callback (mapcar #'second headings)))
+                    :fallback (lambda ()
+                                (get-headings
+                                 (lambda (headings-json)
+                                   (funcall callback (cl-json:decode-json-from-string headings-json)))
+                                 buffer))))
+
 (define-command jump-to-heading ()
   "Jump to a particular heading, of type h1, h2, h3, h4, h5, or h6"
-  (with-result* ((headings (get-headings))
+  (with-result* ((headings (query-headings))
                  (heading (read-from-minibuffer
                            (minibuffer *interface*)
                            :input-prompt "Jump to heading:"
                            :completion-function (lambda (input)
-                                                  (fuzzy-match
-                                                   input
-                                                   (cl-json:decode-json-from-string
-                                                    headings))))))
-    (buffer-evaluate-javascript *interface*
-                               (active-buffer *interface*)
-                               (paren-jump-to-heading heading))))
+                                                  (fuzzy-match input headings)))))
+    (let ((buffer (active-buffer *interface*)))
+      (buffer-query-dom *interface* buffer "buffer.scroll.to.heading"
+                        :args (list (position heading headings :test #'string=))
+                        :fallback (lambda ()
+                                    (buffer-evaluate-javascript *interface* buffer
+                                                                (paren-jump-to-heading heading)))))))
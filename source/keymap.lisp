@@ -15,6 +15,13 @@
 (defvar *key-chord-stack* ()
   "A stack that keeps track of the key chords a user has inputted")
 
+(defvar *keymap-versions* (make-hash-table :test #'eq)
+  "The number of changes made by `define-key' to each keymap.  It tells which
+keymaps must be pushed again to the keymap cache of the platform port.")
+
+(defvar *keymap-ids* (make-hash-table :test #'eq)
+  "The identifiers of the keymaps in the keymap cache of the platform port.")
+
 (defun serialize-key-chord (key-chord)
   ;; current implementation ignores keycode
   (append (list nil
@@ -25,18 +32,22 @@
   (let ((key (mapcar #'serialize-key-chord key-chords)))
     (gethash key map)))
 
-(defun |push.input.event| (key-code key-string modifiers x y low-level-data sender)
+(defun |push.input.event| (key-code key-string modifiers x y low-level-data sender
+                           &optional delta-x delta-y (count 1))
   ;; Adds a new chord to key-sequence
   ;; For example, it may add C-M-s or C-x
   ;; to a stack which will be consumed by
   ;; |consume.key.sequence|.
+  ;; Coalesced scroll events come with their accumulated delta and their count.
   (let ((key-chord (make-key-chord
                     :key-code key-code
                     :key-string key-string
                     :position (list x y)
                     :modifiers (when (listp modifiers)
                                  (sort modifiers #'string-lessp))
-                    :low-level-data low-level-data)))
+                    :low-level-data low-level-data
+                    :count count
+                    :delta (when delta-x (list delta-x delta-y)))))
     (push key-chord *key-chord-stack*)
     (if (consume-key-sequence-p sender)
         (|consume.key.sequence| sender)
@@ -82,8 +93,12 @@
               (bound
                (progn
                  (log:debug "Key sequence bound")
-                 (funcall bound)
+                 ;; Run the command once per coalesced event.
+                 (loop repeat (key-chord-count (first *key-chord-stack*))
+                       do (funcall bound))
                  (setf *key-chord-stack* ())
+                 ;; The command may have changed a mode or a keymap.
+                 (sync-keymaps *interface*)
                  (return-from |consume.key.sequence| t)))
               ((equalp map (keymap (mode (minibuffer *interface*))))
                (if (member "R" (key-chord-modifiers (first *key-chord-stack*))
@@ -108,12 +123,68 @@
   ;; When a key is set to "prefix" it will not
   ;; consume the stack, so that a sequence of keys
   ;; longer than one key-chord can be recorded
-  (setf (gethash key-sequence mode-map) function)
-  ;; generate prefix representations
-  (loop while key-sequence
-     do
-       (pop key-sequence)
-       (setf (gethash key-sequence mode-map) "prefix")))
+  (flet ((bind (key-sequence value)
+           (unless (equal (gethash key-sequence mode-map) value)
+             (incf (gethash mode-map *keymap-versions* 0))
+             (setf (gethash key-sequence mode-map) value))))
+    (bind key-sequence function)
+    ;; generate prefix representations
+    (loop while key-sequence
+          do
+             (pop key-sequence)
+             (bind key-sequence "prefix"))))
+
+(defun keymap-id (keymap)
+  (if (eq keymap *global-map*)
+      "global"
+      (or (gethash keymap *keymap-ids*)
+          (setf (gethash keymap *keymap-ids*)
+                (format nil "keymap-~a" (hash-table-count *keymap-ids*))))))
+
+(defun key-sequence-string (key-sequence)
+  "Return the string of KEY-SEQUENCE as understood by the keymap cache of the
+platform port, e.g. \"C-x C-s\".
+Modifiers are sorted case-sensitively since \"s\" (shift) and \"S\" (super) are
+different modifiers."
+  (format nil "~{~a~^ ~}"
+          (mapcar (lambda (chord)
+                    (destructuring-bind (key-code key-string &rest modifiers) chord
+                      (declare (ignore key-code))
+                      (format nil "~{~a-~}~a"
+                              (sort (copy-list modifiers) #'string<)
+                              key-string)))
+                  (reverse key-sequence))))
+
+(defmethod sync-keymaps ((interface remote-interface))
+  "Push the keymaps that changed since they were last pushed to the keymap cache
+of the platform port, and tell it the keymap of each buffer.
+With the cache, the platform port forwards the keys that are bound nowhere
+without asking the Lisp core."
+  (when (platform-port-supports-p interface "keymap.set")
+    (with-batched-calls (interface)
+      (flet ((push-keymap (keymap)
+               (let ((version (gethash keymap *keymap-versions* 0)))
+                 (unless (eql version (gethash keymap (pushed-keymaps interface)))
+                   (setf (gethash keymap (pushed-keymaps interface)) version)
+                   (let ((bound '())
+                         (prefixes '()))
+                     (maphash (lambda (key-sequence value)
+                                (when key-sequence
+                                  (if (equal value "prefix")
+                                      (push (key-sequence-string key-sequence) prefixes)
+                                      (push (key-sequence-string key-sequence) bound))))
+                              keymap)
+                     (%xml-rpc-notify interface "keymap.set"
+                                      (keymap-id keymap) bound prefixes))))))
+        (push-keymap *global-map*)
+        (loop for buffer being the hash-values of (buffers interface)
+              for keymap = (keymap (mode buffer))
+              do (push-keymap keymap)
+                 (unless (equal (keymap-id keymap)
+                                (gethash (id buffer) (buffer-keymaps interface)))
+                   (setf (gethash (id buffer) (buffer-keymaps interface)) (keymap-id keymap))
+                   (%xml-rpc-notify interface "buffer.set.keymap"
+                                    (id buffer) (keymap-id keymap))))))))
 
 (defun key (key-sequence-string)
   ;; Take a key-sequence-string in the form of "C-x C-s"
@@ -100,16 +100,35 @@
       (ps:chain el (remove))))
   (hints-remove-all))
 
+(defun query-link-hints (callback &optional (buffer (active-buffer *interface*)))
+  "Add link hints to BUFFER and call CALLBACK with the list of (HINT URL ...) of
+the hinted links.  The platform port finds the links natively when it can."
+  (buffer-query-dom *interface* buffer "buffer.link.hints"
+                    :callback callback
+                    :fallback (lambda ()
+                                (add-link-hints
+                                 (lambda (links-json)
+                                   (funcall callback (cl-json:decode-json-from-string links-json)))
+                                 buffer))))
+
+(defvar *link-hint-prefetch-count* 10
+  "The number of hinted links whose hosts are resolved while the user picks a
+hint, in the order of the page.  See `buffer-prefetch'.")
+
 (defmacro query-anchors (prompt (symbol) &body body)
-  `(with-result* ((links-json (add-link-hints))
-                  (selected-anchor (read-from-minibuffer
+  `(with-result (link-hints (query-link-hints))
+     ;; Resolve the hosts of the first links while the user picks a hint.
+     (let ((urls (remove-duplicates (remove nil (mapcar #'cadr link-hints))
+                                    :test #'equal :from-end t)))
+       (buffer-prefetch *interface* (active-buffer *interface*)
+                        (subseq urls 0 (min (length urls) *link-hint-prefetch-count*))))
+     (with-result (selected-anchor (read-from-minibuffer
                                     (minibuffer *interface*)
                                     :input-prompt ,prompt
-                                    :cleanup-function #'remove-link-hints)))
-     (let* ((link-hints (cl-json:decode-json-from-string links-json))
-            (,symbol (cadr (assoc selected-anchor link-hints :test #'equalp))))
-       (when ,symbol
-         ,@body))))
+                                    :cleanup-function #'remove-link-hints))
+       (let ((,symbol (cadr (assoc selected-anchor link-hints :test #'equalp))))
+         (when ,symbol
+           ,@body)))))
 
 (define-command go-anchor ()
   "Show a set of link hints, and go to the user inputted one in the
@@ -5,12 +5,25 @@
 ;; used to allow inlining of parenscript compilation in a lisp file.
 ;; with the syntax (define-parenstatic name) allows definition of a paren
 ;; to some constant of name "name"
+;; The script is also registered in the platform port under the downcased name,
+;; so that running it only sends the name, see `buffer-invoke-script'.  It is
+;; registered as a function, so its definitions are local to it, unless it
+;; declares variables with `ps:defvar' for other scripts: then it runs its
+;; statements at the toplevel with an indirect eval, like the script evaluated
+;; by `buffer-evaluate-javascript', and its functions are global too.
 (defmacro define-parenstatic (script-name &rest script-body)
-  `(progn
-     (defparameter ,script-name
-       (ps:ps ,@script-body))
-     (defun ,script-name (&optional (callback nil) (buffer (active-buffer *interface*)))
-       (buffer-evaluate-javascript *interface* buffer ,script-name callback))))
+  (let ((name (string-downcase (symbol-name script-name)))
+        (globals-p (find 'ps:defvar script-body
+                         :key (lambda (form) (and (consp form) (first form))))))
+    `(progn
+       (defparameter ,script-name
+         (ps:ps ,@script-body))
+       (register-script ,name ,(if globals-p
+                                   `(ps:ps (lambda ()
+                                             (ps:chain window (eval (ps:lisp ,script-name)))))
+                                   `(ps:ps (lambda () ,@script-body))))
+       (defun ,script-name (&optional (callback nil) (buffer (active-buffer *interface*)))
+         (buffer-invoke-script *interface* buffer ,name :callback callback)))))
 
 ;; allow inlining of a parenscript function that can accept arguments,
 ;; useful for parenscript that will accept variables from lisp
@@ -18,6 +31,19 @@
   `(defun ,name (,@lambda-list)
      (ps:ps ,@body)))
 
+(defmacro with-batched-calls ((interface) &body body)
+  "Evaluate BODY and send the platform port calls it makes with
+`%xml-rpc-notify' in a single round trip once BODY returns.
+Calls made with `%xml-rpc-send' still return their result: the queued calls are
+sent first to preserve ordering.  Nested uses join the outermost batch."
+  (let ((interface-var (gensym "INTERFACE")))
+    `(let ((,interface-var ,interface))
+       (if *call-batch*
+           (progn ,@body)
+           (let ((*call-batch* (make-array 0 :adjustable t :fill-pointer 0)))
+             (multiple-value-prog1 (progn ,@body)
+               (flush-call-batch ,interface-var)))))))
+
 (defmacro with-result ((symbol async-form) &body body)
   `(,(first async-form)
     (lambda (,symbol) ,@body)
@@ -38,6 +38,9 @@
 (defclass minibuffer (buffer)
   ((mode :accessor mode :initarg :mode :initform 'minibuffer-mode)
    (completion-function :accessor completion-function)
+   (selection-function :accessor selection-function :initform nil
+                       :documentation "Called with the selected completion
+whenever it is displayed, e.g. to prepare for it.")
    (callback-function :accessor callback-function)
    (callback-buffer :accessor callback-buffer)
    (setup-function :accessor setup-function)
@@ -84,13 +87,15 @@
 (defmethod read-from-minibuffer (callback-function
                                  (minibuffer minibuffer)
                                  &key input-prompt completion-function setup-function
-                                   cleanup-function empty-complete-immediate)
+                                   cleanup-function empty-complete-immediate
+                                   selection-function)
   (if input-prompt
       (setf (input-prompt minibuffer) input-prompt)
       (setf (input-prompt minibuffer) "Input:"))
   (setf (display-mode minibuffer) :read)
   (setf (callback-function minibuffer) callback-function)
   (setf (completion-function minibuffer) completion-function)
+  (setf (selection-function minibuffer) selection-function)
   (setf (completions minibuffer) nil)
   (setf (completion-cursor minibuffer) 0)
   (setf (setup-function minibuffer) setup-function)
@@ -170,6 +175,8 @@
 (defmethod show ((interface remote-interface))
   (let ((active-window (window-active interface)))
     (setf (minibuffer-active active-window) t)
+    (when (platform-port-supports-p interface "window.set.minibuffer.active")
+      (%xml-rpc-notify interface "window.set.minibuffer.active" (id active-window) t))
     (window-set-minibuffer-height interface
                                   active-window
                                   (minibuffer-open-height active-window))))
@@ -177,6 +184,8 @@
 (defmethod hide ((interface remote-interface))
   (let ((active-window (window-active interface)))
     (setf (minibuffer-active active-window) nil)
+    (when (platform-port-supports-p interface "window.set.minibuffer.active")
+      (%xml-rpc-notify interface "window.set.minibuffer.active" (id active-window) nil))
     (window-set-minibuffer-height *interface*
                                   active-window
                                   (minibuffer-closed-height active-window))))
@@ -315,11 +324,13 @@
 
 (defmethod update-display ((minibuffer minibuffer))
   (with-slots (input-buffer input-buffer-cursor completion-function
-               completions completion-cursor)
+               completions completion-cursor selection-function)
       minibuffer
     (if completion-function
         (setf completions (funcall completion-function input-buffer))
         (setf completions nil))
+    (when (and selection-function (nth completion-cursor completions))
+      (funcall selection-function (nth completion-cursor completions)))
     (let ((input-text (generate-input-html input-buffer input-buffer-cursor))
           (completion-html (generate-completion-html completions completion-cursor)))
       (minibuffer-evaluate-javascript
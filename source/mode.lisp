@@ -30,3 +30,7 @@
 
 (defmethod did-finish-navigation ((mode fundamental-mode) url)
   url)
+
+(defmethod did-receive-message ((mode fundamental-mode) type message)
+  (declare (ignore type))
+  message)
@@ -53,14 +53,24 @@ as a string.")
 (defun default-port-args ()
   "Derive platform port arguments dynamically at runtime.
 This is useful if, for instance, the socket gets changed after startup."
+  (when (platform-port-socket-path *interface*)
+    (return-from default-port-args
+      (append
+       (list "--socket-path" (namestring (platform-port-socket-path *interface*)))
+       (if (core-socket-path *interface*)
+           (list "--core-socket-path" (namestring (core-socket-path *interface*)))
+           (list "--core-socket" (format nil "http://localhost:~a/RPC2" (core-port *interface*)))))))
   ;; TODO: Make sure that it works if platform port is started manually.
   (unless (find-port:port-open-p (getf (platform-port-socket *interface*) :port))
     (let ((new-port (find-port:find-port)))
       (format *error-output* "Platform port socket ~a seems busy, trying ~a instead.~%"
               (getf (platform-port-socket *interface*) :port) new-port)
       (setf (getf (platform-port-socket *interface*) :port) new-port)))
-  (list "--port" (write-to-string (getf (platform-port-socket *interface*) :port))
-        "--core-socket" (format nil "http://localhost:~a/RPC2" (core-port *interface*))))
+  (append
+   (list "--port" (write-to-string (getf (platform-port-socket *interface*) :port)))
+   (if (core-socket-path *interface*)
+       (list "--core-socket-path" (namestring (core-socket-path *interface*)))
+       (list "--core-socket" (format nil "http://localhost:~a/RPC2" (core-port *interface*))))))
 
 (defmethod run-loop ((port port))
   (uiop:wait-process (running-process port)))
@@ -53,7 +53,88 @@ distance scroll-left or scroll-right will scroll.")
                        :documentation "The default zoom ratio.")
    (cookies-path :accessor cookies-path :initform (xdg-data-home "cookies.txt")
                  :documentation "The path where cookies are stored.  Not all
-platform ports might support this.")))
+platform ports might support this.")
+   (ephemeral-p :accessor ephemeral-p :initarg :ephemeral-p :initform nil
+                :documentation "Whether the buffer keeps no data on disk, such
+as cookies and cache.  Not all platform ports might support this.")
+   (proxy-uri :accessor proxy-uri :initform ""
+              :documentation "The proxy of the buffer, or the empty string for
+the system settings.  See `set-proxy'.")
+   (proxy-ignore-hosts :accessor proxy-ignore-hosts :initform nil
+                       :documentation "The hosts reached without the proxy.")
+   (cache-model :accessor cache-model :initform nil
+                :documentation "How much the platform port caches, one of
+:web-browser (caches the most, for fast back and forward navigation),
+:document-browser and :document-viewer (no memory cache), or nil for the
+default of the port.  Not all platform ports might support this.")
+   (data-directory :accessor data-directory :initform nil
+                   :documentation "The directory of the website data, such as
+local storage and IndexedDB databases, or nil for the default of the platform
+port.")
+   (cache-directory :accessor cache-directory :initform nil
+                    :documentation "The directory of the disk cache, or nil for
+the default of the platform port.  Set it to faster storage to speed up repeat
+visits.")
+   (hibernate-after :accessor hibernate-after :initform 1800
+                    :documentation "The number of seconds after which a buffer
+that is not displayed may be hibernated, i.e. have its web view unloaded by
+the platform port until it is needed again, or nil to never hibernate it after
+some time.  See `hibernate-p'.")
+   (hibernate-on-memory-pressure-p :accessor hibernate-on-memory-pressure-p :initform t
+                                   :documentation "Whether the buffer may be
+hibernated when it is not displayed and the system runs low on memory.")
+   (last-access-time :accessor last-access-time :initform (get-universal-time)
+                     :documentation "The universal time at which the buffer was
+last displayed or used.")
+   (hibernated-p :accessor hibernated-p :initform nil
+                 :documentation "Whether the platform port has unloaded the web
+view of the buffer.  It is reloaded transparently when needed.")
+   (snapshot-path :accessor snapshot-path :initform nil
+                  :documentation "The PNG image of the page at the time the
+buffer was hibernated, if any.")
+   (page-title :accessor page-title :initform nil
+               :documentation "The title of the page when its document was
+parsed, as pushed by the \"dom-ready\" page event.")
+   (scroll-position :accessor scroll-position :initform nil
+                    :documentation "The last (X Y) scroll position pushed by
+the page, if any.")
+   (selection :accessor selection :initform nil
+              :documentation "The last selected text pushed by the page, if
+any.")
+   (find-text :accessor find-text :initform nil
+              :documentation "The text of the current search in the page, if
+any.  See `buffer-find'.")
+   (find-match-count :accessor find-match-count :initform nil
+                     :documentation "The number of matches of `find-text', once
+the platform port has counted them.")))
+
+(defmethod buffer-profile ((buffer buffer))
+  "Return the settings that the platform port may share between buffers, e.g.
+in a single web context: buffers with an equal profile share it."
+  (list (namestring (cookies-path buffer))
+        (ephemeral-p buffer)
+        (proxy-uri buffer)
+        (proxy-ignore-hosts buffer)
+        (cache-model buffer)
+        (data-directory buffer)
+        (cache-directory buffer)))
+
+(defmethod hibernate-p ((buffer buffer) reason)
+  "Return non-nil if BUFFER, which is neither displayed nor hibernated, should be
+hibernated.  REASON is :idle when buffers are checked periodically, or
+:memory-pressure when the system runs low on memory.  Specialize it to keep
+some buffers loaded."
+  (case reason
+    (:idle (and (hibernate-after buffer)
+                (> (- (get-universal-time) (last-access-time buffer))
+                   (hibernate-after buffer))))
+    (:memory-pressure (hibernate-on-memory-pressure-p buffer))))
+
+(defmethod mark-buffer-awake ((buffer buffer))
+  "Record that BUFFER is in use, which also wakes it on the platform port side."
+  (setf (hibernated-p buffer) nil
+        (snapshot-path buffer) nil
+        (last-access-time buffer) (get-universal-time)))
 
 (defmethod initialize-instance :after ((buffer buffer) &key)
   (when (symbolp (mode buffer))
@@ -65,20 +146,66 @@ platform ports might support this.")))
   key-string
   modifiers
   position
-  low-level-data)
+  low-level-data
+  ;; The platform port may coalesce consecutive scroll events into one chord:
+  ;; COUNT is then the number of events and DELTA their accumulated (x y) delta.
+  (count 1)
+  delta)
 
 (defmethod did-commit-navigation ((buffer buffer) url)
   (setf (name buffer) url)
   (did-commit-navigation (mode buffer) url))
 
+(defvar *navigation-waiters* '()
+  "Pairs of a buffer and a future fulfilled with the URL of its next finished
+navigation, see `buffer-navigation-future'.")
+(defvar *navigation-waiters-lock* (bt:make-lock "navigation waiters"))
+
+(defmethod buffer-navigation-future ((buffer buffer))
+  "Return a `future' fulfilled with the URL of the next navigation of BUFFER to
+finish."
+  (let ((future (make-future)))
+    (bt:with-lock-held (*navigation-waiters-lock*)
+      (push (cons buffer future) *navigation-waiters*))
+    future))
+
 (defmethod did-finish-navigation ((buffer buffer) url)
+  (let ((futures '()))
+    (bt:with-lock-held (*navigation-waiters-lock*)
+      (setf *navigation-waiters*
+            (delete-if (lambda (waiter)
+                         (when (eq (car waiter) buffer)
+                           (push (cdr waiter) futures)))
+                       *navigation-waiters*)))
+    (dolist (future futures)
+      (future-fulfill future :value url)))
   (did-finish-navigation (mode buffer) url))
 
+(defmethod did-receive-message ((buffer buffer) type message)
+  "Handle MESSAGE, the alist of the JSON object of type TYPE that the page of
+BUFFER posted, e.g. one of the `page-events'."
+  (flet ((field (key) (cdr (assoc key message))))
+    (cond
+      ((string= type "dom-ready")
+       (setf (page-title buffer) (field :title)
+             (scroll-position buffer) (list (field :x) (field :y))))
+      ((string= type "scroll")
+       (setf (scroll-position buffer) (list (field :x) (field :y))))
+      ((string= type "selection")
+       (setf (selection buffer) (field :text)))))
+  (did-receive-message (mode buffer) type message))
+
 (defclass remote-interface ()
   ((core-port :accessor core-port :initform 8081
               :documentation "The XML-RPC server port of the Lisp core.")
+   (core-socket-path :accessor core-socket-path :initform nil
+                     :documentation "When non-nil, the path of the Unix domain
+socket the XML-RPC server of the Lisp core listens to instead of CORE-PORT.")
    (platform-port-socket :accessor platform-port-socket :initform '(:host "localhost" :port 8082)
                          :documentation "The XML-RPC remote socket of the platform-port.")
+   (platform-port-socket-path :accessor platform-port-socket-path :initform nil
+                              :documentation "When non-nil, the path of the
+Unix domain socket of the platform port, used instead of PLATFORM-PORT-SOCKET.")
    (port :accessor port :initform (make-instance 'port)
          :documentation "The CLOS object responible for handling the platform port.")
    (platform-port-poll-interval :accessor platform-port-poll-interval :initform 0.015
@@ -86,6 +213,89 @@ platform ports might support this.")))
 XML-RPC endpoint of a platform-port to see if it is ready to begin accepting
 XML-RPC commands.")
    (active-connection :accessor active-connection :initform nil)
+   (persistent-connection-p :accessor persistent-connection-p :initform t
+                            :documentation "Whether XML-RPC calls to the
+platform port reuse HTTP/1.1 keep-alive connections instead of opening a new
+connection for each call.")
+   (http-connection-pool :initform nil)
+   (call-queue :initform nil)
+   (platform-port-methods :accessor platform-port-methods :initform nil
+                          :documentation "The methods supported by the platform
+port, as returned by \"listMethods\" at startup.")
+   (pushed-keymaps :accessor pushed-keymaps :initform (make-hash-table :test #'eq)
+                   :documentation "The keymaps pushed to the keymap cache of
+the platform port, associated to their version at the time.")
+   (buffer-keymaps :accessor buffer-keymaps :initform (make-hash-table :test #'equal)
+                   :documentation "The keymap identifier of each buffer as
+known to the platform port.")
+   (protocol :accessor protocol :initform :binary
+             :documentation "Either :binary or :xml-rpc.  When :binary, the
+binary protocol is used if the platform port supports it, XML-RPC otherwise.")
+   (binary-connection :accessor binary-connection :initform nil
+                      :documentation "The `binary-connection' to the platform
+port once the binary protocol has been negotiated.")
+   (integer-handles-p :accessor integer-handles-p :initform nil
+                      :documentation "Whether windows and buffers are identified
+by integers instead of strings.  Set at startup for platform ports that publish
+their method table with \"server.method.table\", which also take integer
+handles.")
+   (hibernation-check-interval :accessor hibernation-check-interval :initform 60
+                               :documentation "The number of seconds between
+two checks for buffers to hibernate, see `hibernate-after'.")
+   (hibernation-thread :accessor hibernation-thread :initform nil)
+   (tables-lock :accessor tables-lock :initform (bt:make-recursive-lock "buffers and windows")
+                :documentation "Held while `buffers' or `windows' is modified,
+and by the hibernation thread while it reads them.")
+   (navigation-rules :accessor navigation-rules
+                     :initform '((:kind :new-window :action :ask)
+                                 (:known-type nil :action :ask)
+                                 (:action :allow))
+                     :documentation "The rules with which the platform port
+decides whether to load a resource without asking `|request.resource|'.  Each
+rule is a plist of :kind (:navigation, :new-window or :response), :scheme,
+:host (a glob pattern), :navigation-type (e.g. \"link-click\"), :known-type
+(whether the MIME type is supported) and :action (:allow, :deny or :ask).
+Missing keys match anything.  The first matching rule wins and the platform
+port asks when none does.  See `push-navigation-rules'.  With platform ports
+that do not support rules, the core applies the deny rules itself in
+`|request.resource|'.")
+   (content-filters :accessor content-filters :initform '()
+                    :documentation "The content filters applied to all buffers,
+as a list of (IDENTIFIER PATH), where PATH is a JSON file of blocking rules in
+the WebKit content blocker format.  Not all platform ports might support this.
+See `load-content-filters'.")
+   (downloads :accessor downloads :initform '()
+              :documentation "The `download' objects of the session, newest
+first.  See `download-manager.lisp'.")
+   (downloads-lock :accessor downloads-lock :initform (bt:make-lock "downloads"))
+   (max-downloads :accessor max-downloads :initform 3
+                  :documentation "The number of downloads in progress at once,
+or nil for no limit.  Further downloads wait in `downloads'.")
+   (download-directory :accessor download-directory :initform nil
+                       :documentation "The directory where files are
+downloaded, or nil for the XDG download directory.")
+   (prefetch-p :accessor prefetch-p :initform t
+               :documentation "Whether the platform port resolves the hosts of
+the URLs the user is likely to visit next, e.g. the selected completion, ahead
+of time.  See `buffer-prefetch'.")
+   (last-prefetch :accessor last-prefetch :initform nil
+                  :documentation "The arguments of the last `buffer-prefetch'
+call, which is not repeated.")
+   (page-events :accessor page-events :initform '("dom-ready" "scroll" "selection")
+                :documentation "The events that the platform port pushes from
+every page, see `did-receive-message'.  Not all platform ports might support
+this.")
+   (restore-session-p :accessor restore-session-p :initform t
+                      :documentation "Whether the windows and buffers are saved
+when quitting and restored at startup, unless URLs are given on the command
+line.  See `save-session'.")
+   (session-path :accessor session-path :initform (xdg-data-home "session.lisp")
+                 :documentation "The file of the window and buffer layout,
+including the history tree of each buffer.")
+   (session-state-path :accessor session-state-path :initform (xdg-data-home "session.bin")
+                       :documentation "The file where the platform port saves
+the back/forward list, form data and scroll position of each buffer.  Not all
+platform ports might support this.")
    (url :accessor url :initform "/RPC2")
    (minibuffer :accessor minibuffer :initform (make-instance 'minibuffer)
                :documentation "The minibuffer object.")
@@ -109,89 +319,286 @@ It's important that it is dynamic since the platform port can be reconfigured on
 startup after the remote-interface was set up."
   (getf (platform-port-socket interface) :port))
 
+(defmethod start-local-server ((interface remote-interface))
+  "Start the XML RPC server on the Unix domain socket CORE-SOCKET-PATH.
+If another instance of Next already listens there, ask it to open the URLs and
+quit."
+  (let ((path (core-socket-path interface)))
+    (when (and (probe-file path)
+               (ignore-errors
+                (xml-rpc-call-local
+                 (s-xml-rpc:encode-xml-rpc-call
+                  "make.buffers"
+                  (or *free-args* (list
+                                   (closer-mop:slot-definition-initform
+                                    (find-slot 'buffer 'default-new-buffer-url)))))
+                 path)
+                t))
+      (format *error-output* "Socket ~a already in use, URL(s) sent to it.~%" path)
+      (uiop:quit))
+    (ensure-parent-exists path)
+    (start-local-xml-rpc-server path)))
+
 (defmethod initialize-instance :after ((interface remote-interface)
                                        &key &allow-other-keys)
   "Start the XML RPC Server."
   (setf (active-connection interface)
-        ;; TODO: Ideally, s-xml-rpc should send an implementation-independent
-        ;; condition.
-        (handler-case
-            (s-xml-rpc:start-xml-rpc-server :port (core-port interface))
-          (#+sbcl sb-bsd-sockets:address-in-use-error
-           #+ccl ccl:socket-error
-           (#+ccl e
-            )
-            (when #+sbcl t
-                  #+ccl (eq (ccl:socket-error-identifier e) :address-in-use)
-                  (let ((url-list (or *free-args* (list
-                                                   (closer-mop:slot-definition-initform
-                                                    (find-slot 'buffer 'default-new-buffer-url))))))
-                (format *error-output* "Port ~a already in use, requesting to open URL(s) ~a.~%"
-                        (core-port interface) url-list)
-                ;; TODO: Check for errors (S-XML-RPC:XML-RPC-FAULT).
-                (handler-case
-                    (progn
-                      (s-xml-rpc:xml-rpc-call
-                       (s-xml-rpc:encode-xml-rpc-call "make.buffers" url-list)
-                       :port (core-port interface))
-                      (uiop:quit))
-                  (error ()
-                    (let ((new-port (find-port:find-port)))
-                      (format *error-output* "Port ~a does not seem to be used by Next, trying ~a instead.~%"
-                              (core-port interface) new-port)
-                      (setf (core-port interface) new-port)
-                      (s-xml-rpc:start-xml-rpc-server :port (core-port interface)))))))))))
+        (if (core-socket-path interface)
+            (start-local-server interface)
+            ;; TODO: Ideally, s-xml-rpc should send an implementation-independent
+            ;; condition.
+            (handler-case
+                (s-xml-rpc:start-xml-rpc-server :port (core-port interface))
+              (#+sbcl sb-bsd-sockets:address-in-use-error
+               #+ccl ccl:socket-error
+               (#+ccl e
+                )
+                (when #+sbcl t
+                      #+ccl (eq (ccl:socket-error-identifier e) :address-in-use)
+                      (let ((url-list (or *free-args* (list
+                                                       (closer-mop:slot-definition-initform
+                                                        (find-slot 'buffer 'default-new-buffer-url))))))
+                    (format *error-output* "Port ~a already in use, requesting to open URL(s) ~a.~%"
+                            (core-port interface) url-list)
+                    ;; TODO: Check for errors (S-XML-RPC:XML-RPC-FAULT).
+                    (handler-case
+                        (progn
+                          (s-xml-rpc:xml-rpc-call
+                           (s-xml-rpc:encode-xml-rpc-call "make.buffers" url-list)
+                           :port (core-port interface))
+                          (uiop:quit))
+                      (error ()
+                        (let ((new-port (find-port:find-port)))
+                          (format *error-output* "Port ~a does not seem to be used by Next, trying ~a instead.~%"
+                                  (core-port interface) new-port)
+                          (setf (core-port interface) new-port)
+                          (s-xml-rpc:start-xml-rpc-server :port (core-port interface))))))))))))
 
 
+(defmethod http-connection-pool ((interface remote-interface))
+  "Return the pool of persistent connections to the platform port."
+  (with-slots (http-connection-pool url) interface
+    (or http-connection-pool
+        (setf http-connection-pool
+              (make-http-connection-pool :path (platform-port-socket-path interface)
+                                         :host (host interface)
+                                         :port (host-port interface)
+                                         :url url)))))
+
+(defmethod negotiate-protocol ((interface remote-interface) methods)
+  "Switch to the binary protocol if the platform port supports it.
+METHODS is the list of methods supported by the platform port."
+  (let ((method-table-p (member "server.method.table" methods :test #'string=)))
+    (setf (integer-handles-p interface) (and method-table-p t))
+    (when (and (eq (protocol interface) :binary)
+               (member "server.binary.listen" methods :test #'string=))
+      (handler-case
+          (let ((address (%xml-rpc-send interface "server.binary.listen")))
+            (unless (string= address "")
+              (let ((connection (open-binary-connection address)))
+                (when method-table-p
+                  (binary-connection-use-method-table
+                   connection (binary-call connection "server.method.table")))
+                (setf (binary-connection interface) connection))
+              (log:info "Using the binary protocol on ~a" address)))
+        (error (c)
+          (log:warn "Falling back to XML-RPC: ~a" c))))))
+
 (defmethod kill-interface ((interface remote-interface))
   "Kill the XML RPC Server."
+  (when (hibernation-thread interface)
+    (bt:destroy-thread (hibernation-thread interface))
+    (setf (hibernation-thread interface) nil))
+  (when (binary-connection interface)
+    (binary-connection-close (binary-connection interface))
+    (setf (binary-connection interface) nil))
+  (when (slot-value interface 'call-queue)
+    (call-queue-stop (slot-value interface 'call-queue)))
+  (when (slot-value interface 'http-connection-pool)
+    (http-connection-pool-close (slot-value interface 'http-connection-pool)))
   (when (active-connection interface)
     (log:debug "Stopping server")
-    (s-xml-rpc:stop-server (active-connection interface))))
+    (if (local-server-p (active-connection interface))
+        (stop-local-xml-rpc-server (active-connection interface))
+        (s-xml-rpc:stop-server (active-connection interface)))))
 
-(defmethod %xml-rpc-send ((interface remote-interface) (method string) &rest args)
-  ;; TODO: Make %xml-rpc-send asynchronous?
-  ;; If the platform port ever hangs, the next %xml-rpc-send will hang the Lisp core too.
+(defmethod call-queue ((interface remote-interface))
+  "Return the queue of the asynchronous XML-RPC calls to the platform port."
+  (with-slots (call-queue) interface
+    (or call-queue
+        (setf call-queue (make-call-queue)))))
+
+(defvar *idempotent-methods* '("server.method.table" "server.binary.listen"
+                               "server.stats" "server.memory"
+                               "window.active" "window.exists" "window.set.title"
+                               "window.set.active.buffer" "window.set.minibuffer.height"
+                               "window.set.minibuffer.active"
+                               "get.proxy" "set.proxy" "keymap.set" "buffer.set.keymap"
+                               "buffer.load.queue.position" "policy.set.rules"
+                               "filter.list" "download.set.directory" "script.register"
+                               "message.subscribe" "buffer.prefetch")
+  "The methods of the platform port that may run twice with the same effect.
+Only these are sent again when a kept-alive connection turns out to be closed.")
+
+(defun idempotent-method-p (method)
+  (member method *idempotent-methods* :test #'string=))
+
+(defmethod %xml-rpc-call ((interface remote-interface) (method string) args)
+  "Send METHOD with ARGS over XML-RPC and return the result."
   (with-slots (url) interface
+    (cond
+      ((persistent-connection-p interface)
+       (http-call (http-connection-pool interface)
+                  (apply #'s-xml-rpc:encode-xml-rpc-call method args)
+                  :retry-p (idempotent-method-p method)))
+      ((platform-port-socket-path interface)
+       (xml-rpc-call-local
+        (apply #'s-xml-rpc:encode-xml-rpc-call method args)
+        (platform-port-socket-path interface) :url url))
+      (t
+       (s-xml-rpc:xml-rpc-call
+        (apply #'s-xml-rpc:encode-xml-rpc-call method args)
+        :host (host interface) :port (host-port interface) :url url)))))
+
+(defmethod %call-in-order ((interface remote-interface) function)
+  "Call FUNCTION, after the asynchronous XML-RPC calls still in flight if any."
+  (if (call-queue-busy-p (call-queue interface))
+      (future-wait (future-set-timeout (call-queue-submit (call-queue interface) function)
+                                       *call-timeout*))
+      (funcall function)))
+
+(defmethod live-binary-connection ((interface remote-interface))
+  "Return the binary connection to the platform port if it is usable."
+  (with-slots (binary-connection) interface
+    (when (and binary-connection
+               (not (binary-connection-alive-p binary-connection)))
+      (log:warn "Binary connection lost, falling back to XML-RPC")
+      (setf binary-connection nil))
+    binary-connection))
+
+(defmethod %xml-rpc-send ((interface remote-interface) (method string) &rest args)
+  "Send METHOD with ARGS to the platform port and return the result.
+See `%xml-rpc-send-async' to not wait for the result."
+  (when (and *call-batch* (plusp (length *call-batch*)))
+    (flush-call-batch interface))
+  (let ((binary-connection (live-binary-connection interface)))
     (handler-case
-        (s-xml-rpc:xml-rpc-call
-         (apply #'s-xml-rpc:encode-xml-rpc-call method args)
-         :host (host interface) :port (host-port interface) :url url)
+        (if binary-connection
+            (future-wait (future-set-timeout
+                          (apply #'binary-call-async binary-connection method args)
+                          *call-timeout*))
+            (%call-in-order interface (lambda () (%xml-rpc-call interface method args))))
+      (call-timeout (c)
+        ;; Don't echo: the minibuffer would need the platform port too.
+        (log:warn "~a: ~a" method c)
+        (error c))
       (s-xml-rpc:xml-rpc-fault (c)
         (log:warn "~a" c)
         (echo (minibuffer *interface*)
               (format nil "Platform port failed to respond to '~a': ~a" method c))
         (error c)))))
 
+(defmethod %xml-rpc-send-async ((interface remote-interface) (method string) &rest args)
+  "Send METHOD with ARGS to the platform port without waiting for the response.
+Return a `future' of the result, see `future-wait' and `future-cancel'.  The
+future fails with a `call-timeout' error after `*call-timeout*' seconds.
+Calls are received by the platform port in the order they are sent."
+  (let ((binary-connection (live-binary-connection interface)))
+    (future-set-timeout
+     (if binary-connection
+         (apply #'binary-call-async binary-connection method args)
+         (call-queue-submit (call-queue interface)
+                            (lambda () (%xml-rpc-call interface method args))))
+     *call-timeout*)))
+
+(defmethod platform-port-supports-p ((interface remote-interface) method)
+  "Return non-nil if the platform port implements METHOD."
+  (member method (platform-port-methods interface) :test #'string=))
+
+(defmethod %xml-rpc-multicall ((interface remote-interface) calls)
+  "Send CALLS, a list of (METHOD . ARGS), and return the list of their results.
+The result of a failed call is nil.  If the platform port does not support
+\"system.multicall\", CALLS are pipelined over a persistent connection when
+possible, or else sent one by one."
+  (cond
+    ((platform-port-supports-p interface "system.multicall")
+     (loop for call in calls
+           for result in (%xml-rpc-send interface "system.multicall" calls)
+           do (unless result
+                (log:warn "Platform port failed to run '~a'" (first call)))
+           collect (first result)))
+    ((and (persistent-connection-p interface)
+          (not (live-binary-connection interface)))
+     (%call-in-order
+      interface
+      (lambda ()
+        (http-pipeline (http-connection-pool interface)
+                       (loop for call in calls
+                             collect (apply #'s-xml-rpc:encode-xml-rpc-call call))
+                       :retry-p (every #'idempotent-method-p (mapcar #'first calls))))))
+    (t
+     (loop for call in calls
+           collect (apply #'%xml-rpc-send interface call)))))
+
+(defmethod flush-call-batch ((interface remote-interface))
+  "Send the calls queued in `*call-batch*'."
+  (when (plusp (length *call-batch*))
+    (let ((calls (coerce *call-batch* 'list)))
+      (setf (fill-pointer *call-batch*) 0)
+      (%xml-rpc-multicall interface calls))))
+
+(defmethod %xml-rpc-notify ((interface remote-interface) (method string) &rest args)
+  "Send METHOD with ARGS to the platform port for calls whose result is not
+needed.  The call is sent with `%xml-rpc-send-async' and failures are logged.
+Within `with-batched-calls', the call is queued and sent with the rest of the
+batch."
+  (cond
+    (*call-batch*
+     (vector-push-extend (cons method args) *call-batch*)
+     nil)
+    (t
+     (future-add-callback (apply #'%xml-rpc-send-async interface method args)
+                          (lambda (future)
+                            (when (future-error future)
+                              (log:warn "Platform port failed to run '~a': ~a"
+                                        method (future-error future))))))))
+
 (defmethod list-methods ((interface remote-interface))
   "Return the unsorted list of XML-RPC methods supported by the platform port."
   (%xml-rpc-send interface "listMethods"))
 
 (defmethod get-unique-window-identifier ((interface remote-interface))
-  (incf (total-window-count interface))
-  (format nil "~a" (total-window-count interface)))
+  (let ((id (bt:with-recursive-lock-held ((tables-lock interface))
+              (incf (total-window-count interface)))))
+    (if (integer-handles-p interface)
+        id
+        (format nil "~a" id))))
 
 (defmethod get-unique-buffer-identifier ((interface remote-interface))
-  (incf (total-buffer-count interface))
-  (format nil "~a" (total-buffer-count interface)))
+  (let ((id (bt:with-recursive-lock-held ((tables-lock interface))
+              (incf (total-buffer-count interface)))))
+    (if (integer-handles-p interface)
+        id
+        (format nil "~a" id))))
 
 (defmethod window-make ((interface remote-interface))
   "Create a window and return the window object."
   (let* ((window-id (get-unique-window-identifier interface))
          (window (make-instance 'window :id window-id)))
-    (setf (gethash window-id (windows interface)) window)
-    (%xml-rpc-send interface "window.make" window-id)
+    (bt:with-recursive-lock-held ((tables-lock interface))
+      (setf (gethash window-id (windows interface)) window))
+    (%xml-rpc-notify interface "window.make" window-id)
     window))
 
 (defmethod window-set-title ((interface remote-interface) (window window) title)
   "Set the title for a given window."
-  (%xml-rpc-send interface "window.set.title" (id window) title))
+  (%xml-rpc-notify interface "window.set.title" (id window) title))
 
 (defmethod window-delete ((interface remote-interface) (window window))
   "Delete a window object and remove it from the hash of windows."
   (%xml-rpc-send interface "window.delete" (id window))
-  (with-slots (windows) interface
-    (remhash (id window) windows)))
+  (bt:with-recursive-lock-held ((tables-lock interface))
+    (remhash (id window) (windows interface))))
 
 (defmethod window-active ((interface remote-interface))
   "Return the window object for the currently active window."
@@ -209,7 +616,12 @@ startup after the remote-interface was set up."
 (defmethod %window-set-active-buffer ((interface remote-interface)
                                       (window window)
                                       (buffer buffer))
-  (%xml-rpc-send interface "window.set.active.buffer" (id window) (id buffer))
+  (%xml-rpc-notify interface "window.set.active.buffer" (id window) (id buffer))
+  ;; The buffer that is left starts being idle now.
+  (when (active-buffer window)
+    (setf (last-access-time (active-buffer window)) (get-universal-time)))
+  ;; The platform port wakes the buffer up if it was hibernated.
+  (mark-buffer-awake buffer)
   (setf (active-buffer window) buffer))
 
 (defmethod window-set-active-buffer ((interface remote-interface)
@@ -221,39 +633,70 @@ startup after the remote-interface was set up."
                                                               (eql (active-buffer other-window) buffer)))
                                   (alexandria:hash-table-values (windows *interface*)))))
     (if window-with-same-buffer ;; if visible on screen perform swap, otherwise just show
-        (let ((temp-buffer (buffer-make *interface*))
-              (buffer-swap (active-buffer window)))
-          (log:debug "Swapping with buffer from existing window.")
-          (%window-set-active-buffer interface window-with-same-buffer temp-buffer)
-          (%window-set-active-buffer interface window buffer)
-          (%window-set-active-buffer interface window-with-same-buffer buffer-swap)
-          (buffer-delete interface temp-buffer))
+        (with-batched-calls (interface)
+          (let ((temp-buffer (buffer-make *interface*))
+                (buffer-swap (active-buffer window)))
+            (log:debug "Swapping with buffer from existing window.")
+            (%window-set-active-buffer interface window-with-same-buffer temp-buffer)
+            (%window-set-active-buffer interface window buffer)
+            (%window-set-active-buffer interface window-with-same-buffer buffer-swap)
+            (buffer-delete interface temp-buffer)))
         (%window-set-active-buffer interface window buffer))))
 
 (defmethod window-set-minibuffer-height ((interface remote-interface)
                                          window height)
-  (%xml-rpc-send interface "window.set.minibuffer.height" (id window) height))
+  (%xml-rpc-notify interface "window.set.minibuffer.height" (id window) height))
 
 (defmethod buffer-make ((interface remote-interface)
-                        &key name mode)
+                        &key name mode deferred-url session-id)
+  "Create a buffer.  If DEFERRED-URL is non-nil, the platform port loads it only
+once the buffer is displayed or used, see `make-deferred-buffer'.  If SESSION-ID
+is non-nil, the platform port restores instead the buffer saved with that
+identifier in the session it loaded, see `session-restore'."
   (let* ((buffer-id (get-unique-buffer-identifier interface))
          (buffer (apply #'make-instance 'buffer :id buffer-id
                         (append (when name `(:name ,name))
                                 (when mode `(:mode ,mode))))))
+    (when deferred-url
+      ;; Like a hibernated buffer, it has no web view yet.
+      (setf (name buffer) deferred-url
+            (hibernated-p buffer) t))
     (ensure-parent-exists (cookies-path buffer))
-    (setf (gethash buffer-id (buffers interface)) buffer)
-    (%xml-rpc-send interface "buffer.make" buffer-id
-                   (list
-                    :cookies-path (namestring (cookies-path buffer))))
+    (bt:with-recursive-lock-held ((tables-lock interface))
+      (setf (gethash buffer-id (buffers interface)) buffer))
+    (%xml-rpc-notify interface "buffer.make" buffer-id
+                   (append
+                    (list :cookies-path (namestring (cookies-path buffer)))
+                    (when (ephemeral-p buffer)
+                      (list :ephemeral "true"))
+                    (when deferred-url
+                      (list :deferred-uri deferred-url))
+                    (when session-id
+                      (list :session-id (princ-to-string session-id)))
+                    (when (cache-model buffer)
+                      (list :cache-model (string-downcase (symbol-name (cache-model buffer)))))
+                    (when (data-directory buffer)
+                      (list :data-directory (namestring (data-directory buffer))))
+                    (when (cache-directory buffer)
+                      (list :cache-directory (namestring (cache-directory buffer))))
+                    (unless (string= (proxy-uri buffer) "")
+                      (list :proxy-uri (proxy-uri buffer)
+                            :proxy-ignore-hosts (format nil "~{~a~^,~}"
+                                                        (proxy-ignore-hosts buffer))))))
     buffer))
 
 (defmethod %buffer-make ((interface remote-interface)
                          &optional
                            (name "default")
-                           mode)
-  (let* ((buffer (buffer-make interface :name name :mode mode)))
+                           mode
+                           deferred-url
+                           session-id)
+  (let* ((buffer (buffer-make interface :name name :mode mode
+                                        :deferred-url deferred-url
+                                        :session-id session-id)))
     (when (mode buffer)
       (setup (mode buffer) buffer))
+    (sync-keymaps interface)
     buffer))
 
 (defmethod %get-inactive-buffer ((interface remote-interface))
@@ -269,21 +712,108 @@ startup after the remote-interface was set up."
                         (alexandria:hash-table-values (windows *interface*))))
         (replacement-buffer (or (%get-inactive-buffer interface)
                                 (%buffer-make interface))))
-    (%xml-rpc-send interface "buffer.delete" (id buffer))
+    (%xml-rpc-notify interface "buffer.delete" (id buffer))
     (when parent-window
       (window-set-active-buffer interface parent-window replacement-buffer))
-    (with-slots (buffers) interface
-      (remhash (id buffer) buffers))))
+    (remhash (id buffer) (buffer-keymaps interface))
+    (bt:with-recursive-lock-held ((tables-lock interface))
+      (remhash (id buffer) (buffers interface)))))
 
 (defmethod buffer-load ((interface remote-interface) (buffer buffer) uri)
-  (%xml-rpc-send interface "buffer.load" (id buffer) uri))
+  (mark-buffer-awake buffer)
+  (%xml-rpc-notify interface "buffer.load" (id buffer) uri))
 
 (defmethod buffer-evaluate-javascript ((interface remote-interface)
                                        (buffer buffer) javascript &optional (callback nil))
-  (let ((callback-id
-          (%xml-rpc-send interface "buffer.evaluate.javascript" (id buffer) javascript)))
-    (setf (gethash callback-id (callbacks buffer)) callback)
-    callback-id))
+  ;; Scripts wake up hibernated buffers.
+  (mark-buffer-awake buffer)
+  (if callback
+      (let ((callback-id
+              (%xml-rpc-send interface "buffer.evaluate.javascript" (id buffer) javascript)))
+        (setf (gethash callback-id (callbacks buffer)) callback)
+        callback-id)
+      ;; Without callback, the call can be batched.
+      (%xml-rpc-notify interface "buffer.evaluate.javascript" (id buffer) javascript)))
+
+(defun register-script (name source)
+  "Make the JavaScript function SOURCE available as NAME to `buffer-invoke-script'."
+  ;; Parenscript ends statements with a semicolon, which would not be valid
+  ;; inside an expression.
+  (setf source (string-right-trim '(#\; #\Space #\Newline) source)
+        (gethash name *scripts*) source)
+  (when (and *interface*
+             (platform-port-supports-p *interface* "script.register"))
+    (%xml-rpc-notify *interface* "script.register" name source)))
+
+(defmethod push-scripts ((interface remote-interface))
+  "Register `*scripts*' in the platform port."
+  (when (platform-port-supports-p interface "script.register")
+    (with-batched-calls (interface)
+      (maphash (lambda (name source)
+                 (%xml-rpc-notify interface "script.register" name source))
+               *scripts*))))
+
+(defvar *dom-query-failed* "next:dom-query-failed"
+  "The result of a native DOM query that failed in the platform port, see
+`buffer-query-dom'.")
+
+(defmethod buffer-query-dom ((interface remote-interface) (buffer buffer) method
+                             &key args callback fallback)
+  "Run the native DOM query METHOD of the platform port, e.g.
+\"buffer.headings\", in BUFFER with ARGS.  CALLBACK is called with the result,
+a list.  When the query cannot run natively, e.g. before the page is ready or
+when the web extension fails, FALLBACK is called instead, without arguments: it
+should run a script.  Return nil if FALLBACK was called right away."
+  (let ((callback-id (when (platform-port-supports-p interface method)
+                       (mark-buffer-awake buffer)
+                       (apply #'%xml-rpc-send interface method (id buffer) args))))
+    (if (or (not (stringp callback-id)) (string= callback-id ""))
+        (progn
+          (when fallback
+            (funcall fallback))
+          nil)
+        (progn
+          (when (or callback fallback)
+            (setf (gethash callback-id (callbacks buffer))
+                  (lambda (result)
+                    (if (equal result *dom-query-failed*)
+                        (when fallback
+                          (funcall fallback))
+                        (when callback
+                          (funcall callback result))))))
+          callback-id))))
+
+(defmethod push-page-events ((interface remote-interface))
+  "Subscribe to the `page-events' of the platform port."
+  (when (platform-port-supports-p interface "message.subscribe")
+    (%xml-rpc-notify interface "message.subscribe" (page-events interface))))
+
+(defmethod page-event-p ((interface remote-interface) type)
+  "Return non-nil if the platform port pushes the page event TYPE, so that
+there is no need to ask the page."
+  (and (platform-port-supports-p interface "message.subscribe")
+       (member type (page-events interface) :test #'string=)))
+
+(defmethod buffer-invoke-script ((interface remote-interface) (buffer buffer) name
+                                 &key args callback)
+  "Call the function NAME of `*scripts*' with ARGS, a list of strings, in BUFFER.
+Like `buffer-evaluate-javascript', CALLBACK is called with the result.  Only the
+name and the arguments are sent when the platform port supports it."
+  (if (platform-port-supports-p interface "buffer.invoke.script")
+      (progn
+        (mark-buffer-awake buffer)
+        (if callback
+            (let ((callback-id
+                    (%xml-rpc-send interface "buffer.invoke.script" (id buffer) name args)))
+              (unless (string= callback-id "")
+                (setf (gethash callback-id (callbacks buffer)) callback))
+              callback-id)
+            (%xml-rpc-notify interface "buffer.invoke.script" (id buffer) name args)))
+      (buffer-evaluate-javascript interface buffer
+                                  (format nil "(~a)(~{~a~^, ~})"
+                                          (gethash name *scripts*)
+                                          (mapcar #'cl-json:encode-json-to-string args))
+                                  callback)))
 
 (defmethod minibuffer-evaluate-javascript ((interface remote-interface)
                                            (window window) javascript &optional (callback nil))
@@ -305,25 +835,169 @@ events."
               (key-chord-low-level-data event)
               (key-chord-position event))
              (id window))
-  (%xml-rpc-send interface "generate.input.event"
-                 (id window)
-                 (key-chord-key-code event)
-                 (or (key-chord-modifiers event) (list ""))
-                 (key-chord-low-level-data event)
-                 (float (or (first (key-chord-position event)) -1.0))
-                 (float (or (second (key-chord-position event)) -1.0))))
+  (apply #'%xml-rpc-send interface "generate.input.event"
+         (id window)
+         (key-chord-key-code event)
+         (or (key-chord-modifiers event) (list ""))
+         (key-chord-low-level-data event)
+         (float (or (first (key-chord-position event)) -1.0))
+         (float (or (second (key-chord-position event)) -1.0))
+         (when (key-chord-delta event)
+           (mapcar #'float (key-chord-delta event)))))
 
 (defmethod set-proxy ((interface remote-interface) (buffer buffer)
                       &optional (proxy-uri "") (ignore-hosts (list nil)))
-  (%xml-rpc-send interface "set.proxy" (list (id buffer))
-                 (if (string= proxy-uri "")
-                     "default"
-                     "custom")
-                 proxy-uri ignore-hosts))
+  "Set the proxy of BUFFER and of all the buffers that share its profile, see
+`buffer-profile'."
+  (let* ((profile (buffer-profile buffer))
+         (buffers (remove-if-not (lambda (other) (equal (buffer-profile other) profile))
+                                 (alexandria:hash-table-values (buffers interface)))))
+    (dolist (other buffers)
+      (setf (proxy-uri other) proxy-uri
+            (proxy-ignore-hosts other) (remove nil ignore-hosts)))
+    (%xml-rpc-send interface "set.proxy" (mapcar #'id buffers)
+                   (if (string= proxy-uri "")
+                       "default"
+                       "custom")
+                   proxy-uri ignore-hosts)))
 
 (defmethod get-proxy ((interface remote-interface) (buffer buffer))
   (%xml-rpc-send interface "get.proxy" (id buffer)))
 
+(defun navigation-rule-fields (rule)
+  "Return the strings of RULE as \"policy.set.rules\" expects them."
+  (destructuring-bind (&key kind scheme host navigation-type (known-type :any) action)
+      rule
+    (list (if kind (string-downcase kind) "")
+          (or scheme "")
+          (or host "")
+          (or navigation-type "")
+          (case known-type
+            (:any "")
+            ((nil) "false")
+            (t "true"))
+          (string-downcase action))))
+
+(defun navigation-rule-matches-p (rule kind url navigation-type known-type-p)
+  "Return whether RULE, one of `navigation-rules', matches the decision of KIND
+(:navigation, :new-window or :response) on URL, a string."
+  (destructuring-bind (&key ((:kind rule-kind)) scheme host
+                         ((:navigation-type rule-navigation-type))
+                         (known-type :any) &allow-other-keys)
+      rule
+    (let ((uri (ignore-errors (puri:parse-uri url))))
+      (and (or (null rule-kind) (eq rule-kind kind))
+           (or (null scheme)
+               (and uri (puri:uri-scheme uri)
+                    (string-equal scheme (puri:uri-scheme uri))))
+           (or (null host)
+               (and uri (puri:uri-host uri)
+                    (glob-match-p host (puri:uri-host uri))))
+           (or (null rule-navigation-type)
+               (equal rule-navigation-type navigation-type))
+           (or (eq known-type :any)
+               (eq (not known-type) (not known-type-p)))))))
+
+(defun navigation-rule-action (rules kind url navigation-type known-type-p)
+  "Return the action of the first of RULES that matches the decision, or :ask,
+as the platform port does with `navigation-rules'."
+  (let ((rule (find-if (lambda (rule)
+                         (navigation-rule-matches-p rule kind url
+                                                    navigation-type known-type-p))
+                       rules)))
+    (if rule
+        (getf rule :action)
+        :ask)))
+
+(defmethod push-navigation-rules ((interface remote-interface))
+  "Install `navigation-rules' in the platform port, which then asks
+`|request.resource|' only for the decisions they leave to the core."
+  (when (platform-port-supports-p interface "policy.set.rules")
+    (%xml-rpc-notify interface "policy.set.rules"
+                     (mapcan #'navigation-rule-fields (navigation-rules interface)))))
+
+(defmethod buffer-prefetch ((interface remote-interface) (buffer buffer) urls)
+  "Resolve the hosts of URLS in the web context of BUFFER so that navigating to
+them skips the DNS lookup.  Only for the few URLs the user is likely to visit
+next."
+  (when (and urls
+             (prefetch-p interface)
+             (platform-port-supports-p interface "buffer.prefetch")
+             (not (equal (list buffer urls) (last-prefetch interface))))
+    (setf (last-prefetch interface) (list buffer urls))
+    (%xml-rpc-notify interface "buffer.prefetch" (id buffer) urls)))
+
+(defmethod load-content-filters ((interface remote-interface) &key refresh)
+  "Load the `content-filters' in the platform port.  It compiles a filter only
+if its file changed since it was last compiled, or always with REFRESH."
+  (when (platform-port-supports-p interface "filter.load")
+    (with-batched-calls (interface)
+      (loop for (identifier path) in (content-filters interface)
+            do (%xml-rpc-notify interface (if refresh "filter.refresh" "filter.load")
+                                identifier (namestring path))))))
+
+(defmethod list-content-filters ((interface remote-interface))
+  "Return the identifiers of the content filters in use by the platform port."
+  (when (platform-port-supports-p interface "filter.list")
+    (%xml-rpc-send interface "filter.list")))
+
+(defmethod buffer-load-queue-position ((interface remote-interface) (buffer buffer))
+  "Return the number of buffers that load before BUFFER, or nil if BUFFER is not
+waiting to load."
+  (when (platform-port-supports-p interface "buffer.load.queue.position")
+    (let ((position (%xml-rpc-send interface "buffer.load.queue.position" (id buffer))))
+      (unless (minusp position)
+        position))))
+
+(defmethod buffer-hibernate ((interface remote-interface) (buffer buffer))
+  "Ask the platform port to unload the web view of BUFFER, which must not be
+displayed, until it is needed again.  `hibernated-p' is set once the platform
+port is done."
+  (when (platform-port-supports-p interface "buffer.hibernate")
+    (%xml-rpc-notify interface "buffer.hibernate" (id buffer))))
+
+(defmethod buffer-wake ((interface remote-interface) (buffer buffer))
+  "Reload the web view of BUFFER if it is hibernated, without displaying it."
+  (when (platform-port-supports-p interface "buffer.wake")
+    (%xml-rpc-notify interface "buffer.wake" (id buffer)))
+  (mark-buffer-awake buffer))
+
+(defmethod displayed-buffers ((interface remote-interface))
+  (remove nil (mapcar #'active-buffer
+                      (alexandria:hash-table-values (windows interface)))))
+
+(defmethod hibernate-buffers ((interface remote-interface) reason)
+  "Hibernate the buffers that are neither displayed nor hibernated and for
+which `hibernate-p' returns non-nil for REASON."
+  ;; The hibernation thread runs this while the other threads may add and
+  ;; remove buffers and windows.
+  (destructuring-bind (buffers displayed)
+      (bt:with-recursive-lock-held ((tables-lock interface))
+        (list (alexandria:hash-table-values (buffers interface))
+              (displayed-buffers interface)))
+    (with-batched-calls (interface)
+      (dolist (buffer buffers)
+        (when (and (not (hibernated-p buffer))
+                   (not (member buffer displayed))
+                   (hibernate-p buffer reason))
+          (log:debug "Hibernate buffer ~a (~a)" (id buffer) reason)
+          (buffer-hibernate interface buffer))))))
+
+(defmethod start-hibernation-thread ((interface remote-interface))
+  "Check every `hibernation-check-interval' seconds for idle buffers to
+hibernate, if the platform port supports it."
+  (when (and (platform-port-supports-p interface "buffer.hibernate")
+             (not (hibernation-thread interface)))
+    (setf (hibernation-thread interface)
+          (bt:make-thread
+           (lambda ()
+             (loop
+               (sleep (hibernation-check-interval interface))
+               (handler-case (hibernate-buffers interface :idle)
+                 (error (c)
+                   (log:warn "Cannot hibernate idle buffers: ~a" c)))))
+           :name "buffer hibernation"))))
+
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 ;; Expose Lisp Core XML RPC Endpoints ;;
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
@@ -333,6 +1007,20 @@ events."
     (when callback
       (funcall callback javascript-response))))
 
+(defun |buffer.javascript.call.back.file| (buffer-id path length callback-id)
+  "Like |buffer.javascript.call.back| for large results, which the platform
+port passes in the file at PATH."
+  (|buffer.javascript.call.back| buffer-id (read-out-of-band-string path length)
+                                 callback-id))
+
+(defun |buffer.dom.call.back| (buffer-id result callback-id)
+  "Like |buffer.javascript.call.back| for `buffer-query-dom', whose RESULT is a
+list instead of JSON, or `*dom-query-failed*'."
+  (let* ((buffer (gethash buffer-id (buffers *interface*)))
+         (callback (and buffer (gethash callback-id (callbacks buffer)))))
+    (when callback
+      (funcall callback result))))
+
 (defun |minibuffer.javascript.call.back| (window-id javascript-response callback-id)
   (let* ((window (gethash window-id (windows *interface*)))
          (callback (gethash callback-id (minibuffer-callbacks window))))
@@ -347,38 +1035,81 @@ events."
   (let ((buffer (gethash buffer-id (buffers *interface*))))
     (did-finish-navigation buffer url)))
 
+(defun |buffer.did.hibernate| (buffer-id url snapshot-path)
+  (let ((buffer (gethash buffer-id (buffers *interface*))))
+    ;; The buffer may have been displayed again in the meantime, which woke it up.
+    (when (and buffer
+               (not (member buffer (displayed-buffers *interface*))))
+      (log:debug "Buffer ~a hibernated at ~a" buffer-id url)
+      (setf (hibernated-p buffer) t
+            (snapshot-path buffer) (unless (string= snapshot-path "")
+                                     snapshot-path)))))
+
+(defun |buffer.did.post.messages| (buffer-ids messages)
+  "Pass MESSAGES, the JSON objects posted by the pages of the buffers BUFFER-IDS,
+to `did-receive-message'."
+  (loop for buffer-id in buffer-ids
+        for json in messages
+        for buffer = (gethash buffer-id (buffers *interface*))
+        when buffer
+          do (let ((message (cl-json:decode-json-from-string json)))
+               (did-receive-message buffer (cdr (assoc :type message)) message)))
+  t)
+
+(defun |memory.pressure| (level)
+  "Hibernate the buffers that allow it, see `hibernate-on-memory-pressure-p'.
+LEVEL grows with the pressure, from 50 to 255."
+  (log:info "Low memory warning from the platform port, level ~a" level)
+  (hibernate-buffers *interface* :memory-pressure)
+  t)
+
 (defun |window.will.close| (window-id)
   (let ((windows (windows *interface*)))
     (log:debug "Closing window ID ~a (new total: ~a)" window-id
                (1- (length (alexandria:hash-table-values windows))))
-    (remhash window-id windows)))
+    (bt:with-recursive-lock-held ((tables-lock *interface*))
+      (remhash window-id windows))))
 
 (defun |make.buffers| (urls)
   "Create new buffers from URLs."
   ;; The new active buffer should be the first created buffer.
-  (when urls
-    (let ((buffer (make-buffer))
-          (window (window-make *interface*)))
-      (set-url-buffer (car urls) buffer)
-      (window-set-active-buffer *interface* window buffer))
-    (loop for url in (cdr urls) do
-      (let ((buffer (make-buffer)))
-        (set-url-buffer url buffer)))))
+  (with-batched-calls (*interface*)
+    (when urls
+      (let ((buffer (make-deferred-buffer (car urls)))
+            (window (window-make *interface*)))
+        (window-set-active-buffer *interface* window buffer))
+      ;; Only the displayed buffer loads its URL for now.
+      (loop for url in (cdr urls) do
+        (make-deferred-buffer url)))))
 
 (defun |request.resource| (buffer-id url event-type is-new-window is-known-type
                            mouse-button modifiers)
-  "Return whether URL should be loaded or not."
-  (declare (ignore event-type))
+  "Return whether URL should be loaded or not.
+Platform ports that support `navigation-rules' only ask for what the rules
+leave to the core.  Return 2 to download it, see `download-response'."
   (log:debug "Mouse ~a, modifiers ~a" mouse-button modifiers)
   (let ((buffer (gethash buffer-id (buffers *interface*))))
     (cond
+      ;; Platform ports without rules of their own ask about everything.
+      ((and (not (platform-port-supports-p *interface* "policy.set.rules"))
+            (eq :deny (navigation-rule-action
+                       (navigation-rules *interface*)
+                       (cond
+                         (is-new-window :new-window)
+                         ((not (equal mouse-button "")) :navigation)
+                         (t :response))
+                       url event-type is-known-type)))
+       (log:info "Ignore ~a by rule" url)
+       0)
       (is-new-window
        (log:info "Load ~a in new window" url)
        (|make.buffers| url)
        0)
       ((not is-known-type)
        (log:info "Buffer ~a downloads ~a" buffer url)
-       0)
+       (if (platform-port-supports-p *interface* "download.start")
+           (download-response *interface* buffer url)
+           0))
       (t
        (log:info "Forwarding ~a back to platform port" url)
        1))
@@ -392,9 +1123,14 @@ events."
 
 (import '|buffer.did.commit.navigation| :s-xml-rpc-exports)
 (import '|buffer.did.finish.navigation| :s-xml-rpc-exports)
+(import '|buffer.did.hibernate| :s-xml-rpc-exports)
+(import '|buffer.did.post.messages| :s-xml-rpc-exports)
+(import '|memory.pressure| :s-xml-rpc-exports)
 (import '|push.input.event| :s-xml-rpc-exports)
 (import '|consume.key.sequence| :s-xml-rpc-exports)
 (import '|buffer.javascript.call.back| :s-xml-rpc-exports)
+(import '|buffer.javascript.call.back.file| :s-xml-rpc-exports)
+(import '|buffer.dom.call.back| :s-xml-rpc-exports)
 (import '|minibuffer.javascript.call.back| :s-xml-rpc-exports)
 (import '|window.will.close| :s-xml-rpc-exports)
 (import '|make.buffers| :s-xml-rpc-exports)
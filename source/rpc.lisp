@@ -0,0 +1,800 @@
+;;; rpc.lisp --- transports of the link between the Lisp core and the platform port
+
+(in-package :next)
+
+;; s-xml-rpc only speaks over TCP.  The following lets the same XML-RPC surface
+;; run over Unix domain sockets, which saves the TCP loopback overhead on every
+;; call.
+
+(defun open-local-socket-stream (path)
+  "Return a bidirectional character stream connected to the Unix domain socket
+at PATH."
+  #+sbcl
+  (let ((socket (make-instance 'sb-bsd-sockets:local-socket :type :stream)))
+    (handler-bind ((error (lambda (c)
+                            (declare (ignore c))
+                            (sb-bsd-sockets:socket-close socket))))
+      (sb-bsd-sockets:socket-connect socket (namestring path)))
+    (sb-bsd-sockets:socket-make-stream socket :input t :output t
+                                              :element-type 'character
+                                              :external-format :utf-8
+                                              :buffering :full))
+  #+ccl
+  (ccl:make-socket :address-family :file :type :stream :connect :active
+                   :remote-filename (namestring path)
+                   :format :text :external-format :utf-8)
+  #-(or sbcl ccl)
+  (error "Unix domain sockets are not supported on this Lisp implementation: ~a" path))
+
+(defun write-http-line (stream control-string &rest args)
+  (apply #'format stream control-string args)
+  (write-char #\Return stream)
+  (write-char #\Linefeed stream))
+
+(defun read-http-header (stream)
+  "Read the status line and the header fields of an HTTP message from STREAM.
+Return the status line and an alist of (downcased-name . value)."
+  (let ((status-line (string-right-trim '(#\Return) (or (read-line stream nil nil) ""))))
+    (values status-line
+            (loop for line = (string-right-trim '(#\Return) (or (read-line stream nil nil) ""))
+                  until (string= line "")
+                  collect (let ((colon (position #\: line)))
+                            (cons (string-downcase (subseq line 0 colon))
+                                  (string-trim " " (subseq line (1+ colon)))))))))
+
+(defun xml-rpc-call-local (encoded path &key (url "/RPC2"))
+  "Like `s-xml-rpc:xml-rpc-call' but over the Unix domain socket at PATH."
+  (let ((stream (open-local-socket-stream path)))
+    (unwind-protect
+         (progn
+           (write-http-line stream "POST ~a HTTP/1.0" url)
+           (write-http-line stream "User-Agent: ~a" s-xml-rpc:*xml-rpc-agent*)
+           (write-http-line stream "Host: localhost")
+           (write-http-line stream "Content-Type: text/xml")
+           (write-http-line stream "Content-Length: ~a"
+                            (babel:string-size-in-octets encoded :encoding :utf-8))
+           (write-http-line stream "")
+           (write-string encoded stream)
+           (finish-output stream)
+           (let ((status-line (read-http-header stream)))
+             (unless (search " 200 " status-line)
+               (error "Platform port answered '~a'" status-line)))
+           (let ((result (s-xml-rpc::decode-xml-rpc stream)))
+             (if (typep result 's-xml-rpc:xml-rpc-fault)
+                 (error result)
+                 (car result))))
+      (close stream))))
+
+(defstruct local-server
+  path
+  socket
+  thread)
+
+(defun start-local-xml-rpc-server (path &key (url "/RPC2"))
+  "Serve the exported XML-RPC methods on the Unix domain socket at PATH.
+Each connection is handled in its own thread, like `s-xml-rpc:start-xml-rpc-server'
+does for TCP connections."
+  #+sbcl
+  (let ((socket (make-instance 'sb-bsd-sockets:local-socket :type :stream))
+        (counter 0))
+    (when (probe-file path)
+      (delete-file path))
+    (sb-bsd-sockets:socket-bind socket (namestring path))
+    (sb-bsd-sockets:socket-listen socket 16)
+    (make-local-server
+     :path path
+     :socket socket
+     :thread (bt:make-thread
+              (lambda ()
+                (loop for client = (sb-bsd-sockets:socket-accept socket)
+                      while client
+                      do (let ((stream (sb-bsd-sockets:socket-make-stream
+                                        client :input t :output t
+                                               :element-type 'character
+                                               :external-format :utf-8
+                                               :buffering :full))
+                               (id (incf counter)))
+                           (bt:make-thread
+                            (lambda ()
+                              (unwind-protect
+                                   (s-xml-rpc::xml-rpc-implementation
+                                    stream id s-xml-rpc:*xml-rpc-agent* url)
+                                (close stream)))
+                            :name (format nil "xml-rpc connection ~a" id)))))
+              :name (format nil "xml-rpc server ~a" path))))
+  #-sbcl
+  (error "Serving over Unix domain sockets is not supported on this Lisp implementation: ~a" path))
+
+(defun stop-local-xml-rpc-server (server)
+  (ignore-errors (bt:destroy-thread (local-server-thread server)))
+  #+sbcl
+  (sb-bsd-sockets:socket-close (local-server-socket server))
+  (when (probe-file (local-server-path server))
+    (delete-file (local-server-path server))))
+
+(defun open-octet-stream (&key path host port)
+  "Return a bidirectional octet stream connected to the Unix domain socket at
+PATH, or else to HOST and PORT over TCP with Nagle's algorithm disabled."
+  (if path
+      #+sbcl
+      (let ((socket (make-instance 'sb-bsd-sockets:local-socket :type :stream)))
+        (handler-bind ((error (lambda (c)
+                                (declare (ignore c))
+                                (sb-bsd-sockets:socket-close socket))))
+          (sb-bsd-sockets:socket-connect socket (namestring path)))
+        (sb-bsd-sockets:socket-make-stream socket :input t :output t
+                                                  :element-type '(unsigned-byte 8)
+                                                  :buffering :full))
+      #+ccl
+      (ccl:make-socket :address-family :file :type :stream :connect :active
+                       :remote-filename (namestring path) :format :binary)
+      #-(or sbcl ccl)
+      (error "Unix domain sockets are not supported on this Lisp implementation: ~a" path)
+      #+sbcl
+      (let ((socket (make-instance 'sb-bsd-sockets:inet-socket :type :stream :protocol :tcp)))
+        (handler-bind ((error (lambda (c)
+                                (declare (ignore c))
+                                (sb-bsd-sockets:socket-close socket))))
+          (setf (sb-bsd-sockets:sockopt-tcp-nodelay socket) t)
+          (sb-bsd-sockets:socket-connect
+           socket
+           (sb-bsd-sockets:host-ent-address (sb-bsd-sockets:get-host-by-name host))
+           port))
+        (sb-bsd-sockets:socket-make-stream socket :input t :output t
+                                                  :element-type '(unsigned-byte 8)
+                                                  :buffering :full))
+      #+ccl
+      (ccl:make-socket :remote-host host :remote-port port :format :binary :nodelay t)
+      #-(or sbcl ccl)
+      (error "Persistent connections are not supported on this Lisp implementation: ~a:~a"
+             host port)))
+
+;; Persistent HTTP connections.  `s-xml-rpc:xml-rpc-call' opens and tears down a
+;; connection for every call, which dominates the cost of small calls such as
+;; "window.active".  The following keeps HTTP/1.1 connections to the platform
+;; port alive and reuses them.  A pool rather than a single connection lets
+;; concurrent threads (e.g. XML-RPC handlers calling back into the port) proceed
+;; without waiting on each other.
+
+(defstruct http-connection-pool
+  path
+  host
+  port
+  (url "/RPC2")
+  (lock (bt:make-lock "http connection pool"))
+  (idle '())
+  (max-idle 4))
+
+(defun read-octet-line (stream)
+  "Return the next CRLF-terminated line of STREAM as a string without the
+terminator, or nil on end of file."
+  (let ((octets (make-array 64 :element-type '(unsigned-byte 8)
+                               :adjustable t :fill-pointer 0)))
+    (loop for octet = (read-byte stream nil nil)
+          do (cond
+               ((null octet)
+                (return (when (plusp (length octets))
+                          (map 'string #'code-char octets))))
+               ((= octet 10)
+                (when (and (plusp (length octets))
+                           (= 13 (aref octets (1- (length octets)))))
+                  (decf (fill-pointer octets)))
+                (return (map 'string #'code-char octets)))
+               (t (vector-push-extend octet octets))))))
+
+(defun read-octets (stream count)
+  (let ((octets (make-array count :element-type '(unsigned-byte 8))))
+    (unless (= count (read-sequence octets stream))
+      (error "Connection closed while reading the HTTP body"))
+    octets))
+
+(defun read-out-of-band-string (path length)
+  "Read the UTF-8 string of LENGTH octets that the platform port wrote to the
+file at PATH instead of sending it over the RPC connection.
+The port keeps the file around until the call carrying PATH returns."
+  (with-open-file (stream path :element-type '(unsigned-byte 8))
+    (let ((octets (make-array length :element-type '(unsigned-byte 8))))
+      (unless (= length (read-sequence octets stream))
+        (error "Out-of-band data in ~a is shorter than ~a octets" path length))
+      (babel:octets-to-string octets :encoding :utf-8))))
+
+(defun read-http-response (stream)
+  "Read an HTTP response from STREAM.
+Return the body as a string, or nil if the connection was closed before the
+status line, and whether the server is closing the connection."
+  (let ((status-line (read-octet-line stream)))
+    (when status-line
+      (unless (search " 200 " status-line)
+        (error "Platform port answered '~a'" status-line))
+      (let* ((headers (loop for line = (read-octet-line stream)
+                            until (or (null line) (string= line ""))
+                            collect (let ((colon (position #\: line)))
+                                      (cons (string-downcase (subseq line 0 colon))
+                                            (string-trim " " (subseq line (1+ colon)))))))
+             (header-value (lambda (name) (cdr (assoc name headers :test #'string=))))
+             (content-length (funcall header-value "content-length"))
+             (close-p (or (alexandria:starts-with-subseq "HTTP/1.0" status-line)
+                          (string-equal (funcall header-value "connection") "close")))
+             (body (cond
+                     (content-length
+                      (read-octets stream (parse-integer content-length)))
+                     ((string-equal (funcall header-value "transfer-encoding") "chunked")
+                      (apply #'concatenate '(vector (unsigned-byte 8))
+                             (loop for size = (parse-integer (read-octet-line stream)
+                                                             :radix 16 :junk-allowed t)
+                                   until (zerop size)
+                                   collect (prog1 (read-octets stream size)
+                                             (read-octet-line stream))
+                                   finally (loop for line = (read-octet-line stream)
+                                                 until (or (null line) (string= line ""))))))
+                     (t
+                      (setf close-p t)
+                      (let ((octets (make-array 0 :element-type '(unsigned-byte 8)
+                                                  :adjustable t :fill-pointer 0)))
+                        (loop for octet = (read-byte stream nil nil)
+                              while octet
+                              do (vector-push-extend octet octets))
+                        octets)))))
+        (values (babel:octets-to-string body :encoding :utf-8)
+                close-p)))))
+
+(defun http-request-octets (pool encoded)
+  (let ((body (babel:string-to-octets encoded :encoding :utf-8)))
+    (concatenate '(vector (unsigned-byte 8))
+                 (babel:string-to-octets
+                  (format nil "POST ~a HTTP/1.1~c~c~
+Host: ~a~c~c~
+User-Agent: ~a~c~c~
+Content-Type: text/xml~c~c~
+Content-Length: ~a~c~c~c~c"
+                          (http-connection-pool-url pool) #\Return #\Linefeed
+                          (or (http-connection-pool-host pool) "localhost") #\Return #\Linefeed
+                          s-xml-rpc:*xml-rpc-agent* #\Return #\Linefeed
+                          #\Return #\Linefeed
+                          (length body) #\Return #\Linefeed #\Return #\Linefeed)
+                  :encoding :latin-1)
+                 body)))
+
+(defun decode-xml-rpc-response (body)
+  (let ((result (with-input-from-string (stream body)
+                  (s-xml-rpc::decode-xml-rpc stream))))
+    (if (typep result 's-xml-rpc:xml-rpc-fault)
+        (error result)
+        (car result))))
+
+(defun http-connection-pool-acquire (pool)
+  "Return an idle stream of POOL and whether it was reused, or a new stream."
+  (let ((stream (bt:with-lock-held ((http-connection-pool-lock pool))
+                  (pop (http-connection-pool-idle pool)))))
+    (if stream
+        (values stream t)
+        (values (open-octet-stream :path (http-connection-pool-path pool)
+                                   :host (http-connection-pool-host pool)
+                                   :port (http-connection-pool-port pool))
+                nil))))
+
+(defun http-connection-pool-release (pool stream)
+  (unless (bt:with-lock-held ((http-connection-pool-lock pool))
+            (when (< (length (http-connection-pool-idle pool))
+                     (http-connection-pool-max-idle pool))
+              (push stream (http-connection-pool-idle pool))))
+    (ignore-errors (close stream))))
+
+(defun http-connection-pool-close (pool)
+  (dolist (stream (bt:with-lock-held ((http-connection-pool-lock pool))
+                    (prog1 (http-connection-pool-idle pool)
+                      (setf (http-connection-pool-idle pool) '()))))
+    (ignore-errors (close stream))))
+
+(defun http-pipeline (pool encoded-calls &key retry-p)
+  "Send the ENCODED-CALLS over a single connection of POOL without waiting for
+the responses in between, then read the responses.  Return the list of results.
+If the server closes the connection, the remaining calls are resent on a new
+connection.  An idle connection that turns out to be closed before the first
+response is only retried, once, if RETRY-P is non-nil: the server may have run
+some of the calls already."
+  (when encoded-calls
+    (multiple-value-bind (stream reused-p) (http-connection-pool-acquire pool)
+      (let ((results '())
+            (close-p nil))
+        (flet ((retry (c)
+                 (ignore-errors (close stream))
+                 (if (and reused-p retry-p (null results))
+                     (return-from http-pipeline (http-pipeline pool encoded-calls))
+                     (error c))))
+          (handler-bind ((error (lambda (c)
+                                  (declare (ignore c))
+                                  (ignore-errors (close stream)))))
+            (handler-case
+                (progn
+                  (dolist (encoded encoded-calls)
+                    (write-sequence (http-request-octets pool encoded) stream))
+                  (finish-output stream))
+              ;; The server may have closed the idle connection in the meantime.
+              (stream-error (c)
+                (retry c)))
+            (loop repeat (length encoded-calls)
+                  until close-p
+                  do (multiple-value-bind (body closing) (read-http-response stream)
+                       (unless body
+                         (retry (make-condition 'simple-error
+                                                :format-control "Platform port closed the connection"
+                                                :format-arguments nil)))
+                       (setf close-p closing)
+                       (push (decode-xml-rpc-response body) results)))))
+        (if close-p
+            (ignore-errors (close stream))
+            (http-connection-pool-release pool stream))
+        (append (nreverse results)
+                (http-pipeline pool (nthcdr (length results) encoded-calls)
+                               :retry-p retry-p))))))
+
+(defun http-call (pool encoded &key retry-p)
+  "Like `s-xml-rpc:xml-rpc-call' but over a persistent connection of POOL.
+See `http-pipeline' for RETRY-P."
+  (first (http-pipeline pool (list encoded) :retry-p retry-p)))
+
+;; Futures.  Calls to the platform port may be sent asynchronously, in which
+;; case the caller gets a `future' it can wait on, with a timeout, or cancel.
+;; Futures with a deadline are failed by a watchdog thread if they are not
+;; fulfilled in time, so that a hung platform port cannot block the core.
+
+(define-condition call-timeout (error)
+  ((seconds :initarg :seconds :reader call-timeout-seconds))
+  (:report (lambda (c stream)
+             (if (call-timeout-seconds c)
+                 (format stream "Platform port did not respond within ~a seconds"
+                         (call-timeout-seconds c))
+                 (format stream "Platform port did not respond in time")))))
+
+(define-condition call-cancelled (error)
+  ()
+  (:report "Call to the platform port was cancelled"))
+
+(defstruct future
+  "The eventual result of a call to the platform port."
+  (lock (bt:make-lock "future"))
+  (condition-variable (bt:make-condition-variable))
+  done-p
+  value
+  error
+  timeout
+  deadline
+  (callbacks '())
+  (cancel-function nil :documentation "Called with no argument when the
+future is cancelled or times out, e.g. to forget about the pending call."))
+
+(defun future-fulfill (future &key value error)
+  "Fulfill FUTURE with VALUE, or with ERROR if non-nil.
+Return nil if FUTURE was already fulfilled, e.g. because it was cancelled."
+  (let ((callbacks
+          (bt:with-lock-held ((future-lock future))
+            (unless (future-done-p future)
+              (setf (future-value future) value
+                    (future-error future) error
+                    (future-done-p future) t)
+              (bt:condition-notify (future-condition-variable future))
+              (or (future-callbacks future) t)))))
+    (when (listp callbacks)
+      (dolist (callback callbacks)
+        (funcall callback future)))
+    (and callbacks t)))
+
+(defun future-add-callback (future callback)
+  "Call CALLBACK with FUTURE once it is fulfilled, possibly right away."
+  (unless (bt:with-lock-held ((future-lock future))
+            (unless (future-done-p future)
+              (push callback (future-callbacks future))))
+    (funcall callback future))
+  future)
+
+(defun future-cancel (future &optional (error (make-condition 'call-cancelled)))
+  "Fail FUTURE with ERROR unless it is already fulfilled.
+Return non-nil if FUTURE was cancelled."
+  (when (future-fulfill future :error error)
+    (when (future-cancel-function future)
+      (funcall (future-cancel-function future)))
+    t))
+
+(defun future-wait (future &key timeout)
+  "Block until FUTURE is fulfilled and return its value, or signal its error.
+Give up after TIMEOUT seconds, or at the deadline of FUTURE, by cancelling it
+with a `call-timeout' error."
+  (let ((deadline (let ((timeout-deadline
+                          (when timeout
+                            (+ (get-internal-real-time)
+                               (* timeout internal-time-units-per-second)))))
+                    (if (and timeout-deadline (future-deadline future))
+                        (min timeout-deadline (future-deadline future))
+                        (or timeout-deadline (future-deadline future))))))
+    (bt:with-lock-held ((future-lock future))
+      (loop until (or (future-done-p future)
+                      (and deadline (<= deadline (get-internal-real-time))))
+            do (if deadline
+                   (bt:condition-wait (future-condition-variable future) (future-lock future)
+                                      :timeout (/ (max 0 (- deadline (get-internal-real-time)))
+                                                  internal-time-units-per-second))
+                   (bt:condition-wait (future-condition-variable future) (future-lock future)))))
+    (unless (future-done-p future)
+      (future-cancel future (make-condition 'call-timeout
+                                            :seconds (or timeout (future-timeout future)))))
+    (if (future-error future)
+        (error (future-error future))
+        (future-value future))))
+
+(defvar *future-watchdog* nil
+  "The thread failing the futures that are past their deadline.")
+(defvar *future-watchdog-lock* (bt:make-lock "future watchdog"))
+(defvar *future-watchdog-condition-variable* (bt:make-condition-variable))
+(defvar *timed-futures* '()
+  "The futures watched by `*future-watchdog*'.")
+
+(defun future-watchdog-loop ()
+  (loop
+    (let ((expired '()))
+      (bt:with-lock-held (*future-watchdog-lock*)
+        (let ((now (get-internal-real-time)))
+          (setf *timed-futures*
+                (delete-if (lambda (future)
+                             (cond
+                               ((future-done-p future) t)
+                               ((<= (future-deadline future) now)
+                                (push future expired)
+                                t)))
+                           *timed-futures*))
+          (when (null expired)
+            (let ((next (reduce #'min *timed-futures* :key #'future-deadline
+                                                      :initial-value (+ now internal-time-units-per-second))))
+              (bt:condition-wait *future-watchdog-condition-variable* *future-watchdog-lock*
+                                 :timeout (/ (max 0 (- next now)) internal-time-units-per-second))))))
+      (dolist (future expired)
+        (future-cancel future (make-condition 'call-timeout
+                                              :seconds (future-timeout future)))))))
+
+(defun future-set-timeout (future seconds)
+  "Fail FUTURE with a `call-timeout' error if it is not fulfilled within
+SECONDS.  Return FUTURE."
+  (when seconds
+    (setf (future-timeout future) seconds
+          (future-deadline future)
+          (+ (get-internal-real-time) (* seconds internal-time-units-per-second)))
+    (bt:with-lock-held (*future-watchdog-lock*)
+      (push future *timed-futures*)
+      (unless (and *future-watchdog* (bt:thread-alive-p *future-watchdog*))
+        (setf *future-watchdog* (bt:make-thread #'future-watchdog-loop
+                                                :name "future watchdog")))
+      (bt:condition-notify *future-watchdog-condition-variable*)))
+  future)
+
+;; A call queue runs thunks one after the other in a worker thread.  It lets
+;; the blocking XML-RPC transports be used asynchronously while preserving the
+;; order of the calls.
+
+(defstruct call-queue
+  (lock (bt:make-lock "call queue"))
+  (condition-variable (bt:make-condition-variable))
+  (items '())
+  (pending-count 0)
+  thread)
+
+(defun call-queue-busy-p (queue)
+  "Return non-nil if QUEUE has calls that are queued or running."
+  (plusp (call-queue-pending-count queue)))
+
+(defun call-queue-loop (queue)
+  (loop
+    (destructuring-bind (future . thunk)
+        (bt:with-lock-held ((call-queue-lock queue))
+          (loop while (null (call-queue-items queue))
+                do (bt:condition-wait (call-queue-condition-variable queue)
+                                      (call-queue-lock queue)))
+          (pop (call-queue-items queue)))
+      (unwind-protect
+           ;; Skip the calls that were cancelled or timed out while queued.
+           (unless (future-done-p future)
+             (handler-case (future-fulfill future :value (funcall thunk))
+               (error (c)
+                 (future-fulfill future :error c))))
+        (bt:with-lock-held ((call-queue-lock queue))
+          (decf (call-queue-pending-count queue)))))))
+
+(defun call-queue-submit (queue thunk)
+  "Run THUNK in the worker thread of QUEUE after the previously submitted thunks.
+Return a `future' of its result."
+  (let ((future (make-future)))
+    (bt:with-lock-held ((call-queue-lock queue))
+      (setf (call-queue-items queue)
+            (append (call-queue-items queue) (list (cons future thunk))))
+      (incf (call-queue-pending-count queue))
+      (unless (call-queue-thread queue)
+        (setf (call-queue-thread queue)
+              (bt:make-thread (lambda () (call-queue-loop queue))
+                              :name "platform port call queue")))
+      (bt:condition-notify (call-queue-condition-variable queue)))
+    future))
+
+(defun call-queue-stop (queue)
+  (when (call-queue-thread queue)
+    (ignore-errors (bt:destroy-thread (call-queue-thread queue)))
+    (setf (call-queue-thread queue) nil)))
+
+;; Binary protocol.  XML-RPC spends most of its time building, sending and
+;; parsing XML and HTTP headers.  Once the platform port is up, we ask it for
+;; the address of a second listener (see "server.binary.listen") on which both
+;; sides exchange length-prefixed frames over a single persistent connection.
+;; The format is described in ports/gtk-webkit/protocol.h.
+
+(defun write-uint32 (value buffer)
+  (loop for shift from 24 downto 0 by 8
+        do (vector-push-extend (ldb (byte 8 shift) value) buffer)))
+
+(defun write-uint64 (value buffer)
+  (loop for shift from 56 downto 0 by 8
+        do (vector-push-extend (ldb (byte 8 shift) value) buffer)))
+
+(defun read-uint (bytes position octet-count)
+  "Return the big-endian unsigned integer of OCTET-COUNT octets at POSITION in
+BYTES and the position that follows it."
+  (when (> (+ position octet-count) (length bytes))
+    (error "Truncated binary frame"))
+  (values (loop with value = 0
+                for i from position below (+ position octet-count)
+                do (setf value (logior (ash value 8) (aref bytes i)))
+                finally (return value))
+          (+ position octet-count)))
+
+(defun unsigned-to-signed (value bits)
+  (if (logbitp (1- bits) value)
+      (- value (ash 1 bits))
+      value))
+
+(defun double-float-bits (number)
+  "Return the IEEE 754 binary64 representation of NUMBER as an integer."
+  (let ((number (coerce number 'double-float)))
+    (multiple-value-bind (significand exponent sign)
+        (integer-decode-float number)
+      (logior (if (minusp sign) (ash 1 63) 0)
+              (cond
+                ((zerop significand) 0)
+                ((<= (+ exponent 1075) 0)
+                 ;; Subnormal.
+                 (ash significand (+ exponent 1074)))
+                (t (logior (ash (+ exponent 1075) 52)
+                           (ldb (byte 52 0) significand))))))))
+
+(defun bits-double-float (bits)
+  (let* ((exponent (ldb (byte 11 52) bits))
+         (mantissa (ldb (byte 52 0) bits))
+         (magnitude (if (zerop exponent)
+                        (scale-float (coerce mantissa 'double-float) -1074)
+                        (scale-float (coerce (logior mantissa (ash 1 52)) 'double-float)
+                                     (- exponent 1075)))))
+    (if (logbitp 63 bits) (- magnitude) magnitude)))
+
+(defun encode-binary-value (value buffer)
+  "Append the tagged representation of VALUE to the adjustable octet vector
+BUFFER.  Lisp values are mapped the way s-xml-rpc maps them to XML-RPC."
+  (flet ((tag (char) (vector-push-extend (char-code char) buffer)))
+    (typecase value
+      ((member t nil)
+       (tag #\b)
+       (vector-push-extend (if value 1 0) buffer))
+      ((signed-byte 32)
+       (tag #\i)
+       (write-uint32 (ldb (byte 32 0) value) buffer))
+      (integer
+       (tag #\x)
+       (write-uint64 (ldb (byte 64 0) value) buffer))
+      (real
+       (tag #\d)
+       (write-uint64 (double-float-bits value) buffer))
+      ((or string symbol)
+       (let ((octets (babel:string-to-octets (string value) :encoding :utf-8)))
+         (tag #\s)
+         (write-uint32 (length octets) buffer)
+         (loop for octet across octets
+               do (vector-push-extend octet buffer))))
+      (sequence
+       (tag #\a)
+       (write-uint32 (length value) buffer)
+       (map nil (lambda (element) (encode-binary-value element buffer)) value))
+      (t (error "Cannot encode ~s in a binary frame" value)))))
+
+(defvar *binary-frame-max-length* (* 64 1024 1024)
+  "The largest payload of a binary frame that is read, in octets.")
+
+(defvar *binary-value-max-depth* 32
+  "How deep arrays may be nested in a binary frame.")
+
+(defun decode-binary-value (bytes position &optional (depth 0))
+  "Decode the tagged value at POSITION in BYTES, enclosed in DEPTH arrays.
+Return the value and the position that follows it."
+  (when (>= position (length bytes))
+    (error "Truncated binary frame"))
+  (let ((tag (code-char (aref bytes position)))
+        (position (1+ position)))
+    (ecase tag
+      (#\b (read-uint bytes position 1)
+       (values (/= 0 (aref bytes position)) (1+ position)))
+      (#\i (multiple-value-bind (value position) (read-uint bytes position 4)
+             (values (unsigned-to-signed value 32) position)))
+      (#\x (multiple-value-bind (value position) (read-uint bytes position 8)
+             (values (unsigned-to-signed value 64) position)))
+      (#\d (multiple-value-bind (value position) (read-uint bytes position 8)
+             (values (bits-double-float value) position)))
+      (#\s (multiple-value-bind (length position) (read-uint bytes position 4)
+             (when (> (+ position length) (length bytes))
+               (error "Truncated binary frame"))
+             (values (babel:octets-to-string bytes :start position :end (+ position length)
+                                                   :encoding :utf-8)
+                     (+ position length))))
+      (#\a (when (>= depth *binary-value-max-depth*)
+             (error "Binary frame nests arrays too deep"))
+           (multiple-value-bind (count position) (read-uint bytes position 4)
+             (values (loop repeat count
+                           collect (multiple-value-bind (element next)
+                                       (decode-binary-value bytes position (1+ depth))
+                                     (setf position next)
+                                     element))
+                     position))))))
+
+(defun make-binary-frame (kind id &rest values)
+  "Return the octets of a frame of KIND (#\\c, #\\r or #\\f) with the given ID
+and VALUES, length prefix included."
+  (let ((buffer (make-array 64 :element-type '(unsigned-byte 8)
+                               :adjustable t :fill-pointer 0)))
+    (write-uint32 0 buffer)
+    (vector-push-extend (char-code kind) buffer)
+    (write-uint32 id buffer)
+    (dolist (value values)
+      (encode-binary-value value buffer))
+    (let ((length (- (length buffer) 4)))
+      (loop for i from 0 below 4
+            do (setf (aref buffer i) (ldb (byte 8 (- 24 (* 8 i))) length))))
+    buffer))
+
+(defstruct binary-connection
+  stream
+  (write-lock (bt:make-lock "binary connection write"))
+  (pending-lock (bt:make-lock "binary connection pending calls"))
+  (pending (make-hash-table))
+  (next-id 0)
+  ;; Method identifiers of the platform port, indexed by method name.
+  (method-ids (make-hash-table :test #'equal))
+  ;; Calls of the platform port are run in the order they arrive.
+  (incoming (make-call-queue))
+  thread
+  (alive-p t))
+
+(defun open-binary-stream (address)
+  "Return a bidirectional octet stream connected to ADDRESS, as returned by the
+\"server.binary.listen\" method, i.e. \"unix:PATH\" or \"tcp:HOST:PORT\"."
+  (cond
+    ((alexandria:starts-with-subseq "unix:" address)
+     (open-octet-stream :path (subseq address (length "unix:"))))
+    ((alexandria:starts-with-subseq "tcp:" address)
+     (let* ((host-port (subseq address (length "tcp:")))
+            (colon (position #\: host-port :from-end t)))
+       (open-octet-stream :host (subseq host-port 0 colon)
+                          :port (parse-integer host-port :start (1+ colon)))))
+    (t (error "Unknown binary protocol address '~a'" address))))
+
+(defun binary-connection-write (connection frame)
+  (bt:with-lock-held ((binary-connection-write-lock connection))
+    (let ((stream (binary-connection-stream connection)))
+      (write-sequence frame stream)
+      (finish-output stream))))
+
+(defun read-binary-frame (stream)
+  "Return the payload of the next frame on STREAM, or nil on end of file."
+  (let ((header (make-array 4 :element-type '(unsigned-byte 8))))
+    (when (= 4 (read-sequence header stream))
+      (let ((length (read-uint header 0 4)))
+        (when (> length *binary-frame-max-length*)
+          (error "Binary frame of ~a octets is too large" length))
+        (let ((payload (make-array length :element-type '(unsigned-byte 8))))
+          (when (= (length payload) (read-sequence payload stream))
+            payload))))))
+
+(defun execute-exported-call (method-name args)
+  "Call the XML-RPC exported function named METHOD-NAME with ARGS."
+  (let ((function (find-symbol method-name :s-xml-rpc-exports)))
+    (unless (and function (fboundp function))
+      (error "Unknown method: ~a" method-name))
+    (apply function args)))
+
+(defun binary-connection-handle-call (connection id method-name args)
+  (binary-connection-write
+   connection
+   (handler-case (make-binary-frame #\r id (execute-exported-call method-name args))
+     (error (c)
+       (log:warn "Binary call to '~a' failed: ~a" method-name c)
+       (make-binary-frame #\f id -1 (princ-to-string c))))))
+
+(defun binary-connection-close (connection)
+  (setf (binary-connection-alive-p connection) nil)
+  (ignore-errors (close (binary-connection-stream connection)))
+  ;; A call of the platform port may be the one closing the connection.
+  (unless (eq (bt:current-thread)
+              (call-queue-thread (binary-connection-incoming connection)))
+    (call-queue-stop (binary-connection-incoming connection)))
+  (let ((pending (bt:with-lock-held ((binary-connection-pending-lock connection))
+                   (prog1 (alexandria:hash-table-values (binary-connection-pending connection))
+                     (clrhash (binary-connection-pending connection))))))
+    (dolist (future pending)
+      (future-fulfill future :error (make-condition 'simple-error
+                                                    :format-control "Binary connection closed"
+                                                    :format-arguments nil)))))
+
+(defun binary-connection-read-loop (connection)
+  (unwind-protect
+       (loop for payload = (ignore-errors (read-binary-frame (binary-connection-stream connection)))
+             while payload
+             do (let* ((kind (code-char (aref payload 0)))
+                       (id (read-uint payload 1 4)))
+                  (if (char= kind #\c)
+                      (multiple-value-bind (method-name position) (decode-binary-value payload 5)
+                        (let ((args (decode-binary-value payload position)))
+                          (call-queue-submit
+                           (binary-connection-incoming connection)
+                           (lambda () (binary-connection-handle-call connection id method-name args)))))
+                      (let ((future (bt:with-lock-held ((binary-connection-pending-lock connection))
+                                      (prog1 (gethash id (binary-connection-pending connection))
+                                        (remhash id (binary-connection-pending connection))))))
+                        (if (not future)
+                            (log:debug "Response to unknown or cancelled binary call ~a" id)
+                            (handler-case
+                                (multiple-value-bind (value position) (decode-binary-value payload 5)
+                                  (if (char= kind #\f)
+                                      (future-fulfill
+                                       future
+                                       :error (make-condition 'simple-error
+                                                              :format-control "Platform port fault ~a: ~a"
+                                                              :format-arguments (list value (decode-binary-value payload position))))
+                                      (future-fulfill future :value value)))
+                              (error (c)
+                                (future-fulfill future :error c))))))))
+    (binary-connection-close connection)))
+
+(defun open-binary-connection (address)
+  (let ((connection (make-binary-connection :stream (open-binary-stream address))))
+    (setf (binary-connection-thread connection)
+          (bt:make-thread (lambda () (binary-connection-read-loop connection))
+                          :name (format nil "binary connection ~a" address)))
+    connection))
+
+(defun binary-connection-use-method-table (connection method-names)
+  "Call methods over CONNECTION by identifier rather than by name.
+METHOD-NAMES lists the methods of the platform port in the order of their
+identifiers, as returned by \"server.method.table\"."
+  (loop for name in method-names
+        for id from 0
+        do (setf (gethash name (binary-connection-method-ids connection)) id)))
+
+(defun binary-call-async (connection method-name &rest args)
+  "Send METHOD-NAME with ARGS over CONNECTION and return a `future'.
+The method is sent by identifier when the method table of the platform port is
+known, see `binary-connection-use-method-table'.
+Cancelling the future forgets about the call; its response is then ignored."
+  (let* ((future (make-future))
+         (id (bt:with-lock-held ((binary-connection-pending-lock connection))
+               (setf (binary-connection-next-id connection)
+                     (ldb (byte 32 0) (1+ (binary-connection-next-id connection)))))))
+    (setf (future-cancel-function future)
+          (lambda ()
+            (bt:with-lock-held ((binary-connection-pending-lock connection))
+              (remhash id (binary-connection-pending connection)))))
+    (bt:with-lock-held ((binary-connection-pending-lock connection))
+      (setf (gethash id (binary-connection-pending connection)) future))
+    (handler-case (let ((method (gethash method-name (binary-connection-method-ids connection)
+                                         method-name)))
+                    (binary-connection-write connection (make-binary-frame #\c id method args)))
+      (error (c)
+        (bt:with-lock-held ((binary-connection-pending-lock connection))
+          (remhash id (binary-connection-pending connection)))
+        (binary-connection-close connection)
+        (future-fulfill future :error c)))
+    future))
+
+(defun binary-call (connection method-name &rest args)
+  (future-wait (apply #'binary-call-async connection method-name args)))
@@ -34,17 +34,73 @@
     (setf (ps:chain document body inner-h-t-m-l) body))
   nil)
 
+(defmethod buffer-find ((interface remote-interface) (buffer buffer) text)
+  "Highlight the matches of TEXT in BUFFER with the find controller of the
+platform port and go to the first one.  The search is case-insensitive unless
+TEXT has upper-case letters.  The port reports the number of matches with
+|buffer.did.find|."
+  (setf (find-text buffer) text
+        (find-match-count buffer) nil)
+  (if (string= text "")
+      (%xml-rpc-notify interface "buffer.find.finish" (id buffer))
+      (%xml-rpc-notify interface "buffer.find.search" (id buffer) text
+                       (if (some #'upper-case-p text) t nil))))
+
+(defun search-buffer-incrementally (input)
+  "Search INPUT in the buffer of the minibuffer as it is typed.  There is no
+completion: the input is returned as is."
+  (let ((buffer (callback-buffer (minibuffer *interface*))))
+    (unless (equal input (find-text buffer))
+      (buffer-find *interface* buffer input)))
+  nil)
+
+(defun search-prompt (match-count)
+  (if match-count
+      (format nil "Search for (~d match~:[es~;~]):" match-count (= match-count 1))
+      "Search for:"))
+
+(defun |buffer.did.find| (buffer-id text match-count)
+  (let ((buffer (gethash buffer-id (buffers *interface*)))
+        (minibuffer (minibuffer *interface*)))
+    ;; Results of previous inputs are stale.
+    (when (and buffer (equal text (find-text buffer)))
+      (setf (find-match-count buffer) match-count)
+      (if (and (eql (display-mode minibuffer) :read)
+               (eq (completion-function minibuffer) 'search-buffer-incrementally)
+               (eq (callback-buffer minibuffer) buffer))
+          (progn
+            (setf (input-prompt minibuffer) (search-prompt match-count))
+            (update-display minibuffer))
+          (echo minibuffer (format nil "~d match~:[es~;~] for \"~a\"."
+                                   match-count (= match-count 1) text)))))
+  t)
+(import '|buffer.did.find| :s-xml-rpc-exports)
+
 (define-command add-search-boxes ()
-  "Add search boxes for a given search string"
-  (initialize-search-buffer)
-  (with-result (input (read-from-minibuffer
-                       (minibuffer *interface*)
-                       :input-prompt "Search for:"))
-    (buffer-evaluate-javascript *interface*
-                                (active-buffer *interface*)
-                                (paren-add-search-boxes input))))
+  "Search for a given string in the current buffer, as it is typed.  All the
+matches are highlighted; see `next-search-hint' and `previous-search-hint'."
+  (if (platform-port-supports-p *interface* "buffer.find.search")
+      (let ((buffer (active-buffer *interface*)))
+        (setf (find-text buffer) nil)
+        (read-from-minibuffer (lambda (input)
+                                (declare (ignore input))
+                                nil)
+                              (minibuffer *interface*)
+                              :input-prompt (search-prompt nil)
+                              :completion-function 'search-buffer-incrementally))
+      (progn
+        ;; `paren-add-search-boxes' runs in the page, so the other search
+        ;; scripts run there too rather than with `buffer-invoke-script'.
+        (buffer-evaluate-javascript *interface* (active-buffer *interface*)
+                                    initialize-search-buffer)
+        (with-result (input (read-from-minibuffer
+                             (minibuffer *interface*)
+                             :input-prompt "Search for:"))
+          (buffer-evaluate-javascript *interface*
+                                      (active-buffer *interface*)
+                                      (paren-add-search-boxes input))))))
 
-(define-parenstatic remove-search-hints
+(define-parenstatic paren-remove-search-hints
   (defun qsa (context selector)
     "Alias of document.querySelectorAll"
     (ps:chain context (query-selector-all selector)))
@@ -54,14 +110,38 @@
       (ps:chain el (remove))))
   (search-hints-remove-all))
 
-(define-parenstatic next-search-hint
+(define-parenstatic paren-next-search-hint
   (when (> match-count current-search)
     (setf current-search (+ current-search 1)))
   (let ((element (ps:chain document (get-element-by-id current-search))))
     (ps:chain element (scroll-into-view t))))
 
-(define-parenstatic previous-search-hint
+(define-parenstatic paren-previous-search-hint
   (when (> current-search 0)
     (setf current-search (- current-search 1)))
   (let ((element (ps:chain document (get-element-by-id current-search))))
     (ps:chain element (scroll-into-view t))))
+
+(define-command remove-search-hints ()
+  "Remove the highlights of the search in the current buffer."
+  (let ((buffer (active-buffer *interface*)))
+    (if (platform-port-supports-p *interface* "buffer.find.finish")
+        (progn
+          (setf (find-text buffer) nil
+                (find-match-count buffer) nil)
+          (%xml-rpc-notify *interface* "buffer.find.finish" (id buffer)))
+        (paren-remove-search-hints nil buffer))))
+
+(define-command next-search-hint ()
+  "Go to the next match of the search in the current buffer."
+  (if (platform-port-supports-p *interface* "buffer.find.next")
+      (%xml-rpc-notify *interface* "buffer.find.next" (id (active-buffer *interface*)))
+      (buffer-evaluate-javascript *interface* (active-buffer *interface*)
+                                  paren-next-search-hint)))
+
+(define-command previous-search-hint ()
+  "Go to the previous match of the search in the current buffer."
+  (if (platform-port-supports-p *interface* "buffer.find.previous")
+      (%xml-rpc-notify *interface* "buffer.find.previous" (id (active-buffer *interface*)))
+      (buffer-evaluate-javascript *interface* (active-buffer *interface*)
+                                  paren-previous-search-hint)))
@@ -0,0 +1,144 @@
+;;; session.lisp --- save and restore the windows and buffers
+
+(in-package :next)
+
+;; The session is saved in two files: the Lisp core writes the layout of the
+;; windows and buffers, with the history tree and zoom of each buffer, to
+;; `session-path', and the platform port writes the back/forward list, form
+;; data and scroll position of each buffer to `session-state-path'.  Restored
+;; buffers are deferred: their page only loads once they are displayed.
+
+(defvar *session-version* 1
+  "The version of the format of `session-path'.")
+
+(defun history-tree-root (node)
+  (loop while (node-parent node)
+        do (setf node (node-parent node)))
+  node)
+
+(defun history-tree-sexp (node)
+  "Return the history tree from NODE as nested lists (URL CHILD...)."
+  (cons (node-data node) (mapcar #'history-tree-sexp (node-children node))))
+
+(defun sexp-history-tree (sexp &optional parent)
+  "Return the root node of the history tree of SEXP, see `history-tree-sexp'."
+  (let ((node (make-instance 'node :parent parent :data (first sexp))))
+    (setf (node-children node)
+          (mapcar (lambda (child) (sexp-history-tree child node)) (rest sexp)))
+    node))
+
+(defun history-node-path (node)
+  "Return the indices of the children that lead from the root of the history
+tree to NODE."
+  (loop for child = node then parent
+        for parent = (node-parent child)
+        while parent
+        collect (position child (node-children parent)) into path
+        finally (return (nreverse path))))
+
+(defun history-node-at (root path)
+  (reduce (lambda (node index)
+            (or (nth index (node-children node)) node))
+          path :initial-value root))
+
+(defmethod buffer-session-url ((buffer buffer))
+  "Return the URL of the current node of the history of BUFFER, or the URL that
+BUFFER loads once displayed if it was never displayed."
+  (let ((node (active-history-node (mode buffer))))
+    (if (and (hibernated-p buffer)
+             (null (node-parent node))
+             (null (node-children node)))
+        (name buffer)
+        (node-data node))))
+
+(defmethod buffer-session-sexp ((buffer buffer))
+  (let ((node (active-history-node (mode buffer))))
+    (list :id (id buffer)
+          :url (buffer-session-url buffer)
+          :zoom (current-zoom-ratio buffer)
+          :history (history-tree-sexp (history-tree-root node))
+          :history-path (history-node-path node))))
+
+(defmethod session-save ((interface remote-interface))
+  "Write the windows and buffers to `session-path', and have the platform port
+write the state of the buffers to `session-state-path'."
+  (let* ((buffers (remove-if-not (lambda (buffer)
+                                   (typep (mode buffer) 'document-mode))
+                                 (alexandria:hash-table-values (buffers interface))))
+         (windows (remove-if-not (lambda (window)
+                                   (member (active-buffer window) buffers))
+                                 (alexandria:hash-table-values (windows interface)))))
+    (when (platform-port-supports-p interface "session.save")
+      (%xml-rpc-send interface "session.save"
+                     (namestring (ensure-parent-exists (session-state-path interface)))))
+    (with-open-file (stream (ensure-parent-exists (session-path interface))
+                            :direction :output :if-exists :supersede)
+      (with-standard-io-syntax
+        (prin1 (list :version *session-version*
+                     :windows (mapcar (lambda (window)
+                                        (list :buffer (id (active-buffer window))))
+                                      windows)
+                     :buffers (mapcar #'buffer-session-sexp buffers))
+               stream)))
+    (length buffers)))
+
+(defun read-session (path)
+  "Return the session saved in PATH, or nil if there is none."
+  (when (probe-file path)
+    (handler-case
+        (with-open-file (stream path)
+          (with-standard-io-syntax
+            (let* ((*read-eval* nil)
+                   (session (read stream)))
+              (when (eql (getf session :version) *session-version*)
+                session))))
+      (error (c)
+        (log:warn "Cannot read the session of ~a: ~a" path c)
+        nil))))
+
+(defmethod session-restore-buffer ((interface remote-interface) entry)
+  (let* ((url (getf entry :url))
+         (buffer (if (platform-port-supports-p interface "buffer.wake")
+                     (%buffer-make interface "default" nil url
+                                   (when (platform-port-supports-p interface "session.load")
+                                     (getf entry :id)))
+                     (let ((buffer (make-buffer)))
+                       (set-url-buffer url buffer)
+                       buffer))))
+    (when (getf entry :history)
+      (setf (active-history-node (mode buffer))
+            (history-node-at (sexp-history-tree (getf entry :history))
+                             (getf entry :history-path))))
+    (when (getf entry :zoom)
+      (setf (current-zoom-ratio buffer) (getf entry :zoom)))
+    buffer))
+
+(defmethod session-restore ((interface remote-interface))
+  "Recreate the windows and buffers saved with `session-save'.  Return the
+restored windows, or nil if there is no session."
+  (let ((session (read-session (session-path interface))))
+    (when (getf session :windows)
+      (when (and (platform-port-supports-p interface "session.load")
+                 (probe-file (session-state-path interface)))
+        (%xml-rpc-notify interface "session.load"
+                         (namestring (session-state-path interface))))
+      (let ((buffers (make-hash-table :test #'equal)))
+        (dolist (entry (getf session :buffers))
+          (setf (gethash (getf entry :id) buffers)
+                (session-restore-buffer interface entry)))
+        (mapcar (lambda (window-entry)
+                  (let ((window (window-make interface)))
+                    (window-set-active-buffer
+                     interface window
+                     (or (gethash (getf window-entry :buffer) buffers)
+                         (make-buffer)))
+                    window))
+                (getf session :windows))))))
+
+(define-command save-session ()
+  "Save the windows and buffers, which are restored at the next start if
+`restore-session-p' is non-nil."
+  (echo (minibuffer *interface*)
+        (format nil "Saved ~a buffer~:p to ~a."
+                (session-save *interface*)
+                (session-path *interface*))))
@@ -40,6 +40,22 @@ slime. Default port is 4006."
     (puri:uri-parse-error ()
       input-url)))
 
+(defun glob-match-p (pattern string)
+  "Return whether STRING matches the glob PATTERN, in which `*' matches any
+sequence of characters and `?' any single character, like the GLib patterns of
+the platform port."
+  (labels ((match (p s)
+             (cond
+               ((= p (length pattern)) (= s (length string)))
+               ((char= (char pattern p) #\*)
+                (loop for rest from s to (length string)
+                        thereis (match (1+ p) rest)))
+               ((= s (length string)) nil)
+               ((or (char= (char pattern p) #\?)
+                    (char= (char pattern p) (char string s)))
+                (match (1+ p) (1+ s))))))
+    (match 0 0)))
+
 (defun generate-search-query (search-string)
   (let* ((encoded-search-string
            (cl-string-match:replace-re "  *" "+" search-string :all t))
@@ -25,6 +25,9 @@
       (ps:lisp (setf (current-zoom-ratio buffer) (zoom-ratio-default buffer)))
       (setf (ps:chain document body style zoom) (ps:lisp (zoom-ratio-default buffer))))))
 
+(define-parenscript %set-page-zoom (ratio)
+  (setf (ps:chain document body style zoom) (ps:lisp ratio)))
+
 (define-command zoom-in-page ()
   "Zoom in the current page."
   (buffer-evaluate-javascript *interface* (active-buffer *interface*) (%zoom-in-page)))
@@ -0,0 +1,69 @@
+;;; test-binary-protocol.lisp --- tests of the binary framed protocol
+
+(in-package :next)
+
+(prove:plan nil)
+
+(defun binary-round-trip (value)
+  (let ((buffer (make-array 16 :element-type '(unsigned-byte 8)
+                               :adjustable t :fill-pointer 0)))
+    (encode-binary-value value buffer)
+    (multiple-value-bind (decoded position) (decode-binary-value buffer 0)
+      (prove:is position (length buffer) "The whole value is decoded")
+      decoded)))
+
+(prove:subtest "Values"
+  (prove:is (binary-round-trip t) t)
+  (prove:is (binary-round-trip nil) nil)
+  (prove:is (binary-round-trip 42) 42)
+  (prove:is (binary-round-trip -1) -1)
+  (prove:is (binary-round-trip (expt 2 40)) (expt 2 40))
+  (prove:is (binary-round-trip (- (expt 2 40))) (- (expt 2 40)))
+  (prove:is (binary-round-trip 1.5d0) 1.5d0)
+  (prove:is (binary-round-trip -0.1d0) -0.1d0)
+  (prove:is (binary-round-trip "") "")
+  (prove:is (binary-round-trip "héllo → wörld") "héllo → wörld")
+  (prove:is (binary-round-trip '(1 "two" (3.0d0 (t)))) '(1 "two" (3.0d0 (t))))
+  (prove:is (binary-round-trip :symbol) "SYMBOL"))
+
+(prove:subtest "Frames"
+  (let ((frame (make-binary-frame #\c 7 "buffer.load" '(3 "about:blank"))))
+    (prove:is (read-uint frame 0 4) (- (length frame) 4)
+              "The length prefix excludes itself")
+    (prove:is (code-char (aref frame 4)) #\c)
+    (prove:is (read-uint frame 5 4) 7)
+    (multiple-value-bind (method position) (decode-binary-value frame 9)
+      (prove:is method "buffer.load")
+      (prove:is (decode-binary-value frame position) '(3 "about:blank")))))
+
+(prove:subtest "Malformed frames"
+  (let ((frame (make-binary-frame #\r 1 "truncated")))
+    (prove:is-error (decode-binary-value (subseq frame 0 (- (length frame) 2)) 9)
+                    'error
+                    "Truncated strings are rejected"))
+  (let ((buffer (make-array 16 :element-type '(unsigned-byte 8)
+                               :adjustable t :fill-pointer 0))
+        (nested '()))
+    (dotimes (i (1+ *binary-value-max-depth*))
+      (setf nested (list nested)))
+    (encode-binary-value nested buffer)
+    (prove:is-error (decode-binary-value buffer 0) 'error
+                    "Arrays nested too deep are rejected")))
+
+(prove:subtest "Calls of the platform port run in order"
+  (let ((queue (make-call-queue))
+        (order '())
+        (lock (bt:make-lock)))
+    (unwind-protect
+         (let ((futures (loop for i below 50
+                              collect (let ((i i))
+                                        (call-queue-submit
+                                         queue
+                                         (lambda ()
+                                           (bt:with-lock-held (lock)
+                                             (push i order))))))))
+           (future-wait (car (last futures)) :timeout 10)
+           (prove:is (reverse order) (loop for i below 50 collect i)))
+      (call-queue-stop queue))))
+
+(prove:finalize)
@@ -0,0 +1,64 @@
+;;; test-downloads.lisp --- tests of the states of downloads
+
+(in-package :next)
+
+(prove:plan nil)
+
+(defmacro with-test-downloads ((&rest downloads) &body body)
+  "Run BODY with a `*interface*' whose downloads are DOWNLOADS, newest first."
+  `(let ((*interface* (make-test-interface)))
+     (setf (downloads *interface*) (list ,@downloads))
+     ,@body))
+
+(prove:subtest "Reports of the platform port"
+  (let ((download (make-instance 'download :url "https://example.org/a.iso"
+                                           :status :starting
+                                           :start-time (get-universal-time))))
+    (with-test-downloads (download)
+      (|download.did.start| 4 "https://example.org/a.iso" "/tmp/a.iso")
+      (prove:is (status download) :active
+                "A starting download is found by URL")
+      (prove:is (id download) 4)
+      (prove:is (destination download) "/tmp/a.iso")
+      (|download.did.progress| '(4.0d0 512.0d0 2048.0d0))
+      (prove:is (bytes-received download) 512)
+      (prove:is (bytes-total download) 2048)
+      (|download.did.start| 4 "https://example.org/a.iso" "/tmp/a (1).iso")
+      (prove:is (destination download) "/tmp/a (1).iso"
+                "A retry to another file updates the destination")
+      (prove:is (length (downloads *interface*)) 1))))
+
+(prove:subtest "Downloads started by pages"
+  (with-test-downloads ()
+    (|download.did.start| 9 "https://example.org/b.zip" "/tmp/b.zip")
+    (let ((download (first (downloads *interface*))))
+      (prove:is (id download) 9)
+      (prove:is (status download) :active))))
+
+(prove:subtest "Downloads the port never reports expire"
+  (let ((stale (make-instance 'download :url "https://example.org/old"
+                                        :status :starting
+                                        :start-time (- (get-universal-time)
+                                                       *download-start-timeout* 1)))
+        (fresh (make-instance 'download :url "https://example.org/new"
+                                        :status :starting
+                                        :start-time (get-universal-time))))
+    (with-test-downloads (fresh stale)
+      (%expire-starting-downloads *interface*)
+      (prove:is (status stale) :failed)
+      (prove:is (status fresh) :starting)
+      (prove:is (%running-download-count *interface*) 1))))
+
+(prove:subtest "Responses wait for a free slot"
+  (with-test-downloads ((make-instance 'download :url "https://example.org/c"
+                                                 :status :active))
+    (setf (max-downloads *interface*) 2)
+    (prove:is (download-response *interface* nil "https://example.org/d") 2)
+    (prove:is (status (first (downloads *interface*))) :starting
+              "It counts as running until the port reports it")
+    (prove:ok (not (%download-slot-free-p *interface*)))
+    (setf (max-downloads *interface*) nil)
+    (prove:ok (%download-slot-free-p *interface*)
+              "No limit without max-downloads")))
+
+(prove:finalize)
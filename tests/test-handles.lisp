@@ -0,0 +1,38 @@
+;;; test-handles.lisp --- tests of the allocation of window and buffer handles
+
+(in-package :next)
+
+(prove:plan nil)
+
+(defun make-test-interface ()
+  "Return a `remote-interface' that does not start the XML-RPC server."
+  (shared-initialize (allocate-instance (find-class 'remote-interface)) t))
+
+(prove:subtest "Handles are positive and never reused"
+  (let ((interface (make-test-interface)))
+    (setf (integer-handles-p interface) t)
+    (let ((ids (loop repeat 10 collect (get-unique-buffer-identifier interface))))
+      (prove:is ids (loop for i from 1 to 10 collect i)))
+    (prove:is (get-unique-window-identifier interface) 1
+              "Windows and buffers are counted separately")))
+
+(prove:subtest "Handles are strings for older platform ports"
+  (let ((interface (make-test-interface)))
+    (prove:is (get-unique-buffer-identifier interface) "1")
+    (prove:is (get-unique-window-identifier interface) "1")))
+
+(prove:subtest "Handles allocated concurrently are distinct"
+  (let* ((interface (make-test-interface))
+         (ids '())
+         (lock (bt:make-lock))
+         (threads (loop repeat 8
+                        collect (bt:make-thread
+                                 (lambda ()
+                                   (loop repeat 1000
+                                         do (let ((id (get-unique-buffer-identifier interface)))
+                                              (bt:with-lock-held (lock)
+                                                (push id ids)))))))))
+    (mapc #'bt:join-thread threads)
+    (prove:is (length (remove-duplicates ids :test #'equal)) 8000)))
+
+(prove:finalize)
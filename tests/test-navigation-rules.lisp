@@ -0,0 +1,59 @@
+;;; test-navigation-rules.lisp --- tests of the navigation rules
+
+(in-package :next)
+
+(prove:plan nil)
+
+(prove:subtest "Glob patterns"
+  (prove:ok (glob-match-p "*.example.org" "www.example.org"))
+  (prove:ok (not (glob-match-p "*.example.org" "example.org")))
+  (prove:ok (glob-match-p "example.???" "example.org"))
+  (prove:ok (not (glob-match-p "example.???" "example.info")))
+  (prove:ok (glob-match-p "*" ""))
+  (prove:ok (glob-match-p "a*b*c" "aXXbYYc"))
+  (prove:ok (not (glob-match-p "a*b*c" "aXXbYY"))))
+
+(prove:subtest "The first matching rule wins"
+  (let ((rules '((:kind :new-window :action :ask)
+                 (:scheme "http" :host "*.tracker.com" :action :deny)
+                 (:known-type nil :action :ask)
+                 (:action :allow))))
+    (prove:is (navigation-rule-action rules :new-window "https://example.org/"
+                                      "link-click" t)
+              :ask)
+    (prove:is (navigation-rule-action rules :navigation "http://ads.tracker.com/x"
+                                      "other" t)
+              :deny)
+    (prove:is (navigation-rule-action rules :navigation "https://ads.tracker.com/x"
+                                      "other" t)
+              :allow
+              "The scheme must match too")
+    (prove:is (navigation-rule-action rules :response "https://example.org/file.bin"
+                                      "other" nil)
+              :ask)
+    (prove:is (navigation-rule-action rules :response "https://example.org/"
+                                      "other" t)
+              :allow)))
+
+(prove:subtest "Without a matching rule, the core is asked"
+  (prove:is (navigation-rule-action '() :navigation "https://example.org/" "other" t)
+            :ask)
+  (prove:is (navigation-rule-action '((:navigation-type "form-submitted" :action :deny))
+                                    :navigation "https://example.org/" "link-click" t)
+            :ask)
+  (prove:is (navigation-rule-action '((:host "*.org" :action :deny))
+                                    :navigation "about:blank" "other" t)
+            :ask
+            "Rules on the host do not match URLs without one"))
+
+(prove:subtest "Rules sent to the platform port"
+  (prove:is (navigation-rule-fields '(:kind :new-window :action :ask))
+            '("new-window" "" "" "" "" "ask"))
+  (prove:is (navigation-rule-fields '(:scheme "http" :host "*.example.org"
+                                      :navigation-type "link-click"
+                                      :known-type nil :action :deny))
+            '("" "http" "*.example.org" "link-click" "false" "deny"))
+  (prove:is (navigation-rule-fields '(:known-type t :action :allow))
+            '("" "" "" "" "true" "allow")))
+
+(prove:finalize)
@@ -0,0 +1,43 @@
+;;; test-session.lisp --- tests of the serialization of sessions
+
+(in-package :next)
+
+(prove:plan nil)
+
+(defun write-test-session (path form)
+  (with-open-file (stream path :direction :output :if-exists :supersede)
+    (with-standard-io-syntax
+      (prin1 form stream))))
+
+(prove:subtest "History trees"
+  (let* ((sexp '("https://a.org/" ("https://b.org/" ("https://c.org/"))
+                 ("https://d.org/")))
+         (root (sexp-history-tree sexp)))
+    (prove:is (history-tree-sexp root) sexp "The tree is read back as written")
+    (let ((node (history-node-at root '(0 0))))
+      (prove:is (node-data node) "https://c.org/")
+      (prove:is (history-node-path node) '(0 0))
+      (prove:is (history-tree-root node) root))
+    (prove:is (history-node-path (history-node-at root '(1))) '(1))
+    (prove:is (node-data (history-node-at root '(0 5))) "https://b.org/"
+              "Paths beyond the tree stop at the last node found")))
+
+(prove:subtest "Session files"
+  (uiop:with-temporary-file (:pathname path :keep nil)
+    (let ((session (list :version *session-version*
+                         :windows '((:buffer 2))
+                         :buffers '((:id 2 :url "https://a.org/" :zoom 1.5
+                                     :history ("https://a.org/") :history-path ())))))
+      (write-test-session path session)
+      (prove:is (read-session path) session))
+    (write-test-session path (list :version (1+ *session-version*) :windows '()))
+    (prove:is (read-session path) nil "Other versions are ignored")
+    (with-open-file (stream path :direction :output :if-exists :supersede)
+      (write-string "(:version 1 :windows #.(error \"evaluated\"))" stream))
+    (prove:is (read-session path) nil "Nothing is evaluated while reading")
+    (with-open-file (stream path :direction :output :if-exists :supersede)
+      (write-string "(:version 1 :windows (" stream))
+    (prove:is (read-session path) nil "Truncated files are ignored"))
+  (prove:is (read-session "/nonexistent/next-session") nil))
+
+(prove:finalize)